@@ -0,0 +1,901 @@
+/*-----------------------------------------------------------------------------
+ * File: bench.c
+ *
+ * Microbenchmarks for the data-plane building blocks: checksums, route
+ * lookup (list and compiled FIB), loading the routing table (text and
+ * binary image), the NAT mapping table, the ARP cache,
+ * the whole sr_handlepacket path with sr_send_packet stubbed out the
+ * same way test.c does it, and access list lookups.
+ *
+ * Every case runs its operation in a loop, growing the iteration count
+ * until one run lasts at least the minimum time (-t), and reports the
+ * best of -r such runs. Inputs come from a fixed seed so two builds see
+ * the same tables and keys. Heap allocations are counted by wrapping
+ * malloc, calloc and realloc at link time (see the bench target in the
+ * Makefile).
+ *
+ * The expiry sweeps run on the virtual clock (sr_clock.h), one simulated
+ * second per op, so ops_per_sec is simulated seconds per second.
+ *
+ * Output is CSV on stdout, one line per case after a header line:
+ *
+ *   benchmark,param,iterations,ns_per_op,ops_per_sec,allocs_per_op
+ *
+ *   bench [-t min seconds] [-r runs] [-f filter] [-q]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_arpcache.h"
+#include "sr_utils.h"
+#include "sr_nat.h"
+#include "sr_nat_pool.h"
+#include "sr_nat_ckpt.h"
+#include "sr_nat_tcp.h"
+#include "sr_clock.h"
+#include "sr_fib.h"
+#include "sr_fib_image.h"
+
+bool longest_prefix_match(struct sr_rt* routing_table, uint32_t lookup, struct sr_rt **best_match);
+
+#define BENCH_KEYS 4096             /* lookup keys per case, power of two */
+#define BENCH_QUICK_MAX 100000      /* table size cap with -q */
+
+typedef void (*bench_fn)(void *arg, uint64_t n);
+
+static double bench_min_ns = 200e6;
+static int bench_runs = 3;
+static const char *bench_filter;
+static bool bench_quick;
+
+/* -- allocation counting -------------------------------------------------- */
+
+static uint64_t bench_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+/* -- sr_send_packet stub --------------------------------------------------- */
+
+static uint8_t sentframe[65536];
+static unsigned int sentlen;
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         const char* iface /* borrowed */)
+{
+    memcpy(sentframe, buf, len < sizeof(sentframe) ? len : sizeof(sentframe));
+    sentlen = len;
+    return 0;
+}
+
+int sr_send_packets(struct sr_instance* sr, struct sr_txq_frame* frames, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; i++)
+        sr_send_packet(sr, frames[i].buf, frames[i].len, frames[i].iface->name);
+    return 0;
+}
+
+/* -- harness --------------------------------------------------------------- */
+
+static uint64_t bench_rng = 0x9e3779b97f4a7c15ull;
+
+static uint32_t bench_rand(void)
+{
+    /* xorshift64*, fixed seed so runs are repeatable */
+    bench_rng ^= bench_rng >> 12;
+    bench_rng ^= bench_rng << 25;
+    bench_rng ^= bench_rng >> 27;
+    return (uint32_t) ((bench_rng * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+static double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool bench_selected(const char *name)
+{
+    return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+static void bench_report(const char *name, const char *param, uint64_t iters,
+                         double ns, uint64_t allocs)
+{
+    double ns_op = ns / iters;
+    printf("%s,%s,%llu,%.2f,%.0f,%.3f\n", name, param, (unsigned long long) iters,
+           ns_op, ns_op > 0 ? 1e9 / ns_op : 0.0, (double) allocs / iters);
+    fflush(stdout);
+}
+
+/*---------------------------------------------------------------------
+ * Method: bench_case
+ * Scope:  Local
+ *
+ * Time 'fn' and print one result line. The iteration count is scaled
+ * up until a run takes bench_min_ns; then bench_runs runs are made at
+ * that count and the fastest is reported.
+ *
+ *---------------------------------------------------------------------*/
+
+static void bench_case(const char *name, const char *param, bench_fn fn, void *arg)
+{
+    uint64_t n = 1, allocs = 0;
+    double ns, best = 0;
+
+    for (;;) {
+        double t0 = bench_now_ns();
+        fn(arg, n);
+        ns = bench_now_ns() - t0;
+        if (ns >= bench_min_ns)
+            break;
+        double grow = ns > 0 ? bench_min_ns * 1.2 / ns : 100;
+        n = grow > 100 ? n * 100 : (uint64_t) (n * grow) + 1;
+    }
+
+    for (int r = 0; r < bench_runs; r++) {
+        uint64_t a0 = bench_allocs;
+        double t0 = bench_now_ns();
+        fn(arg, n);
+        ns = bench_now_ns() - t0;
+        if (r == 0 || ns < best) {
+            best = ns;
+            allocs = bench_allocs - a0;
+        }
+    }
+    bench_report(name, param, n, best, allocs);
+}
+
+static void bench_sizes(unsigned int from, unsigned int to, unsigned int *sizes, int *count)
+{
+    *count = 0;
+    for (unsigned int s = from; s <= to; s *= 10) {
+        if (bench_quick && s > BENCH_QUICK_MAX)
+            break;
+        sizes[(*count)++] = s;
+    }
+}
+
+/* -- checksums -------------------------------------------------------------- */
+
+struct cksum_arg {
+    uint8_t *buf;
+    unsigned int len;
+    sr_ip_hdr_t *iphdr;
+    sr_tcp_hdr_t *tcphdr;
+};
+
+static volatile uint16_t bench_sink16;
+
+static void run_cksum(void *arg, uint64_t n)
+{
+    struct cksum_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++)
+        bench_sink16 = cksum(a->buf, a->len);
+}
+
+static void run_tcp_cksum(void *arg, uint64_t n)
+{
+    struct cksum_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++)
+        bench_sink16 = tcp_cksum(a->iphdr, a->tcphdr, a->len);
+}
+
+static void bench_cksums(void)
+{
+    static const unsigned int cksum_lens[] = { 20, 64, 576, 1500, 9000 };
+    static const unsigned int tcp_lens[] = { 20, 536, 1460, 8960 };
+    struct cksum_arg a;
+    char param[32];
+
+    a.buf = malloc(sizeof(sr_ip_hdr_t) + 9000);
+    for (unsigned int i = 0; i < sizeof(sr_ip_hdr_t) + 9000; i++)
+        a.buf[i] = bench_rand();
+    a.iphdr = (sr_ip_hdr_t *) a.buf;
+    a.iphdr->ip_p = ip_protocol_tcp;
+    a.tcphdr = (sr_tcp_hdr_t *) (a.buf + sizeof(sr_ip_hdr_t));
+
+    if (bench_selected("cksum")) {
+        for (int i = 0; i < sizeof(cksum_lens) / sizeof(cksum_lens[0]); i++) {
+            a.len = cksum_lens[i];
+            snprintf(param, sizeof(param), "bytes=%u", a.len);
+            bench_case("cksum", param, run_cksum, &a);
+        }
+    }
+    if (bench_selected("tcp_cksum")) {
+        for (int i = 0; i < sizeof(tcp_lens) / sizeof(tcp_lens[0]); i++) {
+            a.len = tcp_lens[i];
+            snprintf(param, sizeof(param), "bytes=%u", a.len);
+            bench_case("tcp_cksum", param, run_tcp_cksum, &a);
+        }
+    }
+    free(a.buf);
+}
+
+/* -- route lookup ----------------------------------------------------------- */
+
+struct lpm_arg {
+    struct sr_rt *rtable;
+    struct sr_fib *fib;
+    uint32_t keys[BENCH_KEYS];
+};
+
+static void run_lpm(void *arg, uint64_t n)
+{
+    struct lpm_arg *a = arg;
+    struct sr_rt *best;
+    for (uint64_t i = 0; i < n; i++)
+        longest_prefix_match(a->rtable, a->keys[i & (BENCH_KEYS - 1)], &best);
+}
+
+static void run_fib(void *arg, uint64_t n)
+{
+    struct lpm_arg *a = arg;
+    struct sr_rt *best;
+    for (uint64_t i = 0; i < n; i++)
+        sr_fib_lookup(a->fib, a->keys[i & (BENCH_KEYS - 1)], &best);
+}
+
+static void add_route(struct sr_rt **rtable, uint32_t dest, uint32_t mask, uint32_t gw, const char *iface)
+{
+    struct sr_rt *rt = calloc(1, sizeof(struct sr_rt));
+    rt->dest.s_addr = dest;
+    rt->mask.s_addr = mask;
+    rt->gw.s_addr = gw;
+    strncpy(rt->interface, iface, sr_IFACE_NAMELEN - 1);
+    rt->next = *rtable;
+    *rtable = rt;
+}
+
+static void free_routes(struct sr_rt *rtable)
+{
+    while (rtable) {
+        struct sr_rt *next = rtable->next;
+        free(rtable);
+        rtable = next;
+    }
+}
+
+/* 'routes' random prefixes of length 8 to 32 plus a default route, looked
+   up with random addresses, so every lookup matches something. */
+static void bench_lpm(void)
+{
+    unsigned int sizes[8];
+    int nsizes;
+    char param[32];
+
+    if (!bench_selected("longest_prefix_match") && !bench_selected("fib_lookup"))
+        return;
+
+    bench_sizes(10, 1000000, sizes, &nsizes);
+    for (int s = 0; s < nsizes; s++) {
+        struct lpm_arg *a = calloc(1, sizeof(*a));
+        add_route(&a->rtable, 0, 0, 1, "eth2");
+        for (unsigned int i = 1; i < sizes[s]; i++) {
+            unsigned int plen = 8 + bench_rand() % 25;
+            uint32_t mask = htonl(0xffffffffu << (32 - plen));
+            add_route(&a->rtable, bench_rand() & mask, mask, bench_rand(), "eth2");
+        }
+        for (int k = 0; k < BENCH_KEYS; k++)
+            a->keys[k] = bench_rand();
+
+        snprintf(param, sizeof(param), "routes=%u", sizes[s]);
+        if (bench_selected("longest_prefix_match"))
+            bench_case("longest_prefix_match", param, run_lpm, a);
+        if (bench_selected("fib_lookup")) {
+            a->fib = sr_fib_build(a->rtable);
+            bench_case("fib_lookup", param, run_fib, a);
+            sr_fib_free(a->fib);
+        } else
+            free_routes(a->rtable);
+        free(a);
+    }
+}
+
+struct load_arg {
+    char text[32];
+    char image[32];
+};
+
+static void run_load_text(void *arg, uint64_t n)
+{
+    struct load_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        struct sr_rt *routes;
+        sr_read_rt(a->text, &routes);
+        sr_fib_free(sr_fib_build(routes));
+    }
+}
+
+static void run_load_image(void *arg, uint64_t n)
+{
+    struct load_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++)
+        sr_fib_free(sr_fib_image_load(a->image));
+}
+
+/* Startup cost of a table of 'routes' prefixes: reading and compiling the
+   text file against mapping the image compiled from it. */
+static void bench_rtable_load(void)
+{
+    unsigned int sizes[8];
+    int nsizes;
+    char param[32];
+    struct load_arg a;
+
+    if (!bench_selected("rtable_load_text") && !bench_selected("rtable_load_image"))
+        return;
+
+    strcpy(a.text, "/tmp/bench_rtable_XXXXXX");
+    strcpy(a.image, "/tmp/bench_rtable_XXXXXX");
+    int tfd = mkstemp(a.text), ifd = mkstemp(a.image);
+    if (tfd < 0 || ifd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(ifd);
+
+    bench_sizes(1000, 1000000, sizes, &nsizes);
+    for (int s = 0; s < nsizes; s++) {
+        struct sr_rt *rtable = NULL;
+        add_route(&rtable, 0, 0, 1, "eth2");
+        for (unsigned int i = 1; i < sizes[s]; i++) {
+            unsigned int plen = 8 + bench_rand() % 25;
+            uint32_t mask = htonl(0xffffffffu << (32 - plen));
+            add_route(&rtable, bench_rand() & mask, mask, bench_rand(), "eth2");
+        }
+        /* the text file gets the routes the FIB kept, so no duplicates */
+        struct sr_fib *fib = sr_fib_build(rtable);
+        FILE *fp = fdopen(dup(tfd), "w");
+        ftruncate(tfd, 0);
+        for (struct sr_rt *rt = fib->routes; rt != NULL; rt = rt->next) {
+            fprintf(fp, "%s ", inet_ntoa(rt->dest));
+            fprintf(fp, "%s ", inet_ntoa(rt->gw));
+            fprintf(fp, "%s %s\n", inet_ntoa(rt->mask), rt->interface);
+        }
+        fclose(fp);
+        if (sr_fib_image_write(fib, a.image) != 0) {
+            perror(a.image);
+            exit(1);
+        }
+        sr_fib_free(fib);
+
+        snprintf(param, sizeof(param), "routes=%u", sizes[s]);
+        if (bench_selected("rtable_load_text"))
+            bench_case("rtable_load_text", param, run_load_text, &a);
+        if (bench_selected("rtable_load_image"))
+            bench_case("rtable_load_image", param, run_load_image, &a);
+    }
+    close(tfd);
+    unlink(a.text);
+    unlink(a.image);
+}
+
+/* -- NAT mapping table ------------------------------------------------------ */
+
+struct nat_arg {
+    struct sr_instance *sr;
+    sr_nat_mapping_t **maps;
+    unsigned int nmaps;
+    unsigned int keys[BENCH_KEYS];
+};
+
+static void run_nat_lookup_internal(void *arg, uint64_t n)
+{
+    struct nat_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        sr_nat_mapping_t *m = a->maps[a->keys[i & (BENCH_KEYS - 1)]];
+        sr_nat_lookup_internal(&a->sr->nat, m->ip_int, m->aux_int, m->type);
+    }
+}
+
+static void run_nat_lookup_external(void *arg, uint64_t n)
+{
+    struct nat_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        sr_nat_mapping_t *m = a->maps[a->keys[i & (BENCH_KEYS - 1)]];
+        sr_nat_lookup_external(&a->sr->nat, m->ip_ext, m->aux_ext, m->type);
+    }
+}
+
+/* Insertion is timed once while the table is filled from empty; the
+   lookups then pick random existing mappings from the filled table. */
+static void bench_nat(struct sr_instance *sr)
+{
+    unsigned int sizes[8];
+    int nsizes;
+    char param[32];
+
+    if (!bench_selected("sr_nat_insert_mapping") && !bench_selected("sr_nat_lookup_internal") &&
+        !bench_selected("sr_nat_lookup_external"))
+        return;
+
+    bench_sizes(1000, 1000000, sizes, &nsizes);
+    for (int s = 0; s < nsizes; s++) {
+        struct nat_arg a;
+        a.sr = sr;
+        a.nmaps = sizes[s];
+        a.maps = malloc(a.nmaps * sizeof(*a.maps));
+        snprintf(param, sizeof(param), "mappings=%u", a.nmaps);
+
+        uint64_t a0 = bench_allocs;
+        double t0 = bench_now_ns();
+        for (unsigned int i = 0; i < a.nmaps; i++)
+            a.maps[i] = sr_nat_insert_mapping(sr, htonl(0x0a000000 | (i >> 6)),
+                                              htons(1024 + (i & 63)), 0x08080808, 0,
+                                              (i & 1) ? nat_mapping_tcp : nat_mapping_icmp);
+        double ns = bench_now_ns() - t0;
+        if (bench_selected("sr_nat_insert_mapping"))
+            bench_report("sr_nat_insert_mapping", param, a.nmaps, ns, bench_allocs - a0);
+
+        for (int k = 0; k < BENCH_KEYS; k++)
+            a.keys[k] = bench_rand() % a.nmaps;
+        if (bench_selected("sr_nat_lookup_internal"))
+            bench_case("sr_nat_lookup_internal", param, run_nat_lookup_internal, &a);
+        if (bench_selected("sr_nat_lookup_external"))
+            bench_case("sr_nat_lookup_external", param, run_nat_lookup_external, &a);
+
+        sr_nat_clear(&sr->nat);
+        free(a.maps);
+    }
+}
+
+/* Sweep a table of ICMP mappings that stay idle but never expire, so every
+   op walks the whole table. */
+static void run_nat_sweep(void *arg, uint64_t n)
+{
+    struct sr_instance *sr = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        sr_clock_advance(1);
+        sr_nat_sweep(sr, sr_clock_now());
+    }
+}
+
+static void bench_nat_sweep(struct sr_instance *sr)
+{
+    unsigned int sizes[8];
+    int nsizes;
+    char param[32];
+
+    if (!bench_selected("sr_nat_sweep"))
+        return;
+
+    sr->nat.icmp_query_timeout = (time_t) 1 << 40;
+    bench_sizes(1000, 1000000, sizes, &nsizes);
+    for (int s = 0; s < nsizes; s++) {
+        for (unsigned int i = 0; i < sizes[s]; i++)
+            sr_nat_insert_mapping(sr, htonl(0x0a000000 | (i >> 6)), htons(1024 + (i & 63)),
+                                  0x08080808, 0, nat_mapping_icmp);
+        snprintf(param, sizeof(param), "mappings=%u", sizes[s]);
+        bench_case("sr_nat_sweep", param, run_nat_sweep, sr);
+        sr_nat_clear(&sr->nat);
+    }
+    sr->nat.icmp_query_timeout = DEFAULT_ICMP_TIMEOUT;
+}
+
+/* Checkpoints are timed once per size like insertion: the table is
+   written, cleared and loaded back from the file. */
+static void bench_nat_ckpt(struct sr_instance *sr)
+{
+    unsigned int sizes[8];
+    int nsizes;
+    char param[32];
+    char path[] = "/tmp/bench_nat_ckpt_XXXXXX";
+
+    if (!bench_selected("sr_nat_ckpt_write") && !bench_selected("sr_nat_ckpt_load"))
+        return;
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+    close(fd);
+
+    bench_sizes(1000, 1000000, sizes, &nsizes);
+    for (int s = 0; s < nsizes; s++) {
+        for (unsigned int i = 0; i < sizes[s]; i++)
+            sr_nat_insert_mapping(sr, htonl(0x0a000000 | (i >> 6)), htons(1024 + (i & 63)),
+                                  0x08080808, 0, (i & 1) ? nat_mapping_tcp : nat_mapping_icmp);
+        snprintf(param, sizeof(param), "mappings=%u", sizes[s]);
+
+        uint64_t a0 = bench_allocs;
+        double t0 = bench_now_ns();
+        int ret = sr_nat_ckpt_write(sr, path);
+        double ns = bench_now_ns() - t0;
+        if (ret == 0 && bench_selected("sr_nat_ckpt_write"))
+            bench_report("sr_nat_ckpt_write", param, sizes[s], ns, bench_allocs - a0);
+
+        sr_nat_clear(&sr->nat);
+        a0 = bench_allocs;
+        t0 = bench_now_ns();
+        long restored = sr_nat_ckpt_load(sr, path);
+        ns = bench_now_ns() - t0;
+        if (restored == sizes[s] && bench_selected("sr_nat_ckpt_load"))
+            bench_report("sr_nat_ckpt_load", param, sizes[s], ns, bench_allocs - a0);
+        sr_nat_clear(&sr->nat);
+    }
+    unlink(path);
+}
+
+/* -- ARP cache -------------------------------------------------------------- */
+
+struct arp_arg {
+    struct sr_arpcache *cache;
+    uint32_t ip;
+    int slot;
+};
+
+static void run_arp_lookup(void *arg, uint64_t n)
+{
+    struct arp_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++)
+        free(sr_arpcache_lookup(a->cache, a->ip));
+}
+
+/* Insert into the first free slot, then free it again for the next op. */
+static void run_arp_insert(void *arg, uint64_t n)
+{
+    struct arp_arg *a = arg;
+    unsigned char mac[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0, 0x01 };
+    for (uint64_t i = 0; i < n; i++) {
+        sr_arpcache_insert(a->cache, mac, a->ip);
+        a->cache->entries[a->slot].valid = 0;
+    }
+}
+
+static void fill_arpcache(struct sr_arpcache *cache, int count)
+{
+    memset(cache->entries, 0, sizeof(cache->entries));
+    for (int i = 0; i < count; i++) {
+        cache->entries[i].ip = htonl(0x0a010000 + i);
+        cache->entries[i].added = time(NULL);
+        cache->entries[i].valid = 1;
+    }
+}
+
+static void run_arp_sweep(void *arg, uint64_t n)
+{
+    struct sr_instance *sr = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        sr_clock_advance(1);
+        sr_arpcache_sweep(sr, sr_clock_now());
+    }
+}
+
+static void bench_arp(struct sr_instance *sr)
+{
+    struct arp_arg a = { &sr->cache, 0, 0 };
+
+    if (bench_selected("sr_arpcache_lookup")) {
+        fill_arpcache(&sr->cache, SR_ARPCACHE_SZ);
+        a.ip = htonl(0x0a010000 + SR_ARPCACHE_SZ / 2);
+        bench_case("sr_arpcache_lookup", "hit", run_arp_lookup, &a);
+        a.ip = htonl(0x0b000001);
+        bench_case("sr_arpcache_lookup", "miss", run_arp_lookup, &a);
+    }
+    if (bench_selected("sr_arpcache_insert")) {
+        fill_arpcache(&sr->cache, 0);
+        a.ip = htonl(0x0b000001);
+        a.slot = 0;
+        bench_case("sr_arpcache_insert", "entries=0", run_arp_insert, &a);
+        fill_arpcache(&sr->cache, SR_ARPCACHE_SZ - 1);
+        a.slot = SR_ARPCACHE_SZ - 1;
+        bench_case("sr_arpcache_insert", "entries=99", run_arp_insert, &a);
+    }
+    if (bench_selected("sr_arpcache_sweep")) {
+        /* added in the far future, so no entry expires and every sweep
+           checks all of them */
+        fill_arpcache(&sr->cache, SR_ARPCACHE_SZ);
+        for (int i = 0; i < SR_ARPCACHE_SZ; i++)
+            sr->cache.entries[i].added = (time_t) 1 << 40;
+        bench_case("sr_arpcache_sweep", "entries=100", run_arp_sweep, sr);
+    }
+    fill_arpcache(&sr->cache, 0);
+}
+
+/* -- sr_handlepacket -------------------------------------------------------- */
+
+#define HOST_IP   0x0a000102    /* behind eth1 */
+#define REMOTE_IP 0x0a020304    /* behind eth2, via GW_IP */
+#define GW_IP     0x0a020001
+#define ETH1_IP   0x0a000101
+#define ETH2_IP   0x0a020002
+
+struct pkt_arg {
+    struct sr_instance *sr;
+    uint8_t template[sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + ICMP_PACKET_SIZE];
+    uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + ICMP_PACKET_SIZE];
+};
+
+/* The router rewrites the frame in place (TTL, checksum), so every op
+   starts from a fresh copy of the template. */
+static void run_handlepacket(void *arg, uint64_t n)
+{
+    struct pkt_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        memcpy(a->frame, a->template, sizeof(a->frame));
+        sr_handlepacket(a->sr, a->frame, sizeof(a->frame), "eth1");
+    }
+}
+
+static void build_echo(struct pkt_arg *a, sr_if_t *in, uint32_t dst)
+{
+    sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *) a->template;
+    sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) (ehdr + 1);
+    sr_icmp_hdr_t *icmphdr = (sr_icmp_hdr_t *) (iphdr + 1);
+    static const uint8_t host_mac[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0x01, 0x02 };
+
+    memset(a->template, 0, sizeof(a->template));
+    icmphdr->icmp_type = icmp_type_echoreq;
+    icmphdr->icmp_sum = cksum(icmphdr, ICMP_PACKET_SIZE);
+
+    iphdr->ip_v = 4;
+    iphdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+    iphdr->ip_len = htons(sizeof(sr_ip_hdr_t) + ICMP_PACKET_SIZE);
+    iphdr->ip_id = htons(1);
+    iphdr->ip_ttl = 64;
+    iphdr->ip_p = ip_protocol_icmp;
+    iphdr->ip_src = htonl(HOST_IP);
+    iphdr->ip_dst = dst;
+    iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
+
+    memcpy(ehdr->ether_dhost, in->addr, ETHER_ADDR_LEN);
+    memcpy(ehdr->ether_shost, host_mac, ETHER_ADDR_LEN);
+    ehdr->ether_type = htons(ethertype_ip);
+}
+
+/* "forward": echo request from a host on eth1 routed out of eth2 with the
+   next hop in the ARP cache. "local": echo request to eth1's address,
+   answered by the router. */
+static void bench_handlepacket(struct sr_instance *sr)
+{
+    static const uint8_t gw_mac[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0x02, 0x01 };
+    static const uint8_t host_mac[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0x01, 0x02 };
+    struct pkt_arg *a;
+
+    if (!bench_selected("sr_handlepacket"))
+        return;
+
+    a = calloc(1, sizeof(*a));
+    a->sr = sr;
+    sr_arpcache_insert(&sr->cache, (unsigned char *) gw_mac, htonl(GW_IP));
+    sr_arpcache_insert(&sr->cache, (unsigned char *) host_mac, htonl(HOST_IP));
+
+    build_echo(a, sr_get_interface(sr, "eth1"), htonl(REMOTE_IP));
+    bench_case("sr_handlepacket", "forward", run_handlepacket, a);
+
+    build_echo(a, sr_get_interface(sr, "eth1"), htonl(ETH1_IP));
+    bench_case("sr_handlepacket", "local", run_handlepacket, a);
+
+    fill_arpcache(&sr->cache, 0);
+    free(a);
+}
+
+/* -- access lists ----------------------------------------------------------- */
+
+struct acl_arg {
+    struct sr_acl *acl;
+    sr_if_t *iface;
+    uint8_t pkts[BENCH_KEYS][sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t)];
+};
+
+static const struct sr_acl_rule *volatile bench_sink_rule;
+
+static void run_acl(void *arg, uint64_t n)
+{
+    struct acl_arg *a = arg;
+    for (uint64_t i = 0; i < n; i++)
+        bench_sink_rule = sr_acl_lookup(a->acl, a->iface, sr_acl_in,
+                                        (sr_ip_hdr_t *) a->pkts[i & (BENCH_KEYS - 1)],
+                                        sizeof(a->pkts[0]));
+}
+
+/* 'rules' rules in four shapes (source /24 with a TCP port; source /16,
+   destination /24 and a UDP port; a single source; destination /24 with
+   a TCP port range and SYN) and a final permit. Half the packets are built to hit a random rule, the
+   rest are random and fall through to the permit. A linear scan would
+   grow with the rule count; the classifier should stay flat. */
+static void bench_acl(struct sr_instance *sr)
+{
+    unsigned int sizes[8];
+    int nsizes;
+    char line[160], param[32];
+
+    if (!bench_selected("acl_lookup"))
+        return;
+
+    bench_sizes(10, 10000, sizes, &nsizes);
+    for (int s = 0; s < nsizes; s++) {
+        struct acl_arg *a = calloc(1, sizeof(*a));
+        uint32_t *src = malloc(sizes[s] * sizeof(uint32_t));
+        uint32_t *dst = malloc(sizes[s] * sizeof(uint32_t));
+        uint16_t *port = malloc(sizes[s] * sizeof(uint16_t));
+        uint8_t *proto = malloc(sizes[s]);
+
+        a->acl = sr_acl_create();
+        a->iface = sr_get_interface(sr, "eth1");
+        for (unsigned int i = 0; i + 1 < sizes[s]; i++) {
+            struct in_addr sa = { bench_rand() }, da = { bench_rand() };
+            char sbuf[16], dbuf[16];
+            strcpy(sbuf, inet_ntoa(sa));
+            strcpy(dbuf, inet_ntoa(da));
+            port[i] = 1 + bench_rand() % 65000;
+            src[i] = sa.s_addr;
+            dst[i] = da.s_addr;
+            switch (i % 4) {
+                case 0:
+                    proto[i] = ip_protocol_tcp;
+                    snprintf(line, sizeof(line), "eth1 in deny proto=tcp src=%s/24 dport=%u", sbuf, port[i]);
+                    break;
+                case 1:
+                    proto[i] = ip_protocol_udp;
+                    snprintf(line, sizeof(line), "eth1 in deny proto=udp src=%s/16 dst=%s/24 dport=%u",
+                             sbuf, dbuf, port[i]);
+                    break;
+                case 2:
+                    proto[i] = ip_protocol_icmp;
+                    snprintf(line, sizeof(line), "eth1 in deny src=%s", sbuf);
+                    break;
+                default:
+                    proto[i] = ip_protocol_tcp;
+                    snprintf(line, sizeof(line), "eth1 in permit proto=tcp dst=%s/24 dport=%u-%u flags=S/SA",
+                             dbuf, port[i], port[i] + 100);
+                    break;
+            }
+            if (sr_acl_add(a->acl, sr, line) != 0) {
+                fprintf(stderr, "bench: bad rule %s\n", line);
+                exit(1);
+            }
+        }
+        sr_acl_add(a->acl, sr, "eth1 in permit");
+        sr_acl_compile(a->acl);
+
+        for (int k = 0; k < BENCH_KEYS; k++) {
+            sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) a->pkts[k];
+            sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (iphdr + 1);
+            iphdr->ip_v = 4;
+            iphdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+            iphdr->ip_len = htons(sizeof(a->pkts[0]));
+            tcphdr->th_flags = TH_SYN;
+            if ((k & 1) && sizes[s] > 1) {
+                unsigned int i = bench_rand() % (sizes[s] - 1);
+                iphdr->ip_p = proto[i];
+                iphdr->ip_src = src[i];
+                iphdr->ip_dst = dst[i];
+                tcphdr->th_sport = htons(bench_rand());
+                tcphdr->th_dport = htons(port[i]);
+            } else {
+                iphdr->ip_p = (bench_rand() & 1) ? ip_protocol_tcp : ip_protocol_udp;
+                iphdr->ip_src = bench_rand();
+                iphdr->ip_dst = bench_rand();
+                tcphdr->th_sport = htons(bench_rand());
+                tcphdr->th_dport = htons(bench_rand());
+            }
+        }
+
+        snprintf(param, sizeof(param), "rules=%u", sizes[s]);
+        bench_case("acl_lookup", param, run_acl, a);
+        sr_acl_destroy(a->acl);
+        free(src);
+        free(dst);
+        free(port);
+        free(proto);
+        free(a);
+    }
+}
+
+/* -- setup ------------------------------------------------------------------ */
+
+static struct sr_instance *bench_sr(void)
+{
+    static const unsigned char eth1_mac[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0x00, 0x01 };
+    static const unsigned char eth2_mac[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0x00, 0x02 };
+    struct sr_instance *sr = calloc(1, sizeof(struct sr_instance));
+
+    sr_add_interface(sr, "eth1");
+    sr_set_ether_addr(sr, eth1_mac);
+    sr_set_ether_ip(sr, htonl(ETH1_IP));
+    sr_add_interface(sr, "eth2");
+    sr_set_ether_addr(sr, eth2_mac);
+    sr_set_ether_ip(sr, htonl(ETH2_IP));
+
+    add_route(&sr->routing_table, htonl(0x0a020000), htonl(0xffff0000), htonl(GW_IP), "eth2");
+    add_route(&sr->routing_table, htonl(0x0a000100), htonl(0xffffff00), 0, "eth1");
+
+    /* The ARP sweeper and NAT timeout threads are not started: nothing
+       else touches the tables while a case runs. */
+    sr_arpcache_init(&sr->cache);
+    sr->nat.int_iface_name = "eth1";
+    sr->nat.icmp_query_timeout = DEFAULT_ICMP_TIMEOUT;
+    /* the NAT cases put 64 mappings on each of up to 16k hosts */
+    sr_nat_pool_add(&sr->nat.pool, htonl(0xcb007100), 256, NULL);   /* 203.0.113.0/24 */
+    pthread_mutexattr_init(&sr->nat.attr);
+    pthread_mutexattr_settype(&sr->nat.attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sr->nat.lock, &sr->nat.attr);
+    return sr;
+}
+
+static void usage(char* argv0)
+{
+    printf("Format: %s [-t min seconds] [-r runs] [-f filter] [-q]\n", argv0);
+    printf("   defaults min seconds=%.1f runs=%d, -q caps tables at %d entries\n",
+           bench_min_ns / 1e9, bench_runs, BENCH_QUICK_MAX);
+}
+
+int main(int argc, char **argv)
+{
+    struct sr_instance *sr;
+    int c;
+
+    while ((c = getopt(argc, argv, "ht:r:f:q")) != EOF) {
+        switch (c) {
+            case 't':
+                bench_min_ns = atof(optarg) * 1e9;
+                break;
+            case 'r':
+                bench_runs = atoi(optarg);
+                break;
+            case 'f':
+                bench_filter = optarg;
+                break;
+            case 'q':
+                bench_quick = true;
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (bench_runs < 1 || bench_min_ns <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    sr = bench_sr();
+    sr_clock_set_virtual(0);
+
+    printf("benchmark,param,iterations,ns_per_op,ops_per_sec,allocs_per_op\n");
+    bench_cksums();
+    bench_lpm();
+    bench_rtable_load();
+    bench_nat(sr);
+    bench_nat_sweep(sr);
+    bench_nat_ckpt(sr);
+    bench_arp(sr);
+    bench_handlepacket(sr);
+    bench_acl(sr);
+
+    return 0;
+}
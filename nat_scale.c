@@ -0,0 +1,511 @@
+/*-----------------------------------------------------------------------------
+ * File: nat_scale.c
+ *
+ * Scale harness for the NAT. It builds the same stubbed sr_instance as
+ * test_nat.c (an internal and an external interface, sr_send_packet
+ * swallowed) and drives synthetic traffic through do_nat: N internal
+ * hosts each ping once and open M TCP flows with a full three way
+ * handshake. Then it measures lookups and a sweeper pass over the full
+ * table, and finally runs simulated hours of churn on the virtual clock
+ * (sr_clock.h). Hosts are spread over an external address pool of one
+ * address per 128 hosts (198.18.0.0 upward), each host taking one port
+ * block for its mappings. During churn each flow is torn down with FINs and
+ * reopened once per flow lifetime, hosts keep pinging, and the sweeper
+ * runs once per simulated second.
+ *
+ * For every N it prints one CSV line:
+ *
+ *   hosts,flows_per_host,hosts_done,mappings,conns,
+ *   bytes_per_host,bytes_per_flow,setup_pkts_per_s,
+ *   lookup_int_per_s,lookup_ext_per_s,sweep_ms,churn_sim_s,
+ *   churn_pkts_per_s,nat_hold_p50_us,nat_hold_p99_us,nat_hold_max_us,
+ *   sweep_hold_max_ms,misdirected
+ *
+ * nat_hold_* is the time do_nat holds the NAT lock per packet and
+ * sweep_hold_max_ms the longest sweeper pass, which holds it throughout.
+ * Memory is in-use heap, allocator overhead included: per host for its
+ * first ping (ICMP mapping, host record and port block) and per TCP flow
+ * (mapping and connection).
+ * misdirected counts inbound segments the NAT delivered to a different
+ * internal host or port than the flow they belong to. Every phase stops
+ * early once it has used its time budget (-b), so large N report the
+ * rates they reached and hosts_done says how much of the table was
+ * built.
+ *
+ *   nat_scale [-n max hosts] [-m flows per host] [-H hours] [-L flow lifetime]
+ *             [-b budget seconds]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include <stdbool.h>
+
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_utils.h"
+#include "sr_nat.h"
+#include "sr_nat_pool.h"
+#include "sr_stats.h"
+#include "sr_clock.h"
+
+#define SCALE_SAMPLES   65536       /* reservoir for lock hold times */
+#define SCALE_PKT_LEN   (sizeof(sr_ip_hdr_t) + ICMP_PACKET_SIZE)
+#define SCALE_LOOKUPS   1000000
+
+#define SERVER_PORT     443
+#define CLIENT_ISN      1000
+#define SERVER_ISN      5000
+
+static unsigned int max_hosts = 1000000;
+static unsigned int flows_per_host = 4;
+static double churn_hours = 1;
+static unsigned int flow_lifetime = 600;    /* seconds */
+static unsigned int echo_interval = 30;     /* seconds between pings per host */
+static double budget_ns = 10e9;
+
+static uint32_t eth1_ip, eth2_ip;
+
+/* -- sr_send_packet stub --------------------------------------------------- */
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         const char* iface /* borrowed */)
+{
+    return 0;
+}
+
+int sr_send_packets(struct sr_instance* sr, struct sr_txq_frame* frames, unsigned int n)
+{
+    return 0;
+}
+
+/* -- helpers ---------------------------------------------------------------- */
+
+static uint64_t scale_rng = 0x9e3779b97f4a7c15ull;
+
+static uint32_t scale_rand(void)
+{
+    scale_rng ^= scale_rng >> 12;
+    scale_rng ^= scale_rng << 25;
+    scale_rng ^= scale_rng >> 27;
+    return (uint32_t) ((scale_rng * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t heap_in_use(void)
+{
+    return mallinfo2().uordblks;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* -- lock hold times -------------------------------------------------------- */
+
+static uint32_t hold_samples[SCALE_SAMPLES];
+static uint64_t hold_count;
+static double hold_max_ns;
+static double sweep_max_ns;
+
+static void hold_record(double ns)
+{
+    uint64_t slot = hold_count < SCALE_SAMPLES ? hold_count
+                                               : scale_rand() % (hold_count + 1);
+    if (slot < SCALE_SAMPLES)
+        hold_samples[slot] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t) ns;
+    hold_count++;
+    if (ns > hold_max_ns)
+        hold_max_ns = ns;
+}
+
+static double hold_percentile(double p)
+{
+    unsigned int n = hold_count < SCALE_SAMPLES ? hold_count : SCALE_SAMPLES;
+    if (n == 0)
+        return 0;
+    qsort(hold_samples, n, sizeof(hold_samples[0]), cmp_u32);
+    return hold_samples[(unsigned int) (p * (n - 1))];
+}
+
+static void hold_reset(void)
+{
+    hold_count = 0;
+    hold_max_ns = 0;
+    sweep_max_ns = 0;
+}
+
+/* -- traffic ---------------------------------------------------------------- */
+
+struct scale {
+    struct sr_instance *sr;
+    sr_if_t *int_iface;
+    sr_if_t *ext_iface;
+    unsigned int hosts;
+    unsigned int nflows;
+    uint16_t *flow_ext;         /* external port of each flow */
+    uint16_t *flow_gen;         /* times the flow has been reopened */
+    uint16_t *echo_ext;         /* external ICMP id of each host */
+    uint32_t *host_ext;         /* external address each host is paired with */
+    uint64_t packets;
+    uint64_t misdirected;
+};
+
+static uint32_t host_ip(unsigned int h)
+{
+    return htonl(0x0a000000 + h + 1);
+}
+
+static uint32_t server_ip(unsigned int f)
+{
+    return htonl(0xc6336400 + 1 + f % 200);    /* 198.51.100.1-200 */
+}
+
+static uint16_t flow_port(struct scale *sc, unsigned int f)
+{
+    unsigned int slot = f % flows_per_host + sc->flow_gen[f] * flows_per_host;
+    return htons(1024 + slot % 60000);
+}
+
+static nat_action_type nat_call(struct scale *sc, uint8_t *pkt, sr_if_t *iface)
+{
+    double t0 = now_ns();
+    nat_action_type action = do_nat(sc->sr, (sr_ip_hdr_t *) pkt, iface);
+    hold_record(now_ns() - t0);
+    sc->packets++;
+    return action;
+}
+
+static sr_tcp_hdr_t *build_tcp(uint8_t *pkt, uint32_t src, uint32_t dst, uint16_t sport,
+                               uint16_t dport, uint8_t flags, uint32_t seq, uint32_t ack)
+{
+    sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) pkt;
+    sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (iphdr + 1);
+
+    memset(pkt, 0, SCALE_PKT_LEN);
+    iphdr->ip_v = 4;
+    iphdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+    iphdr->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t));
+    iphdr->ip_ttl = 64;
+    iphdr->ip_p = ip_protocol_tcp;
+    iphdr->ip_src = src;
+    iphdr->ip_dst = dst;
+    tcphdr->th_sport = sport;
+    tcphdr->th_dport = dport;
+    tcphdr->th_seq = htonl(seq);
+    tcphdr->th_ack = htonl(ack);
+    tcphdr->th_off = sizeof(sr_tcp_hdr_t) / 4;
+    tcphdr->th_flags = flags;
+    return tcphdr;
+}
+
+static void tcp_out(struct scale *sc, unsigned int f, uint8_t flags, uint32_t seq, uint32_t ack)
+{
+    uint8_t pkt[SCALE_PKT_LEN];
+    sr_tcp_hdr_t *tcphdr = build_tcp(pkt, host_ip(f / flows_per_host), server_ip(f),
+                                     flow_port(sc, f), htons(SERVER_PORT), flags, seq, ack);
+    if (nat_call(sc, pkt, sc->int_iface) == nat_action_route) {
+        sc->flow_ext[f] = tcphdr->th_sport;
+        sc->host_ext[f / flows_per_host] = ((sr_ip_hdr_t *) pkt)->ip_src;
+    }
+}
+
+static void tcp_in(struct scale *sc, unsigned int f, uint8_t flags, uint32_t seq, uint32_t ack)
+{
+    uint8_t pkt[SCALE_PKT_LEN];
+    sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) pkt;
+    sr_tcp_hdr_t *tcphdr = build_tcp(pkt, server_ip(f), sc->host_ext[f / flows_per_host], htons(SERVER_PORT),
+                                     sc->flow_ext[f], flags, seq, ack);
+    nat_call(sc, pkt, sc->ext_iface);
+    if (iphdr->ip_dst != host_ip(f / flows_per_host) || tcphdr->th_dport != flow_port(sc, f))
+        sc->misdirected++;
+}
+
+static void flow_open(struct scale *sc, unsigned int f)
+{
+    tcp_out(sc, f, TH_SYN, CLIENT_ISN, 0);
+    tcp_in(sc, f, TH_SYN | TH_ACK, SERVER_ISN, CLIENT_ISN + 1);
+    tcp_out(sc, f, TH_ACK, CLIENT_ISN + 1, SERVER_ISN + 1);
+}
+
+static void flow_close(struct scale *sc, unsigned int f)
+{
+    tcp_out(sc, f, TH_FIN | TH_ACK, CLIENT_ISN + 1, SERVER_ISN + 1);
+    tcp_in(sc, f, TH_ACK, SERVER_ISN + 1, CLIENT_ISN + 2);
+    tcp_in(sc, f, TH_FIN | TH_ACK, SERVER_ISN + 1, CLIENT_ISN + 2);
+    tcp_out(sc, f, TH_ACK, CLIENT_ISN + 2, SERVER_ISN + 2);
+}
+
+/* echo request from host 'h' and, when it went out, the reply */
+static void host_ping(struct scale *sc, unsigned int h)
+{
+    uint8_t pkt[SCALE_PKT_LEN];
+    sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) pkt;
+    sr_icmp_echo_hdr_t *echo = (sr_icmp_echo_hdr_t *) (iphdr + 1);
+
+    memset(pkt, 0, sizeof(pkt));
+    iphdr->ip_v = 4;
+    iphdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+    iphdr->ip_len = htons(SCALE_PKT_LEN);
+    iphdr->ip_ttl = 64;
+    iphdr->ip_p = ip_protocol_icmp;
+    iphdr->ip_src = host_ip(h);
+    iphdr->ip_dst = server_ip(h);
+    echo->icmp_type = icmp_type_echoreq;
+    echo->icmp_id = htons(7);
+    if (nat_call(sc, pkt, sc->int_iface) != nat_action_route)
+        return;
+    sc->echo_ext[h] = echo->icmp_id;
+    sc->host_ext[h] = iphdr->ip_src;
+
+    iphdr->ip_dst = iphdr->ip_src;
+    iphdr->ip_src = server_ip(h);
+    echo->icmp_type = icmp_type_echoreply;
+    nat_call(sc, pkt, sc->ext_iface);
+    if (iphdr->ip_dst != host_ip(h) || echo->icmp_id != htons(7))
+        sc->misdirected++;
+}
+
+static void timed_sweep(struct scale *sc)
+{
+    double t0 = now_ns();
+    sr_nat_sweep(sc->sr, sr_clock_now());
+    double ns = now_ns() - t0;
+    if (ns > sweep_max_ns)
+        sweep_max_ns = ns;
+}
+
+/* -- setup ------------------------------------------------------------------ */
+
+static void add_route(struct sr_rt **rtable, uint32_t dest, uint32_t mask, uint32_t gw, const char *iface)
+{
+    struct sr_rt *rt = calloc(1, sizeof(struct sr_rt));
+    rt->dest.s_addr = dest;
+    rt->mask.s_addr = mask;
+    rt->gw.s_addr = gw;
+    strncpy(rt->interface, iface, sr_IFACE_NAMELEN - 1);
+    rt->next = *rtable;
+    *rtable = rt;
+}
+
+static struct sr_instance *scale_sr(void)
+{
+    static const unsigned char eth1_mac[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0x00, 0x01 };
+    static const unsigned char eth2_mac[ETHER_ADDR_LEN] = { 0x02, 0, 0, 0, 0x00, 0x02 };
+    struct sr_instance *sr = calloc(1, sizeof(struct sr_instance));
+
+    eth1_ip = htonl(0x0afffffe);               /* 10.255.255.254 */
+    eth2_ip = htonl(0xcb007101);               /* 203.0.113.1 */
+    sr_add_interface(sr, "eth1");
+    sr_set_ether_addr(sr, eth1_mac);
+    sr_set_ether_ip(sr, eth1_ip);
+    sr_add_interface(sr, "eth2");
+    sr_set_ether_addr(sr, eth2_mac);
+    sr_set_ether_ip(sr, eth2_ip);
+
+    add_route(&sr->routing_table, 0, 0, htonl(0xcb0071fe), "eth2");
+    add_route(&sr->routing_table, htonl(0x0a000000), htonl(0xff000000), 0, "eth1");
+
+    /* no timeout thread: the harness sweeps on the virtual clock itself */
+    sr->nat_enabled = true;
+    sr->nat.int_iface_name = "eth1";
+    sr->nat.icmp_query_timeout = DEFAULT_ICMP_TIMEOUT;
+    sr->nat.tcp_estab_timeout = DEFAULT_TCP_ESTABLISHED_TIMEOUT;
+    sr->nat.tcp_trans_timeout = DEFAULT_TCP_TRANSITORY_TIMEOUT;
+    sr->nat.udp_timeout = DEFAULT_UDP_TIMEOUT;
+    pthread_mutexattr_init(&sr->nat.attr);
+    pthread_mutexattr_settype(&sr->nat.attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sr->nat.lock, &sr->nat.attr);
+    return sr;
+}
+
+/* Expire everything a previous run left behind. */
+static void scale_flush(struct sr_instance *sr)
+{
+    sr_clock_advance(DEFAULT_TCP_ESTABLISHED_TIMEOUT * 2);
+    sr_nat_sweep(sr, sr_clock_now());
+    sr_clock_advance(DEFAULT_TCP_TRANSITORY_TIMEOUT * 2);
+    sr_nat_sweep(sr, sr_clock_now());
+}
+
+/* -- phases ----------------------------------------------------------------- */
+
+static void run_scale(struct sr_instance *sr, unsigned int hosts)
+{
+    struct scale sc = { sr, sr_get_interface(sr, "eth1"), sr_get_interface(sr, "eth2"), hosts };
+    struct sr_stats_snapshot snap;
+    unsigned int h, done;
+    double t0, elapsed, setup_pkts_s, lookup_int_s = 0, lookup_ext_s = 0;
+    double per_host = 0, per_flow = 0;
+
+    sc.nflows = hosts * flows_per_host;
+    sc.flow_ext = calloc(sc.nflows, sizeof(uint16_t));
+    sc.flow_gen = calloc(sc.nflows, sizeof(uint16_t));
+    sc.echo_ext = calloc(hosts, sizeof(uint16_t));
+    sc.host_ext = calloc(hosts, sizeof(uint32_t));
+
+    scale_flush(sr);
+    /* a pool address per 128 hosts, half of its port blocks */
+    sr_nat_pool_destroy(&sr->nat.pool);
+    if (sr_nat_pool_add(&sr->nat.pool, htonl(0xc6120000), hosts / 128 + 1, "eth2") != 0) {
+        fprintf(stderr, "cannot set up a pool for %u hosts\n", hosts);
+        exit(1);
+    }
+    hold_reset();
+
+    /* one ping per host: ICMP mappings only */
+    size_t heap0 = heap_in_use();
+    t0 = now_ns();
+    for (h = 0; h < hosts; h++) {
+        host_ping(&sc, h);
+        if ((h & 1023) == 0 && now_ns() - t0 > budget_ns / 2)
+            break;
+    }
+    size_t heap1 = heap_in_use();
+    unsigned int pinged = h < hosts ? h + 1 : hosts;
+    per_host = (double) (heap1 - heap0) / pinged;
+
+    /* M handshakes per host: one TCP mapping and connection per flow */
+    for (done = 0; done < hosts; done++) {
+        for (unsigned int f = done * flows_per_host; f < (done + 1) * flows_per_host; f++)
+            flow_open(&sc, f);
+        if ((done & 255) == 0 && now_ns() - t0 > budget_ns)
+            break;
+    }
+    done = done < hosts ? done + 1 : hosts;
+    elapsed = now_ns() - t0;
+    setup_pkts_s = sc.packets / (elapsed / 1e9);
+    if (done * flows_per_host > 0)
+        per_flow = (double) (heap_in_use() - heap1) / (done * flows_per_host);
+
+    /* lookups of random established flows, both directions */
+    unsigned int open_flows = done * flows_per_host;
+    if (open_flows > 0) {
+        unsigned int n;
+        t0 = now_ns();
+        for (n = 0; n < SCALE_LOOKUPS && (n & 63 || now_ns() - t0 < budget_ns / 4); n++) {
+            unsigned int f = scale_rand() % open_flows;
+            sr_nat_lookup_internal(&sr->nat, host_ip(f / flows_per_host), flow_port(&sc, f),
+                                   nat_mapping_tcp);
+        }
+        lookup_int_s = n / ((now_ns() - t0) / 1e9);
+        t0 = now_ns();
+        for (n = 0; n < SCALE_LOOKUPS && (n & 63 || now_ns() - t0 < budget_ns / 4); n++) {
+            unsigned int f = scale_rand() % open_flows;
+            sr_nat_lookup_external(&sr->nat, sc.host_ext[f / flows_per_host], sc.flow_ext[f],
+                                   nat_mapping_tcp);
+        }
+        lookup_ext_s = n / ((now_ns() - t0) / 1e9);
+    }
+
+    /* one sweeper pass over the full table, nothing due yet */
+    sr_stats_snapshot(&snap);
+    t0 = now_ns();
+    sr_nat_sweep(sr, sr_clock_now());
+    double sweep_ms = (now_ns() - t0) / 1e6;
+
+    /* churn: every flow is closed and reopened once per lifetime, every
+       host pings once per echo interval, the sweeper runs each second */
+    uint64_t churn_s = 0, churn_pkts0 = sc.packets;
+    unsigned int closes = open_flows / flow_lifetime + 1, pings = done / echo_interval + 1;
+    unsigned int fcur = 0, hcur = 0;
+    t0 = now_ns();
+    while (open_flows > 0 && churn_s < churn_hours * 3600 && now_ns() - t0 < budget_ns) {
+        for (unsigned int i = 0; i < closes; i++, fcur = (fcur + 1) % open_flows) {
+            flow_close(&sc, fcur);
+            sc.flow_gen[fcur]++;
+            flow_open(&sc, fcur);
+        }
+        for (unsigned int i = 0; i < pings; i++, hcur = (hcur + 1) % done)
+            host_ping(&sc, hcur);
+        sr_clock_advance(1);
+        timed_sweep(&sc);
+        churn_s++;
+    }
+    double churn_pkts_s = (sc.packets - churn_pkts0) / ((now_ns() - t0) / 1e9);
+
+    printf("%u,%u,%u,%lld,%lld,%.0f,%.0f,%.0f,%.0f,%.0f,%.3f,%llu,%.0f,%.2f,%.2f,%.2f,%.3f,%llu\n",
+           hosts, flows_per_host, done,
+           (long long) (snap.gauges[gauge_nat_icmp_mappings] + snap.gauges[gauge_nat_tcp_mappings] +
+                        snap.gauges[gauge_nat_udp_mappings]),
+           (long long) snap.gauges[gauge_nat_tcp_conns], per_host, per_flow, setup_pkts_s,
+           lookup_int_s, lookup_ext_s, sweep_ms, (unsigned long long) churn_s, churn_pkts_s,
+           hold_percentile(0.50) / 1e3, hold_percentile(0.99) / 1e3, hold_max_ns / 1e3,
+           sweep_max_ns / 1e6, (unsigned long long) sc.misdirected);
+    fflush(stdout);
+
+    free(sc.flow_ext);
+    free(sc.flow_gen);
+    free(sc.echo_ext);
+    free(sc.host_ext);
+}
+
+static void usage(char* argv0)
+{
+    printf("Format: %s [-n max hosts] [-m flows per host] [-H hours] [-L flow lifetime]\n"
+           "          [-b budget seconds]\n", argv0);
+    printf("   defaults hosts=%u flows=%u hours=%.1f lifetime=%us budget=%.0fs per phase\n",
+           max_hosts, flows_per_host, churn_hours, flow_lifetime, budget_ns / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    struct sr_instance *sr;
+    int c;
+
+    while ((c = getopt(argc, argv, "hn:m:H:L:b:")) != EOF) {
+        switch (c) {
+            case 'n':
+                max_hosts = atoi(optarg);
+                break;
+            case 'm':
+                flows_per_host = atoi(optarg);
+                break;
+            case 'H':
+                churn_hours = atof(optarg);
+                break;
+            case 'L':
+                flow_lifetime = atoi(optarg);
+                break;
+            case 'b':
+                budget_ns = atof(optarg) * 1e9;
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (max_hosts < 1 || flows_per_host < 1 || flow_lifetime < 1 || budget_ns <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    sr_clock_set_virtual(0);
+    sr = scale_sr();
+
+    printf("hosts,flows_per_host,hosts_done,mappings,conns,bytes_per_host,bytes_per_flow,"
+           "setup_pkts_per_s,lookup_int_per_s,lookup_ext_per_s,sweep_ms,churn_sim_s,"
+           "churn_pkts_per_s,nat_hold_p50_us,nat_hold_p99_us,nat_hold_max_us,"
+           "sweep_hold_max_ms,misdirected\n");
+    for (unsigned int hosts = 1000; hosts <= max_hosts; hosts *= 10)
+        run_scale(sr, hosts);
+
+    return 0;
+}
@@ -0,0 +1,568 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sr_router.h"
+#include "sr_utils.h"
+#include "sr_acl.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+
+/*
+ * Access lists.
+ *
+ * Stateless rules per interface and direction, read from a file with one
+ * rule per line:
+ *
+ *   iface in|out permit|deny [proto=tcp|udp|icmp|N] [src=prefix] [dst=prefix]
+ *                            [sport=port[-port]] [dport=port[-port]] [flags=SA[/SAFR]]
+ *
+ * The first rule that matches a packet decides; a packet no rule matches
+ * is permitted. handle_ip_packet checks the "in" rules of the receiving
+ * interface before NAT, route_ip_packet the "out" rules of the outgoing
+ * one once the route is known, so both see the addresses on the wire.
+ *
+ * The rules are not walked one by one. sr_acl_compile sorts the rules of
+ * each interface and direction into tuples, one per combination of
+ * source and destination prefix length and of whether the protocol and
+ * each port are exact. Within a tuple the rules are hashed on those exact
+ * fields, so a packet costs one hash probe per tuple whatever the number
+ * of rules. Rules sharing a key are chained in file order and their port
+ * ranges and flags are checked on the rule. Tuples are kept in the order
+ * of their first rule, and the search stops at the first tuple that
+ * cannot beat the match found so far.
+ */
+
+#define ACL_F_PROTO  0x01    /* the protocol is part of the tuple's key */
+#define ACL_F_SPORT  0x02
+#define ACL_F_DPORT  0x04
+
+struct sr_acl_tuple {
+  uint32_t src_mask, dst_mask;
+  uint8_t fields;            /* ACL_F_* */
+  unsigned int best;         /* lowest priority of its rules */
+  unsigned int nrules;
+  unsigned int mask;         /* slots - 1 */
+  int *slots;                /* first rule of each key, -1 if free */
+};
+
+struct acl_key {
+  uint32_t src, dst;
+  uint16_t sport, dport;
+  int proto;
+};
+
+/* What the rules look at in a packet */
+struct acl_pkt {
+  uint32_t src, dst;
+  int proto;
+  uint16_t sport, dport;     /* host byte order, valid if 'ports' */
+  uint8_t flags;             /* valid if 'tcp' */
+  bool ports;
+  bool tcp;
+};
+
+
+struct sr_acl *sr_acl_create(void)
+{
+  return calloc(1, sizeof(struct sr_acl));
+}
+
+static void acl_free_tables(struct sr_acl *acl)
+{
+  for (int i = 0; i < SR_STATS_MAX_IFACES; i++) {
+    for (int d = 0; d < sr_acl_dirs; d++) {
+      struct sr_acl_table *table = acl->tables[i][d];
+      if (table == NULL)
+        continue;
+      for (unsigned int t = 0; t < table->ntuples; t++)
+        free(table->tuples[t].slots);
+      free(table->tuples);
+      free(table->rules);
+      free(table);
+      acl->tables[i][d] = NULL;
+    }
+  }
+}
+
+void sr_acl_destroy(struct sr_acl *acl)
+{
+  if (acl == NULL)
+    return;
+  acl_free_tables(acl);
+  free(acl->rules);
+  free(acl);
+}
+
+
+static int acl_parse_ports(const char *val, uint16_t *lo, uint16_t *hi)
+{
+  char *end;
+  unsigned long l = strtoul(val, &end, 10);
+  unsigned long h = l;
+
+  if (end == val)
+    return -1;
+  if (*end == '-') {
+    const char *p = end + 1;
+    h = strtoul(p, &end, 10);
+    if (end == p)
+      return -1;
+  }
+  if ((*end != '\0') || (l > h) || (h > 0xffff))
+    return -1;
+  *lo = l;
+  *hi = h;
+  return 0;
+}
+
+static int acl_parse_proto(const char *val, int *proto)
+{
+  char *end;
+  unsigned long p;
+
+  if (strcmp(val, "tcp") == 0)
+    *proto = ip_protocol_tcp;
+  else if (strcmp(val, "udp") == 0)
+    *proto = ip_protocol_udp;
+  else if (strcmp(val, "icmp") == 0)
+    *proto = ip_protocol_icmp;
+  else {
+    p = strtoul(val, &end, 10);
+    if ((end == val) || (*end != '\0') || (p > 255))
+      return -1;
+    *proto = p;
+  }
+  return 0;
+}
+
+/* "SA/SAFR": the flags to look at after the slash, those of them that
+   must be set before it. Without a slash only the given flags are looked
+   at. Letters as in FSRPAUEW. */
+static int acl_parse_flags(const char *val, uint8_t *flags, uint8_t *mask)
+{
+  static const char letters[] = "FSRPAUEW";
+  uint8_t bits[2] = { 0, 0 };
+  int part = 0;
+
+  for (const char *c = val; *c; c++) {
+    const char *l = strchr(letters, *c);
+    if (*c == '/' && part == 0)
+      part = 1;
+    else if (l != NULL)
+      bits[part] |= 1 << (l - letters);
+    else
+      return -1;
+  }
+  *flags = bits[0];
+  *mask = part ? bits[1] : bits[0];
+  if ((*flags & ~*mask) != 0)
+    return -1;
+  return 0;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_add
+ *
+ * Scope:  Global
+ *
+ * Adds the rule on 'line', after the ones already added. Blank lines
+ * and '#' comments are ignored. The rule only takes effect once
+ * sr_acl_compile has run.
+ *
+ * returns:
+ *    0 on success, -1 if the rule is malformed or names an unknown
+ *    interface
+ *
+ *---------------------------------------------------------------------*/
+int sr_acl_add(struct sr_acl *acl, struct sr_instance *sr, const char *line)
+{
+  struct sr_acl_rule r;
+  char *copy = strdup(line);
+  char *save = NULL;
+  char *tok;
+  int ret = 0;
+
+  char *comment = strchr(copy, '#');
+  if (comment)
+    *comment = '\0';
+  if ((tok = strtok_r(copy, " \t\r\n", &save)) == NULL) {
+    free(copy);
+    return 0;
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.proto = -1;
+  r.sport_hi = r.dport_hi = 0xffff;
+  r.next = -1;
+
+  sr_if_t *iface = sr_get_interface(sr, tok);
+  if ((iface == NULL) || (iface->idx >= SR_STATS_MAX_IFACES))
+    ret = -1;
+  else
+    r.idx = iface->idx;
+
+  tok = strtok_r(NULL, " \t\r\n", &save);
+  if (tok && strcmp(tok, "in") == 0)
+    r.dir = sr_acl_in;
+  else if (tok && strcmp(tok, "out") == 0)
+    r.dir = sr_acl_out;
+  else
+    ret = -1;
+
+  tok = (ret == 0) ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+  if (tok && strcmp(tok, "permit") == 0)
+    r.permit = true;
+  else if (!tok || strcmp(tok, "deny") != 0)
+    ret = -1;
+
+  while (ret == 0 && (tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+    char *val = strchr(tok, '=');
+    if (!val) {
+      ret = -1;
+      break;
+    }
+    *val++ = '\0';
+
+    if (strcmp(tok, "proto") == 0)
+      ret = acl_parse_proto(val, &r.proto);
+    else if (strcmp(tok, "src") == 0)
+      ret = sr_parse_prefix(val, &r.src, &r.src_mask);
+    else if (strcmp(tok, "dst") == 0)
+      ret = sr_parse_prefix(val, &r.dst, &r.dst_mask);
+    else if (strcmp(tok, "sport") == 0)
+      ret = acl_parse_ports(val, &r.sport_lo, &r.sport_hi);
+    else if (strcmp(tok, "dport") == 0)
+      ret = acl_parse_ports(val, &r.dport_lo, &r.dport_hi);
+    else if (strcmp(tok, "flags") == 0)
+      ret = acl_parse_flags(val, &r.flags, &r.flags_mask);
+    else
+      ret = -1;
+  }
+  free(copy);
+
+  //ports need a protocol that has them, flags need TCP
+  bool ports = (r.sport_lo != 0) || (r.sport_hi != 0xffff) ||
+               (r.dport_lo != 0) || (r.dport_hi != 0xffff);
+  if (ports && r.proto != ip_protocol_tcp && r.proto != ip_protocol_udp)
+    ret = -1;
+  if (r.flags_mask != 0 && r.proto != ip_protocol_tcp)
+    ret = -1;
+  if (ret != 0)
+    return -1;
+
+  if (acl->nrules == acl->cap) {
+    unsigned int cap = acl->cap ? 2 * acl->cap : 16;
+    struct sr_acl_rule *rules = realloc(acl->rules, cap * sizeof(struct sr_acl_rule));
+    if (rules == NULL)
+      return -1;
+    acl->rules = rules;
+    acl->cap = cap;
+  }
+  r.prio = acl->nrules;
+  acl->rules[acl->nrules++] = r;
+  return 0;
+}
+
+
+static uint8_t acl_rule_fields(const struct sr_acl_rule *r)
+{
+  return ((r->proto >= 0) ? ACL_F_PROTO : 0) |
+         ((r->sport_lo == r->sport_hi) ? ACL_F_SPORT : 0) |
+         ((r->dport_lo == r->dport_hi) ? ACL_F_DPORT : 0);
+}
+
+static inline unsigned int acl_hash(const struct acl_key *k)
+{
+  return sr_nat_hash(((uint64_t) k->src << 32) | k->dst) ^
+         sr_nat_hash(((uint64_t) (uint8_t) k->proto << 32) | ((uint32_t) k->sport << 16) | k->dport);
+}
+
+static inline void acl_rule_key(const struct sr_acl_rule *r, uint8_t fields, struct acl_key *k)
+{
+  k->src = r->src;
+  k->dst = r->dst;
+  k->proto = (fields & ACL_F_PROTO) ? r->proto : 0;
+  k->sport = (fields & ACL_F_SPORT) ? r->sport_lo : 0;
+  k->dport = (fields & ACL_F_DPORT) ? r->dport_lo : 0;
+}
+
+static inline bool acl_key_equal(const struct acl_key *a, const struct acl_key *b)
+{
+  return (a->src == b->src) && (a->dst == b->dst) && (a->proto == b->proto) &&
+         (a->sport == b->sport) && (a->dport == b->dport);
+}
+
+static int acl_tuple_cmp(const void *a, const void *b)
+{
+  const struct sr_acl_tuple *ta = a, *tb = b;
+  return (ta->best > tb->best) - (ta->best < tb->best);
+}
+
+/* Builds the table of the 'n' rules in 'rules', which are in file order */
+static struct sr_acl_table *acl_build_table(const struct sr_acl_rule *rules, unsigned int n)
+{
+  struct sr_acl_table *table = calloc(1, sizeof(struct sr_acl_table));
+  unsigned int *tuple_of = malloc(n * sizeof(unsigned int));
+
+  table->rules = malloc(n * sizeof(struct sr_acl_rule));
+  table->tuples = calloc(n, sizeof(struct sr_acl_tuple));
+  table->nrules = n;
+
+  //which tuple each rule goes to
+  for (unsigned int i = 0; i < n; i++) {
+    const struct sr_acl_rule *r = &rules[i];
+    uint8_t fields = acl_rule_fields(r);
+    unsigned int t;
+
+    table->rules[i] = *r;
+    table->rules[i].next = -1;
+    for (t = 0; t < table->ntuples; t++) {
+      struct sr_acl_tuple *tp = &table->tuples[t];
+      if (tp->src_mask == r->src_mask && tp->dst_mask == r->dst_mask && tp->fields == fields)
+        break;
+    }
+    if (t == table->ntuples) {
+      table->tuples[t].src_mask = r->src_mask;
+      table->tuples[t].dst_mask = r->dst_mask;
+      table->tuples[t].fields = fields;
+      table->tuples[t].best = r->prio;
+      table->ntuples++;
+    }
+    table->tuples[t].nrules++;
+    tuple_of[i] = t;
+  }
+
+  //hash tables at most half full, so a probe always ends on a free slot
+  for (unsigned int t = 0; t < table->ntuples; t++) {
+    struct sr_acl_tuple *tp = &table->tuples[t];
+    unsigned int slots = 2;
+    while (slots < 2 * tp->nrules)
+      slots *= 2;
+    tp->mask = slots - 1;
+    tp->slots = malloc(slots * sizeof(int));
+    memset(tp->slots, 0xff, slots * sizeof(int));
+  }
+
+  //in file order, so the rules of a key are chained best first
+  for (unsigned int i = 0; i < n; i++) {
+    struct sr_acl_tuple *tp = &table->tuples[tuple_of[i]];
+    struct acl_key k, kr;
+
+    acl_rule_key(&table->rules[i], tp->fields, &k);
+    for (unsigned int h = acl_hash(&k); ; h++) {
+      int *slot = &tp->slots[h & tp->mask];
+      if (*slot < 0) {
+        *slot = i;
+        break;
+      }
+      acl_rule_key(&table->rules[*slot], tp->fields, &kr);
+      if (acl_key_equal(&k, &kr)) {
+        int j = *slot;
+        while (table->rules[j].next >= 0)
+          j = table->rules[j].next;
+        table->rules[j].next = i;
+        break;
+      }
+    }
+  }
+  free(tuple_of);
+
+  qsort(table->tuples, table->ntuples, sizeof(struct sr_acl_tuple), acl_tuple_cmp);
+  table->tuples = realloc(table->tuples, table->ntuples * sizeof(struct sr_acl_tuple));
+  return table;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_compile
+ *
+ * Scope:  Global
+ *
+ * (Re)builds the classifier of every interface and direction from the
+ * rules added so far. Not safe while packets are checked against 'acl'.
+ *
+ *---------------------------------------------------------------------*/
+void sr_acl_compile(struct sr_acl *acl)
+{
+  struct sr_acl_rule *rules = malloc((acl->nrules ? acl->nrules : 1) * sizeof(struct sr_acl_rule));
+
+  acl_free_tables(acl);
+  for (int i = 0; i < SR_STATS_MAX_IFACES; i++) {
+    for (int d = 0; d < sr_acl_dirs; d++) {
+      unsigned int n = 0;
+      for (unsigned int k = 0; k < acl->nrules; k++)
+        if (acl->rules[k].idx == i && acl->rules[k].dir == d)
+          rules[n++] = acl->rules[k];
+      if (n != 0)
+        acl->tables[i][d] = acl_build_table(rules, n);
+    }
+  }
+  free(rules);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_load
+ *
+ * Scope:  Global
+ *
+ * Reads and compiles the rules in the file 'path'. The interfaces must
+ * be known.
+ *
+ * returns:
+ *    the access lists, or NULL if the file cannot be read or has a bad
+ *    rule
+ *
+ *---------------------------------------------------------------------*/
+struct sr_acl *sr_acl_load(struct sr_instance *sr, const char *path)
+{
+  char line[BUFSIZ];
+  unsigned int lineno = 0;
+  FILE *fp = fopen(path, "r");
+
+  if (fp == NULL) {
+    perror(path);
+    return NULL;
+  }
+
+  struct sr_acl *acl = sr_acl_create();
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    if (sr_acl_add(acl, sr, line) != 0) {
+      fprintf(stderr, "sr_acl: %s:%u: bad rule\n", path, lineno);
+      fclose(fp);
+      sr_acl_destroy(acl);
+      return NULL;
+    }
+  }
+  fclose(fp);
+
+  sr_acl_compile(acl);
+  return acl;
+}
+
+
+static void acl_packet(const sr_ip_hdr_t *iphdr, unsigned int iplen, struct acl_pkt *p)
+{
+  unsigned int hl = iphdr->ip_hl * 4;
+  const uint8_t *l4 = (const uint8_t *) iphdr + hl;
+
+  memset(p, 0, sizeof(*p));
+  p->src = iphdr->ip_src;
+  p->dst = iphdr->ip_dst;
+  p->proto = iphdr->ip_p;
+
+  //later fragments carry no ports
+  if ((ntohs(iphdr->ip_off) & IP_OFFMASK) != 0)
+    return;
+  if ((p->proto == ip_protocol_tcp || p->proto == ip_protocol_udp) && iplen >= hl + 4) {
+    p->sport = ntohs(*(const uint16_t *) l4);
+    p->dport = ntohs(*(const uint16_t *) (l4 + 2));
+    p->ports = true;
+  }
+  if (p->proto == ip_protocol_tcp && iplen >= hl + sizeof(sr_tcp_hdr_t)) {
+    p->flags = ((const sr_tcp_hdr_t *) l4)->th_flags;
+    p->tcp = true;
+  }
+}
+
+/* The checks the key of the rule's tuple leaves out */
+static inline bool acl_rule_matches(const struct sr_acl_rule *r, const struct acl_pkt *p)
+{
+  if ((r->sport_lo != 0) || (r->sport_hi != 0xffff) || (r->dport_lo != 0) || (r->dport_hi != 0xffff)) {
+    if (!p->ports)
+      return false;
+    if ((p->sport < r->sport_lo) || (p->sport > r->sport_hi) ||
+        (p->dport < r->dport_lo) || (p->dport > r->dport_hi))
+      return false;
+  }
+  if ((r->flags_mask != 0) && (!p->tcp || ((p->flags & r->flags_mask) != r->flags)))
+    return false;
+  return true;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_lookup
+ *
+ * Scope:  Global
+ *
+ * Finds the first rule of 'iface' and 'dir' that matches the packet.
+ *
+ * returns:
+ *    the rule, or NULL if none matches
+ *
+ *---------------------------------------------------------------------*/
+const struct sr_acl_rule *sr_acl_lookup(const struct sr_acl *acl, const sr_if_t *iface,
+                                        enum sr_acl_dir dir, const sr_ip_hdr_t *iphdr,
+                                        unsigned int iplen)
+{
+  if (iface->idx >= SR_STATS_MAX_IFACES)
+    return NULL;
+  const struct sr_acl_table *table = acl->tables[iface->idx][dir];
+  if (table == NULL)
+    return NULL;
+
+  const struct sr_acl_rule *best = NULL;
+  struct acl_pkt p;
+  acl_packet(iphdr, iplen, &p);
+
+  for (unsigned int t = 0; t < table->ntuples; t++) {
+    const struct sr_acl_tuple *tp = &table->tuples[t];
+    if (best != NULL && tp->best > best->prio)
+      break;
+
+    struct acl_key k, kr;
+    k.src = p.src & tp->src_mask;
+    k.dst = p.dst & tp->dst_mask;
+    k.proto = (tp->fields & ACL_F_PROTO) ? p.proto : 0;
+    k.sport = (tp->fields & ACL_F_SPORT) ? p.sport : 0;
+    k.dport = (tp->fields & ACL_F_DPORT) ? p.dport : 0;
+
+    for (unsigned int h = acl_hash(&k); ; h++) {
+      int i = tp->slots[h & tp->mask];
+      if (i < 0)
+        break;
+      acl_rule_key(&table->rules[i], tp->fields, &kr);
+      if (!acl_key_equal(&k, &kr))
+        continue;
+      for (; i >= 0 && (best == NULL || table->rules[i].prio < best->prio); i = table->rules[i].next) {
+        if (acl_rule_matches(&table->rules[i], &p)) {
+          best = &table->rules[i];
+          break;
+        }
+      }
+      break;
+    }
+  }
+  return best;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_acl_check
+ *
+ * Scope:  Global
+ *
+ * Checks a packet against the rules of 'iface' and 'dir'. Use
+ * sr_acl_permit, which skips this when there are no access lists.
+ *
+ * returns:
+ *    true if the packet may go on, false if a rule denies it
+ *
+ *---------------------------------------------------------------------*/
+bool sr_acl_check(const struct sr_acl *acl, const sr_if_t *iface, enum sr_acl_dir dir,
+                  const sr_ip_hdr_t *iphdr, unsigned int iplen)
+{
+  const struct sr_acl_rule *r = sr_acl_lookup(acl, iface, dir, iphdr, iplen);
+
+  if (r == NULL || r->permit)
+    return true;
+  sr_trace(trace_router,"[%I] to [%I] denied by rule [%u] of [%s]",iphdr->ip_src,iphdr->ip_dst,
+           r->prio,(uintptr_t)iface->name);
+  sr_stats_drop(drop_acl_deny);
+  return false;
+}
@@ -0,0 +1,76 @@
+
+#ifndef SR_ACL_H
+#define SR_ACL_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "sr_protocol.h"
+#include "sr_if.h"
+#include "sr_stats.h"
+
+struct sr_instance;
+
+enum sr_acl_dir {
+  sr_acl_in,
+  sr_acl_out,
+  sr_acl_dirs
+};
+
+/* One rule as read from the rule file. Addresses are in network byte
+   order, ports in host byte order. A field that is not given matches
+   anything: a zero mask, proto -1, the port range 0-65535, a zero flag
+   mask. */
+struct sr_acl_rule {
+  uint32_t src, src_mask;
+  uint32_t dst, dst_mask;
+  int proto;
+  uint16_t sport_lo, sport_hi;
+  uint16_t dport_lo, dport_hi;
+  uint8_t flags, flags_mask;   /* TCP flags under the mask must equal 'flags' */
+  bool permit;
+  uint8_t idx;                 /* interface index */
+  uint8_t dir;
+  unsigned int prio;           /* position in the file, lower wins */
+  int next;                    /* compiled: next rule with the same key */
+};
+
+struct sr_acl_tuple;
+
+/* The compiled rules of one interface and direction */
+struct sr_acl_table {
+  struct sr_acl_rule *rules;
+  unsigned int nrules;
+  struct sr_acl_tuple *tuples; /* by their best rule, see sr_acl.c */
+  unsigned int ntuples;
+};
+
+/* Access lists of the router, see sr_acl.c */
+struct sr_acl {
+  struct sr_acl_rule *rules;   /* as added, in file order */
+  unsigned int nrules, cap;
+  struct sr_acl_table *tables[SR_STATS_MAX_IFACES][sr_acl_dirs]; /* NULL: permit all */
+};
+
+struct sr_acl *sr_acl_create(void);
+int  sr_acl_add(struct sr_acl *acl, struct sr_instance *sr, const char *line);
+void sr_acl_compile(struct sr_acl *acl);
+struct sr_acl *sr_acl_load(struct sr_instance *sr, const char *path);
+void sr_acl_destroy(struct sr_acl *acl);
+const struct sr_acl_rule *sr_acl_lookup(const struct sr_acl *acl, const sr_if_t *iface,
+                                        enum sr_acl_dir dir, const sr_ip_hdr_t *iphdr,
+                                        unsigned int iplen);
+bool sr_acl_check(const struct sr_acl *acl, const sr_if_t *iface, enum sr_acl_dir dir,
+                  const sr_ip_hdr_t *iphdr, unsigned int iplen);
+
+/* True if 'iphdr' may pass 'iface' in direction 'dir'. Always true
+   without access lists. Denied packets are counted. */
+static inline bool sr_acl_permit(const struct sr_acl *acl, const sr_if_t *iface,
+                                 enum sr_acl_dir dir, const sr_ip_hdr_t *iphdr,
+                                 unsigned int iplen)
+{
+  if (__builtin_expect(acl == NULL, 1))
+    return true;
+  return sr_acl_check(acl, iface, dir, iphdr, iplen);
+}
+
+#endif
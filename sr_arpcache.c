@@ -11,6 +11,9 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_stats.h"
+#include "sr_clock.h"
+#include "sr_fib.h"
 
 /* 
   This function gets called every second. For each request sent out, we keep
@@ -82,6 +85,7 @@ struct sr_arpreq * sr_arpcache_queuereq(struct sr_arpcache *cache,
         req->times_sent = 0;
         strncpy(req->iface,iface,sr_IFACE_NAMELEN);
         cache->requests = req;
+        sr_stats_gauge(gauge_arp_requests, 1);
     }
     
     /* Add the packet to the list of packets for this request */
@@ -93,6 +97,7 @@ struct sr_arpreq * sr_arpcache_queuereq(struct sr_arpcache *cache,
         new_pkt->len = packet_len;
         new_pkt->next = req->packets;
         req->packets = new_pkt;
+        sr_stats_gauge(gauge_arp_queued_pkts, 1);
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -136,8 +141,9 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
     if (i != SR_ARPCACHE_SZ) {
         memcpy(cache->entries[i].mac, mac, 6);
         cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
+        cache->entries[i].added = sr_clock_now();
         cache->entries[i].valid = 1;
+        sr_stats_gauge(gauge_arp_entries, 1);
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -177,14 +183,61 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
             /*if (pkt->iface)
                 free(pkt->iface); interface is passed in as a reference in my implementation*/ 
             free(pkt);
+            sr_stats_gauge(gauge_arp_queued_pkts, -1);
         }
         
         free(entry);
+        sr_stats_gauge(gauge_arp_requests, -1);
     }
     
     pthread_mutex_unlock(&(cache->lock));
 }
 
+/* Moves the packets waiting for ARP whose destination is under
+   'prefix'/'mask' (network byte order) and whose route now leads to
+   another next hop, or nowhere. They are routed again, or dropped.
+   Requests left without packets stay queued until they time out, as a
+   thread that just queued on one may still be about to send it. */
+void sr_arpcache_reroute(struct sr_instance *sr, uint32_t prefix, uint32_t mask) {
+    struct sr_arpcache *cache = &sr->cache;
+    struct sr_packet *moved = NULL;
+    struct sr_rt route;
+
+    pthread_mutex_lock(&(cache->lock));
+    
+    struct sr_arpreq *req;
+    for (req = cache->requests; req != NULL; req = req->next) {
+        struct sr_packet **ppkt = &req->packets;
+        while (*ppkt) {
+            struct sr_packet *pkt = *ppkt;
+            uint32_t dst = ((sr_ip_hdr_t *) pkt->buf)->ip_dst;
+            if ((dst & mask) == prefix &&
+                (!sr_fib_route(sr, dst, &route) || route.gw.s_addr != req->ip ||
+                 strncmp(route.interface, req->iface, sr_IFACE_NAMELEN) != 0)) {
+                *ppkt = pkt->next;
+                pkt->next = moved;
+                moved = pkt;
+                sr_stats_gauge(gauge_arp_queued_pkts, -1);
+            }
+            else
+                ppkt = &pkt->next;
+        }
+    }
+    
+    pthread_mutex_unlock(&(cache->lock));
+    
+    while (moved) {
+        struct sr_packet *pkt = moved;
+        moved = pkt->next;
+        if (sr_fib_route(sr, ((sr_ip_hdr_t *) pkt->buf)->ip_dst, &route))
+            route_ip_packet(sr, (sr_ip_hdr_t *) pkt->buf, NULL);
+        else
+            sr_stats_drop(drop_no_route);
+        free(pkt->buf);
+        free(pkt);
+    }
+}
+
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
@@ -222,29 +275,36 @@ int sr_arpcache_destroy(struct sr_arpcache *cache) {
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
+/* Invalidates entries that were added more than SR_ARPCACHE_TO seconds
+   before 'now' and gives pending requests a chance to be resent. */
+void sr_arpcache_sweep(struct sr_instance *sr, time_t now) {
+    struct sr_arpcache *cache = &(sr->cache);
+
+    pthread_mutex_lock(&(cache->lock));
+
+    int i;
+    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+        if ((cache->entries[i].valid) && (difftime(now,cache->entries[i].added) > SR_ARPCACHE_TO)) {
+            cache->entries[i].valid = 0;
+            sr_stats_gauge(gauge_arp_entries, -1);
+        }
+    }
+
+    sr_arpcache_sweepreqs(sr);
+
+    pthread_mutex_unlock(&(cache->lock));
+
+    /* host unreachables for the requests given up on */
+    sr_icmp_flush(sr, SR_ICMP_QUEUE);
+}
+
+/* Thread which sweeps through the cache once a second. */
 void *sr_arpcache_timeout(void *sr_ptr) {
     struct sr_instance *sr = sr_ptr;
-    struct sr_arpcache *cache = &(sr->cache);
     
     while (1) {
-        sleep(1.0);
-        
-        pthread_mutex_lock(&(cache->lock));
-    
-        time_t curtime = time(NULL);
-        
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
-        }
-        
-        sr_arpcache_sweepreqs(sr);
-
-        pthread_mutex_unlock(&(cache->lock));
+        sr_clock_sleep(1);
+        sr_arpcache_sweep(sr, sr_clock_now());
     }
     
     return NULL;
@@ -76,6 +76,11 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
 
+/* Routes the packets waiting for ARP whose destination is under
+   'prefix'/'mask' (network byte order) again if the route they took has
+   changed since they were queued. Called with routing table updates. */
+void sr_arpcache_reroute(struct sr_instance *sr, uint32_t prefix, uint32_t mask);
+
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache);
 
@@ -88,4 +93,7 @@ int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
 
+/* One pass of the cleanup thread as of time 'now' (see sr_clock.h). */
+void  sr_arpcache_sweep(struct sr_instance *sr, time_t now);
+
 #endif
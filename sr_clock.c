@@ -0,0 +1,75 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_clock.c
+ *
+ * Description:
+ *
+ * Cached and virtual clocks, see sr_clock.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sr_clock.h"
+
+static time_t clock_coarse(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+time_t sr_clock_cached;
+
+static bool clock_virtual;
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clock_cond = PTHREAD_COND_INITIALIZER;
+
+/* Make sure anything that reads the clock before the first tick sees
+   real time rather than 0. */
+static void __attribute__((constructor)) clock_init(void)
+{
+    sr_clock_cached = clock_coarse();
+}
+
+void sr_clock_tick(void)
+{
+    if (!__atomic_load_n(&clock_virtual, __ATOMIC_RELAXED))
+        __atomic_store_n(&sr_clock_cached, clock_coarse(), __ATOMIC_RELAXED);
+}
+
+void sr_clock_set_virtual(time_t start)
+{
+    pthread_mutex_lock(&clock_lock);
+    __atomic_store_n(&clock_virtual, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&sr_clock_cached, start, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&clock_cond);
+    pthread_mutex_unlock(&clock_lock);
+}
+
+void sr_clock_advance(time_t secs)
+{
+    pthread_mutex_lock(&clock_lock);
+    __atomic_store_n(&sr_clock_cached, sr_clock_cached + secs, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&clock_cond);
+    pthread_mutex_unlock(&clock_lock);
+}
+
+void sr_clock_sleep(unsigned int secs)
+{
+    if (!__atomic_load_n(&clock_virtual, __ATOMIC_RELAXED)) {
+        struct timespec sl = { secs, 0 };
+        while (nanosleep(&sl, &sl) != 0);
+        sr_clock_tick();
+        return;
+    }
+
+    pthread_mutex_lock(&clock_lock);
+    /* -- the wait is a cancellation point, see sr_nat_destroy -- */
+    pthread_cleanup_push((void (*)(void *)) pthread_mutex_unlock, &clock_lock);
+    time_t wake = sr_clock_cached + secs;
+    while (sr_clock_cached < wake)
+        pthread_cond_wait(&clock_cond, &clock_lock);
+    pthread_cleanup_pop(1);
+}
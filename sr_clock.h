@@ -0,0 +1,45 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_clock.h
+ *
+ * Description:
+ *
+ * The router's notion of "now", in whole seconds, for ARP and NAT
+ * timeouts. Reading it is a single load: the value is refreshed by
+ * sr_clock_tick() from CLOCK_MONOTONIC_COARSE, which the receive loops
+ * call once per batch of frames and the sweeper threads once per
+ * second, so the packet path never makes a clock call of its own.
+ *
+ * Tests and benchmarks switch to a virtual clock instead. It only moves
+ * when sr_clock_advance() is called, so expiry logic can be driven
+ * through hours of simulated time without waiting for it; threads
+ * blocked in sr_clock_sleep() wake up as virtual time passes.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_CLOCK_H
+#define SR_CLOCK_H
+
+#include <time.h>
+
+extern time_t sr_clock_cached;
+
+/* Current time in seconds, as of the last tick or advance. */
+static inline time_t sr_clock_now(void)
+{
+    return __atomic_load_n(&sr_clock_cached, __ATOMIC_RELAXED);
+}
+
+/* Refresh the cached time. Does nothing on the virtual clock. */
+void sr_clock_tick(void);
+
+/* Switch to the virtual clock, starting at 'start' seconds. */
+void sr_clock_set_virtual(time_t start);
+
+/* Move the virtual clock forward and wake sleepers that are due. */
+void sr_clock_advance(time_t secs);
+
+/* Sleep 'secs' seconds of clock time and tick. On the virtual clock this
+   blocks until sr_clock_advance() has moved time far enough. */
+void sr_clock_sleep(unsigned int secs);
+
+#endif /* -- SR_CLOCK_H -- */
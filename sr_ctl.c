@@ -0,0 +1,236 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_rcu.h"
+#include "sr_ctl.h"
+
+/*
+ * Control socket.
+ *
+ * A UNIX stream socket that takes one command per line and answers each
+ * with "ok" or "error: reason", after any output of its own:
+ *
+ *   route add dest gw mask iface      add the route for a new prefix
+ *   route change dest gw mask iface   change the route for a prefix
+ *   route del dest mask               delete the route for a prefix
+ *   route show                        the table, in rtable format
+ *   reload                            reread the routing table file
+ *
+ * Route updates go to the compiled table one at a time (sr_fib_add and
+ * friends), so a client can stream thousands of them. What they unlink
+ * is freed once per read from the socket rather than once per command,
+ * which keeps the grace periods off the per-route cost.
+ *
+ * Connections are served one after the other by a single thread.
+ */
+
+#define CTL_MAX_ARGS 8
+#define CTL_RECV_BUF (64 * 1024)
+
+struct ctl_server {
+  struct sr_instance *sr;
+  int fd;                    //listening socket
+};
+
+static int ctl_split(char *line, char **argv)
+{
+  char *save;
+  int argc = 0;
+  for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+       tok = strtok_r(NULL, " \t\r\n", &save)) {
+    if ((tok[0] == '#') || (argc == CTL_MAX_ARGS))
+      break;
+    argv[argc++] = tok;
+  }
+  return argc;
+}
+
+static int ctl_route(struct sr_instance *sr, int argc, char **argv, FILE *out)
+{
+  struct sr_rt rt;
+
+  memset(&rt, 0, sizeof(rt));
+  if ((argc == 2) && (strcmp(argv[1], "show") == 0)) {
+    sr_rcu_read_lock();
+    for (struct sr_rt *walk = __atomic_load_n(&sr->routing_table, __ATOMIC_ACQUIRE);
+         walk != NULL; walk = __atomic_load_n(&walk->next, __ATOMIC_ACQUIRE)) {
+      fprintf(out, "%s ", inet_ntoa(walk->dest));
+      fprintf(out, "%s ", inet_ntoa(walk->gw));
+      fprintf(out, "%s %s\n", inet_ntoa(walk->mask), walk->interface);
+    }
+    sr_rcu_read_unlock();
+    return 0;
+  }
+  if ((argc == 4) && (strcmp(argv[1], "del") == 0)) {
+    if ((inet_aton(argv[2], &rt.dest) == 0) || (inet_aton(argv[3], &rt.mask) == 0))
+      return -EINVAL;
+    return sr_fib_delete(sr, rt.dest, rt.mask);
+  }
+  if ((argc == 6) && ((strcmp(argv[1], "add") == 0) || (strcmp(argv[1], "change") == 0))) {
+    if ((inet_aton(argv[2], &rt.dest) == 0) || (inet_aton(argv[3], &rt.gw) == 0) ||
+        (inet_aton(argv[4], &rt.mask) == 0) || (strlen(argv[5]) >= sr_IFACE_NAMELEN))
+      return -EINVAL;
+    strcpy(rt.interface, argv[5]);
+    return (argv[1][0] == 'a') ? sr_fib_add(sr, &rt) : sr_fib_change(sr, &rt);
+  }
+  return -EINVAL;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ctl_command
+ *
+ * Scope:  Global
+ *
+ * Runs one command line (which it modifies) and writes its output and
+ * answer to 'out'. Blank lines and comments get no answer.
+ *
+ * returns:
+ *    0 if the command succeeded or there was none, -1 otherwise
+ *
+ *---------------------------------------------------------------------*/
+int sr_ctl_command(struct sr_instance *sr, char *line, FILE *out)
+{
+  char *argv[CTL_MAX_ARGS];
+  int argc = ctl_split(line, argv);
+  int ret;
+
+  if (argc == 0)
+    return 0;
+  if (strcmp(argv[0], "route") == 0)
+    ret = (argc > 1) ? ctl_route(sr, argc, argv, out) : -EINVAL;
+  else if ((strcmp(argv[0], "reload") == 0) && (argc == 1)) {
+    if (sr->rtable_path == NULL)
+      ret = -ENOENT;
+    else
+      ret = (sr_fib_reload(sr, sr->rtable_path) < 0) ? -EINVAL : 0;
+  }
+  else
+    ret = -EINVAL;
+
+  if (ret == 0)
+    fprintf(out, "ok\n");
+  else
+    fprintf(out, "error: %s\n", strerror(-ret));
+  return (ret == 0) ? 0 : -1;
+}
+
+static void ctl_reply(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= n;
+  }
+}
+
+static void ctl_serve(struct sr_instance *sr, int fd, char *buf)
+{
+  size_t have = 0;
+
+  while (1) {
+    ssize_t n = read(fd, buf + have, CTL_RECV_BUF - have);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    have += n;
+
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *out = open_memstream(&reply, &reply_len);
+    assert(out);
+    char *line = buf, *end;
+    while ((end = memchr(line, '\n', buf + have - line)) != NULL) {
+      *end = '\0';
+      if (end - line < SR_CTL_LINE)
+        sr_ctl_command(sr, line, out);
+      else
+        fprintf(out, "error: line too long\n");
+      line = end + 1;
+    }
+    if ((line == buf) && (have == CTL_RECV_BUF)) {
+      fprintf(out, "error: line too long\n");
+      line = buf + have;
+    }
+    sr_fib_reclaim();
+    fclose(out);
+    ctl_reply(fd, reply, reply_len);
+    free(reply);
+
+    memmove(buf, line, buf + have - line);
+    have -= line - buf;
+  }
+}
+
+static void *ctl_thread(void *arg)
+{
+  struct ctl_server *server = (struct ctl_server *) arg;
+  char *buf = malloc(CTL_RECV_BUF);
+  assert(buf);
+
+  while (1) {
+    int fd = accept(server->fd, NULL, NULL);
+    if (fd < 0) {
+      usleep(100000);
+      continue;
+    }
+    ctl_serve(server->sr, fd, buf);
+    close(fd);
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_ctl_start
+ *
+ * Scope:  Global
+ *
+ * Listens for control connections on the UNIX socket 'path' (replacing
+ * any file there) and starts the thread that serves them.
+ *
+ * returns:
+ *    0 on success, -1 if the socket cannot be set up
+ *
+ *---------------------------------------------------------------------*/
+int sr_ctl_start(struct sr_instance *sr, const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  pthread_t thread;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  unlink(path);
+  if ((bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) || (listen(fd, 4) != 0)) {
+    close(fd);
+    return -1;
+  }
+  struct ctl_server *server = malloc(sizeof(*server));
+  assert(server);
+  server->sr = sr;
+  server->fd = fd;
+  if (pthread_create(&thread, NULL, ctl_thread, server) != 0) {
+    free(server);
+    close(fd);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
@@ -0,0 +1,17 @@
+
+#ifndef SR_CTL_H
+#define SR_CTL_H
+
+#include <stdio.h>
+
+struct sr_instance;
+
+#define SR_CTL_LINE 256     /* longest command line */
+
+int sr_ctl_command(struct sr_instance *sr, char *line, FILE *out);
+
+int sr_ctl_start(struct sr_instance *sr, const char *path);
+
+
+
+#endif /* SR_CTL_H */
@@ -4,6 +4,14 @@
 #include <stdio.h>
 #include "sr_dumper.h"
 
+/* set by sr_dump_open_read when the file was written on a host of the
+ * opposite byte order */
+static int sf_swapped = 0;
+
+#define SWAP16(x) ((uint16_t)((((x) & 0xff) << 8) | (((x) >> 8) & 0xff)))
+#define SWAP32(x) ((uint32_t)((((x) & 0xff) << 24) | (((x) & 0xff00) << 8) | \
+                              (((x) >> 8) & 0xff00) | (((x) >> 24) & 0xff)))
+
 static void
 sf_write_header(FILE *fp, int linktype, int thiszone, int snaplen)
 {
@@ -69,3 +77,89 @@ sr_dump_close(FILE *fp)
   fclose(fp);
 }
 
+/*
+ * Open a dump file written by sr_dump_open (or any other libpcap compatible
+ * writer using ethernet framing) for reading.
+ */
+FILE *
+sr_dump_open_read(const char *fname, struct pcap_file_header *hdr)
+{
+        FILE *fp;
+        struct pcap_file_header fhdr;
+
+        if (fname[0] == '-' && fname[1] == '\0')
+                fp = stdin;
+        else {
+                fp = fopen(fname, "r");
+                if (fp == NULL) {
+                        fprintf(stderr, "sr_dump_open_read: can't open %s\n",
+                            fname);
+                        return (NULL);
+                }
+        }
+
+        if (fread(&fhdr, sizeof(fhdr), 1, fp) != 1) {
+                fprintf(stderr, "sr_dump_open_read: %s: short file header\n", fname);
+                fclose(fp);
+                return (NULL);
+        }
+
+        if (fhdr.magic == TCPDUMP_MAGIC_SWAPPED) {
+                sf_swapped = 1;
+                fhdr.magic = TCPDUMP_MAGIC;
+                fhdr.version_major = SWAP16(fhdr.version_major);
+                fhdr.version_minor = SWAP16(fhdr.version_minor);
+                fhdr.snaplen = SWAP32(fhdr.snaplen);
+                fhdr.linktype = SWAP32(fhdr.linktype);
+        } else {
+                sf_swapped = 0;
+        }
+
+        if (fhdr.magic != TCPDUMP_MAGIC) {
+                fprintf(stderr, "sr_dump_open_read: %s: not a pcap file\n", fname);
+                fclose(fp);
+                return (NULL);
+        }
+        if (fhdr.linktype != LINKTYPE_ETHERNET) {
+                fprintf(stderr, "sr_dump_open_read: %s: unsupported link type %u\n",
+                    fname, fhdr.linktype);
+                fclose(fp);
+                return (NULL);
+        }
+
+        if (hdr != NULL)
+                *hdr = fhdr;
+        return fp;
+}
+
+/*
+ * Read the next packet from a dump file.
+ */
+int
+sr_dump_read(FILE *fp, struct pcap_pkthdr *h, unsigned char *buf, unsigned int buflen)
+{
+        struct pcap_sf_pkthdr sf_hdr;
+
+        if (fread(&sf_hdr, sizeof(sf_hdr), 1, fp) != 1)
+                return feof(fp) ? 0 : -1;
+
+        if (sf_swapped) {
+                sf_hdr.ts.tv_sec = SWAP32(sf_hdr.ts.tv_sec);
+                sf_hdr.ts.tv_usec = SWAP32(sf_hdr.ts.tv_usec);
+                sf_hdr.caplen = SWAP32(sf_hdr.caplen);
+                sf_hdr.len = SWAP32(sf_hdr.len);
+        }
+
+        h->ts.tv_sec  = sf_hdr.ts.tv_sec;
+        h->ts.tv_usec = sf_hdr.ts.tv_usec;
+        h->len        = sf_hdr.len;
+        h->caplen     = min(sf_hdr.caplen, buflen);
+
+        if (fread(buf, 1, h->caplen, fp) != h->caplen)
+                return -1;
+        if (sf_hdr.caplen > h->caplen &&
+            fseek(fp, sf_hdr.caplen - h->caplen, SEEK_CUR) != 0)
+                return -1;
+
+        return 1;
+}
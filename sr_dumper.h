@@ -20,6 +20,7 @@
 #define PCAP_PROTO_LEN 2
 
 #define TCPDUMP_MAGIC 0xa1b2c3d4
+#define TCPDUMP_MAGIC_SWAPPED 0xd4c3b2a1
 
 #define LINKTYPE_ETHERNET 1
 
@@ -77,3 +78,17 @@ void sr_dump(FILE *fp, const struct pcap_pkthdr *h, const unsigned char *sp);
  * Close the file
  */
 void sr_dump_close(FILE *fp);
+
+/**
+ * Open a dump file for reading and validate its header. The header is
+ * returned in host byte order through 'hdr' if it is not null.
+ */
+FILE* sr_dump_open_read(const char *fname, struct pcap_file_header *hdr);
+
+/**
+ * Read the next packet from a file opened with sr_dump_open_read. At most
+ * 'buflen' bytes of packet data are stored in 'buf'; the rest of an
+ * oversized record is skipped. Returns 1 on success, 0 at end of file and
+ * -1 on a truncated or corrupt record.
+ */
+int sr_dump_read(FILE *fp, struct pcap_pkthdr *h, unsigned char *buf, unsigned int buflen);
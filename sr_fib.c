@@ -0,0 +1,478 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.c
+ *
+ * Description:
+ *
+ * Trie compiled from the routing table, its hot replacement and its
+ * incremental updates, see sr_fib.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_arpcache.h"
+#include "sr_fib.h"
+#include "sr_fib_image.h"
+#include "sr_rcu.h"
+
+#define FIB_RETIRE_MAX 4096     /* unlinked blocks that force a reclaim */
+
+/* Serializes everything that changes the published table */
+static pthread_mutex_t fib_writer = PTHREAD_MUTEX_INITIALIZER;
+
+/* Blocks unlinked by updates, freed after the next grace period */
+static void **fib_retired;
+static unsigned int fib_nretired, fib_retired_size;
+
+/* Prefix length of a mask in host byte order, -1 if its ones are not
+   contiguous from the top. */
+static int fib_prefix_len(uint32_t mask)
+{
+    uint32_t host = ~mask;
+    if ((host & (host + 1)) != 0)
+        return -1;
+    return __builtin_popcount(mask);
+}
+
+/* False for blocks inside a mapped image, which are never freed alone */
+static bool fib_owns(const struct sr_fib *fib, const void *block)
+{
+    const char *p = block, *image = fib->image;
+    return image == NULL || p < image || p >= image + fib->image_size;
+}
+
+static void fib_free_nodes(struct sr_fib *fib, struct sr_fib_node *node)
+{
+    if (node == NULL)
+        return;
+    fib_free_nodes(fib, node->child[0]);
+    fib_free_nodes(fib, node->child[1]);
+    if (fib_owns(fib, node))
+        free(node);
+}
+
+static struct sr_fib_node *fib_node_new(struct sr_fib *fib)
+{
+    struct sr_fib_node *node = calloc(1, sizeof(struct sr_fib_node));
+    assert(node);
+    fib->nnodes++;
+    return node;
+}
+
+struct sr_fib *sr_fib_build(struct sr_rt *routes)
+{
+    struct sr_fib *fib = calloc(1, sizeof(*fib));
+    assert(fib);
+    fib->root = fib_node_new(fib);
+    fib->routes = routes;
+    fib->tail = &fib->routes;
+    unsigned int dups = 0;
+
+    for (struct sr_rt *rt = routes; rt != NULL; rt = rt->next) {
+        int plen = fib_prefix_len(ntohl(rt->mask.s_addr));
+        if (plen < 0) {
+            fprintf(stderr, "Route to %s: mask is not a prefix length\n",
+                    inet_ntoa(rt->dest));
+            fib_free_nodes(fib, fib->root);
+            free(fib);
+            return NULL;
+        }
+    }
+
+    while (*fib->tail != NULL) {
+        struct sr_rt *rt = *fib->tail;
+        uint32_t mask = ntohl(rt->mask.s_addr);
+        uint32_t key = ntohl(rt->dest.s_addr) & mask;
+        int plen = fib_prefix_len(mask);
+
+        struct sr_fib_node *node = fib->root;
+        for (int depth = 0; depth < plen; depth++) {
+            struct sr_fib_node **next = &node->child[(key >> (31 - depth)) & 1];
+            if (*next == NULL)
+                *next = fib_node_new(fib);
+            node = *next;
+        }
+        if (node->route != NULL) {
+            if (dups++ == 0)
+                fprintf(stderr, "Route to %s/%d given twice, the first one is used\n",
+                        inet_ntoa(rt->dest), plen);
+            *fib->tail = rt->next;
+            free(rt);
+            continue;
+        }
+        node->route = rt;
+        rt->pprev = fib->tail;
+        fib->tail = &rt->next;
+        fib->nroutes++;
+    }
+    if (dups > 1)
+        fprintf(stderr, "%u more routes repeat a prefix and are ignored\n", dups - 1);
+
+    return fib;
+}
+
+void sr_fib_free(struct sr_fib *fib)
+{
+    if (fib == NULL)
+        return;
+    fib_free_nodes(fib, fib->root);
+    for (struct sr_rt *rt = fib->routes, *next; rt != NULL; rt = next) {
+        next = rt->next;
+        if (fib_owns(fib, rt))
+            free(rt);
+    }
+    if (fib->image != NULL)
+        munmap(fib->image, fib->image_size);
+    free(fib);
+}
+
+bool sr_fib_lookup(const struct sr_fib *fib, uint32_t ip, struct sr_rt **route)
+{
+    uint32_t key = ntohl(ip);
+    const struct sr_fib_node *node = fib->root;
+    struct sr_rt *best = NULL;
+
+    for (int depth = 0; ; depth++) {
+        struct sr_rt *rt = __atomic_load_n(&node->route, __ATOMIC_ACQUIRE);
+        if (rt != NULL)
+            best = rt;
+        if (depth == 32)
+            break;
+        node = __atomic_load_n(&node->child[(key >> (31 - depth)) & 1], __ATOMIC_ACQUIRE);
+        if (node == NULL)
+            break;
+    }
+
+    if (best == NULL)
+        return false;
+    *route = best;
+    return true;
+}
+
+static void fib_reclaim_locked(void)
+{
+    if (fib_nretired == 0)
+        return;
+    sr_rcu_synchronize();
+    for (unsigned int i = 0; i < fib_nretired; i++)
+        free(fib_retired[i]);
+    fib_nretired = 0;
+}
+
+static void fib_retire(struct sr_fib *fib, void *block)
+{
+    if (!fib_owns(fib, block))
+        return;
+    if (fib_nretired == fib_retired_size) {
+        fib_retired_size = fib_retired_size ? 2 * fib_retired_size : 64;
+        fib_retired = realloc(fib_retired, fib_retired_size * sizeof(void *));
+        assert(fib_retired);
+    }
+    fib_retired[fib_nretired++] = block;
+}
+
+static void fib_swap(struct sr_instance *sr, struct sr_fib *fib)
+{
+    struct sr_rt *old_routes = sr->routing_table;
+    struct sr_fib *old = __atomic_exchange_n(&sr->fib, fib, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&sr->routing_table, fib->routes, __ATOMIC_RELEASE);
+
+    if (old == NULL && old_routes == fib->routes)
+        return;
+    sr_rcu_synchronize();
+    if (old != NULL)
+        sr_fib_free(old);
+    else
+        sr_free_rt(old_routes);
+    fib_reclaim_locked();
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_publish(..)
+ * Scope: Global
+ *
+ * Swaps in the new table. Lookups that started before the swap may still
+ * be walking the old trie, so it is freed only after a grace period. A
+ * table that was never compiled (the list from startup when its masks
+ * were not usable) is freed the same way.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_publish(struct sr_instance *sr, struct sr_fib *fib)
+{
+    pthread_mutex_lock(&fib_writer);
+    fib_swap(sr, fib);
+    pthread_mutex_unlock(&fib_writer);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_reload(..)
+ * Scope: Global
+ *
+ * Replaces the routing table with the one in 'path', a text table or a
+ * binary image (sr_fib_image.h). Every route must leave through an
+ * interface the router has; an empty, unreadable or inconsistent file
+ * leaves the running table alone. Packets waiting for ARP are moved if
+ * their next hop changed.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_reload(struct sr_instance *sr, const char *path)
+{
+    struct sr_fib *fib;
+    struct sr_rt *bad;
+    int n;
+
+    if (sr_fib_image_is(path)) {
+        fib = sr_fib_image_load(path);
+    } else {
+        struct sr_rt *routes;
+        if (sr_read_rt(path, &routes) < 0)
+            return -1;
+        fib = sr_fib_build(routes);
+        if (fib == NULL) {
+            sr_free_rt(routes);
+            return -1;
+        }
+    }
+    if (fib == NULL)
+        return -1;
+    if (fib->nroutes == 0) {
+        fprintf(stderr, "Routing table %s is empty\n", path);
+        sr_fib_free(fib);
+        return -1;
+    }
+    if (sr_check_rt_ifaces(sr, fib->routes, &bad) != 0) {
+        fprintf(stderr, "Route to %s: no interface %s\n",
+                inet_ntoa(bad->dest), bad->interface);
+        sr_fib_free(fib);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fib_writer);
+    n = fib->nroutes;
+    fib_swap(sr, fib);
+    sr_arpcache_reroute(sr, 0, 0);
+    pthread_mutex_unlock(&fib_writer);
+    return n;
+}
+
+/* The published FIB, compiling the list first if there is none yet */
+static struct sr_fib *fib_writable(struct sr_instance *sr)
+{
+    if (sr->fib == NULL) {
+        struct sr_fib *fib = sr_fib_build(sr->routing_table);
+        if (fib == NULL)
+            return NULL;
+        fib_swap(sr, fib);
+    }
+    return sr->fib;
+}
+
+/* Walk the path of a prefix, creating the missing nodes if 'create'. The
+   nodes on the way are stored in 'path' (root first), their number is
+   returned, -1 if the prefix has no node. */
+static int fib_walk(struct sr_fib *fib, uint32_t key, int plen, bool create,
+                    struct sr_fib_node **path)
+{
+    struct sr_fib_node *node = fib->root;
+    path[0] = node;
+    for (int depth = 0; depth < plen; depth++) {
+        struct sr_fib_node **next = &node->child[(key >> (31 - depth)) & 1];
+        if (*next == NULL) {
+            if (!create)
+                return -1;
+            /* the node is complete before readers can reach it */
+            __atomic_store_n(next, fib_node_new(fib), __ATOMIC_RELEASE);
+        }
+        node = *next;
+        path[depth + 1] = node;
+    }
+    return plen + 1;
+}
+
+static int fib_update(struct sr_instance *sr, const struct sr_rt *route, bool change)
+{
+    struct sr_fib_node *path[33];
+    uint32_t mask = ntohl(route->mask.s_addr);
+    uint32_t key = ntohl(route->dest.s_addr) & mask;
+    int plen = fib_prefix_len(mask);
+    int ret = 0;
+
+    if (plen < 0)
+        return -EINVAL;
+    if (sr_get_interface(sr, route->interface) == NULL)
+        return -ENODEV;
+
+    pthread_mutex_lock(&fib_writer);
+    struct sr_fib *fib = fib_writable(sr);
+    if (fib == NULL) {
+        ret = -EINVAL;
+        goto out;
+    }
+    int n = fib_walk(fib, key, plen, !change, path);
+    struct sr_fib_node *node = (n < 0) ? NULL : path[n - 1];
+    struct sr_rt *old = (node == NULL) ? NULL : node->route;
+    if (change ? (old == NULL) : (old != NULL)) {
+        ret = change ? -ESRCH : -EEXIST;
+        goto out;
+    }
+
+    struct sr_rt *rt = malloc(sizeof(struct sr_rt));
+    assert(rt);
+    *rt = *route;
+    rt->dest.s_addr = htonl(key);
+    if (change) {
+        /* take the old entry's place in the list */
+        rt->next = old->next;
+        rt->pprev = old->pprev;
+        if (old->next != NULL)
+            old->next->pprev = &rt->next;
+        else
+            fib->tail = &rt->next;
+        __atomic_store_n(rt->pprev, rt, __ATOMIC_RELEASE);
+        fib_retire(fib, old);
+    } else {
+        rt->next = NULL;
+        rt->pprev = fib->tail;
+        __atomic_store_n(fib->tail, rt, __ATOMIC_RELEASE);
+        fib->tail = &rt->next;
+        fib->nroutes++;
+    }
+    __atomic_store_n(&node->route, rt, __ATOMIC_RELEASE);
+    __atomic_store_n(&sr->routing_table, fib->routes, __ATOMIC_RELEASE);
+
+    sr_arpcache_reroute(sr, rt->dest.s_addr, rt->mask.s_addr);
+    if (fib_nretired >= FIB_RETIRE_MAX)
+        fib_reclaim_locked();
+out:
+    pthread_mutex_unlock(&fib_writer);
+    return ret;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_add(..), sr_fib_change(..)
+ * Scope: Global
+ *
+ * Add or change the route for one prefix without rebuilding the table.
+ * A new route goes to the end of the list, a changed one keeps its
+ * place.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_add(struct sr_instance *sr, const struct sr_rt *route)
+{
+    return fib_update(sr, route, false);
+}
+
+int sr_fib_change(struct sr_instance *sr, const struct sr_rt *route)
+{
+    return fib_update(sr, route, true);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_delete(..)
+ * Scope: Global
+ *
+ * Delete the route for one prefix, and the trie nodes that led only to
+ * it.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_delete(struct sr_instance *sr, struct in_addr dest, struct in_addr mask)
+{
+    struct sr_fib_node *path[33];
+    uint32_t host_mask = ntohl(mask.s_addr);
+    uint32_t key = ntohl(dest.s_addr) & host_mask;
+    int plen = fib_prefix_len(host_mask);
+    int ret = 0;
+
+    if (plen < 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&fib_writer);
+    struct sr_fib *fib = fib_writable(sr);
+    if (fib == NULL) {
+        ret = -EINVAL;
+        goto out;
+    }
+    int n = fib_walk(fib, key, plen, false, path);
+    struct sr_rt *old = (n < 0) ? NULL : path[n - 1]->route;
+    if (old == NULL) {
+        ret = -ESRCH;
+        goto out;
+    }
+
+    __atomic_store_n(&path[n - 1]->route, NULL, __ATOMIC_RELEASE);
+    if (old->next != NULL)
+        old->next->pprev = old->pprev;
+    else
+        fib->tail = old->pprev;
+    __atomic_store_n(old->pprev, old->next, __ATOMIC_RELEASE);
+    __atomic_store_n(&sr->routing_table, fib->routes, __ATOMIC_RELEASE);
+    fib_retire(fib, old);
+    fib->nroutes--;
+
+    /* unlink the nodes left with neither a route nor children */
+    for (int depth = n - 1; depth > 0; depth--) {
+        struct sr_fib_node *node = path[depth];
+        if (node->route != NULL || node->child[0] != NULL || node->child[1] != NULL)
+            break;
+        __atomic_store_n(&path[depth - 1]->child[(key >> (32 - depth)) & 1], NULL,
+                         __ATOMIC_RELEASE);
+        fib_retire(fib, node);
+        fib->nnodes--;
+    }
+
+    sr_arpcache_reroute(sr, htonl(key), mask.s_addr);
+    if (fib_nretired >= FIB_RETIRE_MAX)
+        fib_reclaim_locked();
+out:
+    pthread_mutex_unlock(&fib_writer);
+    return ret;
+}
+
+void sr_fib_reclaim(void)
+{
+    pthread_mutex_lock(&fib_writer);
+    fib_reclaim_locked();
+    pthread_mutex_unlock(&fib_writer);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_route(..)
+ * Scope: Global
+ *
+ * The packet path's route lookup. The entry is copied while the read
+ * section pins the table, so callers may keep using it after a reload.
+ *
+ *---------------------------------------------------------------------*/
+
+bool sr_fib_route(struct sr_instance *sr, uint32_t ip, struct sr_rt *route)
+{
+    struct sr_rt *best;
+    bool found;
+
+    sr_rcu_read_lock();
+    struct sr_fib *fib = __atomic_load_n(&sr->fib, __ATOMIC_ACQUIRE);
+    if (fib != NULL)
+        found = sr_fib_lookup(fib, ip, &best);
+    else
+        found = longest_prefix_match(__atomic_load_n(&sr->routing_table, __ATOMIC_ACQUIRE),
+                                     ip, &best);
+    if (found) {
+        *route = *best;
+        route->next = NULL;
+        route->pprev = NULL;
+    }
+    sr_rcu_read_unlock();
+    return found;
+}
@@ -0,0 +1,98 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * The forwarding table: the routing table compiled into a binary trie
+ * on the destination prefix, so a lookup costs at most 33 node visits
+ * whatever the number of routes.
+ *
+ * The packet path looks routes up with sr_fib_route(), which reads the
+ * published FIB under an RCU read section (sr_rcu.h) and copies the
+ * route out, so nothing it keeps can be freed underneath it. Replacing
+ * the table (sr_fib_reload, on SIGHUP) reads and compiles the new one
+ * (or maps a precompiled image, sr_fib_image.h) on the calling thread,
+ * publishes it with one atomic pointer store and frees the old one after
+ * a grace period; lookups never wait.
+ *
+ * Single routes are added, changed and deleted in place (sr_fib_add,
+ * sr_fib_change, sr_fib_delete, driven by the control socket, see
+ * sr_ctl.h). Each walks one path of the trie: new nodes and routes are
+ * filled in before the store that links them, and what a change unlinks
+ * is retired and freed by the next sr_fib_reclaim(), once no lookup can
+ * see it. Packets waiting in the ARP queue whose destination is under
+ * the changed prefix are moved to their new next hop.
+ *
+ * Until a FIB is published sr_fib_route() scans sr->routing_table
+ * instead.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sr_rt.h"
+
+struct sr_instance;
+
+struct sr_fib_node {
+    struct sr_fib_node *child[2];   /* next bit of the destination 0 / 1 */
+    struct sr_rt *route;            /* route for the prefix ending here, or NULL */
+};
+
+struct sr_fib {
+    struct sr_fib_node *root;
+    struct sr_rt *routes;           /* the routes, in file order, owned */
+    struct sr_rt **tail;            /* 'next' of the last route */
+    unsigned int nroutes;
+    unsigned int nnodes;
+    void *image;                    /* mapping the table was loaded from, or NULL */
+    size_t image_size;              /* (see sr_fib_image.h) */
+};
+
+/* Compile 'routes' into a FIB, which then owns the list. Of routes with
+   the same prefix the first one wins, as with the list lookup, and the
+   others are dropped. Returns NULL, and leaves the list to the caller, if
+   a mask is not contiguous. */
+struct sr_fib *sr_fib_build(struct sr_rt *routes);
+
+/* Free a FIB and its routes (or unmap its image). It must not be
+   published. */
+void sr_fib_free(struct sr_fib *fib);
+
+/* Longest prefix match for 'ip' (network byte order) in 'fib'. The
+   route is only valid for as long as the FIB is. */
+bool sr_fib_lookup(const struct sr_fib *fib, uint32_t ip, struct sr_rt **route);
+
+/* Make 'fib' the router's table and free the one it replaces once no
+   lookup can still be using it. Publishing, reloads and updates are
+   serialized among themselves. */
+void sr_fib_publish(struct sr_instance *sr, struct sr_fib *fib);
+
+/* Read, check and compile the routing table in 'path' (text, or an
+   image) and publish it. Returns the number of routes, or -1 with the
+   old table kept. */
+int sr_fib_reload(struct sr_instance *sr, const char *path);
+
+/* Add a route for a prefix that has none, or change the gateway and
+   interface of the one it has. Both return 0, or -EINVAL for a mask that
+   is not a prefix length, -ENODEV for an unknown interface, -EEXIST /
+   -ESRCH if the prefix already has / has no route. */
+int sr_fib_add(struct sr_instance *sr, const struct sr_rt *route);
+int sr_fib_change(struct sr_instance *sr, const struct sr_rt *route);
+
+/* Delete the route for a prefix: 0, -EINVAL or -ESRCH. */
+int sr_fib_delete(struct sr_instance *sr, struct in_addr dest, struct in_addr mask);
+
+/* Wait for a grace period and free what updates since the last call have
+   unlinked. Updates call it themselves when a lot has piled up. */
+void sr_fib_reclaim(void);
+
+/* Look up the route to 'ip' (network byte order) in the published table
+   and copy it to 'route' (its list links are cleared). */
+bool sr_fib_route(struct sr_instance *sr, uint32_t ip, struct sr_rt *route);
+
+#endif /* -- SR_FIB_H -- */
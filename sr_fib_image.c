@@ -0,0 +1,253 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib_image.c
+ *
+ * Description:
+ *
+ * Writing and mapping binary routing table images, see sr_fib_image.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_fib_image.h"
+
+#define IMG_ALIGN 64
+
+static uint64_t img_align(uint64_t off)
+{
+    return (off + IMG_ALIGN - 1) & ~(uint64_t) (IMG_ALIGN - 1);
+}
+
+static void *img_ptr(uint64_t off)
+{
+    return (void *) (uintptr_t) off;
+}
+
+/* Copy of the trie being laid out for the file */
+struct img_out {
+    struct sr_rt *routes;
+    struct sr_fib_node *nodes;
+    uint32_t nroutes, nnodes;
+    uint64_t routes_off, nodes_off;
+};
+
+/* Lay out 'node' and below in preorder, routes in the order met. Returns
+   the node's offset in the file. */
+static uint64_t img_node(struct img_out *img, const struct sr_fib_node *node)
+{
+    uint32_t i = img->nnodes++;
+    struct sr_fib_node *out = &img->nodes[i];
+
+    if (node->route != NULL) {
+        uint32_t r = img->nroutes++;
+        img->routes[r] = *node->route;
+        img->routes[r].next = NULL;
+        img->routes[r].pprev = NULL;
+        out->route = img_ptr(img->routes_off + (uint64_t) r * sizeof(struct sr_rt));
+    }
+    for (int c = 0; c < 2; c++) {
+        if (node->child[c] != NULL)
+            out->child[c] = img_ptr(img_node(img, node->child[c]));
+    }
+    return img->nodes_off + (uint64_t) i * sizeof(struct sr_fib_node);
+}
+
+static int img_write_all(FILE *fp, const void *buf, size_t len, uint64_t *pos)
+{
+    if (len > 0 && fwrite(buf, len, 1, fp) != 1)
+        return -1;
+    *pos += len;
+    return 0;
+}
+
+static int img_pad(FILE *fp, uint64_t to, uint64_t *pos)
+{
+    static const char zero[IMG_ALIGN];
+    return img_write_all(fp, zero, to - *pos, pos);
+}
+
+int sr_fib_image_write(const struct sr_fib *fib, const char *path)
+{
+    struct sr_fib_image_hdr hdr;
+    struct img_out img;
+    char tmp[4096];
+    uint64_t pos = 0;
+    int ret = -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SR_FIB_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.byte_order = 0x01020304;
+    hdr.ptr_size = sizeof(void *);
+    hdr.route_size = sizeof(struct sr_rt);
+    hdr.node_size = sizeof(struct sr_fib_node);
+    hdr.nroutes = fib->nroutes;
+    hdr.nnodes = fib->nnodes;
+    hdr.routes_off = img_align(sizeof(hdr));
+    hdr.nodes_off = img_align(hdr.routes_off + (uint64_t) hdr.nroutes * sizeof(struct sr_rt));
+
+    memset(&img, 0, sizeof(img));
+    img.routes = calloc(hdr.nroutes ? hdr.nroutes : 1, sizeof(struct sr_rt));
+    img.nodes = calloc(hdr.nnodes, sizeof(struct sr_fib_node));
+    assert(img.routes && img.nodes);
+    img.routes_off = hdr.routes_off;
+    img.nodes_off = hdr.nodes_off;
+    img_node(&img, fib->root);
+    assert(img.nroutes == hdr.nroutes && img.nnodes == hdr.nnodes);
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        goto out;
+    }
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL)
+        goto out;
+    if (img_write_all(fp, &hdr, sizeof(hdr), &pos) != 0 ||
+        img_pad(fp, hdr.routes_off, &pos) != 0 ||
+        img_write_all(fp, img.routes, (size_t) hdr.nroutes * sizeof(struct sr_rt), &pos) != 0 ||
+        img_pad(fp, hdr.nodes_off, &pos) != 0 ||
+        img_write_all(fp, img.nodes, (size_t) hdr.nnodes * sizeof(struct sr_fib_node), &pos) != 0) {
+        fclose(fp);
+        unlink(tmp);
+        goto out;
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        goto out;
+    }
+    ret = 0;
+out:
+    free(img.routes);
+    free(img.nodes);
+    return ret;
+}
+
+bool sr_fib_image_is(const char *path)
+{
+    char magic[8];
+    FILE *fp = fopen(path, "r");
+    bool is = false;
+
+    if (fp == NULL)
+        return false;
+    if (fread(magic, sizeof(magic), 1, fp) == 1)
+        is = (memcmp(magic, SR_FIB_IMAGE_MAGIC, sizeof(magic)) == 0);
+    fclose(fp);
+    return is;
+}
+
+/* Offset 'off' as a pointer into the region of 'count' records of 'size'
+   bytes at 'start', NULL if it is not the start of one of them. */
+static void *img_reloc(uint8_t *base, uint64_t off, uint64_t start, uint32_t count, size_t size)
+{
+    if (off < start || (off - start) % size != 0 || (off - start) / size >= count)
+        return NULL;
+    return base + off;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_image_load(..)
+ * Scope: Global
+ *
+ * Maps an image and relocates it in place. Every offset is checked
+ * against the region it must point into, and a node's children must come
+ * after it, so a damaged file cannot make the trie cyclic or point
+ * outside the mapping. The route list is rebuilt rather than trusted.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib *sr_fib_image_load(const char *path)
+{
+    struct sr_fib_image_hdr hdr;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < sizeof(hdr) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        fprintf(stderr, "%s: not a routing table image\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    uint64_t size = st.st_size;
+    if (memcmp(hdr.magic, SR_FIB_IMAGE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.byte_order != 0x01020304 || hdr.ptr_size != sizeof(void *) ||
+        hdr.route_size != sizeof(struct sr_rt) || hdr.node_size != sizeof(struct sr_fib_node)) {
+        fprintf(stderr, "%s: not a routing table image for this build\n", path);
+        close(fd);
+        return NULL;
+    }
+    if (hdr.nnodes == 0 || hdr.routes_off % IMG_ALIGN != 0 || hdr.nodes_off % IMG_ALIGN != 0 ||
+        hdr.routes_off < sizeof(hdr) || hdr.nodes_off < hdr.routes_off ||
+        (uint64_t) hdr.nroutes * sizeof(struct sr_rt) > hdr.nodes_off - hdr.routes_off ||
+        hdr.nodes_off > size || (uint64_t) hdr.nnodes * sizeof(struct sr_fib_node) > size - hdr.nodes_off) {
+        fprintf(stderr, "%s: routing table image is truncated or damaged\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    struct sr_fib *fib = calloc(1, sizeof(*fib));
+    assert(fib);
+    fib->image = base;
+    fib->image_size = size;
+    fib->nroutes = hdr.nroutes;
+    fib->nnodes = hdr.nnodes;
+
+    struct sr_fib_node *nodes = (struct sr_fib_node *) (base + hdr.nodes_off);
+    for (uint32_t i = 0; i < hdr.nnodes; i++) {
+        struct sr_fib_node *node = &nodes[i];
+        uint64_t self = hdr.nodes_off + (uint64_t) i * sizeof(struct sr_fib_node);
+        for (int c = 0; c < 2; c++) {
+            uint64_t off = (uintptr_t) node->child[c];
+            if (off == 0)
+                continue;
+            node->child[c] = img_reloc(base, off, hdr.nodes_off, hdr.nnodes, sizeof(struct sr_fib_node));
+            if (node->child[c] == NULL || off <= self)
+                goto bad;
+        }
+        uint64_t off = (uintptr_t) node->route;
+        if (off != 0) {
+            node->route = img_reloc(base, off, hdr.routes_off, hdr.nroutes, sizeof(struct sr_rt));
+            if (node->route == NULL)
+                goto bad;
+        }
+    }
+    fib->root = &nodes[0];
+
+    struct sr_rt *routes = (struct sr_rt *) (base + hdr.routes_off);
+    fib->tail = &fib->routes;
+    for (uint32_t r = 0; r < hdr.nroutes; r++) {
+        routes[r].interface[sr_IFACE_NAMELEN - 1] = '\0';
+        routes[r].next = NULL;
+        routes[r].pprev = fib->tail;
+        *fib->tail = &routes[r];
+        fib->tail = &routes[r].next;
+    }
+    return fib;
+
+bad:
+    fprintf(stderr, "%s: routing table image is truncated or damaged\n", path);
+    munmap(base, size);
+    free(fib);
+    return NULL;
+}
@@ -0,0 +1,58 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib_image.h
+ *
+ * Description:
+ *
+ * Binary images of a compiled routing table, for tables too large to
+ * parse at every start. "sr -r rtable -W rtable.fib" compiles the text
+ * table once; -r and SIGHUP then accept the image wherever they accept
+ * a text table.
+ *
+ * The image holds the routes and trie nodes exactly as struct sr_rt and
+ * struct sr_fib_node lay them out in memory, with every pointer stored as
+ * an offset from the start of the file. Loading maps the file privately,
+ * checks the header and turns the offsets back into pointers in one pass
+ * over the mapping: no parsing and no allocation per route. The mapped
+ * table is a normal FIB; routes and nodes later updates unlink from it
+ * are simply left in the mapping.
+ *
+ * An image is only good for the build that wrote it (same structure
+ * layout, pointer size and byte order); a mismatch is refused.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FIB_IMAGE_H
+#define SR_FIB_IMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sr_fib.h"
+
+#define SR_FIB_IMAGE_MAGIC "srfib\0\0\1"
+
+struct sr_fib_image_hdr {
+    char magic[8];
+    uint32_t byte_order;        /* 0x01020304 in the writer's order */
+    uint16_t ptr_size;
+    uint16_t route_size;        /* sizeof(struct sr_rt) */
+    uint16_t node_size;         /* sizeof(struct sr_fib_node) */
+    uint16_t pad;
+    uint32_t nroutes;
+    uint32_t nnodes;
+    uint64_t routes_off;        /* routes in prefix order */
+    uint64_t nodes_off;         /* nodes in preorder, the root first */
+};
+
+/* True if 'path' starts with the image magic. */
+bool sr_fib_image_is(const char *path);
+
+/* Write 'fib' to 'path' (through a temporary file and a rename, so a
+   reader never sees half an image). Returns 0, or -1 with errno set. */
+int sr_fib_image_write(const struct sr_fib *fib, const char *path);
+
+/* Map the image in 'path' as an unpublished FIB, NULL if it cannot be
+   read or is not a valid image for this build. */
+struct sr_fib *sr_fib_image_load(const char *path);
+
+#endif /* -- SR_FIB_IMAGE_H -- */
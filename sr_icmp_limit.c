@@ -0,0 +1,179 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sr_router.h"
+#include "sr_icmp_limit.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+
+/*
+ * ICMP error limits.
+ *
+ * Every error the router would send (TTL exceeded, host, net and port
+ * unreachable) first has to take a token from a global bucket and from
+ * the bucket of the host it goes to, so a flood of bad packets cannot be
+ * turned into a flood of errors. Destinations share a fixed, direct
+ * mapped table of buckets; a destination that lands on a slot held by
+ * another one starts over with a full bucket, which the global bucket
+ * still caps. Errors that pass are only copied into a queue here. They
+ * are built and sent by sr_icmp_flush(), which the receive path calls
+ * once the frame at hand has been forwarded and the sweeper threads
+ * call after releasing their table locks, so error generation never
+ * holds up forwarding. Errors refused by a bucket or by a full queue are
+ * counted as drop_icmp_suppressed.
+ */
+
+
+void sr_icmp_limit_init(struct sr_icmp_limit *limit, unsigned int rate, unsigned int dest_rate)
+{
+  memset(limit, 0, sizeof(*limit));
+  pthread_mutex_init(&(limit->lock), NULL);
+  limit->rate = rate;
+  limit->dest_rate = dest_rate;
+}
+
+/* Parses "rate[,per destination rate]" as given to -L. */
+int sr_icmp_limit_parse(const char *spec, unsigned int *rate, unsigned int *dest_rate)
+{
+  char *end;
+  unsigned long r = strtoul(spec, &end, 10);
+  unsigned long d = SR_ICMP_DEST_RATE;
+
+  if ((end == spec) || (r == 0) || (r > UINT32_MAX))
+    return -1;
+  if (*end == ',') {
+    const char *p = end + 1;
+    d = strtoul(p, &end, 10);
+    if ((end == p) || (d == 0) || (d > UINT32_MAX))
+      return -1;
+  }
+  if (*end != '\0')
+    return -1;
+  *rate = r;
+  *dest_rate = d;
+  return 0;
+}
+
+static void bucket_refill(struct sr_icmp_bucket *b, time_t now, unsigned int rate, unsigned int burst)
+{
+  if (now <= b->refilled)
+    return;
+  uint64_t tokens = b->tokens + (uint64_t) (now - b->refilled) * rate;
+  b->tokens = (tokens > burst) ? burst : (uint32_t) tokens;
+  b->refilled = now;
+}
+
+/* Takes a token from the global bucket and the bucket of 'ip', or from
+   neither. Called with the limiter locked. */
+static bool limit_admit(struct sr_icmp_limit *limit, uint32_t ip, time_t now)
+{
+  unsigned int rate = limit->rate ? limit->rate : SR_ICMP_RATE;
+  unsigned int dest_rate = limit->dest_rate ? limit->dest_rate : SR_ICMP_DEST_RATE;
+  unsigned int dest_burst = (dest_rate > SR_ICMP_DEST_BURST) ? dest_rate : SR_ICMP_DEST_BURST;
+
+  struct sr_icmp_bucket *dest = &limit->dests[sr_nat_hash(ip) & (SR_ICMP_DEST_BUCKETS - 1)];
+  if ((dest->ip != ip) || (dest->refilled == 0)) {
+    dest->ip = ip;
+    dest->tokens = dest_burst;
+    dest->refilled = now;
+  }
+  if (limit->global.refilled == 0) {
+    limit->global.tokens = rate;
+    limit->global.refilled = now;
+  }
+  bucket_refill(dest, now, dest_rate, dest_burst);
+  bucket_refill(&limit->global, now, rate, rate);
+
+  if ((dest->tokens == 0) || (limit->global.tokens == 0))
+    return false;
+  dest->tokens--;
+  limit->global.tokens--;
+  return true;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_icmp_error
+ *
+ * Scope:  Global
+ *
+ * Queues an ICMP error of the given type and code about 'recv_iphdr',
+ * addressed to its source, if the global and the per destination limits
+ * allow it. Nothing is built or sent here; see sr_icmp_flush.
+ *
+ * parameters:
+ *    sr          - a reference to the router structure
+ *    type, code  - ICMP type and code of the error
+ *    recv_iphdr  - the packet the error is about. ICMP_DATA_SIZE bytes of
+ *                  it are copied
+ *    iface       - the interface the packet was received on
+ *
+ * returns:
+ *    true if the error was queued, false if it was suppressed
+ *
+ *---------------------------------------------------------------------*/
+bool sr_icmp_error(struct sr_instance *sr, uint8_t type, uint8_t code,
+                   sr_ip_hdr_t *recv_iphdr, sr_if_t *iface)
+{
+  struct sr_icmp_limit *limit = &sr->icmp;
+  bool queued = false;
+
+  pthread_mutex_lock(&(limit->lock));
+  if ((limit->count < SR_ICMP_QUEUE) && limit_admit(limit, recv_iphdr->ip_src, sr_clock_now())) {
+    struct sr_icmp_error *err = &limit->queue[(limit->head + limit->count) % SR_ICMP_QUEUE];
+    err->type = type;
+    err->code = code;
+    memcpy(err->data, recv_iphdr, ICMP_DATA_SIZE);
+    err->iface = iface;
+    __atomic_store_n(&limit->count, limit->count + 1, __ATOMIC_RELEASE);
+    queued = true;
+  }
+  pthread_mutex_unlock(&(limit->lock));
+
+  if (!queued) {
+    sr_trace(trace_router,"ICMP error [%u/%u] to [%I] suppressed",type,code,recv_iphdr->ip_src);
+    sr_stats_drop(drop_icmp_suppressed);
+  }
+  return queued;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_icmp_flush
+ *
+ * Scope:  Global
+ *
+ * Builds and sends up to 'max' queued ICMP errors, oldest first. Must not
+ * be called with the ARP cache or NAT lock held. Costs one load when the
+ * queue is empty.
+ *
+ * returns:
+ *    the number of errors sent
+ *
+ *---------------------------------------------------------------------*/
+unsigned int sr_icmp_flush(struct sr_instance *sr, unsigned int max)
+{
+  struct sr_icmp_limit *limit = &sr->icmp;
+  unsigned int sent = 0;
+
+  while ((sent < max) && (__atomic_load_n(&limit->count, __ATOMIC_ACQUIRE) != 0)) {
+    struct sr_icmp_error err;
+
+    pthread_mutex_lock(&(limit->lock));
+    if (limit->count == 0) {
+      pthread_mutex_unlock(&(limit->lock));
+      break;
+    }
+    err = limit->queue[limit->head];
+    limit->head = (limit->head + 1) % SR_ICMP_QUEUE;
+    limit->count--;
+    pthread_mutex_unlock(&(limit->lock));
+
+    send_ICMP_error(sr, err.type, err.code, err.data, err.iface);
+    sent++;
+  }
+  return sent;
+}
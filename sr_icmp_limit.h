@@ -0,0 +1,56 @@
+
+#ifndef SR_ICMP_LIMIT_H
+#define SR_ICMP_LIMIT_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+#include "sr_protocol.h"
+#include "sr_if.h"
+
+#define SR_ICMP_RATE          1000   /* errors per second, all destinations */
+#define SR_ICMP_DEST_RATE     10     /* errors per second to one destination */
+#define SR_ICMP_DEST_BURST    20
+#define SR_ICMP_DEST_BUCKETS  1024   /* per destination buckets, power of two */
+#define SR_ICMP_QUEUE         256    /* errors waiting to be sent */
+#define SR_ICMP_FLUSH_BATCH   8      /* errors sent after each received frame */
+
+struct sr_instance;
+
+/* A token bucket. Tokens are added once per clock second. */
+struct sr_icmp_bucket {
+  uint32_t ip;          /* destination owning the bucket, network byte order */
+  uint32_t tokens;
+  time_t refilled;
+};
+
+/* An error that passed the limits and waits to be built and sent */
+struct sr_icmp_error {
+  uint8_t type;
+  uint8_t code;
+  uint8_t data[ICMP_DATA_SIZE];  /* IP header plus 8 bytes of the offending packet */
+  sr_if_t *iface;
+};
+
+/* ICMP error limits and the deferred send queue, see sr_icmp_limit.c.
+   All zero is a valid limiter with the default rates. */
+struct sr_icmp_limit {
+  pthread_mutex_t lock;          /* never held across a send */
+  unsigned int rate;             /* 0: SR_ICMP_RATE */
+  unsigned int dest_rate;        /* 0: SR_ICMP_DEST_RATE */
+  struct sr_icmp_bucket global;
+  struct sr_icmp_bucket dests[SR_ICMP_DEST_BUCKETS];
+  struct sr_icmp_error queue[SR_ICMP_QUEUE];
+  unsigned int head;
+  unsigned int count;
+};
+
+void sr_icmp_limit_init(struct sr_icmp_limit *limit, unsigned int rate, unsigned int dest_rate);
+int  sr_icmp_limit_parse(const char *spec, unsigned int *rate, unsigned int *dest_rate);
+
+bool sr_icmp_error(struct sr_instance *sr, uint8_t type, uint8_t code,
+                   sr_ip_hdr_t *recv_iphdr, sr_if_t *iface);
+unsigned int sr_icmp_flush(struct sr_instance *sr, unsigned int max);
+
+#endif
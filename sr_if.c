@@ -14,6 +14,7 @@
 
 #include "sr_if.h"
 #include "sr_router.h"
+#include "sr_trace.h"
 
 /*--------------------------------------------------------------------- 
  * Method: sr_get_interface
@@ -55,18 +56,25 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 void sr_add_interface(struct sr_instance* sr, const char* name)
 {
     struct sr_if* if_walker = 0;
+    struct sr_if* new_if = 0;
 
     /* -- REQUIRES -- */
     assert(name);
     assert(sr);
 
+    new_if = (struct sr_if*)calloc(1, sizeof(struct sr_if));
+    assert(new_if);
+    strncpy(new_if->name,name,sr_IFACE_NAMELEN);
+    new_if->next = 0;
+
+    /* -- the node is complete before it is linked, so threads that only
+     *    read names (the stats publisher) may walk the list meanwhile -- */
+
     /* -- empty list special case -- */
     if(sr->if_list == 0)
     {
-        sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
-        assert(sr->if_list);
-        sr->if_list->next = 0;
-        strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        new_if->idx = 0;
+        __atomic_store_n(&sr->if_list, new_if, __ATOMIC_RELEASE);
         return;
     }
 
@@ -75,11 +83,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     while(if_walker->next)
     {if_walker = if_walker->next; }
 
-    if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
-    assert(if_walker->next);
-    if_walker = if_walker->next;
-    strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
-    if_walker->next = 0;
+    new_if->idx = if_walker->idx + 1;
+    __atomic_store_n(&if_walker->next, new_if, __ATOMIC_RELEASE);
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
@@ -130,6 +135,97 @@ void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
 
 } /* -- sr_set_ether_ip -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_set_ether_speed(..)
+ * Scope: Global
+ *
+ * set the speed (Mbit/s) of the LAST interface in the interface list
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_set_ether_speed(struct sr_instance* sr, uint32_t speed)
+{
+    struct sr_if* if_walker = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr->if_list);
+
+    if_walker = sr->if_list;
+    while(if_walker->next)
+    {if_walker = if_walker->next; }
+
+    if_walker->speed = speed;
+
+} /* -- sr_set_ether_speed -- */
+
+/*--------------------------------------------------------------------- 
+ * Method: sr_load_if_file(..)
+ * Scope: Global
+ *
+ * Build the interface list from a file instead of the VNSHWINFO message,
+ * for running without a server. Same format as the VNS stand-in server's
+ * hwinfo file, one interface per line ('#' starts a comment):
+ *
+ *     <name> <ip> <mask> <mac> [speed]
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success
+ *  -1 on error
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_if_file(struct sr_instance* sr, const char* filename)
+{
+    FILE* fp;
+    char  line[BUFSIZ];
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(filename);
+
+    if((fp = fopen(filename,"r")) == 0)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    while( fgets(line,BUFSIZ,fp) != 0)
+    {
+        char name[sr_IFACE_NAMELEN], ip[32], mask[32], mac[32];
+        unsigned int m[ETHER_ADDR_LEN], speed = 0;
+        unsigned char addr[ETHER_ADDR_LEN];
+        struct in_addr ip_addr;
+
+        if(line[0] == '#' || line[0] == '\n')
+        { continue; }
+
+        if(sscanf(line,"%31s %31s %31s %31s %u",name,ip,mask,mac,&speed) < 4 ||
+           inet_aton(ip,&ip_addr) == 0 ||
+           sscanf(mac,"%x:%x:%x:%x:%x:%x",&m[0],&m[1],&m[2],&m[3],&m[4],&m[5]) != 6)
+        {
+            fprintf(stderr,"Error loading interfaces, malformed line: %s",line);
+            fclose(fp);
+            return -1;
+        }
+
+        for(int i = 0; i < ETHER_ADDR_LEN; i++)
+        { addr[i] = (unsigned char)m[i]; }
+
+        sr_add_interface(sr,name);
+        sr_set_ether_addr(sr,addr);
+        sr_set_ether_ip(sr,ip_addr.s_addr);
+        sr_get_interface(sr,name)->speed = speed;
+    } /* -- while -- */
+
+    fclose(fp);
+
+    printf("Router interfaces:\n");
+    sr_print_if_list(sr);
+
+    return (sr->if_list != 0) ? 0 : -1;
+} /* -- sr_load_if_file -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_print_if_list(..)
  * Scope: Global
@@ -169,16 +265,10 @@ void sr_print_if_list(struct sr_instance* sr)
 
 void sr_print_if(struct sr_if* iface)
 {
-    struct in_addr ip_addr;
-
     /* -- REQUIRES --*/
     assert(iface);
     assert(iface->name);
 
-    ip_addr.s_addr = iface->ip;
-
-    Debug("%s\tHWaddr",iface->name);
-    DebugMAC(iface->addr);
-    Debug("\n");
-    Debug("\tinet addr %s\n",inet_ntoa(ip_addr));
+    sr_trace(trace_router, "%s\tHWaddr %M\tinet addr %I", (uintptr_t)iface->name,
+             sr_trace_mac(iface->addr), iface->ip);
 } /* -- sr_print_if -- */
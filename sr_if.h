@@ -30,7 +30,8 @@ struct sr_if
   char name[sr_IFACE_NAMELEN];
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
-  uint32_t speed;
+  uint32_t speed;          /* Mbit/s, 0 if unknown. egress is shaped to it */
+  int idx;                /* position in the list, indexes per interface stats */
   struct sr_if* next;
 };
 typedef struct sr_if sr_if_t;
@@ -39,6 +40,8 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
 void sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
+void sr_set_ether_speed(struct sr_instance*, uint32_t speed);
+int sr_load_if_file(struct sr_instance*, const char*);
 void sr_print_if_list(struct sr_instance*);
 void sr_print_if(struct sr_if*);
 
@@ -0,0 +1,220 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_latency.c
+ *
+ * Description:
+ *
+ * Per-stage latency histograms, see sr_latency.h.
+ *
+ * Histograms are kept per thread the same way as the counters in
+ * sr_stats.c: a cache line aligned block registered on first use, only
+ * ever written by its owner with relaxed loads and stores, and summed by
+ * readers without a lock.
+ *
+ * Bucket layout: values below SR_LAT_SUB get a bucket each; above that,
+ * a value whose highest set bit is e goes to sub-bucket
+ * (v >> (e - SR_LAT_SUB_BITS)) & (SR_LAT_SUB - 1) of group e.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "sr_latency.h"
+
+#define LAT_CACHELINE 64
+#define LAT_CALIBRATE_NS 20000000
+
+struct sr_lat_block {
+    struct sr_lat_hist hist[lat_stage_max];
+    struct sr_lat_block *next;
+} __attribute__((aligned(LAT_CACHELINE)));
+
+static const char *sr_lat_stage_names[lat_stage_max] = {
+    [lat_rx_parse]  = "rx parse",
+    [lat_validate]  = "validation",
+    [lat_nat]       = "NAT",
+    [lat_route]     = "route lookup",
+    [lat_arp]       = "ARP",
+    [lat_tx_build]  = "tx build",
+    [lat_tx_enqueue] = "tx enqueue",
+    [lat_tx_write]  = "tx write",
+};
+
+int sr_lat_on;
+
+static double lat_ns_per_tick = 1.0;
+
+static __thread struct sr_lat_block *lat_self;
+static struct sr_lat_block *lat_blocks;
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sr_lat_block *lat_register(void)
+{
+    struct sr_lat_block *blk;
+
+    if (posix_memalign((void **)&blk, LAT_CACHELINE, sizeof(*blk)) != 0)
+        abort();
+    memset(blk, 0, sizeof(*blk));
+
+    pthread_mutex_lock(&lat_lock);
+    blk->next = lat_blocks;
+    __atomic_store_n(&lat_blocks, blk, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lat_lock);
+
+    lat_self = blk;
+    return blk;
+}
+
+static inline unsigned int lat_bucket(uint64_t v)
+{
+    if (v < SR_LAT_SUB)
+        return v;
+    unsigned int e = 63 - __builtin_clzll(v);
+    return (e - SR_LAT_SUB_BITS + 1) * SR_LAT_SUB +
+           ((v >> (e - SR_LAT_SUB_BITS)) & (SR_LAT_SUB - 1));
+}
+
+/* largest value that lands in bucket 'b' */
+static uint64_t lat_bucket_high(unsigned int b)
+{
+    if (b < SR_LAT_SUB)
+        return b;
+    unsigned int e = b / SR_LAT_SUB + SR_LAT_SUB_BITS - 1;
+    uint64_t sub = b % SR_LAT_SUB;
+    uint64_t low = (SR_LAT_SUB + sub) << (e - SR_LAT_SUB_BITS);
+    return low + (1ull << (e - SR_LAT_SUB_BITS)) - 1;
+}
+
+static inline void lat_add(uint64_t *ctr, uint64_t n)
+{
+    __atomic_store_n(ctr, __atomic_load_n(ctr, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void sr_lat_record(enum sr_lat_stage stage, uint64_t ticks)
+{
+    struct sr_lat_block *blk = lat_self ? lat_self : lat_register();
+    struct sr_lat_hist *h = &blk->hist[stage];
+
+    assert(stage < lat_stage_max);
+
+    lat_add(&h->buckets[lat_bucket(ticks)], 1);
+    lat_add(&h->count, 1);
+    lat_add(&h->sum, ticks);
+    if (ticks > h->max)
+        __atomic_store_n(&h->max, ticks, __ATOMIC_RELAXED);
+}
+
+/*---------------------------------------------------------------------
+ * Method: lat_calibrate
+ * Scope:  Local
+ *
+ * Measure the TSC rate against CLOCK_MONOTONIC. Assumes an invariant
+ * TSC, which every x86 CPU of the last decade has.
+ *
+ *---------------------------------------------------------------------*/
+
+static void lat_calibrate(void)
+{
+#ifdef SR_LAT_TSC
+    struct timespec t0, t1, sl = { 0, LAT_CALIBRATE_NS };
+    uint64_t c0, c1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = sr_lat_ticks();
+    nanosleep(&sl, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c1 = sr_lat_ticks();
+
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    if (c1 > c0)
+        lat_ns_per_tick = ns / (c1 - c0);
+#endif
+}
+
+void sr_lat_enable(bool on)
+{
+    if (on)
+        lat_calibrate();
+    __atomic_store_n(&sr_lat_on, on, __ATOMIC_RELAXED);
+}
+
+void sr_lat_snapshot(enum sr_lat_stage stage, struct sr_lat_hist *hist)
+{
+    const size_t n = sizeof(*hist) / sizeof(uint64_t);
+    uint64_t *dst = (uint64_t *) hist;
+
+    assert(stage < lat_stage_max);
+    memset(hist, 0, sizeof(*hist));
+
+    for (struct sr_lat_block *blk = __atomic_load_n(&lat_blocks, __ATOMIC_ACQUIRE);
+         blk != NULL; blk = blk->next) {
+        uint64_t *src = (uint64_t *) &blk->hist[stage];
+        uint64_t max = __atomic_load_n(&blk->hist[stage].max, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < n; i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        hist->max -= max;
+        if (max > hist->max)
+            hist->max = max;
+    }
+}
+
+uint64_t sr_lat_percentile(const struct sr_lat_hist *hist, double p)
+{
+    uint64_t rank = (uint64_t) (p * hist->count + 0.5), seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+    for (unsigned int b = 0; b < SR_LAT_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) {
+            uint64_t high = lat_bucket_high(b);
+            return high < hist->max ? high : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+double sr_lat_ticks_to_ns(double ticks)
+{
+    return ticks * lat_ns_per_tick;
+}
+
+const char *sr_lat_stage_name(enum sr_lat_stage stage)
+{
+    return stage < lat_stage_max ? sr_lat_stage_names[stage] : "?";
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_lat_print
+ * Scope:  Global
+ *
+ * Times are in nanoseconds. Percentiles are bucket upper bounds.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_lat_print(FILE *fp)
+{
+    static const double pct[] = { 0.50, 0.90, 0.99, 0.999 };
+    struct sr_lat_hist *hist = malloc(sizeof(*hist));
+
+    assert(hist);
+
+    fprintf(fp, "---------------------------------------------\n");
+    fprintf(fp, "%-13s %12s %9s %9s %9s %9s %9s %10s\n", "stage (ns)", "count",
+            "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int s = 0; s < lat_stage_max; s++) {
+        sr_lat_snapshot(s, hist);
+        fprintf(fp, "%-13s %12llu %9.0f", sr_lat_stage_names[s],
+                (unsigned long long) hist->count,
+                hist->count ? sr_lat_ticks_to_ns((double) hist->sum / hist->count) : 0.0);
+        for (int i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+            fprintf(fp, " %9.0f", hist->count ?
+                    sr_lat_ticks_to_ns(sr_lat_percentile(hist, pct[i])) : 0.0);
+        fprintf(fp, " %10.0f\n", sr_lat_ticks_to_ns(hist->max));
+    }
+    fprintf(fp, "---------------------------------------------\n");
+    free(hist);
+}
@@ -0,0 +1,97 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_latency.h
+ *
+ * Description:
+ *
+ * Per-stage latency histograms for the packet path. Each stage is timed
+ * with the TSC where available (clock_gettime otherwise) and the sample
+ * goes into a log bucketed histogram owned by the calling thread: 8
+ * sub-buckets per power of two, so any recorded value is known to within
+ * 12.5%. The instrumentation is always compiled in but costs a single
+ * predictable branch per stage until it is switched on.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_LATENCY_H
+#define SR_LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SR_LAT_TSC 1
+#endif
+
+#define SR_LAT_SUB_BITS 3
+#define SR_LAT_SUB      (1 << SR_LAT_SUB_BITS)
+#define SR_LAT_BUCKETS  ((64 - SR_LAT_SUB_BITS + 1) * SR_LAT_SUB)
+
+/* Keep sr_lat_stage_names in sr_latency.c in sync. */
+enum sr_lat_stage {
+    lat_rx_parse,       /* interface lookup, ethertype and MAC checks */
+    lat_validate,       /* IP header length and checksum */
+    lat_nat,            /* do_nat */
+    lat_route,          /* longest_prefix_match */
+    lat_arp,            /* ARP cache lookup, queueing on a miss */
+    lat_tx_build,       /* building the ethernet frame */
+    lat_tx_enqueue,     /* sr_txq_send: classify and queue the frame */
+    lat_tx_write,       /* VNS write, one sample per batch of frames */
+    lat_stage_max
+};
+
+struct sr_lat_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[SR_LAT_BUCKETS];
+};
+
+extern int sr_lat_on;
+
+static inline uint64_t sr_lat_ticks(void)
+{
+#ifdef SR_LAT_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void sr_lat_record(enum sr_lat_stage stage, uint64_t ticks);
+
+/* Start timing a stage. Returns 0 while the histograms are off. */
+static inline uint64_t sr_lat_begin(void)
+{
+    if (__builtin_expect(!__atomic_load_n(&sr_lat_on, __ATOMIC_RELAXED), 1))
+        return 0;
+    return sr_lat_ticks();
+}
+
+static inline void sr_lat_end(enum sr_lat_stage stage, uint64_t start)
+{
+    if (__builtin_expect(start != 0, 0))
+        sr_lat_record(stage, sr_lat_ticks() - start);
+}
+
+/* Switch recording on or off. Turning it on calibrates the TSC, which
+   takes a few milliseconds. */
+void sr_lat_enable(bool on);
+
+/* Sum the histograms of all threads for 'stage'. */
+void sr_lat_snapshot(enum sr_lat_stage stage, struct sr_lat_hist *hist);
+
+/* Value (in ticks) below which a fraction 'p' of the samples fall. */
+uint64_t sr_lat_percentile(const struct sr_lat_hist *hist, double p);
+
+double sr_lat_ticks_to_ns(double ticks);
+const char *sr_lat_stage_name(enum sr_lat_stage stage);
+
+/* Print count, mean, percentiles and max of every stage. */
+void sr_lat_print(FILE *fp);
+
+#endif /* -- SR_LATENCY_H -- */
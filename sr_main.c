@@ -11,7 +11,10 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
@@ -20,7 +23,23 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_fib_image.h"
+#include "sr_rcu.h"
+#include "sr_ctl.h"
 #include "sr_nat.h"
+#include "sr_nat_pool.h"
+#include "sr_nat_ckpt.h"
+#include "sr_nat_sync.h"
+#include "sr_nat_forward.h"
+#include "sr_nat_lb.h"
+#include "sr_if.h"
+#include "sr_replay.h"
+#include "sr_pcaplog.h"
+#include "sr_stats.h"
+#include "sr_shmstats.h"
+#include "sr_latency.h"
+#include "sr_trace.h"
 
 extern char* optarg;
 
@@ -36,11 +55,21 @@ extern char* optarg;
 
 #define DEFAULT_INTERNAL_INTERFACE "eth1"
 
+/* -- print the whole routing table when it is loaded (-q turns it off) -- */
+static bool print_rtable = true;
+
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static void sr_publish_fib(struct sr_instance* sr);
+static int sr_write_fib_image(const char* rtable, const char* image);
+static void sr_block_signals(sigset_t* set);
+static void sr_start_signal_thread(struct sr_instance* sr);
+static int sr_checkpoint_on_stop(struct sr_instance* sr);
+static void sr_start_shmstats(struct sr_instance* sr, const char* name);
+static void sr_start_ctl(struct sr_instance* sr, const char* path);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -58,13 +87,37 @@ int main(int argc, char **argv)
     int tcp_estab_timeout = DEFAULT_TCP_ESTABLISHED_TIMEOUT;
     int tcp_trans_timeout = DEFAULT_TCP_TRANSITORY_TIMEOUT;
     int icmp_query_timeout = DEFAULT_ICMP_TIMEOUT;
+    int udp_timeout = DEFAULT_UDP_TIMEOUT;
+    sr_nat_pool_t nat_pool = { 0 };
+    char *ckpt_path = 0;
+    char *forwards_path = 0;
+    unsigned int ckpt_interval = DEFAULT_NAT_CKPT_INTERVAL;
+    char *sync_path = 0;
+    bool sync_standby = false;
+    unsigned int icmp_rate = 0, icmp_dest_rate = 0;
+    struct sr_police police = { 0 };
+    char *acl_file = 0;
     bool nat_enabled = false;
     char *logfile = 0;
+    char *capture = 0;
+    struct sr_pcaplog_policy policy;
+    char *replay_file = 0;
+    char *replay_out = 0;
+    char *hwinfo = 0;
+    bool replay_paced = false;
+    char *shm_name = 0;
+    char *ctl_path = 0;
+    char *image_out = 0;
+    uint32_t trace_mask = 0;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:nT:I:E:R:")) != EOF)
+    /* -- handled by the signal thread, must be blocked before any other
+     *    thread is created so that all of them inherit the mask -- */
+    sr_block_signals(NULL);
+
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:F:nT:I:E:R:U:a:f:C:c:S:B:L:Q:A:P:i:o:xM:HD:K:W:q")) != EOF)
     {
         switch (c)
         {
@@ -90,6 +143,9 @@ int main(int argc, char **argv)
             case 'l':
                 logfile = optarg;
                 break;
+            case 'F':
+                capture = optarg;
+                break;
             case 'r':
                 rtable = optarg;
                 break;
@@ -112,11 +168,100 @@ int main(int argc, char **argv)
                 tcp_trans_timeout = atoi((char *) optarg);
                 fprintf(stderr,"TCP transitory idle timeout set to: %d\n",tcp_trans_timeout);
                 break;
+            case 'U':
+                udp_timeout = atoi((char *) optarg);
+                fprintf(stderr,"UDP idle timeout set to: %d\n",udp_timeout);
+                break;
+            case 'a':
+                if(sr_nat_pool_parse(&nat_pool, optarg) != 0)
+                {
+                    fprintf(stderr,"Invalid NAT address pool %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f':
+                forwards_path = optarg;
+                break;
+            case 'C':
+                ckpt_path = optarg;
+                break;
+            case 'c':
+                ckpt_interval = atoi((char *) optarg);
+                if(ckpt_interval == 0)
+                {
+                    fprintf(stderr,"Invalid NAT checkpoint interval %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+            case 'B':
+                sync_path = optarg;
+                sync_standby = (c == 'B');
+                break;
+            case 'L':
+                if(sr_icmp_limit_parse(optarg, &icmp_rate, &icmp_dest_rate) != 0)
+                {
+                    fprintf(stderr,"Invalid ICMP error limit %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'Q':
+                if(sr_police_parse(&police, optarg) != 0)
+                { exit(1); }
+                break;
+            case 'A':
+                acl_file = optarg;
+                break;
+            case 'P':
+                replay_file = optarg;
+                break;
+            case 'i':
+                hwinfo = optarg;
+                break;
+            case 'o':
+                replay_out = optarg;
+                break;
+            case 'x':
+                replay_paced = true;
+                break;
+            case 'M':
+                shm_name = optarg;
+                break;
+            case 'K':
+                ctl_path = optarg;
+                break;
+            case 'W':
+                image_out = optarg;
+                break;
+            case 'q':
+                print_rtable = false;
+                break;
+            case 'H':
+                sr_lat_enable(true);
+                break;
+            case 'D':
+                if(sr_trace_parse(optarg, &trace_mask) != 0)
+                { exit(1); }
+                break;
         } /* switch */
     } /* -- while -- */
 
+    /* -- compile the routing table into an image and stop -- */
+    if(image_out)
+    { exit(sr_write_fib_image(rtable, image_out) == 0 ? 0 : 1); }
+
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.nat.pool = nat_pool;
+    sr.nat.forwards_path = forwards_path;
+    sr.nat.ckpt_path = ckpt_path;
+    sr.nat.ckpt_interval = ckpt_interval;
+    sr.icmp.rate = icmp_rate;
+    sr.icmp.dest_rate = icmp_dest_rate;
+    sr.police = police;
+
+    if(trace_mask)
+    { sr_trace_set(trace_mask, stderr); }
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -137,7 +282,10 @@ int main(int argc, char **argv)
     /* -- set up file pointer for logging of raw packets -- */
     if(logfile != 0)
     {
-        sr.logfile = sr_dump_open(logfile,0,PACKET_DUMP_SIZE);
+        sr_pcaplog_policy_init(&policy);
+        if(capture && sr_pcaplog_policy_parse(capture, &policy) != 0)
+        { exit(1); }
+        sr.logfile = sr_pcaplog_open(logfile,PACKET_DUMP_SIZE,SR_PCAPLOG_SLOTS,&policy);
         if(!sr.logfile)
         {
             fprintf(stderr,"Error opening up dump file %s\n",
@@ -146,11 +294,63 @@ int main(int argc, char **argv)
         }
     }
 
-    Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
+    if(replay_file)
+    {
+        int ret;
+
+        if(!hwinfo)
+        {
+            fprintf(stderr,"Replay mode requires an interface file (-i)\n");
+            exit(1);
+        }
+        if(template || sr_load_if_file(&sr, hwinfo) != 0)
+        {
+            fprintf(stderr,"Error setting up interfaces from file %s\n", hwinfo);
+            exit(1);
+        }
+        if(sr_verify_routing_table(&sr) != 0)
+        {
+            fprintf(stderr,"Routing table not consistent with hardware\n");
+            exit(1);
+        }
+        if(sr_replay_open(&sr, replay_file, replay_out, replay_paced) != 0)
+        {
+            fprintf(stderr,"Error opening replay file %s\n", replay_file);
+            exit(1);
+        }
+
+        sr_init(&sr,DEFAULT_INTERNAL_INTERFACE,nat_enabled,icmp_query_timeout,tcp_estab_timeout,tcp_trans_timeout,udp_timeout);
+        sr_publish_fib(&sr);
+        if(sr_police_init(&sr) != 0)
+        { exit(1); }
+        if(acl_file && (sr.acl = sr_acl_load(&sr, acl_file)) == NULL)
+        { exit(1); }
+        sr_start_signal_thread(&sr);
+        sr_start_ctl(&sr, ctl_path);
+        sr_start_shmstats(&sr, shm_name);
+        ret = sr_replay_run(&sr);
+        if(sr_checkpoint_on_stop(&sr) != 0)
+        { ret = -1; }
+        sr_txq_stop(&sr);
+        sr_replay_close(&sr);
+        sr_stats_print(&sr, stderr);
+        if(sr_lat_on)
+            sr_lat_print(stderr);
+
+        if(nat_enabled)
+            sr_nat_destroy(&sr.nat);
+        sr_police_destroy(&sr.police);
+        sr_acl_destroy(sr.acl);
+        sr_destroy_instance(&sr);
+        return ret == 0 ? 0 : 1;
+    }
+
+    sr_trace(trace_router, "Client %s connecting to Server %s:%d",
+             (uintptr_t)sr.user, (uintptr_t)server, port);
     if(template)
-        Debug("Requesting topology template %s\n", template);
+        sr_trace(trace_router, "Requesting topology template %s", (uintptr_t)template);
     else
-        Debug("Requesting topology %d\n", topo);
+        sr_trace(trace_router, "Requesting topology %d", topo);
 
     /* connect to server and negotiate session */
     if(sr_connect_to_server(&sr,port,server) == -1)
@@ -159,7 +359,8 @@ int main(int argc, char **argv)
     }
 
     if(template != NULL && strcmp(rtable, "rtable.vrhost") == 0) { /* we've recv'd the rtable now, so read it in */
-        Debug("Connected to new instantiation of topology template %s\n", template);
+        sr_trace(trace_router, "Connected to new instantiation of topology template %s",
+                 (uintptr_t)template);
         sr_load_rt_wrap(&sr, "rtable.vrhost");
     }
     else {
@@ -168,16 +369,38 @@ int main(int argc, char **argv)
     }
 
     /* call router init (for arp subsystem etc.) */
-    sr_init(&sr,DEFAULT_INTERNAL_INTERFACE,nat_enabled,icmp_query_timeout,tcp_estab_timeout,tcp_trans_timeout);
-
+    sr_init(&sr,DEFAULT_INTERNAL_INTERFACE,nat_enabled,icmp_query_timeout,tcp_estab_timeout,tcp_trans_timeout,udp_timeout);
+    sr_publish_fib(&sr);
+    if(nat_enabled && sync_path &&
+       sr_nat_sync_init(&sr, sync_path, sync_standby) != 0)
+    {
+        fprintf(stderr,"Error listening for the active NAT on %s\n", sync_path);
+        exit(1);
+    }
+    if(sr_police_init(&sr) != 0)
+    { exit(1); }
+    if(acl_file && (sr.acl = sr_acl_load(&sr, acl_file)) == NULL)
+    { exit(1); }
+    sr_start_signal_thread(&sr);
+    sr_start_ctl(&sr, ctl_path);
+    sr_start_shmstats(&sr, shm_name);
 
     /* -- whizbang main loop ;-) */
     while( sr_read_from_server(&sr) == 1);
+    int ret = sr_checkpoint_on_stop(&sr);
+    sr_txq_stop(&sr);
 
-    sr_nat_destroy(&sr.nat);
+    sr_stats_print(&sr, stderr);
+    if(sr_lat_on)
+        sr_lat_print(stderr);
+
+    if(nat_enabled)
+        sr_nat_destroy(&sr.nat);
+    sr_police_destroy(&sr.police);
+    sr_acl_destroy(sr.acl);
     sr_destroy_instance(&sr);
 
-    return 0;
+    return ret == 0 ? 0 : 1;
 }/* -- main -- */
 
 /*-----------------------------------------------------------------------------
@@ -191,8 +414,50 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] [-n] [-I ICMP query timeout]\n");
+    printf("           [-l log file [-F capture policy]] [-n] [-I ICMP query timeout]\n");
     printf("           [-E TCP established timeout] [-R TCP transitory idle timeout]\n");
+    printf("           [-U UDP idle timeout] [-a NAT address pool]\n");
+    printf("           [-f NAT port forward file]\n");
+    printf("           [-C NAT checkpoint file [-c checkpoint interval]]\n");
+    printf("           [-S standby socket | -B standby socket]\n");
+    printf("           [-L ICMP errors/s[,errors/s per destination]]\n");
+    printf("           [-Q ingress policer]... [-A access list file]\n");
+    printf("           [-P replay pcap -i interface file [-o output pcap] [-x]]\n");
+    printf("           [-M shared memory stats segment] [-H] [-D trace categories]\n");
+    printf("           [-K control socket] [-q] [-W routing table image]\n");
+    printf("   capture policy: dir=in|out|both,if=name,proto=arp|icmp|tcp|udp|num,\n");
+    printf("                   src=prefix,dst=prefix,sample=N,rate=records/s\n");
+    printf("   SIGHUP rereads the routing table (and the NAT port forwards)\n");
+    printf("   -W compiles the -r routing table into a binary image and exits;\n");
+    printf("      -r and SIGHUP load such an image directly (same build only)\n");
+    printf("   -q prints only the number of routes loaded, not the table\n");
+    printf("   control socket commands, one per line, answered with ok or error:\n");
+    printf("      route add|change dest gw mask iface, route del dest mask,\n");
+    printf("      route show, reload\n");
+    printf("   SIGUSR1 prints interface and drop counters to stderr,\n");
+    printf("   -M publishes them for sr_stat under /dev/shm\n");
+    printf("   -H records per-stage latency histograms, SIGUSR2 prints them\n");
+    printf("      (and switches recording on if it was off)\n");
+    printf("   NAT address pool: addr[/len][@iface],... (default: the external\n");
+    printf("                     interface's address)\n");
+    printf("   NAT port forwards, one per line, reloaded on SIGHUP:\n");
+    printf("      tcp|udp|icmp ext_port[@ext_addr] int_addr:int_port\n");
+    printf("      tcp ext_port[@ext_addr] int_addr:int_port int_addr:int_port...\n");
+    printf("      balances new connections over the listed backends (Maglev),\n");
+    printf("      SIGUSR1 prints their counters\n");
+    printf("   NAT checkpoint: loaded at start, written every interval seconds\n");
+    printf("                   (default %d) and on SIGTERM\n", DEFAULT_NAT_CKPT_INTERVAL);
+    printf("   -S replicates NAT state to a standby listening on the UNIX socket,\n");
+    printf("   -B runs as that standby (both need the same NAT address pool)\n");
+    printf("   ICMP error limits default to %d/s and %d/s per destination\n",
+           SR_ICMP_RATE, SR_ICMP_DEST_RATE);
+    printf("   ingress policer: if=name,rate=bytes/s,burst=bytes,host=bytes/s,\n");
+    printf("                    hostburst=bytes (k, m and g suffixes; host polices\n");
+    printf("                    each source address on the interface)\n");
+    printf("   access list rules, one per line, first match wins, default permit:\n");
+    printf("      iface in|out permit|deny [proto=tcp|udp|icmp|num] [src=prefix]\n");
+    printf("      [dst=prefix] [sport=port[-port]] [dport=port[-port]] [flags=SA[/SAFR]]\n");
+    printf("   trace categories: router,nat,timeout,tcp,block,all,none\n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -236,9 +501,16 @@ static void sr_destroy_instance(struct sr_instance* sr)
 
     if(sr->logfile)
     {
-        sr_dump_close(sr->logfile);
+        sr_pcaplog_close(sr->logfile);
+    }
+
+    if(sr->shmstats)
+    {
+        sr_shmstats_close(sr->shmstats);
     }
 
+    sr_trace_close();
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -262,7 +534,17 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->topo_id = 0;
     sr->if_list = 0;
     sr->routing_table = 0;
+    sr->fib = 0;
+    sr->rtable_path = 0;
     sr->logfile = 0;
+    sr->replay = 0;
+    sr->shmstats = 0;
+    memset(&sr->nat, 0, sizeof(sr->nat));
+    memset(&sr->icmp, 0, sizeof(sr->icmp));
+    memset(&sr->police, 0, sizeof(sr->police));
+    memset(&sr->txq, 0, sizeof(sr->txq));
+    sr->acl = 0;
+    sr->stopping = false;
 } /* -- sr_init_instance -- */
 
 /*-----------------------------------------------------------------------------
@@ -283,49 +565,306 @@ static void sr_init_instance(struct sr_instance* sr)
 int sr_verify_routing_table(struct sr_instance* sr)
 {
     struct sr_rt* rt_walker = 0;
-    struct sr_if* if_walker = 0;
     int ret = 0;
 
     /* -- REQUIRES --*/
     assert(sr);
 
-    if( (sr->if_list == 0) || (sr->routing_table == 0))
+    /* a reload on SIGHUP may free the table while we walk it */
+    sr_rcu_read_lock();
+    rt_walker = __atomic_load_n(&sr->routing_table, __ATOMIC_ACQUIRE);
+    if( (sr->if_list == 0) || (rt_walker == 0))
     {
+        sr_rcu_read_unlock();
         return 999; /* doh! */
     }
 
-    rt_walker = sr->routing_table;
-
-    while(rt_walker)
-    {
-        /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
-        }
-        if(if_walker == 0)
-        { ret++; } /* -- interface not found! -- */
-
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
+    /* -- count the routes through interfaces the hardware lacks -- */
+    ret = sr_check_rt_ifaces(sr, rt_walker, 0);
+    sr_rcu_read_unlock();
 
     return ret;
 } /* -- sr_verify_routing_table -- */
 
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
-    if(sr_load_rt(sr, rtable) != 0) {
+    if(sr_fib_image_is(rtable)) {
+        struct sr_fib* fib = sr_fib_image_load(rtable);
+        if(fib == 0) {
+            fprintf(stderr,"Error setting up routing table from image %s\n",
+                    rtable);
+            exit(1);
+        }
+        sr_fib_publish(sr, fib);
+    }
+    else if(sr_load_rt(sr, rtable) != 0) {
         fprintf(stderr,"Error setting up routing table from file %s\n",
                 rtable);
         exit(1);
     }
-
+    sr->rtable_path = rtable;
+
+    if(!print_rtable) {
+        int n = 0;
+        for(struct sr_rt* rt = sr->routing_table; rt; rt = rt->next)
+        { n++; }
+        printf("Loaded %d routes from %s\n", n, rtable);
+        return;
+    }
 
     printf("Loading routing table\n");
     printf("---------------------------------------------\n");
     sr_print_routing_table(sr);
     printf("---------------------------------------------\n");
 }
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_publish_fib(..)
+ * Scope: Local
+ *
+ * Compile the routing table read at startup and switch lookups over to
+ * it. A table that does not compile is still used, through the list.
+ * A table loaded from an image is already compiled and published.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_publish_fib(struct sr_instance* sr)
+{
+    struct sr_fib* fib;
+
+    /* -- an image is published as soon as it is mapped -- */
+    if(sr->fib && sr->fib->routes == sr->routing_table)
+    { return; }
+
+    fib = sr_fib_build(sr->routing_table);
+
+    if(fib)
+    { sr_fib_publish(sr, fib); }
+    else
+    { fprintf(stderr,"Routing table not compiled, routes are looked up in the list\n"); }
+} /* -- sr_publish_fib -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_write_fib_image(..)
+ * Scope: Local
+ *
+ * Compile the routing table 'rtable' and write it to 'image' for -r to
+ * map at the next start (-W). Interfaces are not checked here, the
+ * router checks them when it loads the image.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_write_fib_image(const char* rtable, const char* image)
+{
+    struct sr_rt* routes;
+    struct sr_fib* fib;
+
+    if(sr_fib_image_is(rtable))
+    { fib = sr_fib_image_load(rtable); }
+    else
+    {
+        if(sr_read_rt(rtable, &routes) < 0)
+        { return -1; }
+        fib = sr_fib_build(routes);
+        if(fib == 0)
+        { sr_free_rt(routes); }
+    }
+    if(fib == 0)
+    { return -1; }
+    if(fib->nroutes == 0)
+    {
+        fprintf(stderr,"Routing table %s is empty\n", rtable);
+        sr_fib_free(fib);
+        return -1;
+    }
+    if(sr_fib_image_write(fib, image) != 0)
+    {
+        perror(image);
+        sr_fib_free(fib);
+        return -1;
+    }
+    printf("Wrote %u routes (%u trie nodes) from %s to %s\n",
+           fib->nroutes, fib->nnodes, rtable, image);
+    sr_fib_free(fib);
+    return 0;
+} /* -- sr_write_fib_image -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_block_signals(..)
+ * Scope: Local
+ *
+ * Block the signals the signal thread waits for in the calling thread and
+ * return them in 'set' if it is not null.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_block_signals(sigset_t* set)
+{
+    sigset_t sigs;
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    if(set)
+    { *set = sigs; }
+} /* -- sr_block_signals -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_signal_thread(..)
+ * Scope: Local
+ *
+ * Handles operator signals synchronously with sigwait, so the handlers may
+ * do anything a normal thread can (take locks, allocate, print).
+ *
+ *---------------------------------------------------------------------------*/
+
+static void* sr_signal_thread(void* arg)
+{
+    struct sr_instance* sr = (struct sr_instance*)arg;
+    sigset_t set;
+    int sig;
+
+    sr_block_signals(&set);
+
+    while(sigwait(&set, &sig) == 0)
+    {
+        switch(sig)
+        {
+            case SIGHUP:
+                if(sr->rtable_path)
+                {
+                    int n = sr_fib_reload(sr, sr->rtable_path);
+                    if(n < 0)
+                    {
+                        fprintf(stderr, "Error reloading routing table %s, keeping the old one\n",
+                                sr->rtable_path);
+                    }
+                    else
+                    {
+                        fprintf(stderr, "Reloaded %d routes\n", n);
+                        if(print_rtable)
+                        {
+                            /* -- the control socket may swap the table meanwhile -- */
+                            sr_rcu_read_lock();
+                            sr_print_routing_table(sr);
+                            sr_rcu_read_unlock();
+                        }
+                    }
+                }
+                if(sr->nat_enabled && sr->nat.forwards_path)
+                {
+                    int n = sr_nat_forward_load(sr, sr->nat.forwards_path);
+                    if(n < 0)
+                    {
+                        fprintf(stderr, "Error reloading NAT port forwards %s, keeping the old ones\n",
+                                sr->nat.forwards_path);
+                    }
+                    else
+                    { fprintf(stderr, "Reloaded %d NAT port forwards\n", n); }
+                }
+                break;
+            case SIGUSR1:
+                sr_stats_print(sr, stderr);
+                if(sr->nat_enabled)
+                { sr_nat_lb_print(&sr->nat, stderr); }
+                break;
+            case SIGUSR2:
+                if(sr_lat_on)
+                { sr_lat_print(stderr); }
+                else
+                {
+                    sr_lat_enable(true);
+                    fprintf(stderr, "Latency histograms enabled\n");
+                }
+                break;
+            case SIGTERM:
+                /* -- main checkpoints and tears down once its loop ends;
+                 *    the write side stays open for the queued frames -- */
+                __atomic_store_n(&sr->stopping, true, __ATOMIC_RELEASE);
+                if(sr->replay == NULL)
+                { shutdown(sr->sockfd, SHUT_RD); }
+                return NULL;
+        }
+    }
+
+    return NULL;
+} /* -- sr_signal_thread -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_checkpoint_on_stop(..)
+ * Scope: Local
+ *
+ * Write the last NAT checkpoint once the main loop has ended because of
+ * SIGTERM. returns 0 on success or if there is nothing to write.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_checkpoint_on_stop(struct sr_instance* sr)
+{
+    if(!__atomic_load_n(&sr->stopping, __ATOMIC_ACQUIRE) ||
+       !sr->nat_enabled || !sr->nat.ckpt_path)
+    { return 0; }
+
+    if(sr_nat_ckpt_write_final(sr, sr->nat.ckpt_path) != 0)
+    {
+        fprintf(stderr, "Error writing NAT checkpoint %s\n", sr->nat.ckpt_path);
+        return -1;
+    }
+    return 0;
+} /* -- sr_checkpoint_on_stop -- */
+
+static void sr_start_signal_thread(struct sr_instance* sr)
+{
+    pthread_t thread;
+
+    if(pthread_create(&thread, NULL, sr_signal_thread, sr) != 0)
+    {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(thread);
+} /* -- sr_start_signal_thread -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_start_shmstats(..)
+ * Scope: Local
+ *
+ * Start publishing stats to shared memory segment 'name', if one was given.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_start_shmstats(struct sr_instance* sr, const char* name)
+{
+    if(!name)
+    { return; }
+
+    sr->shmstats = sr_shmstats_open(sr, name);
+    if(!sr->shmstats)
+    {
+        fprintf(stderr,"Error creating stats segment %s\n", name);
+        exit(1);
+    }
+} /* -- sr_start_shmstats -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_start_ctl(..)
+ * Scope: Local
+ *
+ * Serve route updates on the control socket 'path', if one was given.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_start_ctl(struct sr_instance* sr, const char* path)
+{
+    if(!path)
+    { return; }
+
+    if(sr_ctl_start(sr, path) != 0)
+    {
+        fprintf(stderr,"Error listening for control connections on %s\n", path);
+        exit(1);
+    }
+} /* -- sr_start_ctl -- */
@@ -1,5 +1,6 @@
 
 #include <signal.h>
+#include <stdio.h>
 #include <assert.h>
 #include "sr_nat.h"
 #include <unistd.h>
@@ -14,10 +15,123 @@
 #include "sr_nat_tcp.h"
 #include "sr_nat.h"
 #include "sr_nat_icmp.h"
+#include "sr_nat_udp.h"
+#include "sr_nat_pool.h"
+#include "sr_nat_ckpt.h"
+#include "sr_nat_sync.h"
+#include "sr_nat_forward.h"
+#include "sr_nat_lb.h"
+#include "sr_fib.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
 #include "sr_nat_tcp.h"
 
+#define NAT_INDEX_MIN_SIZE 1024
+
+static enum sr_gauge mapping_gauge(sr_nat_mapping_type type)
+{
+  switch (type) {
+    case nat_mapping_icmp: return gauge_nat_icmp_mappings;
+    case nat_mapping_tcp:  return gauge_nat_tcp_mappings;
+    case nat_mapping_udp:  return gauge_nat_udp_mappings;
+  }
+  return gauge_nat_icmp_mappings;
+}
+
+/*---------------------------------------------------------------------
+ * Lookup indexes
+ *
+ * Every mapping sits on the 'mappings' list, which the timeout sweep
+ * walks, and in two chained hash tables for the packet path: one keyed
+ * on the internal (type, ip, aux) and one on the external (type, ip,
+ * aux).
+ * Chains are threaded through the mappings themselves, so indexing
+ * costs no allocation per mapping. Both tables double once they hold
+ * as many mappings as buckets.
+ *
+ *---------------------------------------------------------------------*/
+static inline unsigned int nat_int_bucket(struct sr_nat *nat, sr_nat_mapping_type type,
+                                          uint32_t ip_int, uint16_t aux_int)
+{
+  return sr_nat_hash(((uint64_t) type << 48) ^ ((uint64_t) aux_int << 32) ^ ip_int) &
+         (nat->index_size - 1);
+}
+
+static inline unsigned int nat_ext_bucket(struct sr_nat *nat, sr_nat_mapping_type type,
+                                          uint32_t ip_ext, uint16_t aux_ext)
+{
+  return sr_nat_hash(((uint64_t) type << 48) ^ ((uint64_t) aux_ext << 32) ^ ip_ext) &
+         (nat->index_size - 1);
+}
+
+static void nat_index_link(struct sr_nat *nat, sr_nat_mapping_t *map)
+{
+  unsigned int b = nat_int_bucket(nat, map->type, map->ip_int, map->aux_int);
+  map->int_next = nat->int_index[b];
+  nat->int_index[b] = map;
+
+  b = nat_ext_bucket(nat, map->type, map->ip_ext, map->aux_ext);
+  map->ext_next = nat->ext_index[b];
+  nat->ext_index[b] = map;
+}
+
+static void nat_index_resize(struct sr_nat *nat, unsigned int size)
+{
+  sr_nat_mapping_t **int_index = calloc(size, sizeof(*int_index));
+  sr_nat_mapping_t **ext_index = calloc(size, sizeof(*ext_index));
+  assert(int_index && ext_index);
+
+  free(nat->int_index);
+  free(nat->ext_index);
+  nat->int_index = int_index;
+  nat->ext_index = ext_index;
+  nat->index_size = size;
+
+  //relink oldest first so that every chain keeps newest mappings in front
+  sr_nat_mapping_t *rev = NULL;
+  for (sr_nat_mapping_t *map = nat->mappings, *next; map != NULL; map = next) {
+    next = map->next;
+    map->int_next = rev;
+    rev = map;
+  }
+  for (sr_nat_mapping_t *map = rev, *next; map != NULL; map = next) {
+    next = map->int_next;
+    nat_index_link(nat, map);
+  }
+}
+
+static void nat_index_insert(struct sr_nat *nat, sr_nat_mapping_t *map)
+{
+  if (nat->index_count >= nat->index_size) {
+    //'map' is already on the list, so the resize links it
+    nat_index_resize(nat, nat->index_size ? nat->index_size * 2 : NAT_INDEX_MIN_SIZE);
+  } else {
+    nat_index_link(nat, map);
+  }
+  nat->index_count++;
+}
+
+static void nat_index_remove(struct sr_nat *nat, sr_nat_mapping_t *map)
+{
+  sr_nat_mapping_t **pp;
+
+  for (pp = &nat->int_index[nat_int_bucket(nat, map->type, map->ip_int, map->aux_int)];
+       *pp != map; pp = &(*pp)->int_next)
+    assert(*pp != NULL);
+  *pp = map->int_next;
+
+  for (pp = &nat->ext_index[nat_ext_bucket(nat, map->type, map->ip_ext, map->aux_ext)];
+       *pp != map; pp = &(*pp)->ext_next)
+    assert(*pp != NULL);
+  *pp = map->ext_next;
+
+  nat->index_count--;
+}
+
+
 int   sr_nat_init(struct sr_instance *sr,time_t icmp_query_timeout, time_t tcp_estab_timeout, 
-                  time_t tcp_trans_timeout,char *int_iface_name) {
+                  time_t tcp_trans_timeout,time_t udp_timeout,char *int_iface_name) {
 
   assert(sr);
   struct sr_nat *nat = &sr->nat;
@@ -28,18 +142,29 @@ int   sr_nat_init(struct sr_instance *sr,time_t icmp_query_timeout, time_t tcp_e
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
   int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
 
-  /* Initialize timeout thread */
+  /* Initialize timeout thread, started at the end once the table is set up */
 
   pthread_attr_init(&(nat->thread_attr));
   pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
   pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
   pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, sr);
 
   /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
   nat->mappings = NULL;
   nat->pending_syns = NULL;
+  nat->pending_syns_tail = NULL;
+  nat->syn_slots = NULL;
+  nat->syn_free = NULL;
+  nat->syn_index = NULL;
+  nat->syn_index_size = 0;
+  nat->npending_syns = 0;
+  if (nat->max_pending_syns == 0)
+    nat->max_pending_syns = DEFAULT_MAX_PENDING_SYNS;
+  nat->int_index = NULL;
+  nat->ext_index = NULL;
+  nat->index_size = 0;
+  nat->index_count = 0;
 
   /* Initialize any variables here */
 
@@ -47,43 +172,101 @@ int   sr_nat_init(struct sr_instance *sr,time_t icmp_query_timeout, time_t tcp_e
   nat->icmp_query_timeout = icmp_query_timeout;
   nat->tcp_estab_timeout = tcp_estab_timeout;
   nat->tcp_trans_timeout = tcp_trans_timeout;
+  nat->udp_timeout = udp_timeout;
+
+  // the pool, forward and checkpoint settings are filled in by the caller.
+  // without interfaces yet (VNS), the hardware info adds the default pool
+  if ((sr->if_list != NULL) && (sr_nat_pool_default(sr) != 0))
+    fprintf(stderr,"No external interface for the NAT address pool\n");
+  // forwards go first so that restored mappings cannot take their ports
+  if (nat->forwards_path != NULL) {
+    int nfwd = sr_nat_forward_load(sr,nat->forwards_path);
+    if (nfwd < 0)
+      fprintf(stderr,"Error loading NAT port forwards %s, starting without\n",nat->forwards_path);
+    else
+      fprintf(stderr,"Loaded %d NAT port forwards from %s\n",nfwd,nat->forwards_path);
+  }
+  if (nat->ckpt_path != NULL) {
+    long restored = sr_nat_ckpt_load(sr,nat->ckpt_path);
+    if (restored < 0)
+      fprintf(stderr,"Error loading NAT checkpoint %s, starting empty\n",nat->ckpt_path);
+    else if (restored > 0)
+      fprintf(stderr,"Restored %ld NAT mappings from %s\n",restored,nat->ckpt_path);
+  }
 
+  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, sr);
   return success;
 }
 
 
-int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
-
+/*---------------------------------------------------------------------
+ * Method: sr_nat_clear
+ *
+ * Scope:  Global
+ *
+ * Frees every mapping with its connections, every pending SYN and the
+ * lookup indexes, and releases all port blocks, leaving an empty NAT
+ * that can be used again. The address pool is kept.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_clear(struct sr_nat *nat)
+{
   pthread_mutex_lock(&(nat->lock));
 
-  /* free nat memory here */
-  //free mapping linked list
-  sr_nat_mapping_t *prevmap = 0;
-  for(sr_nat_mapping_t *curmap = nat->mappings; curmap != 0; curmap = curmap->next) {
-    //free connection linked list
-    sr_nat_connection_t *prevconn = 0;
-    for (sr_nat_connection_t *curconn = curmap->conns; curconn != 0; curconn = curconn->next) {
-      if (prevconn != 0) free(prevconn);
-      prevconn = curconn;
+  if (nat->sync != NULL)
+    nat->sync->cursor = NULL;
+  while (nat->mappings != NULL) {
+    sr_nat_mapping_t *map = nat->mappings;
+    nat->mappings = map->next;
+    while (map->conns != NULL) {
+      sr_nat_connection_t *conn = map->conns;
+      map->conns = conn->next;
+      free(conn);
+      sr_stats_gauge(gauge_nat_tcp_conns, -1);
     }
-    if (prevconn != 0) free(prevconn);
-    if (prevmap != 0) free(prevmap);
-    prevmap = curmap;
-  } 
-  if (prevmap != 0) free(prevmap);
+    sr_stats_gauge(mapping_gauge(map->type), -1);
+    free(map);
+  }
 
-  //free pending syns linked lists
+  sr_stats_gauge(gauge_nat_pending_syns, -(int64_t) nat->npending_syns);
+  free(nat->syn_slots);
+  free(nat->syn_index);
+  nat->syn_slots = NULL;
+  nat->syn_free = NULL;
+  nat->syn_index = NULL;
+  nat->syn_index_size = 0;
+  nat->pending_syns = NULL;
+  nat->pending_syns_tail = NULL;
+  nat->npending_syns = 0;
 
-  sr_nat_pending_syn_t *prevsyn = 0;
-  for (sr_nat_pending_syn_t *cursyn = nat->pending_syns; cursyn != 0; cursyn = cursyn->next) {
-    if (prevsyn != 0) {
-      free(prevsyn->iphdr);
-      prevsyn = cursyn;
-    }
-  }
-  if (prevsyn != 0) free(prevsyn);
+  free(nat->int_index);
+  free(nat->ext_index);
+  nat->int_index = NULL;
+  nat->ext_index = NULL;
+  nat->index_size = 0;
+  nat->index_count = 0;
+
+  sr_nat_pool_clear(&nat->pool);
+  sr_nat_forward_install(nat);
+  sr_nat_sync_resync(nat);
 
-  pthread_kill(nat->thread, SIGKILL);
+  pthread_mutex_unlock(&(nat->lock));
+}
+
+int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
+
+  //the timeout thread can only be cancelled while it sleeps
+  pthread_cancel(nat->thread);
+  pthread_join(nat->thread, NULL);
+
+  pthread_mutex_lock(&(nat->lock));
+
+  /* free nat memory here */
+  sr_nat_forward_clear(nat);
+  sr_nat_clear(nat);
+  sr_nat_pool_destroy(&nat->pool);
+
+  pthread_mutex_unlock(&(nat->lock));
   return pthread_mutex_destroy(&(nat->lock)) &&
     pthread_mutexattr_destroy(&(nat->attr));
 
@@ -112,14 +295,15 @@ bool received_internal(struct sr_nat *nat, sr_if_t *recv_iface) {
  * Scope:  Local
  *
  * returns true if the destination IP address of a packet's  is that
- * of the NAT itself (its external facing IP address)
+ * of the NAT itself (its external facing IP address or one of its pool
+ * addresses)
  *   
  *  parameters:
  *    sr         - a reference to the router structure
  *    ip_dst     - the ip_dst of the received packet.
  *
  *---------------------------------------------------------------------*/
-bool destined_to_nat_external(struct sr_instance* sr, uint32_t ip_dst) {
+static bool external_iface_address(struct sr_instance* sr, uint32_t ip_dst) {
   
   sr_if_t *int_iface = sr_get_interface(sr,sr->nat.int_iface_name);
   for (sr_if_t *iface = sr->if_list; iface != NULL; iface = iface->next) {
@@ -131,6 +315,10 @@ bool destined_to_nat_external(struct sr_instance* sr, uint32_t ip_dst) {
   return false;
 }
 
+bool destined_to_nat_external(struct sr_instance* sr, uint32_t ip_dst) {
+  return external_iface_address(sr,ip_dst) || (sr_nat_pool_find(&sr->nat.pool,ip_dst) != NULL);
+}
+
 
 sr_if_t *get_external_iface(struct sr_instance *sr) 
 {
@@ -163,40 +351,95 @@ void nat_timeout_mappings(struct sr_instance *sr, time_t curtime)
   struct sr_nat *nat = &sr->nat;
 
   
-  for (sr_nat_mapping_t *prevmap = NULL, *curmap = nat->mappings; curmap != NULL; ) {
+  for (sr_nat_mapping_t *curmap = nat->mappings, *nextmap; curmap != NULL; curmap = nextmap) {
+    nextmap = curmap->next;
+    if (curmap->is_static) {
+      //port forwards stay, only their TCP connections expire
+      if (curmap->type == nat_mapping_tcp)
+        nat_timeout_tcp(nat,curmap,curtime);
+      continue;
+    }
     if (((curmap->type == nat_mapping_icmp) && (nat_timeout_icmp(nat,curmap,curtime))) ||
-        ((curmap->type == nat_mapping_tcp)  && (nat_timeout_tcp(nat,curmap,curtime)))) {
+        ((curmap->type == nat_mapping_tcp)  && (nat_timeout_tcp(nat,curmap,curtime))) ||
+        ((curmap->type == nat_mapping_udp)  && (nat_timeout_udp(nat,curmap,curtime)))) {
 
         //remove mapping
-        DebugNATTimeout("+++&& removing mapping from aux [%d] to ip [",ntohs(curmap->aux_ext));
-        DebugNATTimeoutAddrIP(ntohl(curmap->ip_int));
-        DebugNATTimeout("] and aux [%d] &&+++\n",ntohs(curmap->aux_int));
-          
-        if (prevmap != NULL)
-          prevmap->next = curmap->next;
-        else
-          nat->mappings = curmap->next;
-        
-        sr_nat_mapping_t *oldcur = curmap;
-        curmap = curmap->next;
-        free(oldcur);
-        continue;
+        sr_trace(trace_nat_timeout,"removing mapping from aux [%u] to ip [%I] and aux [%u]",
+                 ntohs(curmap->aux_ext),curmap->ip_int,ntohs(curmap->aux_int));
+        sr_nat_remove_mapping(nat,curmap);
     }
-    prevmap = curmap;
-    curmap = curmap->next;
   }
 
 }
 
+/*---------------------------------------------------------------------
+ * Unsolicited SYNs
+ *
+ * An inbound SYN to an unmapped port is held for UNSOLICITED_SYN_TIMEOUT
+ * seconds; if no mapping for the port turns up meanwhile, its sender
+ * gets an ICMP port unreachable. Only the bytes the ICMP error quotes
+ * are kept, in one of 'max_pending_syns' slots allocated together on
+ * first use.
+ * Every entry lives equally long, so the arrival list doubles as the
+ * timer queue: expiry pops its head, and so does eviction when all
+ * slots are taken. A hash on the external address and port finds the
+ * entries for a port without walking the list.
+ *
+ *---------------------------------------------------------------------*/
+static inline unsigned int syn_bucket(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext)
+{
+  return sr_nat_hash(((uint64_t) aux_ext << 32) ^ ip_ext) & (nat->syn_index_size - 1);
+}
+
+static bool syn_slots_alloc(struct sr_nat *nat)
+{
+  if (nat->max_pending_syns == 0)
+    nat->max_pending_syns = DEFAULT_MAX_PENDING_SYNS;
+
+  unsigned int size = 1;
+  while (size < nat->max_pending_syns)
+    size *= 2;
+  nat->syn_slots = calloc(nat->max_pending_syns, sizeof(sr_nat_pending_syn_t));
+  nat->syn_index = calloc(size, sizeof(sr_nat_pending_syn_t *));
+  if (nat->syn_slots == NULL || nat->syn_index == NULL) {
+    free(nat->syn_slots);
+    free(nat->syn_index);
+    nat->syn_slots = NULL;
+    nat->syn_index = NULL;
+    return false;
+  }
+  nat->syn_index_size = size;
+  for (unsigned int i = 0; i < nat->max_pending_syns; i++) {
+    nat->syn_slots[i].next = nat->syn_free;
+    nat->syn_free = &nat->syn_slots[i];
+  }
+  return true;
+}
+
+/* Take the oldest entry off the arrival list and out of the index. */
+static sr_nat_pending_syn_t *syn_pop_oldest(struct sr_nat *nat)
+{
+  sr_nat_pending_syn_t *syn = nat->pending_syns;
+  nat->pending_syns = syn->next;
+  if (nat->pending_syns == NULL)
+    nat->pending_syns_tail = NULL;
+
+  sr_nat_pending_syn_t **pp = &nat->syn_index[syn_bucket(nat,syn->ip_ext,syn->aux_ext)];
+  while (*pp != syn)
+    pp = &(*pp)->hash_next;
+  *pp = syn->hash_next;
+  return syn;
+}
+
 /*---------------------------------------------------------------------
  * Method: nat_timeout_pending_syns
  *
  * Scope:  Local
  *
  * This function is a helper function for the connection garbage collector
- * thread. It cycles through the list of unsolicited syns received, and
- * generates an ICMP host unreachable message if enough time has elapsed
- * since each packet was received.
+ * thread. It takes the unsolicited syns that have waited long enough off
+ * the front of the arrival list, and generates an ICMP port unreachable
+ * message for those whose port is still unmapped.
  *
  *  parameters:
  *    sr       - a reference to the router structure
@@ -206,61 +449,82 @@ void nat_timeout_mappings(struct sr_instance *sr, time_t curtime)
 void nat_timeout_pending_syns(struct sr_instance *sr, time_t curtime)
 {
   struct sr_nat *nat = &sr->nat;
-  for (sr_nat_pending_syn_t *prevsyn = NULL, *cursyn = nat->pending_syns; cursyn != NULL;) {
-    
-    if (difftime(curtime, cursyn->time_received) > UNSOLICITED_SYN_TIMEOUT) {
-      //time is up. remove from list and potentially generate responts
-      DebugNATTimeout("+++&& Unsolicited SYN to port: [%d] timed out &&+++\n",ntohs(cursyn->aux_ext));
-      if (sr_nat_lookup_external(nat,cursyn->aux_ext,nat_mapping_tcp) == NULL) {
-        //mapping does not exist. send ICMP port unreachable
-        DebugNATTimeout("+++&& Generating ICMP port unreachable message &&+++\n");
-        sr_if_t *iface = get_external_iface(sr);
-        send_ICMP_port_unreachable(sr,cursyn->iphdr,iface);
-      }
-
-      //free stored ip packet
-      free(cursyn->iphdr);
-
-      //remove entry from list
-      if (prevsyn != NULL)
-        prevsyn->next = cursyn->next;
-      else
-        nat->pending_syns = cursyn->next;
-
-      sr_nat_pending_syn_t *oldcur = cursyn;
-      cursyn = cursyn->next;
-      free(oldcur);
-      continue;
-      
+  while ((nat->pending_syns != NULL) &&
+         (difftime(curtime, nat->pending_syns->time_received) > UNSOLICITED_SYN_TIMEOUT)) {
+    //time is up. remove from list and potentially generate responts
+    sr_nat_pending_syn_t *syn = syn_pop_oldest(nat);
+    sr_trace(trace_nat_timeout,"unsolicited SYN to port [%u] timed out",ntohs(syn->aux_ext));
+    if (sr_nat_lookup_external(nat,syn->ip_ext,syn->aux_ext,nat_mapping_tcp) == NULL) {
+      //mapping does not exist. send ICMP port unreachable
+      sr_trace(trace_nat_timeout,"generating ICMP port unreachable message");
+      sr_if_t *iface = get_external_iface(sr);
+      send_ICMP_port_unreachable(sr,(sr_ip_hdr_t *) syn->data,iface);
     }
-    prevsyn = cursyn;
-    cursyn = cursyn->next;
+
+    syn->next = nat->syn_free;
+    nat->syn_free = syn;
+    nat->npending_syns--;
+    sr_stats_gauge(gauge_nat_pending_syns, -1);
   }
 
 }
 
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sweep
+ *
+ * Scope:  Global
+ *
+ * Expires idle mappings and unanswered SYNs as of time 'now'. Called
+ * once a second by the timeout thread; tests call it directly with a
+ * virtual time.
+ *
+ *  parameters:
+ *    sr       - a reference to the router structure
+ *    now      - the current time, from sr_clock_now()
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_sweep(struct sr_instance *sr, time_t now)
+{
+  struct sr_nat *nat = &sr->nat;
+  pthread_mutex_lock(&(nat->lock));
+  nat_timeout_mappings(sr,now);
+  nat_timeout_pending_syns(sr,now);
+  sr_nat_lb_sweep(nat,now);
+  pthread_mutex_unlock(&(nat->lock));
+  //port unreachables for the expired SYNs
+  sr_icmp_flush(sr,SR_ICMP_QUEUE);
+}
+
 void *sr_nat_timeout(void *sr_ptr) {  /* Periodic Timout handling */
   struct sr_instance *sr = (struct sr_instance *)sr_ptr;
-  struct sr_nat *nat = &sr->nat;
+  unsigned int since_ckpt = 0;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
   while (1) {
-    sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
-    time_t curtime = current_time();
-    nat_timeout_mappings(sr,curtime);
-    nat_timeout_pending_syns(sr,curtime);
-    
-    pthread_mutex_unlock(&(nat->lock));
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    sr_clock_sleep(1);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    //a standby leaves expiry to the instance it follows
+    if (!sr_nat_sync_following(&sr->nat))
+      sr_nat_sweep(sr,sr_clock_now());
+    if (sr->nat.ckpt_path != NULL && ++since_ckpt >= sr->nat.ckpt_interval) {
+      since_ckpt = 0;
+      if (sr_nat_ckpt_write(sr,sr->nat.ckpt_path) != 0)
+        sr_trace(trace_nat_timeout,"could not write NAT checkpoint");
+    }
   }
   return NULL;
 }
 
-/* Get the mapping associated with given external port.
+/* Get the mapping associated with given external address and port.
    You must free the returned structure if it is not NULL. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type ) {
 
-  for (sr_nat_mapping_t *curmap = nat->mappings; curmap != 0; curmap = curmap->next) {
-    if ((curmap->type == type) && (curmap->aux_ext == aux_ext)) {
+  if (nat->index_size == 0)
+    return NULL;
+  for (sr_nat_mapping_t *curmap = nat->ext_index[nat_ext_bucket(nat,type,ip_ext,aux_ext)];
+       curmap != 0; curmap = curmap->ext_next) {
+    if ((curmap->type == type) && (curmap->aux_ext == aux_ext) && (curmap->ip_ext == ip_ext)) {
       return curmap;
     }
   }
@@ -275,7 +539,10 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
 
   //pthread_mutex_lock(&(nat->lock));
 
-  for (sr_nat_mapping_t *curmap = nat->mappings; curmap != 0; curmap = curmap->next) {
+  if (nat->index_size == 0)
+    return NULL;
+  for (sr_nat_mapping_t *curmap = nat->int_index[nat_int_bucket(nat,type,ip_int,aux_int)];
+       curmap != 0; curmap = curmap->int_next) {
     if ((curmap->type == type) && (curmap->ip_int == ip_int) && (curmap->aux_int == aux_int)) {
       return curmap;
     }
@@ -284,27 +551,6 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
 
 }
 
-/*---------------------------------------------------------------------
- * Method: deterministic_unused_aux
- *
- * Scope:  Local
- *
- * This function generates an unused aux to be used by the NAT, in a 
- * deterministic manner: starting at 1024, and incrementing the assigned
- * port for each connection
- * not mapped to any other hose
- *
- *  parameters:
- *    nat       - a reference to the nat structure
- *    type       - the type of packet: TCP/ICMP supported
- *
- *---------------------------------------------------------------------*/
-uint16_t deterministic_unused_aux(struct sr_nat *nat, sr_nat_mapping_type type) 
-{
-  static uint16_t next_aux = MIN_AUX_VALUE;
-  return htons(next_aux++);
-}
-
 /*---------------------------------------------------------------------
  * Method: rand_unused_aux
  *
@@ -341,10 +587,11 @@ uint16_t deterministic_unused_aux(struct sr_nat *nat, sr_nat_mapping_type type)
  *
  * Scope:  Local
  *
- * This function inserts an IP packet containing an unsolicited SYN TCP
- * segment to the linked list of unsolicited SYN's pending a response.
- * the function performs a copy of the packet so the caller function
- * can free the memory 
+ * This function records an IP packet containing an unsolicited SYN TCP
+ * segment as pending a response. Only the start of the packet is
+ * copied, so the caller function can free the memory. A retransmitted
+ * SYN keeps the timer of the first one; when 'max_pending_syns' are
+ * already pending the oldest is dropped without a response.
  *
  *  parameters:
  *    nat           - a reference to the nat structure
@@ -356,19 +603,64 @@ uint16_t deterministic_unused_aux(struct sr_nat *nat, sr_nat_mapping_type type)
  *---------------------------------------------------------------------*/
  void sr_nat_insert_pending_syn(struct sr_nat *nat, uint16_t aux_ext, sr_ip_hdr_t *iphdr) 
 {
+  if ((nat->syn_slots == NULL) && !syn_slots_alloc(nat))
+    return;
+
+  unsigned int b = syn_bucket(nat,iphdr->ip_dst,aux_ext);
+  for (sr_nat_pending_syn_t *syn = nat->syn_index[b]; syn != NULL; syn = syn->hash_next) {
+    if ((syn->aux_ext == aux_ext) && (syn->ip_ext == iphdr->ip_dst) &&
+        (((sr_ip_hdr_t *) syn->data)->ip_src == iphdr->ip_src))
+      return;
+  }
+
+  sr_nat_pending_syn_t *psyn = nat->syn_free;
+  if (psyn != NULL) {
+    nat->syn_free = psyn->next;
+    nat->npending_syns++;
+    sr_stats_gauge(gauge_nat_pending_syns, 1);
+  } else {
+    psyn = syn_pop_oldest(nat);
+    sr_trace(trace_nat,"pending SYN to port [%u] evicted",ntohs(psyn->aux_ext));
+    sr_stats_drop(drop_nat_syn_evicted);
+  }
+
   unsigned int iplen = ntohs(iphdr->ip_len);
-  sr_nat_pending_syn_t *psyn = malloc(sizeof(sr_nat_pending_syn_t));
-  psyn->time_received = current_time();
+  unsigned int copy = (iplen < ICMP_DATA_SIZE) ? iplen : ICMP_DATA_SIZE;
+  memcpy(psyn->data,iphdr,copy);
+  memset(psyn->data + copy,0,ICMP_DATA_SIZE - copy);
+  psyn->time_received = sr_clock_now();
+  psyn->ip_ext = iphdr->ip_dst;
   psyn->aux_ext = aux_ext;
-  psyn->iphdr = malloc(iplen);
-  memcpy(psyn->iphdr,iphdr,iplen);
 
-  psyn->next = nat->pending_syns;
-  nat->pending_syns = psyn;
+  psyn->next = NULL;
+  if (nat->pending_syns_tail != NULL)
+    nat->pending_syns_tail->next = psyn;
+  else
+    nat->pending_syns = psyn;
+  nat->pending_syns_tail = psyn;
+
+  psyn->hash_next = nat->syn_index[b];
+  nat->syn_index[b] = psyn;
 }
 
-/* Insert a new mapping into the nat's mapping table.
-   returns a reference to the new mapping, for thread safety.
+/* Get the first pending SYN to the given external address and port, or
+   NULL if there is none. */
+sr_nat_pending_syn_t *sr_nat_lookup_pending_syn(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext)
+{
+  if (nat->syn_index == NULL)
+    return NULL;
+  for (sr_nat_pending_syn_t *syn = nat->syn_index[syn_bucket(nat,ip_ext,aux_ext)];
+       syn != NULL; syn = syn->hash_next) {
+    if ((syn->aux_ext == aux_ext) && (syn->ip_ext == ip_ext))
+      return syn;
+  }
+  return NULL;
+}
+
+/* Insert a new mapping into the nat's mapping table, with an external
+   port from the host's port blocks (see sr_nat_pool.c).
+   returns a reference to the new mapping, or NULL if no external port
+   is available for the host.
  */
 
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_instance *sr,
@@ -377,23 +669,153 @@ struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_instance *sr,
 
   /* handle insert here, create a mapping, and then return a copy of it */
   struct sr_nat *nat = &sr->nat;
-  sr_if_t *ext_iface = get_external_iface(sr);
+  uint16_t aux_ext;
+
+  sr_nat_block_t *block = sr_nat_pool_alloc(sr,ip_int,type,&aux_ext);
+  if (block == NULL) {
+    sr_trace(trace_nat,"no external port left for [%I]",ip_int);
+    sr_stats_drop(drop_nat_ports_exhausted);
+    return NULL;
+  }
 
   //create new mapping
   sr_nat_mapping_t *mapping = malloc(sizeof(sr_nat_mapping_t));
   mapping->type = type;
   mapping->ip_int = ip_int;
   mapping->aux_int = aux_int;
-  mapping->ip_ext = ext_iface->ip;
-  mapping->aux_ext = deterministic_unused_aux(nat,type);
-  mapping->last_updated = current_time();
+  mapping->ip_ext = block->host->addr->ip;
+  mapping->aux_ext = aux_ext;
+  mapping->block = block;
+  mapping->is_static = false;
+  mapping->vip = NULL;
+  mapping->last_updated = sr_clock_now();
+  mapping->conns = NULL;
+
+  sr_nat_link_mapping(nat,mapping);
+
+  return mapping;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_restore_mapping
+ *
+ * Scope:  Global
+ *
+ * Recreates a mapping saved or replicated by another instance, with the
+ * same external address and port (see sr_nat_ckpt.c and sr_nat_sync.c).
+ *
+ * returns:
+ *    the new mapping, without connections, or NULL if the address is not
+ *    in the pool, the port is taken or the internal endpoint is forwarded
+ *
+ *---------------------------------------------------------------------*/
+sr_nat_mapping_t *sr_nat_restore_mapping(struct sr_instance *sr, sr_nat_mapping_type type,
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, uint16_t aux_ext, time_t last_updated)
+{
+  sr_nat_mapping_t *fwd = sr_nat_lookup_internal(&sr->nat,ip_int,aux_int,type);
+  if ((fwd != NULL) && fwd->is_static) {
+    sr_trace(trace_nat,"cannot restore mapping [%I]:%u",ip_ext,ntohs(aux_ext));
+    return NULL;
+  }
+
+  sr_nat_block_t *block = sr_nat_pool_reserve(sr,ip_int,ip_ext,type,aux_ext);
+  if (block == NULL) {
+    sr_trace(trace_nat,"cannot restore mapping [%I]:%u",ip_ext,ntohs(aux_ext));
+    return NULL;
+  }
+
+  sr_nat_mapping_t *mapping = malloc(sizeof(sr_nat_mapping_t));
+  mapping->type = type;
+  mapping->ip_int = ip_int;
+  mapping->aux_int = aux_int;
+  mapping->ip_ext = ip_ext;
+  mapping->aux_ext = aux_ext;
+  mapping->block = block;
+  mapping->is_static = false;
+  mapping->vip = NULL;
+  mapping->last_updated = last_updated;
   mapping->conns = NULL;
 
-  //insert to linked list
+  sr_nat_link_mapping(&sr->nat,mapping);
+  return mapping;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_link_mapping
+ *
+ * Scope:  Global
+ *
+ * Puts a filled in mapping on the mapping list and in the lookup
+ * indexes. Its external port must already be taken from the pool.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_link_mapping(struct sr_nat *nat, sr_nat_mapping_t *mapping)
+{
   mapping->next = nat->mappings;
+  mapping->prev = NULL;
+  if (nat->mappings != NULL)
+    nat->mappings->prev = mapping;
   nat->mappings = mapping;
+  nat_index_insert(nat,mapping);
+  sr_stats_gauge(mapping_gauge(mapping->type), 1);
+  //the standby has the same port forwards configured
+  if (!mapping->is_static)
+    sr_nat_sync_mapping(nat,mapping,true);
+}
 
-  return mapping;
+/*---------------------------------------------------------------------
+ * Method: sr_nat_remove_mapping
+ *
+ * Scope:  Global
+ *
+ * Takes a mapping off the list and the lookup indexes, gives its port
+ * back to the pool and frees it together with its connections. A port
+ * forward's port stays reserved; see sr_nat_forward_load.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_remove_mapping(struct sr_nat *nat, sr_nat_mapping_t *mapping)
+{
+  if (!mapping->is_static)
+    sr_nat_sync_mapping(nat,mapping,false);
+  sr_nat_sync_unlink(nat,mapping);
+
+  if (mapping->prev != NULL)
+    mapping->prev->next = mapping->next;
+  else
+    nat->mappings = mapping->next;
+  if (mapping->next != NULL)
+    mapping->next->prev = mapping->prev;
+
+  nat_index_remove(nat,mapping);
+  if (mapping->block != NULL)
+    sr_nat_pool_release(&nat->pool,mapping->block,mapping->type,mapping->aux_ext);
+  sr_stats_gauge(mapping_gauge(mapping->type), -1);
+
+  while (mapping->conns != NULL) {
+    sr_nat_connection_t *conn = mapping->conns;
+    mapping->conns = conn->next;
+    free(conn);
+    sr_stats_gauge(gauge_nat_tcp_conns, -1);
+  }
+  free(mapping);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_reserve
+ *
+ * Scope:  Global
+ *
+ * Sizes the lookup indexes for 'count' mappings up front, so that bulk
+ * inserts do not rehash along the way.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_reserve(struct sr_nat *nat, unsigned int count)
+{
+  unsigned int size = nat->index_size ? nat->index_size : NAT_INDEX_MIN_SIZE;
+  while (size < count)
+    size *= 2;
+  if (size != nat->index_size)
+    nat_index_resize(nat,size);
 }
 
 /*---------------------------------------------------------------------
@@ -414,29 +836,29 @@ struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_instance *sr,
  *---------------------------------------------------------------------*/
 nat_action_type do_nat_internal(struct sr_instance *sr, sr_ip_hdr_t *iphdr, sr_if_t *iface) 
 { 
-  DebugNAT("+++ Applying internal NAT interface logic +++\n");
+  sr_trace(trace_nat,"applying internal NAT interface logic");
   if (destined_to_nat_external(sr,iphdr->ip_dst)) {
     //hairpinning not supported
-    DebugNAT("+++ Potential hairpinning detected. assuming NAT is final destination. +++\n");
+    sr_trace(trace_nat,"potential hairpinning detected. assuming NAT is final destination");
     return nat_action_route;
   }
 
 
-  sr_rt_t *best_match = NULL;
-  if (!longest_prefix_match(sr->routing_table, iphdr->ip_dst,&best_match)) {
-    DebugNAT("+++ No entry in routing table. no action required +++\n");
+  sr_rt_t route;
+  if (!sr_fib_route(sr, iphdr->ip_dst, &route)) {
+    sr_trace(trace_nat,"no entry in routing table. no action required");
     return nat_action_route;  //no match in routing table. need to generate ICMP host unreachable
                               //no action required on behalf of the NAT. no objection by the nat
                               //to routing the packet. let router figure out his response
   }
   
-  if  (strcmp(best_match->interface,iface->name)==0) {
-    DebugNAT("+++ Routing back on same interface: internal->internal. no action required +++\n");
+  if  (strcmp(route.interface,iface->name)==0) {
+    sr_trace(trace_nat,"routing back on same interface: internal->internal. no action required");
     return nat_action_route;  //routing back on same interface: internal->internal.
                               //no action required on behalf of the NAT
   }
 
-  DebugNAT("+++ Outbound packet crossing NAT. handling... +++\n");
+  sr_trace(trace_nat,"outbound packet crossing NAT");
   //packet crossing the NAT outbound
   if (iphdr->ip_p == ip_protocol_icmp) //ICMP
     return handle_outgoing_icmp(sr,iphdr);
@@ -444,7 +866,11 @@ nat_action_type do_nat_internal(struct sr_instance *sr, sr_ip_hdr_t *iphdr, sr_i
   if (iphdr->ip_p == ip_protocol_tcp) //TCP
      return handle_outgoing_tcp(sr,iphdr);
 
-  return nat_action_drop; //drop packet if not TCP/ICMP
+  if (iphdr->ip_p == ip_protocol_udp) //UDP
+     return handle_outgoing_udp(sr,iphdr);
+
+  sr_stats_drop(drop_nat_unsupported_proto);
+  return nat_action_drop; //drop packet if not TCP/ICMP/UDP
        
 }
 
@@ -467,35 +893,50 @@ nat_action_type do_nat_internal(struct sr_instance *sr, sr_ip_hdr_t *iphdr, sr_i
  *---------------------------------------------------------------------*/
 nat_action_type do_nat_external(struct sr_instance *sr, sr_ip_hdr_t *iphdr, sr_if_t *iface) 
 {
-  DebugNAT("+++ Applying external NAT interface logic +++\n");
+  sr_trace(trace_nat,"applying external NAT interface logic");
   if (destined_to_nat_external(sr,iphdr->ip_dst)) {
-    DebugNAT("+++ Inbound packet destined to NAT. handling... +++\n");
+    sr_trace(trace_nat,"inbound packet destined to NAT");
     //destined to nat and/or private network behind it
+    uint32_t ip_dst = iphdr->ip_dst;
+    nat_action_type action;
     if (iphdr->ip_p == ip_protocol_icmp) //ICMP
-      return handle_incoming_icmp(&sr->nat,iphdr);
-    
-    if (iphdr->ip_p == ip_protocol_tcp) //TCP
-      return handle_incoming_tcp(&sr->nat,iphdr);
-    
-    return nat_action_drop; //drop packet if not TCP/ICMP
+      action = handle_incoming_icmp(&sr->nat,iphdr);
+    else if (iphdr->ip_p == ip_protocol_tcp) //TCP
+      action = handle_incoming_tcp(&sr->nat,iphdr);
+    else if (iphdr->ip_p == ip_protocol_udp) //UDP
+      action = handle_incoming_udp(&sr->nat,iphdr);
+    else {
+      sr_stats_drop(drop_nat_unsupported_proto);
+      return nat_action_drop; //drop packet if not TCP/ICMP/UDP
+    }
+
+    //untranslated packets are for the router, which only owns its
+    //interface addresses, not the rest of the pool
+    if ((action == nat_action_route) && (iphdr->ip_dst == ip_dst) &&
+        !external_iface_address(sr,ip_dst)) {
+      sr_trace(trace_nat,"no mapping on pool address [%I]",ip_dst);
+      sr_stats_drop(drop_nat_unmapped);
+      return nat_action_drop;
+    }
+    return action;
   } 
 
 
-  sr_rt_t *best_match = NULL;
-  if (!longest_prefix_match(sr->routing_table, iphdr->ip_dst,&best_match)) {
-    DebugNAT("+++ No entry in routing table. no action required +++\n\n");
+  sr_rt_t route;
+  if (!sr_fib_route(sr, iphdr->ip_dst, &route)) {
+    sr_trace(trace_nat,"no entry in routing table. no action required");
     return nat_action_route;  //no match in routing table. need to generate ICMP host unreachable
                               //no action required on behalf of the NAT
                               //return route. let router figure out what he needs to do.
   }
 
-  if  (strcmp(best_match->interface,iface->name)==0) {
-    DebugNAT("+++ Routing back on same interface: external->external. no action required +++\n");
+  if  (strcmp(route.interface,iface->name)==0) {
+    sr_trace(trace_nat,"routing back on same interface: external->external. no action required");
     return nat_action_route;  //routing back on same interface: external->external.
                   //no action required on behalf of the NAT
   }
 
-  DebugNAT("+++ Packet destined directly to internal interface. refuse request +++\n");
+  sr_trace(trace_nat,"packet destined directly to internal interface. refuse request");
   return nat_action_unrch; //ICMP host unreachable should be sent to packets trying to
                             //access hosts behind the NAT directly
 }
@@ -523,6 +964,16 @@ nat_action_type do_nat_external(struct sr_instance *sr, sr_ip_hdr_t *iphdr, sr_i
  *    iface       - the interface through which the packet was received  
  *
  *---------------------------------------------------------------------*/
+static const char *nat_action_name(nat_action_type action)
+{
+  switch(action) {
+    case nat_action_route:  return "ROUTE";
+    case nat_action_drop:   return "DROP";
+    case nat_action_unrch:  return "UNREACHABLE";
+  }
+  return "?";
+}
+
 nat_action_type do_nat(struct sr_instance *sr, sr_ip_hdr_t* iphdr, sr_if_t *iface) {
 
 
@@ -530,10 +981,8 @@ nat_action_type do_nat(struct sr_instance *sr, sr_ip_hdr_t* iphdr, sr_if_t *ifac
     return true;
   }
 
-  DebugNAT("+++++++ Processin NAT Logic +++++++\n");
-
-  DebugNAT("+++ Original packet:\n");
-  DebugNATPacket(iphdr);
+  sr_trace(trace_nat,"original packet [%I] -> [%I] proto [%u] len [%u] on [%s]",
+           iphdr->ip_src,iphdr->ip_dst,iphdr->ip_p,ntohs(iphdr->ip_len),(uintptr_t)iface->name);
 
   struct sr_nat *nat = &(sr->nat);
   pthread_mutex_lock(&(nat->lock));
@@ -552,14 +1001,11 @@ nat_action_type do_nat(struct sr_instance *sr, sr_ip_hdr_t* iphdr, sr_if_t *ifac
   iphdr->ip_sum = 0;
   iphdr->ip_sum = cksum(iphdr,iplen);
 
-  DebugNAT("+++ Translated packet to:\n");
-  DebugNATPacket(iphdr);
+  sr_trace(trace_nat,"translated packet [%I] -> [%I]",iphdr->ip_src,iphdr->ip_dst);
 
   pthread_mutex_unlock(&(nat->lock));
 
-  DebugNAT("+++++++ NAT action required: ");
-  DebugNATAction(natact);
-  DebugNAT(" +++++++\n");
+  sr_trace(trace_nat,"NAT action required: [%s]",(uintptr_t)nat_action_name(natact));
   return natact;
 
 }
@@ -8,49 +8,21 @@
 #include <stdbool.h>
 #include "sr_if.h"
 
-#ifdef _DEBUG_NAT_
-#define DebugNAT(x, args...) fprintf(stderr, x, ## args)
-#define DebugNATAddrIP(ipaddr) print_addr_ip_int(ipaddr)
-#define DebugNATPacket(pkt) print_ip_full((uint8_t *)pkt)
-#define DebugNATAction(action) do {\
-  switch(action) {\
-    case nat_action_route:\
-      fprintf(stderr," ROUTE");\
-      break;\
-    case nat_action_drop:\
-      fprintf(stderr,"DROP");\
-      break;\
-    case nat_action_unrch:\
-      fprintf(stderr,"UNREACHABLE");\
-      break;\
-  }\
-} while(0)
-#else
-#define DebugNAT(x, args...) 
-#define DebugNATAddrIP(ipaddr) 
-#define DebugNATPacket(pkt)  
-#define DebugNATAction(action) 
-#endif
-
-
-#ifdef _DEBUG_NAT_TIMEOUT_
-#define DebugNATTimeout(x, args...) fprintf(stderr, x, ## args)
-#define DebugNATTimeoutAddrIP(ipaddr) print_addr_ip_int(ipaddr)
-#define DebugNATTimeoutCondition(cond, msg, args...) if(cond) fprintf(stderr, msg, ##args)
-#else
-#define DebugNATTimeout(x, args...) 
-#define DebugNATTimeoutAddrIP(ipaddr) 
-#define DebugNATTimeoutCondition(cond, msg, args...) 
-#endif
-
 #define DEFAULT_TCP_ESTABLISHED_TIMEOUT (2*64*60)
 #define DEFAULT_TCP_TRANSITORY_TIMEOUT (4*60)
 #define DEFAULT_ICMP_TIMEOUT (60)
+#define DEFAULT_UDP_TIMEOUT (5*60)
 #define UNSOLICITED_SYN_TIMEOUT (6)
+#define DEFAULT_MAX_PENDING_SYNS (4096)
 
 #define MAX_AUX_VALUE 65355
 #define MIN_AUX_VALUE 1024    
 
+#define NAT_PORT_BLOCK_SIZE 256      /* external ports per block, multiple of 64 */
+#define NAT_MAX_BLOCKS_PER_HOST 8
+#define NAT_BLOCKS_PER_ADDR ((65536 - MIN_AUX_VALUE) / NAT_PORT_BLOCK_SIZE)
+#define NAT_MAPPING_TYPES 3
+
 
 typedef enum {
   nat_action_route,
@@ -60,8 +32,8 @@ typedef enum {
 
 typedef enum {
   nat_mapping_icmp,
-  nat_mapping_tcp
-  /* nat_mapping_udp, */
+  nat_mapping_tcp,
+  nat_mapping_udp
 } sr_nat_mapping_type;
 
 typedef enum {
@@ -81,11 +53,12 @@ typedef enum {
 
 
 struct sr_nat_pending_syn {
-  /* add TCP connection state data members here */
   time_t time_received;
+  uint8_t data[ICMP_DATA_SIZE]; /* IP header plus 8 bytes, for the ICMP error */
+  uint32_t ip_ext;
   uint16_t aux_ext;
-  sr_ip_hdr_t *iphdr;
-  struct sr_nat_pending_syn *next;
+  struct sr_nat_pending_syn *next;      /* arrival order, or the free list */
+  struct sr_nat_pending_syn *hash_next; /* chain in the port index */
 };
 typedef struct sr_nat_pending_syn sr_nat_pending_syn_t;
 
@@ -107,17 +80,82 @@ struct sr_nat_mapping {
   uint32_t ip_ext; /* external ip addr */
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
-  time_t last_updated; /* use to timeout mappings. used only for ICMP. TCP mappings timed out by connection*/
-  struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+  time_t last_updated; /* use to timeout mappings. used for ICMP and UDP. TCP mappings timed out by connection*/
+  struct sr_nat_connection *conns; /* list of connections. null for ICMP and UDP */
   struct sr_nat_mapping *next;
+  struct sr_nat_mapping *prev;
+  struct sr_nat_mapping *int_next; /* chain in the internal index */
+  struct sr_nat_mapping *ext_next; /* chain in the external index */
+  struct sr_nat_block *block; /* port block aux_ext was allocated from, NULL if static */
+  bool is_static; /* a configured port forward, see sr_nat_forward.c. never expires */
+  struct sr_nat_vip *vip; /* the virtual service of a backend's forward, see sr_nat_lb.c */
 };
 typedef struct sr_nat_mapping sr_nat_mapping_t;
 
+/* A run of NAT_PORT_BLOCK_SIZE external ports on one pool address, owned
+   by a single internal host. Each mapping type has its own port space. */
+struct sr_nat_block {
+  struct sr_nat_host *host;
+  struct sr_nat_block *next;   /* the host's other blocks */
+  uint16_t first;              /* first port, host byte order */
+  uint16_t used;               /* mappings allocated from the block */
+  uint64_t ports[NAT_MAPPING_TYPES][NAT_PORT_BLOCK_SIZE / 64];
+};
+typedef struct sr_nat_block sr_nat_block_t;
+
+/* An internal host holding port blocks. All of them are on one address. */
+struct sr_nat_host {
+  uint32_t ip_int;
+  struct sr_nat_addr *addr;    /* paired external address */
+  struct sr_nat_block *blocks;
+  unsigned int nblocks;
+  struct sr_nat_host *next;    /* hash chain */
+};
+typedef struct sr_nat_host sr_nat_host_t;
+
+struct sr_nat_addr {
+  uint32_t ip;                   /* network byte order */
+  char iface[sr_IFACE_NAMELEN];  /* answers ARP for it. empty: the external interface */
+  unsigned int nblocks;          /* blocks handed out */
+  uint64_t blocks[(NAT_BLOCKS_PER_ADDR + 63) / 64];
+  uint64_t *statics;             /* ports of port forwards, per type, or NULL */
+};
+typedef struct sr_nat_addr sr_nat_addr_t;
+
+/* External address pool, see sr_nat_pool.c */
+struct sr_nat_pool {
+  sr_nat_addr_t *addrs;        /* sorted by address */
+  unsigned int naddrs;
+  unsigned int cursor;         /* next address to pair a new host with */
+  sr_nat_host_t **hosts;       /* hash on ip_int */
+  unsigned int host_index_size;
+  unsigned int nhosts;
+};
+typedef struct sr_nat_pool sr_nat_pool_t;
+
 typedef struct sr_nat {
   /* add any fields here */
   struct sr_nat_mapping *mappings;
   char *int_iface_name;
-  sr_nat_pending_syn_t *pending_syns;
+
+  /* hash indexes over 'mappings': (type, ip_int, aux_int) and
+     (type, ip_ext, aux_ext). allocated on first insert, see sr_nat.c */
+  struct sr_nat_mapping **int_index;
+  struct sr_nat_mapping **ext_index;
+  unsigned int index_size;   /* buckets per index, power of two */
+  unsigned int index_count;  /* mappings indexed */
+  sr_nat_pool_t pool;
+
+  /* unsolicited SYNs, at most 'max_pending_syns', in fixed slots
+     allocated on first use. see sr_nat.c */
+  sr_nat_pending_syn_t *pending_syns;       /* oldest first */
+  sr_nat_pending_syn_t *pending_syns_tail;
+  sr_nat_pending_syn_t *syn_slots;
+  sr_nat_pending_syn_t *syn_free;
+  sr_nat_pending_syn_t **syn_index;         /* keyed on external address and port */
+  unsigned int syn_index_size;              /* power of two */
+  unsigned int npending_syns;
+  unsigned int max_pending_syns;
 
   /* threading */
   pthread_mutex_t lock;
@@ -129,18 +167,37 @@ typedef struct sr_nat {
   time_t icmp_query_timeout;
   time_t tcp_estab_timeout;
   time_t tcp_trans_timeout;
+  time_t udp_timeout;
+
+  /* checkpoint file, written every 'ckpt_interval' seconds and loaded by
+     sr_nat_init, see sr_nat_ckpt.c. no checkpoints when NULL */
+  const char *ckpt_path;
+  unsigned int ckpt_interval;
+
+  /* replication to or from a standby, see sr_nat_sync.c. NULL when off */
+  struct sr_nat_sync *sync;
+
+  /* static port forwards, reloaded from 'forwards_path'. their mappings
+     are on 'mappings' too, see sr_nat_forward.c */
+  struct sr_nat_forward *forwards;
+  unsigned int nforwards;
+  const char *forwards_path;
+  struct sr_nat_vip *vips;     /* forwards to more than one backend */
 } sr_nat_t;
 
 
 int   sr_nat_init(struct sr_instance *sr,time_t icmp_query_timeout, time_t tcp_estab_timeout, 
-                  time_t tcp_trans_timeout,char *int_iface_name);     /* Initializes the nat */
+                  time_t tcp_trans_timeout,time_t udp_timeout,char *int_iface_name);     /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
+void  sr_nat_clear(struct sr_nat *nat);    /* Frees every mapping, connection and pending SYN */
 void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
+void  sr_nat_sweep(struct sr_instance *sr, time_t now);  /* One timeout pass */
 
 
 nat_action_type do_nat(struct sr_instance *sr, sr_ip_hdr_t* iphdr, sr_if_t *iface);
 
 void sr_nat_insert_pending_syn(struct sr_nat *nat, uint16_t aux_ext, sr_ip_hdr_t *iphdr);
+sr_nat_pending_syn_t *sr_nat_lookup_pending_syn(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext);
 
 void send_ICMP_port_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr,sr_if_t *iface);
 
@@ -148,12 +205,32 @@ struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_instance *sr,
   uint32_t ip_int, uint16_t aux_int, uint32_t ip_dest, uint16_t aux_dest,
   sr_nat_mapping_type type );
 
+struct sr_nat_mapping *sr_nat_restore_mapping(struct sr_instance *sr, sr_nat_mapping_type type,
+  uint32_t ip_int, uint16_t aux_int, uint32_t ip_ext, uint16_t aux_ext, time_t last_updated);
+
+void sr_nat_link_mapping(struct sr_nat *nat, struct sr_nat_mapping *mapping);
+
+void sr_nat_remove_mapping(struct sr_nat *nat, struct sr_nat_mapping *mapping);
+
+void sr_nat_reserve(struct sr_nat *nat, unsigned int count);
+
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type );
 
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type);
 
+sr_if_t *get_external_iface(struct sr_instance *sr);
+bool destined_to_nat_external(struct sr_instance* sr, uint32_t ip_dst);
+
+/* 64 bit mix for the NAT's hash tables */
+static inline unsigned int sr_nat_hash(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  return (unsigned int) key;
+}
 
 
 #endif
\ No newline at end of file
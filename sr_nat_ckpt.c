@@ -0,0 +1,331 @@
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sr_nat.h"
+#include "sr_nat_ckpt.h"
+#include "sr_nat_lb.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+
+/*
+ * NAT checkpoints.
+ *
+ * The table is serialized into one buffer while the NAT lock is held,
+ * then written to '<path>.tmp' and renamed over 'path' with the lock
+ * released, so a crash mid-write leaves the previous checkpoint intact.
+ * Writers (the periodic one in the timeout thread and the final one on
+ * SIGTERM) take turns on their own lock, since they share the temporary
+ * file; once the final one is done the periodic one no longer writes.
+ * Loading maps the file and walks it once; every mapping takes back its
+ * exact external port from the address pool, and mappings whose address
+ * is no longer in the pool, or whose port is taken, are skipped. Port
+ * forwards are loaded from their configuration first; their records
+ * only bring back the connections, and the pins of a service. The
+ * time the router was down counts as idle time, so mappings that would
+ * have expired meanwhile go at the next sweep.
+ */
+
+static pthread_mutex_t ckpt_writer = PTHREAD_MUTEX_INITIALIZER;
+static bool ckpt_final;   /* the final checkpoint is written, guarded by ckpt_writer */
+
+static uint32_t ckpt_idle(time_t now, time_t last_updated)
+{
+  if (now <= last_updated)
+    return 0;
+  return (now - last_updated > UINT32_MAX) ? UINT32_MAX : (uint32_t) (now - last_updated);
+}
+
+static int ckpt_write_file(const char *path, const uint8_t *buf, size_t len)
+{
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+    return -1;
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    return -1;
+  for (size_t off = 0; off < len;) {
+    ssize_t n = write(fd, buf + off, len - off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      close(fd);
+      unlink(tmp);
+      return -1;
+    }
+    off += n;
+  }
+  if ((fsync(fd) != 0) | (close(fd) != 0) || (rename(tmp, path) != 0)) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+
+static int ckpt_write(struct sr_instance *sr, const char *path);
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_ckpt_write
+ *
+ * Scope:  Global
+ *
+ * Writes every mapping and TCP connection of the NAT to 'path'. The NAT
+ * lock is only held while the table is copied, not for the file I/O.
+ * Pending unsolicited SYNs are not saved; they are only held for a few
+ * seconds anyway.
+ *
+ * returns:
+ *    0 on success, -1 if the file could not be written
+ *
+ *---------------------------------------------------------------------*/
+int sr_nat_ckpt_write(struct sr_instance *sr, const char *path)
+{
+  pthread_mutex_lock(&ckpt_writer);
+  int ret = ckpt_final ? 0 : ckpt_write(sr, path);
+  pthread_mutex_unlock(&ckpt_writer);
+  return ret;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_ckpt_write_final
+ *
+ * Scope:  Global
+ *
+ * Writes the last checkpoint before the router exits, after any write in
+ * progress. sr_nat_ckpt_write does nothing from then on.
+ *
+ * returns:
+ *    0 on success, -1 if the file could not be written
+ *
+ *---------------------------------------------------------------------*/
+int sr_nat_ckpt_write_final(struct sr_instance *sr, const char *path)
+{
+  pthread_mutex_lock(&ckpt_writer);
+  ckpt_final = true;
+  int ret = ckpt_write(sr, path);
+  pthread_mutex_unlock(&ckpt_writer);
+  return ret;
+}
+
+
+static int ckpt_write(struct sr_instance *sr, const char *path)
+{
+  struct sr_nat *nat = &sr->nat;
+  struct sr_nat_ckpt_hdr hdr = { SR_NAT_CKPT_MAGIC, SR_NAT_CKPT_VERSION, time(NULL), 0, 0 };
+
+  pthread_mutex_lock(&(nat->lock));
+
+  time_t now = sr_clock_now();
+  for (sr_nat_mapping_t *map = nat->mappings; map != NULL; map = map->next) {
+    hdr.nmappings++;
+    for (sr_nat_connection_t *conn = map->conns; conn != NULL; conn = conn->next)
+      hdr.nconns++;
+  }
+
+  size_t len = sizeof(hdr) + hdr.nmappings * sizeof(struct sr_nat_ckpt_mapping) +
+               hdr.nconns * sizeof(struct sr_nat_ckpt_conn);
+  uint8_t *buf = malloc(len);
+  if (buf == NULL) {
+    pthread_mutex_unlock(&(nat->lock));
+    return -1;
+  }
+
+  uint8_t *p = buf;
+  memcpy(p, &hdr, sizeof(hdr));
+  p += sizeof(hdr);
+  for (sr_nat_mapping_t *map = nat->mappings; map != NULL; map = map->next) {
+    struct sr_nat_ckpt_mapping *rec = (struct sr_nat_ckpt_mapping *) p;
+    memset(rec, 0, sizeof(*rec));
+    rec->ip_int = map->ip_int;
+    rec->ip_ext = map->ip_ext;
+    rec->aux_int = map->aux_int;
+    rec->aux_ext = map->aux_ext;
+    rec->type = map->type;
+    rec->flags = map->is_static ? SR_NAT_CKPT_STATIC : 0;
+    rec->idle = ckpt_idle(now, map->last_updated);
+    p += sizeof(*rec);
+
+    for (sr_nat_connection_t *conn = map->conns; conn != NULL; conn = conn->next) {
+      struct sr_nat_ckpt_conn *crec = (struct sr_nat_ckpt_conn *) p;
+      memset(crec, 0, sizeof(*crec));
+      crec->dest_ip = conn->dest_ip;
+      crec->dest_port = conn->dest_port;
+      crec->state = conn->state;
+      crec->fin_sent_seqno = conn->fin_sent_seqno;
+      crec->fin_recv_seqno = conn->fin_recv_seqno;
+      crec->idle = ckpt_idle(now, conn->last_updated);
+      p += sizeof(*crec);
+      rec->nconns++;
+    }
+  }
+  assert(p == buf + len);
+
+  pthread_mutex_unlock(&(nat->lock));
+
+  int ret = ckpt_write_file(path, buf, len);
+  free(buf);
+  sr_trace(trace_nat_timeout,"checkpoint of [%u] mappings written: %d",hdr.nmappings,ret);
+  return ret;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: ckpt_valid
+ *
+ * Scope:  Local
+ *
+ * Checks that the records of a mapped checkpoint add up to its size and
+ * hold known types and states, before anything is restored from it.
+ *
+ *---------------------------------------------------------------------*/
+static bool ckpt_valid(const uint8_t *base, size_t size)
+{
+  const struct sr_nat_ckpt_hdr *hdr = (const struct sr_nat_ckpt_hdr *) base;
+
+  //version 1 files are the same without port forward records
+  if ((size < sizeof(*hdr)) || (hdr->magic != SR_NAT_CKPT_MAGIC) ||
+      (hdr->version < 1) || (hdr->version > SR_NAT_CKPT_VERSION))
+    return false;
+  if ((hdr->nmappings > size / sizeof(struct sr_nat_ckpt_mapping)) ||
+      (hdr->nconns > size / sizeof(struct sr_nat_ckpt_conn)) ||
+      (size != sizeof(*hdr) + hdr->nmappings * sizeof(struct sr_nat_ckpt_mapping) +
+               hdr->nconns * sizeof(struct sr_nat_ckpt_conn)))
+    return false;
+
+  const uint8_t *p = base + sizeof(*hdr);
+  uint64_t nconns = 0;
+  for (uint64_t i = 0; i < hdr->nmappings; i++) {
+    const struct sr_nat_ckpt_mapping *rec = (const struct sr_nat_ckpt_mapping *) p;
+    if ((rec->type >= NAT_MAPPING_TYPES) || (rec->nconns > hdr->nconns - nconns))
+      return false;
+    p += sizeof(*rec);
+    for (uint32_t c = 0; c < rec->nconns; c++, p += sizeof(struct sr_nat_ckpt_conn))
+      if (((const struct sr_nat_ckpt_conn *) p)->state > tcp_state_time_wait)
+        return false;
+    nconns += rec->nconns;
+  }
+  return nconns == hdr->nconns;
+}
+
+
+/* The port forward a static record was written for, if it is still
+   configured the same way. The backends of a service share the
+   external port, so they are told apart by their internal one. */
+static sr_nat_mapping_t *ckpt_find_forward(struct sr_nat *nat,
+                                           const struct sr_nat_ckpt_mapping *rec)
+{
+  sr_nat_mapping_t *map = sr_nat_lookup_external(nat, rec->ip_ext, rec->aux_ext, rec->type);
+  if ((map != NULL) && (map->vip != NULL))
+    map = sr_nat_lookup_internal(nat, rec->ip_int, rec->aux_int, rec->type);
+  if ((map == NULL) || !map->is_static || (map->ip_int != rec->ip_int) ||
+      (map->aux_int != rec->aux_int) || (map->ip_ext != rec->ip_ext) ||
+      (map->aux_ext != rec->aux_ext))
+    return NULL;
+  return map;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_ckpt_load
+ *
+ * Scope:  Global
+ *
+ * Restores the mappings and connections saved in a checkpoint into the
+ * NAT. The address pool and the port forwards must be set up already;
+ * the connections of a forward are put back on it, and pinned if it is
+ * a backend of a service.
+ *
+ * returns:
+ *    the number of learned mappings restored, 0 if there is no checkpoint, or
+ *    -1 if it cannot be read or is corrupt
+ *
+ *---------------------------------------------------------------------*/
+long sr_nat_ckpt_load(struct sr_instance *sr, const char *path)
+{
+  struct sr_nat *nat = &sr->nat;
+  struct stat st;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return (errno == ENOENT) ? 0 : -1;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+  if (!ckpt_valid(base, st.st_size)) {
+    munmap(base, st.st_size);
+    return -1;
+  }
+
+  const struct sr_nat_ckpt_hdr *hdr = (const struct sr_nat_ckpt_hdr *) base;
+  time_t down = time(NULL) - hdr->written;
+  if (down < 0)
+    down = 0;
+  long restored = 0;
+
+  pthread_mutex_lock(&(nat->lock));
+
+  time_t now = sr_clock_now();
+  sr_nat_reserve(nat, nat->index_count + hdr->nmappings);
+
+  const uint8_t *p = base + sizeof(*hdr);
+  for (uint64_t i = 0; i < hdr->nmappings; i++) {
+    const struct sr_nat_ckpt_mapping *rec = (const struct sr_nat_ckpt_mapping *) p;
+    const struct sr_nat_ckpt_conn *crec = (const struct sr_nat_ckpt_conn *) (rec + 1);
+    p += sizeof(*rec) + rec->nconns * sizeof(*crec);
+
+    sr_nat_mapping_t *map;
+    if (rec->flags & SR_NAT_CKPT_STATIC) {
+      //the forward is configured already, unless it has changed since
+      map = ckpt_find_forward(nat, rec);
+      if (map == NULL)
+        continue;
+    } else {
+      map = sr_nat_restore_mapping(sr,rec->type,rec->ip_int,rec->aux_int,
+                                   rec->ip_ext,rec->aux_ext,now - down - rec->idle);
+      if (map == NULL)
+        continue;
+      restored++;
+    }
+
+    sr_nat_connection_t **tail = &map->conns;
+    while (*tail != NULL)
+      tail = &(*tail)->next;
+    for (uint32_t c = 0; c < rec->nconns; c++, crec++) {
+      sr_nat_connection_t *conn = malloc(sizeof(sr_nat_connection_t));
+      conn->dest_ip = crec->dest_ip;
+      conn->dest_port = crec->dest_port;
+      conn->state = crec->state;
+      conn->fin_sent_seqno = crec->fin_sent_seqno;
+      conn->fin_recv_seqno = crec->fin_recv_seqno;
+      conn->last_updated = now - down - crec->idle;
+      conn->next = NULL;
+      *tail = conn;
+      tail = &conn->next;
+      sr_nat_lb_pin(nat, map, conn->dest_ip, conn->dest_port);
+    }
+    sr_stats_gauge(gauge_nat_tcp_conns, rec->nconns);
+  }
+
+  pthread_mutex_unlock(&(nat->lock));
+
+  munmap(base, st.st_size);
+  return restored;
+}
@@ -0,0 +1,61 @@
+
+#ifndef SR_NAT_CKPT_H
+#define SR_NAT_CKPT_H
+
+#include "sr_router.h"
+#include "sr_nat.h"
+
+#define SR_NAT_CKPT_MAGIC    0x534e4b50    /* "SNKP" */
+#define SR_NAT_CKPT_VERSION  2    /* 2: records for port forwards too */
+#define DEFAULT_NAT_CKPT_INTERVAL (60)
+
+/*
+ * Checkpoint file layout, in host byte order (it is only read back on
+ * the machine that wrote it): a header, then every mapping, each
+ * directly followed by its connections. Times are stored as seconds
+ * idle when the file was written, so they survive the clock of the
+ * process that wrote them. A port forward's record only carries its
+ * connections; the mapping itself comes back from the configuration.
+ */
+struct sr_nat_ckpt_hdr {
+  uint32_t magic;
+  uint32_t version;
+  int64_t  written;      /* CLOCK_REALTIME seconds */
+  uint64_t nmappings;
+  uint64_t nconns;
+} __attribute__ ((packed));
+
+struct sr_nat_ckpt_mapping {
+  uint32_t ip_int;       /* addresses and ports in network byte order */
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+  uint8_t  type;
+  uint8_t  flags;        /* SR_NAT_CKPT_STATIC */
+  uint8_t  pad[2];
+  uint32_t idle;
+  uint32_t nconns;
+} __attribute__ ((packed));
+
+#define SR_NAT_CKPT_STATIC 0x01  /* a port forward, see sr_nat_forward.c */
+
+struct sr_nat_ckpt_conn {
+  uint32_t dest_ip;
+  uint16_t dest_port;
+  uint8_t  state;
+  uint8_t  pad;
+  uint32_t fin_sent_seqno;
+  uint32_t fin_recv_seqno;
+  uint32_t idle;
+} __attribute__ ((packed));
+
+
+int sr_nat_ckpt_write(struct sr_instance *sr, const char *path);
+
+int sr_nat_ckpt_write_final(struct sr_instance *sr, const char *path);
+
+long sr_nat_ckpt_load(struct sr_instance *sr, const char *path);
+
+
+
+#endif /* SR_NAT_CKPT_H */
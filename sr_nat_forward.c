@@ -0,0 +1,327 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sr_nat.h"
+#include "sr_nat_pool.h"
+#include "sr_nat_forward.h"
+#include "sr_nat_lb.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+
+/*
+ * Static port forwards.
+ *
+ * A forward is a mapping that is configured instead of learned: it sits
+ * on the mapping list and in both lookup indexes like any other, so the
+ * packet path finds it with the same lookups, and is marked is_static so
+ * that the sweep never expires it (only its TCP connections come and go)
+ * and it is neither checkpointed nor replicated. Its external port is
+ * marked on its pool address, so the dynamic allocator never hands it
+ * out, and has no block.
+ *
+ * The file has one forward per line, '#' starts a comment:
+ *
+ *   tcp|udp|icmp ext_port[@ext_ip] int_ip:int_port [int_ip:int_port...]
+ *
+ * The external address defaults to the external interface's and must be
+ * one the NAT owns; an ICMP "port" is the echo identifier. A TCP forward
+ * may list several internal endpoints, which makes it a virtual service
+ * balanced over them (see sr_nat_lb.c). Each endpoint is a forward of its
+ * own here, marked 'lb', all with the same external port.
+ *
+ * Loading replaces the whole set: forwards that stay as they are keep
+ * their mapping and connections, the rest are removed, and a dynamic
+ * mapping that holds the external port or the internal endpoint of a new
+ * forward is evicted. A file with an error leaves the current set alone.
+ */
+
+static int fwd_cmp_ext(const void *a, const void *b)
+{
+  const struct sr_nat_forward *x = a, *y = b;
+  if (x->type != y->type)
+    return (x->type > y->type) - (x->type < y->type);
+  if (x->ip_ext != y->ip_ext)
+    return (ntohl(x->ip_ext) > ntohl(y->ip_ext)) - (ntohl(x->ip_ext) < ntohl(y->ip_ext));
+  return (ntohs(x->aux_ext) > ntohs(y->aux_ext)) - (ntohs(x->aux_ext) < ntohs(y->aux_ext));
+}
+
+static int fwd_cmp_int(const void *a, const void *b)
+{
+  const struct sr_nat_forward *x = a, *y = b;
+  if (x->type != y->type)
+    return (x->type > y->type) - (x->type < y->type);
+  if (x->ip_int != y->ip_int)
+    return (ntohl(x->ip_int) > ntohl(y->ip_int)) - (ntohl(x->ip_int) < ntohl(y->ip_int));
+  return (ntohs(x->aux_int) > ntohs(y->aux_int)) - (ntohs(x->aux_int) < ntohs(y->aux_int));
+}
+
+/* The order forwards are kept in: by external, then internal key. */
+static int fwd_cmp(const void *a, const void *b)
+{
+  int c = fwd_cmp_ext(a, b);
+  if (c != 0)
+    return c;
+  const struct sr_nat_forward *x = a, *y = b;
+  if (x->ip_int != y->ip_int)
+    return (ntohl(x->ip_int) > ntohl(y->ip_int)) - (ntohl(x->ip_int) < ntohl(y->ip_int));
+  return (ntohs(x->aux_int) > ntohs(y->aux_int)) - (ntohs(x->aux_int) < ntohs(y->aux_int));
+}
+
+static int fwd_parse_port(const char *s, sr_nat_mapping_type type, uint16_t *port)
+{
+  char *end;
+  unsigned long v = strtoul(s, &end, 10);
+  if ((end == s) || (*end != '\0') || (v > 65535) || ((v == 0) && (type != nat_mapping_icmp)))
+    return -1;
+  *port = htons((uint16_t) v);
+  return 0;
+}
+
+/* Parses one line, appending its forwards to 'fwds'. returns the number
+   of forwards, 0 for a blank or comment line, -1 if it is malformed. */
+static int fwd_parse_line(struct sr_instance *sr, char *line, unsigned int lineno,
+                          struct sr_nat_forward **fwds, size_t *n, size_t *cap)
+{
+  struct sr_nat_forward f;
+  char *save = NULL;
+  char *hash = strchr(line, '#');
+  if (hash != NULL)
+    *hash = '\0';
+
+  char *proto = strtok_r(line, " \t\r\n", &save);
+  if (proto == NULL)
+    return 0;
+  char *ext = strtok_r(NULL, " \t\r\n", &save);
+  if (ext == NULL)
+    return -1;
+
+  memset(&f, 0, sizeof(f));
+  f.line = lineno;
+  if (strcmp(proto, "tcp") == 0)
+    f.type = nat_mapping_tcp;
+  else if (strcmp(proto, "udp") == 0)
+    f.type = nat_mapping_udp;
+  else if (strcmp(proto, "icmp") == 0)
+    f.type = nat_mapping_icmp;
+  else
+    return -1;
+
+  char *at = strchr(ext, '@');
+  if (at != NULL) {
+    struct in_addr ip;
+    *at++ = '\0';
+    if (inet_pton(AF_INET, at, &ip) != 1)
+      return -1;
+    f.ip_ext = ip.s_addr;
+  } else {
+    sr_if_t *ext_iface = get_external_iface(sr);
+    if (ext_iface == NULL)
+      return -1;
+    f.ip_ext = ext_iface->ip;
+  }
+  if (!destined_to_nat_external(sr, f.ip_ext) || (fwd_parse_port(ext, f.type, &f.aux_ext) != 0))
+    return -1;
+
+  size_t first = *n;
+  for (char *inta; (inta = strtok_r(NULL, " \t\r\n", &save)) != NULL;) {
+    struct in_addr ip;
+    char *colon = strchr(inta, ':');
+    if (colon == NULL)
+      return -1;
+    *colon++ = '\0';
+    if ((inet_pton(AF_INET, inta, &ip) != 1) || (ip.s_addr == 0) ||
+        (fwd_parse_port(colon, f.type, &f.aux_int) != 0))
+      return -1;
+    f.ip_int = ip.s_addr;
+
+    if (*n == *cap) {
+      *cap = *cap ? *cap * 2 : 16;
+      *fwds = realloc(*fwds, *cap * sizeof(**fwds));
+      assert(*fwds);
+    }
+    (*fwds)[(*n)++] = f;
+  }
+
+  //only TCP has the connections to balance
+  size_t count = *n - first;
+  if ((count == 0) || ((count > 1) && (f.type != nat_mapping_tcp)) ||
+      (count > SR_NAT_LB_MAX_BACKENDS))
+    return -1;
+  for (size_t i = first; i < *n; i++)
+    (*fwds)[i].lb = (count > 1);
+  return (int) count;
+}
+
+/* Reads 'path' into an array in fwd_cmp order. returns the
+   number of forwards, or -1 if the file cannot be read or is bad. */
+static long fwd_read(struct sr_instance *sr, const char *path, struct sr_nat_forward **out)
+{
+  char line[BUFSIZ];
+  unsigned int lineno = 0;
+  struct sr_nat_forward *fwds = NULL;
+  size_t n = 0, cap = 0;
+  FILE *fp = fopen(path, "r");
+
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    if (fwd_parse_line(sr, line, lineno, &fwds, &n, &cap) < 0) {
+      fprintf(stderr, "sr_nat_forward: %s:%u: bad forward\n", path, lineno);
+      fclose(fp);
+      free(fwds);
+      return -1;
+    }
+  }
+  fclose(fp);
+
+  //an external port can only be forwarded by one line, an internal
+  //endpoint only once
+  struct sr_nat_forward *by_int = malloc((n ? n : 1) * sizeof(*by_int));
+  assert(by_int);
+  memcpy(by_int, fwds, n * sizeof(*fwds));
+  qsort(fwds, n, sizeof(*fwds), fwd_cmp);
+  qsort(by_int, n, sizeof(*by_int), fwd_cmp_int);
+  for (size_t i = 1; i < n; i++) {
+    if (((fwd_cmp_ext(&fwds[i - 1], &fwds[i]) == 0) && (fwds[i - 1].line != fwds[i].line)) ||
+        (fwd_cmp_int(&by_int[i - 1], &by_int[i]) == 0)) {
+      fprintf(stderr, "sr_nat_forward: %s: port forwarded twice\n", path);
+      free(by_int);
+      free(fwds);
+      return -1;
+    }
+  }
+  free(by_int);
+
+  *out = fwds;
+  return (long) n;
+}
+
+/* Puts the mapping of a forward on the list and in the indexes. */
+static void fwd_link(struct sr_nat *nat, const struct sr_nat_forward *f)
+{
+  sr_nat_mapping_t *mapping = malloc(sizeof(sr_nat_mapping_t));
+  assert(mapping);
+  mapping->type = f->type;
+  mapping->ip_int = f->ip_int;
+  mapping->aux_int = f->aux_int;
+  mapping->ip_ext = f->ip_ext;
+  mapping->aux_ext = f->aux_ext;
+  mapping->block = NULL;
+  mapping->is_static = true;
+  mapping->vip = NULL;
+  mapping->last_updated = sr_clock_now();
+  mapping->conns = NULL;
+  sr_nat_link_mapping(nat, mapping);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_forward_load
+ *
+ * Scope:  Global
+ *
+ * Reads the port forwards in 'path' and makes them the NAT's, in place
+ * of the ones it has. Safe to call while packets are being translated.
+ *
+ * returns:
+ *    the number of forwards, or -1 if the file cannot be read or is bad,
+ *    in which case the current forwards stay
+ *
+ *---------------------------------------------------------------------*/
+int sr_nat_forward_load(struct sr_instance *sr, const char *path)
+{
+  struct sr_nat *nat = &sr->nat;
+  struct sr_nat_forward *fwds = NULL;
+  long n = fwd_read(sr, path, &fwds);
+  if (n < 0)
+    return -1;
+
+  pthread_mutex_lock(&(nat->lock));
+
+  //both sets are in fwd_cmp order: walk them together and drop the old
+  //forwards that are gone or changed. an internal endpoint has at most
+  //one forward, so it finds the mapping
+  size_t j = 0;
+  for (unsigned int i = 0; i < nat->nforwards; i++) {
+    const struct sr_nat_forward *o = &nat->forwards[i];
+    while ((j < (size_t) n) && (fwd_cmp(&fwds[j], o) < 0))
+      j++;
+    if ((j < (size_t) n) && (fwd_cmp(&fwds[j], o) == 0))
+      continue;
+    sr_nat_mapping_t *m = sr_nat_lookup_internal(nat, o->ip_int, o->aux_int, o->type);
+    if ((m != NULL) && m->is_static)
+      sr_nat_remove_mapping(nat, m);
+    sr_nat_pool_set_static(sr, o->ip_ext, o->type, o->aux_ext, false);
+    sr_trace(trace_nat,"port forward [%I]:%u to [%I]:%u removed",o->ip_ext,ntohs(o->aux_ext),
+             o->ip_int,ntohs(o->aux_int));
+  }
+
+  for (long i = 0; i < n; i++) {
+    const struct sr_nat_forward *f = &fwds[i];
+    //the port may have been shared with a removed forward
+    sr_nat_pool_set_static(sr, f->ip_ext, f->type, f->aux_ext, true);
+    sr_nat_mapping_t *m = sr_nat_lookup_internal(nat, f->ip_int, f->aux_int, f->type);
+    if ((m != NULL) && m->is_static)
+      continue;  //unchanged
+    if (m != NULL)
+      sr_nat_remove_mapping(nat, m);
+    m = sr_nat_lookup_external(nat, f->ip_ext, f->aux_ext, f->type);
+    if ((m != NULL) && !m->is_static)
+      sr_nat_remove_mapping(nat, m);
+    fwd_link(nat, f);
+    sr_trace(trace_nat,"port forward [%I]:%u to [%I]:%u",f->ip_ext,ntohs(f->aux_ext),
+             f->ip_int,ntohs(f->aux_int));
+  }
+
+  struct sr_nat_forward *old = nat->forwards;
+  nat->forwards = fwds;
+  nat->nforwards = (unsigned int) n;
+  sr_nat_lb_update(nat);
+
+  pthread_mutex_unlock(&(nat->lock));
+
+  free(old);
+  return (int) n;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_forward_install
+ *
+ * Scope:  Global
+ *
+ * Links the mappings of all forwards again once sr_nat_clear has freed
+ * every mapping. Their ports are still marked in the pool. Called with
+ * the NAT locked.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_forward_install(struct sr_nat *nat)
+{
+  for (unsigned int i = 0; i < nat->nforwards; i++)
+    fwd_link(nat, &nat->forwards[i]);
+  sr_nat_lb_attach(nat);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_forward_clear
+ *
+ * Scope:  Global
+ *
+ * Forgets the configured forwards and virtual services. Their mappings
+ * go with the next sr_nat_clear.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_forward_clear(struct sr_nat *nat)
+{
+  sr_nat_lb_clear(nat);
+  free(nat->forwards);
+  nat->forwards = NULL;
+  nat->nforwards = 0;
+}
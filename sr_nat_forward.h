@@ -0,0 +1,30 @@
+
+#ifndef SR_NAT_FORWARD_H
+#define SR_NAT_FORWARD_H
+
+#include "sr_router.h"
+#include "sr_nat.h"
+
+/* A static port forward: the external (address, port) always maps to
+   the internal one. All in network byte order; the port of an ICMP
+   forward is the echo identifier. */
+struct sr_nat_forward {
+  sr_nat_mapping_type type;
+  uint32_t ip_ext;
+  uint16_t aux_ext;
+  uint32_t ip_int;
+  uint16_t aux_int;
+  bool lb;              /* one backend of a virtual service */
+  unsigned int line;    /* in the file, forwards of one line share 'ip_ext' and 'aux_ext' */
+};
+
+
+int sr_nat_forward_load(struct sr_instance *sr, const char *path);
+
+void sr_nat_forward_install(struct sr_nat *nat);
+
+void sr_nat_forward_clear(struct sr_nat *nat);
+
+
+
+#endif /* SR_NAT_FORWARD_H */
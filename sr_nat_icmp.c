@@ -3,6 +3,9 @@
 #include "sr_nat.h"
 #include "sr_nat_icmp.h"
 #include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
 
 
 /*---------------------------------------------------------------------
@@ -63,14 +66,10 @@ void translate_outgoing_icmp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map)
 
   //translate src ip address to appear as if packet
   //originated from NAT
-  DebugNAT("+++ Translating source IP address from [");
-  DebugNATAddrIP(ntohl(iphdr->ip_src));
-  DebugNAT("] to [");
-  DebugNATAddrIP(ntohl(map->ip_ext));
-  DebugNAT("]. +++\n");
+  sr_trace(trace_nat,"translating source IP address from [%I] to [%I]",iphdr->ip_src,map->ip_ext);
   iphdr->ip_src = map->ip_ext;
 
-  DebugNAT("+++ Translating ID from [%d] to [%d]. +++\n",ntohs(echohdr->icmp_id),ntohs(map->aux_ext));
+  sr_trace(trace_nat,"translating ID from [%u] to [%u]",ntohs(echohdr->icmp_id),ntohs(map->aux_ext));
   echohdr->icmp_id = map->aux_ext;
   
   //recompute icmp checksum
@@ -119,14 +118,10 @@ void translate_incoming_icmp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map)
   sr_icmp_echo_hdr_t *echohdr = (sr_icmp_echo_hdr_t *) icmphdr; 
 
   //translate destination ip address to private destination of destination host
-  DebugNAT("+++ Translating destination IP address from [");
-  DebugNATAddrIP(ntohl(iphdr->ip_dst));
-  DebugNAT("] to [");
-  DebugNATAddrIP(ntohl(map->ip_int));
-  DebugNAT("]. +++\n");
+  sr_trace(trace_nat,"translating destination IP address from [%I] to [%I]",iphdr->ip_dst,map->ip_int);
   iphdr->ip_dst = map->ip_int;
 
-  DebugNAT("+++ Translating ID from [%d] to [%d]. +++\n",ntohs(echohdr->icmp_id),ntohs(map->aux_int));
+  sr_trace(trace_nat,"translating ID from [%u] to [%u]",ntohs(echohdr->icmp_id),ntohs(map->aux_int));
   echohdr->icmp_id = map->aux_int;
   
   //recompute icmp checksum
@@ -158,7 +153,7 @@ void update_icmp_connection(sr_nat_mapping_t *map)
   	assert(map->type == nat_mapping_icmp);
 
   	//update timestamp
-  	map->last_updated = current_time();
+  	map->last_updated = sr_clock_now();
 
 }
 
@@ -181,7 +176,7 @@ void update_icmp_connection(sr_nat_mapping_t *map)
  *---------------------------------------------------------------------*/
 nat_action_type handle_outgoing_icmp(struct sr_instance *sr, sr_ip_hdr_t *iphdr) 
 {
-	DebugNAT("+++ NAT handling outbound ICMP +++\n");
+	sr_trace(trace_nat,"NAT handling outbound ICMP");
 	struct sr_nat *nat = &sr->nat;
 	unsigned int iplen = ntohs(iphdr->ip_len);
   	unsigned int icmplen = 0;
@@ -189,7 +184,8 @@ nat_action_type handle_outgoing_icmp(struct sr_instance *sr, sr_ip_hdr_t *iphdr)
 
   	if ((icmphdr->icmp_type != icmp_type_echoreply) &&
   		(icmphdr->icmp_type != icmp_type_echoreq)) {
-  		DebugNAT("+++ Unsupported ICMP type. +++\n");
+  		sr_trace(trace_nat,"unsupported ICMP type");
+  		sr_stats_drop(drop_nat_unsupported_icmp);
   		return nat_action_drop; //ignore icmp packets other then echo requests/replies
   	}
 	
@@ -202,7 +198,9 @@ nat_action_type handle_outgoing_icmp(struct sr_instance *sr, sr_ip_hdr_t *iphdr)
 	if (map == NULL) {
 		//insert new mapping into the translation table
 		map = sr_nat_insert_mapping(sr,ip_src,aux_src,0,0,nat_mapping_icmp);
-		DebugNAT("+++ Created NAT mapping from id [%d] to [%d]. +++\n",ntohs(map->aux_int),ntohs(map->aux_ext));
+		if (map == NULL)
+			return nat_action_drop; //counted by the NAT
+		sr_trace(trace_nat,"created NAT mapping from id [%u] to [%u]",ntohs(map->aux_int),ntohs(map->aux_ext));
 	}
 	//translate entry
 	translate_outgoing_icmp(iphdr,map);
@@ -231,14 +229,15 @@ nat_action_type handle_outgoing_icmp(struct sr_instance *sr, sr_ip_hdr_t *iphdr)
  *---------------------------------------------------------------------*/
 nat_action_type handle_incoming_icmp(struct sr_nat *nat, sr_ip_hdr_t *iphdr) 
 {
-	DebugNAT("+++ NAT handling inbound ICMP +++\n");
+	sr_trace(trace_nat,"NAT handling inbound ICMP");
 	unsigned int iplen = ntohs(iphdr->ip_len);
   	unsigned int icmplen = 0;
   	sr_icmp_echo_hdr_t *icmphdr = (sr_icmp_echo_hdr_t *) extract_ip_payload(iphdr, iplen, &icmplen);  
 
   	if ((icmphdr->icmp_type != icmp_type_echoreply) &&
   		(icmphdr->icmp_type != icmp_type_echoreq)) {
-  		DebugNAT("+++ Unsupported ICMP type. +++\n");
+  		sr_trace(trace_nat,"unsupported ICMP type");
+  		sr_stats_drop(drop_nat_unsupported_icmp);
   		return nat_action_drop; //ignore icmp packets other then echo requests/replies
   	}
 	
@@ -246,11 +245,11 @@ nat_action_type handle_incoming_icmp(struct sr_nat *nat, sr_ip_hdr_t *iphdr)
 	//uint32_t ip_dst = ntohl(iphdr->ip_dst);
 	uint16_t aux_dst = icmphdr->icmp_id;
 
-	sr_nat_mapping_t *map = sr_nat_lookup_external(nat,aux_dst,nat_mapping_icmp);
+	sr_nat_mapping_t *map = sr_nat_lookup_external(nat,iphdr->ip_dst,aux_dst,nat_mapping_icmp);
 
 	//do not accept connections from unmapped ports
 	if (map == NULL) {
-		DebugNAT("+++ Segment addressed to unmapped id ++\n");
+		sr_trace(trace_nat,"segment addressed to unmapped id");
 		return nat_action_route; //packet addressed to router itself
 	}
 
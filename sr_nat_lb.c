@@ -0,0 +1,466 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sr_nat.h"
+#include "sr_nat_lb.h"
+#include "sr_nat_forward.h"
+#include "sr_protocol.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+
+/*
+ * Virtual services.
+ *
+ * A TCP port forward with more than one internal endpoint is a virtual
+ * service: every backend has a static mapping from itself to the shared
+ * external address and port, which translates its replies, and the
+ * mappings point at the service. An inbound segment that finds one of
+ * them goes through sr_nat_lb_select, which picks the backend.
+ *
+ * New connections are spread with Maglev hashing: each backend fills
+ * the slots of a prime sized lookup table in the order of its own
+ * permutation, taking turns, so every backend owns an almost equal share
+ * of the table, and adding or removing one backend moves little more
+ * than that backend's share of the slots. The client address and port
+ * pick the slot.
+ *
+ * A SYN pins its connection to the backend it was sent to, in a flow
+ * table of the service, so that connections stay put when the backends
+ * change. A pin lasts for the transitory TCP timeout until the client
+ * acknowledges the backend's SYN/ACK, so a flood of SYNs cannot hold the
+ * flow table, then for the established timeout, and for the transitory
+ * one again once the client sends a FIN or RST. The backend's
+ * mapping keeps the connection's state as with any forward. Segments
+ * without a pin, e.g. after a restart, follow the lookup table.
+ *
+ * Everything here runs under the NAT lock.
+ */
+
+#define LB_FLOW_INDEX_MIN 1024
+#define LB_EMPTY 0xffff
+
+
+static inline unsigned int lb_client_hash(uint32_t ip, uint16_t port)
+{
+  return sr_nat_hash(((uint64_t) port << 32) | ip);
+}
+
+static inline unsigned int lb_flow_bucket(struct sr_nat_vip *vip, uint32_t ip, uint16_t port)
+{
+  return lb_client_hash(ip, port) & (vip->flow_size - 1);
+}
+
+static struct sr_nat_lb_flow *lb_flow_find(struct sr_nat_vip *vip, uint32_t ip, uint16_t port)
+{
+  if (vip->flow_size == 0)
+    return NULL;
+  for (struct sr_nat_lb_flow *flow = vip->flows[lb_flow_bucket(vip, ip, port)]; flow != NULL;
+       flow = flow->next)
+    if ((flow->ip == ip) && (flow->port == port))
+      return flow;
+  return NULL;
+}
+
+static void lb_flow_grow(struct sr_nat_vip *vip)
+{
+  unsigned int old_size = vip->flow_size;
+  struct sr_nat_lb_flow **old = vip->flows;
+
+  vip->flow_size = old_size ? old_size * 2 : LB_FLOW_INDEX_MIN;
+  vip->flows = calloc(vip->flow_size, sizeof(*vip->flows));
+  assert(vip->flows);
+  for (unsigned int i = 0; i < old_size; i++) {
+    for (struct sr_nat_lb_flow *flow = old[i], *next; flow != NULL; flow = next) {
+      next = flow->next;
+      unsigned int b = lb_flow_bucket(vip, flow->ip, flow->port);
+      flow->next = vip->flows[b];
+      vip->flows[b] = flow;
+    }
+  }
+  free(old);
+}
+
+static struct sr_nat_lb_flow *lb_flow_add(struct sr_nat_vip *vip, uint32_t ip, uint16_t port,
+                                          unsigned int backend)
+{
+  if (vip->nflows >= SR_NAT_LB_MAX_FLOWS)
+    return NULL;
+  if (vip->nflows >= vip->flow_size)
+    lb_flow_grow(vip);
+
+  struct sr_nat_lb_flow *flow = malloc(sizeof(*flow));
+  assert(flow);
+  flow->ip = ip;
+  flow->port = port;
+  flow->backend = backend;
+  flow->established = false;
+  unsigned int b = lb_flow_bucket(vip, ip, port);
+  flow->next = vip->flows[b];
+  vip->flows[b] = flow;
+  vip->nflows++;
+  return flow;
+}
+
+/* Drops the pins for which 'drop' is true, after renumbering the rest
+   with 'remap' if it is not NULL. */
+static void lb_flow_filter(struct sr_nat_vip *vip, time_t now, const int *remap)
+{
+  for (unsigned int i = 0; i < vip->flow_size; i++) {
+    struct sr_nat_lb_flow **pp = &vip->flows[i];
+    while (*pp != NULL) {
+      struct sr_nat_lb_flow *flow = *pp;
+      int backend = remap ? remap[flow->backend] : flow->backend;
+      if ((backend < 0) || (flow->expires < now)) {
+        *pp = flow->next;
+        free(flow);
+        vip->nflows--;
+        continue;
+      }
+      flow->backend = backend;
+      pp = &flow->next;
+    }
+  }
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: lb_populate
+ *
+ * Scope:  Local
+ *
+ * Fills the Maglev lookup table of a service from its backends. A
+ * backend's permutation is offset + j * skip modulo the (prime) table
+ * size, both derived from its address and port, so it does not depend
+ * on the other backends.
+ *
+ *---------------------------------------------------------------------*/
+static void lb_populate(struct sr_nat_vip *vip)
+{
+  unsigned int n = vip->nbackends;
+  uint32_t *offset = malloc(n * sizeof(uint32_t));
+  uint32_t *skip = malloc(n * sizeof(uint32_t));
+  uint32_t *next = calloc(n, sizeof(uint32_t));
+  assert(offset && skip && next);
+
+  for (unsigned int i = 0; i < n; i++) {
+    uint64_t key = ((uint64_t) ntohs(vip->backends[i].port) << 32) | ntohl(vip->backends[i].ip);
+    offset[i] = sr_nat_hash(key) % SR_NAT_LB_TABLE;
+    skip[i] = sr_nat_hash(key ^ 0x9e3779b97f4a7c15ull) % (SR_NAT_LB_TABLE - 1) + 1;
+  }
+
+  for (unsigned int c = 0; c < SR_NAT_LB_TABLE; c++)
+    vip->table[c] = LB_EMPTY;
+  for (unsigned int filled = 0; filled < SR_NAT_LB_TABLE;) {
+    for (unsigned int i = 0; i < n && filled < SR_NAT_LB_TABLE; i++) {
+      uint32_t c;
+      do {
+        c = (offset[i] + (uint64_t) next[i]++ * skip[i]) % SR_NAT_LB_TABLE;
+      } while (vip->table[c] != LB_EMPTY);
+      vip->table[c] = i;
+      filled++;
+    }
+  }
+
+  free(offset);
+  free(skip);
+  free(next);
+}
+
+static void lb_vip_free(struct sr_nat_vip *vip)
+{
+  for (unsigned int i = 0; i < vip->flow_size; i++)
+    while (vip->flows[i] != NULL) {
+      struct sr_nat_lb_flow *flow = vip->flows[i];
+      vip->flows[i] = flow->next;
+      free(flow);
+    }
+  free(vip->flows);
+  free(vip->backends);
+  free(vip->table);
+  free(vip);
+}
+
+static struct sr_nat_vip *lb_vip_find(struct sr_nat_vip *list, uint32_t ip, uint16_t port)
+{
+  for (struct sr_nat_vip *vip = list; vip != NULL; vip = vip->next)
+    if ((vip->ip == ip) && (vip->port == port))
+      return vip;
+  return NULL;
+}
+
+static int lb_backend_cmp(const struct sr_nat_lb_backend *a, const struct sr_nat_lb_backend *b)
+{
+  if (a->ip != b->ip)
+    return (ntohl(a->ip) > ntohl(b->ip)) - (ntohl(a->ip) < ntohl(b->ip));
+  return (ntohs(a->port) > ntohs(b->port)) - (ntohs(a->port) < ntohs(b->port));
+}
+
+/* Gives 'vip' the backends of 'fwds', keeping the counters and the pins
+   of the backends it already had. */
+static void lb_vip_set(struct sr_nat_vip *vip, const struct sr_nat_forward *fwds, unsigned int n)
+{
+  struct sr_nat_lb_backend *backends = calloc(n, sizeof(*backends));
+  int *remap = malloc((vip->nbackends ? vip->nbackends : 1) * sizeof(int));
+  assert(backends && remap);
+
+  for (unsigned int i = 0; i < n; i++) {
+    backends[i].ip = fwds[i].ip_int;
+    backends[i].port = fwds[i].aux_int;
+  }
+  qsort(backends, n, sizeof(*backends), (int (*)(const void *, const void *)) lb_backend_cmp);
+
+  //both lists are ordered: carry the old backends' state over
+  unsigned int j = 0;
+  for (unsigned int i = 0; i < vip->nbackends; i++) {
+    while ((j < n) && (lb_backend_cmp(&backends[j], &vip->backends[i]) < 0))
+      j++;
+    if ((j < n) && (lb_backend_cmp(&backends[j], &vip->backends[i]) == 0)) {
+      backends[j] = vip->backends[i];
+      remap[i] = j;
+    } else {
+      remap[i] = -1;
+    }
+  }
+  if (vip->nbackends != 0)
+    lb_flow_filter(vip, 0, remap);
+  free(remap);
+
+  free(vip->backends);
+  vip->backends = backends;
+  vip->nbackends = n;
+  if (vip->table == NULL)
+    vip->table = malloc(SR_NAT_LB_TABLE * sizeof(uint16_t));
+  assert(vip->table);
+  lb_populate(vip);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_lb_update
+ *
+ * Scope:  Global
+ *
+ * Brings the virtual services in line with the NAT's port forwards,
+ * after sr_nat_forward_load has replaced them. Services whose backends
+ * are unchanged keep their lookup table and pins.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_lb_update(struct sr_nat *nat)
+{
+  struct sr_nat_vip *old = nat->vips, *vips = NULL;
+
+  //forwards are ordered on the external key, so a service's are together
+  for (unsigned int i = 0; i < nat->nforwards;) {
+    const struct sr_nat_forward *f = &nat->forwards[i];
+    unsigned int n = 1;
+    if (!f->lb) {
+      i++;
+      continue;
+    }
+    while ((i + n < nat->nforwards) && f[n].lb && (f[n].ip_ext == f->ip_ext) &&
+           (f[n].aux_ext == f->aux_ext))
+      n++;
+
+    struct sr_nat_vip **pp = &old;
+    while ((*pp != NULL) && !(((*pp)->ip == f->ip_ext) && ((*pp)->port == f->aux_ext)))
+      pp = &(*pp)->next;
+    struct sr_nat_vip *vip = *pp;
+    if (vip != NULL) {
+      *pp = vip->next;
+    } else {
+      vip = calloc(1, sizeof(*vip));
+      assert(vip);
+      vip->ip = f->ip_ext;
+      vip->port = f->aux_ext;
+    }
+
+    bool same = (vip->nbackends == n);
+    for (unsigned int k = 0; same && k < n; k++) {
+      struct sr_nat_lb_backend b = { .ip = f[k].ip_int, .port = f[k].aux_int };
+      same = (lb_backend_cmp(&b, &vip->backends[k]) == 0);
+    }
+    if (!same) {
+      lb_vip_set(vip, f, n);
+      sr_trace(trace_nat,"virtual service [%I]:%u has [%u] backends",vip->ip,ntohs(vip->port),n);
+    }
+    vip->next = vips;
+    vips = vip;
+    i += n;
+  }
+
+  while (old != NULL) {
+    struct sr_nat_vip *vip = old;
+    old = vip->next;
+    lb_vip_free(vip);
+  }
+  nat->vips = vips;
+  sr_nat_lb_attach(nat);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_lb_attach
+ *
+ * Scope:  Global
+ *
+ * Points the static mappings of backends at their service, and those of
+ * plain forwards at none.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_lb_attach(struct sr_nat *nat)
+{
+  for (unsigned int i = 0; i < nat->nforwards; i++) {
+    const struct sr_nat_forward *f = &nat->forwards[i];
+    sr_nat_mapping_t *map = sr_nat_lookup_internal(nat, f->ip_int, f->aux_int, f->type);
+    if ((map != NULL) && map->is_static)
+      map->vip = f->lb ? lb_vip_find(nat->vips, f->ip_ext, f->aux_ext) : NULL;
+  }
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_lb_select
+ *
+ * Scope:  Global
+ *
+ * Picks the backend of an inbound segment to a virtual service: the one
+ * its connection is pinned to, else the one its lookup table slot names.
+ * A SYN pins the connection, briefly until the handshake completes.
+ * Counts the segment for the backend.
+ *
+ * returns:
+ *    the mapping of the backend, to translate the segment with, NULL if
+ *    the backend has none
+ *
+ *---------------------------------------------------------------------*/
+sr_nat_mapping_t *sr_nat_lb_select(struct sr_nat *nat, struct sr_nat_vip *vip,
+                                   sr_ip_hdr_t *iphdr, sr_tcp_hdr_t *tcphdr)
+{
+  time_t now = sr_clock_now();
+  uint32_t ip = iphdr->ip_src;
+  uint16_t port = tcphdr->th_sport;
+  bool closing = (tcphdr->th_flags & (TH_FIN | TH_RST)) != 0;
+
+  struct sr_nat_lb_flow *flow = lb_flow_find(vip, ip, port);
+  unsigned int b;
+  if (flow != NULL) {
+    b = flow->backend;
+  } else {
+    b = vip->table[lb_client_hash(ip, port) % SR_NAT_LB_TABLE];
+    if ((tcphdr->th_flags & (TH_SYN | TH_ACK)) == TH_SYN) {
+      flow = lb_flow_add(vip, ip, port, b);
+      vip->backends[b].conns++;
+      sr_trace(trace_nat,"[%I]:%u sent to backend [%I]:%u",ip,ntohs(port),
+               vip->backends[b].ip,ntohs(vip->backends[b].port));
+    }
+  }
+  if (flow != NULL) {
+    //the client's handshake ACK: a SYN alone must not hold a pin for long
+    if ((tcphdr->th_flags & (TH_SYN | TH_ACK)) == TH_ACK)
+      flow->established = true;
+    bool estab = flow->established && !closing;
+    flow->expires = now + (estab ? nat->tcp_estab_timeout : nat->tcp_trans_timeout);
+  }
+
+  struct sr_nat_lb_backend *backend = &vip->backends[b];
+  backend->packets++;
+  backend->bytes += ntohs(iphdr->ip_len);
+  return sr_nat_lookup_internal(nat, backend->ip, backend->port, nat_mapping_tcp);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_lb_pin
+ *
+ * Scope:  Global
+ *
+ * Pins the connection from client 'ip':'port' to the backend of 'map',
+ * for connections learned other than by a SYN, i.e. from the active
+ * NAT. Does nothing unless 'map' belongs to a service.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_lb_pin(struct sr_nat *nat, sr_nat_mapping_t *map, uint32_t ip, uint16_t port)
+{
+  struct sr_nat_vip *vip = map->vip;
+  if (vip == NULL)
+    return;
+
+  struct sr_nat_lb_backend key = { .ip = map->ip_int, .port = map->aux_int };
+  for (unsigned int b = 0; b < vip->nbackends; b++) {
+    if (lb_backend_cmp(&key, &vip->backends[b]) != 0)
+      continue;
+    struct sr_nat_lb_flow *flow = lb_flow_find(vip, ip, port);
+    if (flow == NULL)
+      flow = lb_flow_add(vip, ip, port, b);
+    if (flow != NULL) {
+      flow->backend = b;
+      flow->established = true;
+      flow->expires = sr_clock_now() + nat->tcp_estab_timeout;
+    }
+    return;
+  }
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_lb_sweep
+ *
+ * Scope:  Global
+ *
+ * Drops expired pins. Called from the NAT's timeout sweep.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_lb_sweep(struct sr_nat *nat, time_t now)
+{
+  for (struct sr_nat_vip *vip = nat->vips; vip != NULL; vip = vip->next)
+    lb_flow_filter(vip, now, NULL);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_lb_print
+ *
+ * Scope:  Global
+ *
+ * Prints the counters of every backend.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_lb_print(struct sr_nat *nat, FILE *fp)
+{
+  char vip_ip[INET_ADDRSTRLEN], ip[INET_ADDRSTRLEN];
+
+  pthread_mutex_lock(&(nat->lock));
+  for (struct sr_nat_vip *vip = nat->vips; vip != NULL; vip = vip->next) {
+    inet_ntop(AF_INET, &vip->ip, vip_ip, sizeof(vip_ip));
+    fprintf(fp, "virtual service %s:%u, %u pinned connections\n", vip_ip, ntohs(vip->port),
+            vip->nflows);
+    for (unsigned int b = 0; b < vip->nbackends; b++) {
+      const struct sr_nat_lb_backend *backend = &vip->backends[b];
+      inet_ntop(AF_INET, &backend->ip, ip, sizeof(ip));
+      fprintf(fp, "  %15s:%-5u %12llu conns %14llu packets %16llu bytes\n", ip,
+              ntohs(backend->port), (unsigned long long) backend->conns,
+              (unsigned long long) backend->packets, (unsigned long long) backend->bytes);
+    }
+  }
+  pthread_mutex_unlock(&(nat->lock));
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_lb_clear
+ *
+ * Scope:  Global
+ *
+ * Frees every service. Their mappings go with the next sr_nat_clear.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_lb_clear(struct sr_nat *nat)
+{
+  while (nat->vips != NULL) {
+    struct sr_nat_vip *vip = nat->vips;
+    nat->vips = vip->next;
+    lb_vip_free(vip);
+  }
+}
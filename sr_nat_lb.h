@@ -0,0 +1,62 @@
+
+#ifndef SR_NAT_LB_H
+#define SR_NAT_LB_H
+
+#include <stdio.h>
+#include "sr_router.h"
+#include "sr_nat.h"
+
+#define SR_NAT_LB_TABLE        65537       /* Maglev lookup table entries, prime */
+#define SR_NAT_LB_MAX_BACKENDS 4096
+#define SR_NAT_LB_MAX_FLOWS    (1 << 20)   /* pinned connections per service */
+
+struct sr_nat_lb_backend {
+  uint32_t ip;                 /* network byte order */
+  uint16_t port;
+  uint64_t conns;              /* connections sent to it */
+  uint64_t packets;            /* inbound packets */
+  uint64_t bytes;
+};
+
+/* A client connection pinned to a backend */
+struct sr_nat_lb_flow {
+  uint32_t ip;                 /* client, network byte order */
+  uint16_t port;
+  uint16_t backend;            /* index into the service's backends */
+  bool established;            /* the client has acknowledged the SYN/ACK */
+  time_t expires;
+  struct sr_nat_lb_flow *next;
+};
+
+/* A virtual service: a forwarded TCP port spread over several backends,
+   see sr_nat_lb.c */
+struct sr_nat_vip {
+  uint32_t ip;                 /* external address and port, network byte order */
+  uint16_t port;
+  struct sr_nat_lb_backend *backends;   /* ordered by address and port */
+  unsigned int nbackends;
+  uint16_t *table;             /* SR_NAT_LB_TABLE backend indexes */
+  struct sr_nat_lb_flow **flows;
+  unsigned int flow_size, nflows;
+  struct sr_nat_vip *next;
+};
+
+
+void sr_nat_lb_update(struct sr_nat *nat);
+
+void sr_nat_lb_attach(struct sr_nat *nat);
+
+sr_nat_mapping_t *sr_nat_lb_select(struct sr_nat *nat, struct sr_nat_vip *vip,
+                                   sr_ip_hdr_t *iphdr, sr_tcp_hdr_t *tcphdr);
+
+void sr_nat_lb_pin(struct sr_nat *nat, sr_nat_mapping_t *map, uint32_t ip, uint16_t port);
+
+void sr_nat_lb_sweep(struct sr_nat *nat, time_t now);
+
+void sr_nat_lb_print(struct sr_nat *nat, FILE *fp);
+
+void sr_nat_lb_clear(struct sr_nat *nat);
+
+
+
+#endif /* SR_NAT_LB_H */
@@ -0,0 +1,624 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sr_nat.h"
+#include "sr_nat_pool.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+
+/*
+ * External address pool.
+ *
+ * External ports are handed out in blocks of NAT_PORT_BLOCK_SIZE, each
+ * owned by one internal host, the way carrier-grade NATs do it: a host
+ * costs a few bytes per block instead of state per port, and a single
+ * log record per block (trace category "block") says which host used
+ * which ports when. Pooling is paired: a host's first block picks an
+ * address round robin, and every later block comes from that same
+ * address, so all of a host's traffic leaves from one external IP. A
+ * host takes at most NAT_MAX_BLOCKS_PER_HOST blocks; a block goes back to
+ * its address when its last mapping expires, and the host is forgotten
+ * once its last block is gone.
+ *
+ * Ports of static port forwards are marked on their address and never
+ * handed out, whichever block they fall into.
+ *
+ * Without a configured pool the external interface's address is used,
+ * added by sr_nat_pool_default before the first packet. Everything here
+ * runs under the NAT lock. The one exception is the packet path, which
+ * looks up the address list without it: the list is complete before the
+ * first packet and never changes after.
+ */
+
+#define POOL_HOST_INDEX_MIN 1024
+#define POOL_MAX_RANGE 65536
+#define POOL_STATIC_WORDS (NAT_BLOCKS_PER_ADDR * NAT_PORT_BLOCK_SIZE / 64)  /* per type */
+
+
+/*---------------------------------------------------------------------
+ * Method: addr_cmp
+ *
+ * Scope:  Local
+ *
+ * Orders pool addresses numerically. Used by qsort and bsearch.
+ *
+ *---------------------------------------------------------------------*/
+static int addr_cmp(const void *a, const void *b)
+{
+  uint32_t x = ntohl(((const sr_nat_addr_t *) a)->ip);
+  uint32_t y = ntohl(((const sr_nat_addr_t *) b)->ip);
+  return (x > y) - (x < y);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_add
+ *
+ * Scope:  Global
+ *
+ * Adds 'count' consecutive addresses starting at 'first' to the pool.
+ *
+ *  parameters:
+ *    pool      - the pool to add to
+ *    first     - the first address, network byte order
+ *    count     - the number of addresses, at most 65536
+ *    iface     - the interface that answers ARP for them. NULL or
+ *                empty for the NAT's external interface
+ *
+ * returns:
+ *    0 on success, -1 if the range is too large or overlaps addresses
+ *    already in the pool
+ *
+ *---------------------------------------------------------------------*/
+int sr_nat_pool_add(sr_nat_pool_t *pool, uint32_t first, unsigned int count, const char *iface)
+{
+  if ((count == 0) || (count > POOL_MAX_RANGE) || (ntohl(first) + (uint64_t) count > 1ull << 32))
+    return -1;
+  //hosts point into the array, so it can only change while unused
+  if (pool->nhosts != 0)
+    return -1;
+  for (unsigned int i = 0; i < count; i++)
+    if (sr_nat_pool_find(pool, htonl(ntohl(first) + i)) != NULL)
+      return -1;
+
+  sr_nat_addr_t *addrs = realloc(pool->addrs, (pool->naddrs + count) * sizeof(*addrs));
+  if (addrs == NULL)
+    return -1;
+  pool->addrs = addrs;
+
+  for (unsigned int i = 0; i < count; i++) {
+    sr_nat_addr_t *addr = &addrs[pool->naddrs + i];
+    memset(addr, 0, sizeof(*addr));
+    addr->ip = htonl(ntohl(first) + i);
+    if (iface != NULL)
+      strncpy(addr->iface, iface, sr_IFACE_NAMELEN - 1);
+  }
+  pool->naddrs += count;
+  qsort(addrs, pool->naddrs, sizeof(*addrs), addr_cmp);
+  return 0;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_parse
+ *
+ * Scope:  Global
+ *
+ * Adds the addresses of a pool specification to the pool. The
+ * specification is a comma separated list of 'address[/len][@iface]',
+ * e.g. "198.51.100.0/28@eth2,203.0.113.7". A prefix adds every address
+ * in it; the prefix length must be 16 or more.
+ *
+ * returns:
+ *    0 on success, -1 on a malformed or overlapping entry
+ *
+ *---------------------------------------------------------------------*/
+int sr_nat_pool_parse(sr_nat_pool_t *pool, const char *spec)
+{
+  char *copy = strdup(spec);
+  char *save = NULL;
+  int ret = 0;
+
+  for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+    char *iface = strchr(item, '@');
+    if (iface != NULL)
+      *iface++ = '\0';
+
+    unsigned int len = 32;
+    char *slash = strchr(item, '/');
+    if (slash != NULL) {
+      char *end;
+      *slash++ = '\0';
+      len = strtoul(slash, &end, 10);
+      if ((*end != '\0') || (len < 16) || (len > 32)) {
+        ret = -1;
+        break;
+      }
+    }
+
+    struct in_addr ip;
+    if ((inet_pton(AF_INET, item, &ip) != 1) ||
+        ((iface != NULL) && (strlen(iface) >= sr_IFACE_NAMELEN))) {
+      ret = -1;
+      break;
+    }
+
+    uint32_t mask = (len == 32) ? 0xffffffff : ~(0xffffffffu >> len);
+    uint32_t first = htonl(ntohl(ip.s_addr) & mask);
+    if (sr_nat_pool_add(pool, first, 1u << (32 - len), iface) != 0) {
+      ret = -1;
+      break;
+    }
+  }
+
+  free(copy);
+  return ret;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_find
+ *
+ * Scope:  Global
+ *
+ * returns the pool entry for an external address, or NULL if the
+ * address is not in the pool
+ *
+ *---------------------------------------------------------------------*/
+sr_nat_addr_t *sr_nat_pool_find(sr_nat_pool_t *pool, uint32_t ip)
+{
+  sr_nat_addr_t key = { .ip = ip };
+  if (pool->naddrs == 0)
+    return NULL;
+  return bsearch(&key, pool->addrs, pool->naddrs, sizeof(key), addr_cmp);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_answers_arp
+ *
+ * Scope:  Global
+ *
+ * returns true if the router should answer ARP requests for 'ip' on
+ * 'iface', i.e. if it is a pool address that lives on that interface
+ *
+ *---------------------------------------------------------------------*/
+bool sr_nat_pool_answers_arp(struct sr_instance *sr, uint32_t ip, sr_if_t *iface)
+{
+  sr_nat_addr_t *addr = sr_nat_pool_find(&sr->nat.pool, ip);
+  if (addr == NULL)
+    return false;
+  if (addr->iface[0] != '\0')
+    return strcmp(addr->iface, iface->name) == 0;
+  return iface == get_external_iface(sr);
+}
+
+
+/*---------------------------------------------------------------------
+ * Host table
+ *
+ * Internal hosts that hold blocks, hashed on their address. The table
+ * doubles once it holds as many hosts as buckets.
+ *
+ *---------------------------------------------------------------------*/
+static inline unsigned int host_bucket(sr_nat_pool_t *pool, uint32_t ip_int)
+{
+  return sr_nat_hash(ip_int) & (pool->host_index_size - 1);
+}
+
+static sr_nat_host_t *host_lookup(sr_nat_pool_t *pool, uint32_t ip_int)
+{
+  if (pool->host_index_size == 0)
+    return NULL;
+  for (sr_nat_host_t *host = pool->hosts[host_bucket(pool, ip_int)]; host != NULL; host = host->next)
+    if (host->ip_int == ip_int)
+      return host;
+  return NULL;
+}
+
+static void host_index_grow(sr_nat_pool_t *pool)
+{
+  unsigned int old_size = pool->host_index_size;
+  sr_nat_host_t **old = pool->hosts;
+
+  pool->host_index_size = old_size ? old_size * 2 : POOL_HOST_INDEX_MIN;
+  pool->hosts = calloc(pool->host_index_size, sizeof(*pool->hosts));
+  assert(pool->hosts);
+
+  for (unsigned int i = 0; i < old_size; i++) {
+    for (sr_nat_host_t *host = old[i], *next; host != NULL; host = next) {
+      next = host->next;
+      unsigned int b = host_bucket(pool, host->ip_int);
+      host->next = pool->hosts[b];
+      pool->hosts[b] = host;
+    }
+  }
+  free(old);
+}
+
+static sr_nat_host_t *host_create(sr_nat_pool_t *pool, uint32_t ip_int, sr_nat_addr_t *addr)
+{
+  if (pool->nhosts >= pool->host_index_size)
+    host_index_grow(pool);
+
+  sr_nat_host_t *host = calloc(1, sizeof(*host));
+  host->ip_int = ip_int;
+  host->addr = addr;
+  unsigned int b = host_bucket(pool, ip_int);
+  host->next = pool->hosts[b];
+  pool->hosts[b] = host;
+  pool->nhosts++;
+  return host;
+}
+
+/* The next address, round robin, that still has a free block. */
+static sr_nat_addr_t *pool_next_addr(sr_nat_pool_t *pool)
+{
+  for (unsigned int i = 0; i < pool->naddrs; i++) {
+    sr_nat_addr_t *addr = &pool->addrs[(pool->cursor + i) % pool->naddrs];
+    if (addr->nblocks < NAT_BLOCKS_PER_ADDR) {
+      pool->cursor = (pool->cursor + i + 1) % pool->naddrs;
+      return addr;
+    }
+  }
+  return NULL;
+}
+
+static void host_destroy(sr_nat_pool_t *pool, sr_nat_host_t *host)
+{
+  sr_nat_host_t **pp = &pool->hosts[host_bucket(pool, host->ip_int)];
+  while (*pp != host)
+    pp = &(*pp)->next;
+  *pp = host->next;
+  pool->nhosts--;
+  free(host);
+}
+
+
+/*---------------------------------------------------------------------
+ * Blocks
+ *
+ *---------------------------------------------------------------------*/
+/* Gives block 'k' of the host's address to the host. */
+static sr_nat_block_t *block_create_at(sr_nat_host_t *host, unsigned int k)
+{
+  sr_nat_addr_t *addr = host->addr;
+
+  assert(k < NAT_BLOCKS_PER_ADDR);
+  assert(!(addr->blocks[k / 64] & (1ull << (k % 64))));
+  addr->blocks[k / 64] |= 1ull << (k % 64);
+  addr->nblocks++;
+
+  sr_nat_block_t *block = calloc(1, sizeof(*block));
+  block->host = host;
+  block->first = MIN_AUX_VALUE + k * NAT_PORT_BLOCK_SIZE;
+  block->next = host->blocks;
+  host->blocks = block;
+  host->nblocks++;
+
+  sr_stats_gauge(gauge_nat_port_blocks, 1);
+  sr_trace(trace_nat_block,"port block [%I]:%u-%u allocated to [%I]",addr->ip,block->first,
+           block->first + NAT_PORT_BLOCK_SIZE - 1,host->ip_int);
+  return block;
+}
+
+/* Gives the host the lowest free block of its address. */
+static sr_nat_block_t *block_create(sr_nat_host_t *host)
+{
+  sr_nat_addr_t *addr = host->addr;
+
+  if ((host->nblocks >= NAT_MAX_BLOCKS_PER_HOST) || (addr->nblocks >= NAT_BLOCKS_PER_ADDR))
+    return NULL;
+
+  for (unsigned int w = 0; w < sizeof(addr->blocks) / sizeof(addr->blocks[0]); w++)
+    if (~addr->blocks[w] != 0)
+      return block_create_at(host, w * 64 + __builtin_ctzll(~addr->blocks[w]));
+  return NULL;
+}
+
+static void block_destroy(sr_nat_pool_t *pool, sr_nat_block_t *block)
+{
+  sr_nat_host_t *host = block->host;
+  sr_nat_addr_t *addr = host->addr;
+  unsigned int k = (block->first - MIN_AUX_VALUE) / NAT_PORT_BLOCK_SIZE;
+
+  sr_trace(trace_nat_block,"port block [%I]:%u-%u released by [%I]",addr->ip,block->first,
+           block->first + NAT_PORT_BLOCK_SIZE - 1,host->ip_int);
+  sr_stats_gauge(gauge_nat_port_blocks, -1);
+
+  addr->blocks[k / 64] &= ~(1ull << (k % 64));
+  addr->nblocks--;
+
+  sr_nat_block_t **pp = &host->blocks;
+  while (*pp != block)
+    pp = &(*pp)->next;
+  *pp = block->next;
+  free(block);
+
+  if (--host->nblocks == 0)
+    host_destroy(pool, host);
+}
+
+/* The port forwards of 'type' over the ports of 'block', NULL if none. */
+static const uint64_t *block_statics(sr_nat_block_t *block, sr_nat_mapping_type type)
+{
+  const uint64_t *statics = block->host->addr->statics;
+  if (statics == NULL)
+    return NULL;
+  return statics + type * POOL_STATIC_WORDS + (block->first - MIN_AUX_VALUE) / 64;
+}
+
+/* Takes the lowest free port of 'type' in the block, -1 if it is full. */
+static int block_take(sr_nat_block_t *block, sr_nat_mapping_type type)
+{
+  uint64_t *ports = block->ports[type];
+  const uint64_t *statics = block_statics(block, type);
+  for (unsigned int w = 0; w < NAT_PORT_BLOCK_SIZE / 64; w++) {
+    uint64_t taken = ports[w] | (statics ? statics[w] : 0);
+    if (~taken != 0) {
+      unsigned int bit = __builtin_ctzll(~taken);
+      ports[w] |= 1ull << bit;
+      block->used++;
+      return block->first + w * 64 + bit;
+    }
+  }
+  return -1;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_default
+ *
+ * Scope:  Global
+ *
+ * Falls back on the external interface's address if no pool is set.
+ * Called once the interfaces are known and before the first packet: by
+ * sr_nat_init, or for VNS when the hardware info arrives.
+ *
+ * returns:
+ *    0 on success, -1 if there is no external interface
+ *
+ *---------------------------------------------------------------------*/
+int sr_nat_pool_default(struct sr_instance *sr)
+{
+  sr_nat_pool_t *pool = &sr->nat.pool;
+  int ret = 0;
+
+  pthread_mutex_lock(&(sr->nat.lock));
+  if (pool->naddrs == 0) {
+    sr_if_t *ext_iface = get_external_iface(sr);
+    ret = (ext_iface == NULL) ? -1 : sr_nat_pool_add(pool, ext_iface->ip, 1, NULL);
+  }
+  pthread_mutex_unlock(&(sr->nat.lock));
+  return ret;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_alloc
+ *
+ * Scope:  Global
+ *
+ * Allocates an external port (or ICMP id) of the given type for an
+ * internal host, from one of the host's blocks or from a new block on
+ * the host's paired address.
+ *
+ *  parameters:
+ *    sr        - a reference to the router structure
+ *    ip_int    - the internal host
+ *    type      - the port space to allocate from
+ *    aux_ext   - filled with the port, network byte order
+ *
+ * returns:
+ *    the block the port belongs to, with the external address in
+ *    block->host->addr, or NULL if the host's share or the pool is
+ *    exhausted
+ *
+ *---------------------------------------------------------------------*/
+sr_nat_block_t *sr_nat_pool_alloc(struct sr_instance *sr, uint32_t ip_int,
+                                  sr_nat_mapping_type type, uint16_t *aux_ext)
+{
+  sr_nat_pool_t *pool = &sr->nat.pool;
+
+  sr_nat_host_t *host = host_lookup(pool, ip_int);
+  if (host == NULL) {
+    sr_nat_addr_t *addr = pool_next_addr(pool);
+    if (addr == NULL)
+      return NULL;
+    host = host_create(pool, ip_int, addr);
+  }
+
+  for (sr_nat_block_t *block = host->blocks; block != NULL; block = block->next) {
+    int port = block_take(block, type);
+    if (port >= 0) {
+      *aux_ext = htons(port);
+      return block;
+    }
+  }
+
+  sr_nat_block_t *block = block_create(host);
+  if (block == NULL) {
+    if (host->nblocks == 0)
+      host_destroy(pool, host);
+    return NULL;
+  }
+  *aux_ext = htons(block_take(block, type));
+  return block;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_reserve
+ *
+ * Scope:  Global
+ *
+ * Takes one specific external port for an internal host, for restoring
+ * mappings from a checkpoint. The host is paired with 'ip_ext' and gets
+ * the block that holds the port if it does not have it yet; the per
+ * host block limit is not applied.
+ *
+ * returns:
+ *    the block the port belongs to, or NULL if 'ip_ext' is not in the
+ *    pool, the host is paired with another address, the port or its
+ *    block is taken, or the port is a port forward's
+ *
+ *---------------------------------------------------------------------*/
+sr_nat_block_t *sr_nat_pool_reserve(struct sr_instance *sr, uint32_t ip_int, uint32_t ip_ext,
+                                    sr_nat_mapping_type type, uint16_t aux_ext)
+{
+  sr_nat_pool_t *pool = &sr->nat.pool;
+  unsigned int port = ntohs(aux_ext);
+
+  if (port < MIN_AUX_VALUE)
+    return NULL;
+  unsigned int k = (port - MIN_AUX_VALUE) / NAT_PORT_BLOCK_SIZE;
+  sr_nat_addr_t *addr = sr_nat_pool_find(pool, ip_ext);
+  if ((addr == NULL) || (k >= NAT_BLOCKS_PER_ADDR))
+    return NULL;
+  unsigned int bit = port - MIN_AUX_VALUE;
+  if ((addr->statics != NULL) &&
+      (addr->statics[type * POOL_STATIC_WORDS + bit / 64] & (1ull << (bit % 64))))
+    return NULL;
+
+  sr_nat_host_t *host = host_lookup(pool, ip_int);
+  if ((host != NULL) && (host->addr != addr))
+    return NULL;
+
+  sr_nat_block_t *block = NULL;
+  if (host != NULL)
+    for (block = host->blocks; block != NULL; block = block->next)
+      if (block->first == MIN_AUX_VALUE + k * NAT_PORT_BLOCK_SIZE)
+        break;
+
+  if (block == NULL) {
+    if (addr->blocks[k / 64] & (1ull << (k % 64)))
+      return NULL;  //another host's block
+    if (host == NULL)
+      host = host_create(pool, ip_int, addr);
+    block = block_create_at(host, k);
+  }
+
+  unsigned int off = port - block->first;
+  if (block->ports[type][off / 64] & (1ull << (off % 64)))
+    return NULL;
+  block->ports[type][off / 64] |= 1ull << (off % 64);
+  block->used++;
+  return block;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_set_static
+ *
+ * Scope:  Global
+ *
+ * Marks an external port as used by a port forward, or no longer, so
+ * that sr_nat_pool_alloc skips it. Ports below MIN_AUX_VALUE and
+ * addresses outside the pool are never allocated and are left alone.
+ * The caller evicts a dynamic mapping that holds the port.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_pool_set_static(struct sr_instance *sr, uint32_t ip_ext, sr_nat_mapping_type type,
+                            uint16_t aux_ext, bool on)
+{
+  unsigned int port = ntohs(aux_ext);
+
+  if (port < MIN_AUX_VALUE)
+    return;
+  sr_nat_addr_t *addr = sr_nat_pool_find(&sr->nat.pool, ip_ext);
+  if ((addr == NULL) || (port - MIN_AUX_VALUE >= NAT_BLOCKS_PER_ADDR * NAT_PORT_BLOCK_SIZE))
+    return;
+  if (addr->statics == NULL) {
+    if (!on)
+      return;
+    addr->statics = calloc(NAT_MAPPING_TYPES * POOL_STATIC_WORDS, sizeof(uint64_t));
+    assert(addr->statics);
+  }
+
+  unsigned int bit = port - MIN_AUX_VALUE;
+  uint64_t *word = &addr->statics[type * POOL_STATIC_WORDS + bit / 64];
+  if (on)
+    *word |= 1ull << (bit % 64);
+  else
+    *word &= ~(1ull << (bit % 64));
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_release
+ *
+ * Scope:  Global
+ *
+ * Returns a port taken by sr_nat_pool_alloc. The block is released with
+ * its last port, and the host with its last block.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_pool_release(sr_nat_pool_t *pool, sr_nat_block_t *block,
+                         sr_nat_mapping_type type, uint16_t aux_ext)
+{
+  unsigned int off = ntohs(aux_ext) - block->first;
+  assert(off < NAT_PORT_BLOCK_SIZE);
+  assert(block->ports[type][off / 64] & (1ull << (off % 64)));
+
+  block->ports[type][off / 64] &= ~(1ull << (off % 64));
+  if (--block->used == 0)
+    block_destroy(pool, block);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_clear
+ *
+ * Scope:  Global
+ *
+ * Releases every block and host, keeping the addresses and the ports
+ * of port forwards. For use when all mappings are dropped at once.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_pool_clear(sr_nat_pool_t *pool)
+{
+  for (unsigned int i = 0; i < pool->host_index_size; i++) {
+    while (pool->hosts[i] != NULL) {
+      sr_nat_host_t *host = pool->hosts[i];
+      pool->hosts[i] = host->next;
+      while (host->blocks != NULL) {
+        sr_nat_block_t *block = host->blocks;
+        host->blocks = block->next;
+        free(block);
+        sr_stats_gauge(gauge_nat_port_blocks, -1);
+      }
+      free(host);
+    }
+  }
+  free(pool->hosts);
+  pool->hosts = NULL;
+  pool->host_index_size = 0;
+  pool->nhosts = 0;
+  pool->cursor = 0;
+
+  for (unsigned int i = 0; i < pool->naddrs; i++) {
+    pool->addrs[i].nblocks = 0;
+    memset(pool->addrs[i].blocks, 0, sizeof(pool->addrs[i].blocks));
+  }
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_pool_destroy
+ *
+ * Scope:  Global
+ *
+ * Releases everything, addresses included.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_pool_destroy(sr_nat_pool_t *pool)
+{
+  sr_nat_pool_clear(pool);
+  for (unsigned int i = 0; i < pool->naddrs; i++)
+    free(pool->addrs[i].statics);
+  free(pool->addrs);
+  pool->addrs = NULL;
+  pool->naddrs = 0;
+}
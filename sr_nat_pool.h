@@ -0,0 +1,37 @@
+
+#ifndef SR_NAT_POOL_H
+#define SR_NAT_POOL_H
+
+#include "sr_router.h"
+#include "sr_nat.h"
+
+
+int sr_nat_pool_add(sr_nat_pool_t *pool, uint32_t first, unsigned int count, const char *iface);
+
+int sr_nat_pool_parse(sr_nat_pool_t *pool, const char *spec);
+
+int sr_nat_pool_default(struct sr_instance *sr);
+
+sr_nat_addr_t *sr_nat_pool_find(sr_nat_pool_t *pool, uint32_t ip);
+
+bool sr_nat_pool_answers_arp(struct sr_instance *sr, uint32_t ip, sr_if_t *iface);
+
+sr_nat_block_t *sr_nat_pool_alloc(struct sr_instance *sr, uint32_t ip_int,
+                                  sr_nat_mapping_type type, uint16_t *aux_ext);
+
+sr_nat_block_t *sr_nat_pool_reserve(struct sr_instance *sr, uint32_t ip_int, uint32_t ip_ext,
+                                    sr_nat_mapping_type type, uint16_t aux_ext);
+
+void sr_nat_pool_set_static(struct sr_instance *sr, uint32_t ip_ext, sr_nat_mapping_type type,
+                            uint16_t aux_ext, bool on);
+
+void sr_nat_pool_release(sr_nat_pool_t *pool, sr_nat_block_t *block,
+                         sr_nat_mapping_type type, uint16_t aux_ext);
+
+void sr_nat_pool_clear(sr_nat_pool_t *pool);
+
+void sr_nat_pool_destroy(sr_nat_pool_t *pool);
+
+
+
+#endif /* SR_NAT_POOL_H */
@@ -0,0 +1,657 @@
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sr_nat.h"
+#include "sr_nat_sync.h"
+#include "sr_nat_lb.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+
+/*
+ * NAT state replication.
+ *
+ * The active instance turns every mapping created or removed, and every
+ * TCP connection opened, changed or expired, into a fixed size event.
+ * The packet path only appends the event to a queue (all call sites hold
+ * the NAT lock; the queue has its own lock so that the sender never has
+ * to take the NAT lock for a normal send). Every SR_NAT_SYNC_BATCH_MS a
+ * sender thread swaps the queue for an empty one and writes it out as a
+ * batch.
+ *
+ * If the queue fills up, because the standby is slow or not connected,
+ * the backlog is dropped and the next send is a full resync instead: the
+ * whole table, bracketed by resync begin/end events. It is copied a chunk
+ * at a time, dropping the NAT lock in between; a cursor remembers where
+ * the copy stands and is moved along when that mapping is removed. A new
+ * connection always starts with a resync.
+ *
+ * The standby applies the events to its own table with the same external
+ * addresses and ports, so both instances must have the same address pool.
+ * It does not expire anything while it follows an active instance; once
+ * the connection drops it restarts every idle timer and takes over.
+ */
+
+#define SYNC_RECV_BUF (64 * 1024)
+#define SYNC_RESYNC_CHUNK 256   /* mappings copied per hold of the NAT lock */
+
+static void sync_sleep_ms(unsigned int ms)
+{
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+static bool sync_active(struct sr_nat *nat)
+{
+  return (nat->sync != NULL) && !nat->sync->standby;
+}
+
+static void sync_queue(struct sr_nat_sync *sync, const struct sr_nat_sync_msg *msg)
+{
+  pthread_mutex_lock(&sync->lock);
+  sync->events++;
+  if (!sync->resync) {
+    if (sync->queued < SR_NAT_SYNC_QUEUE) {
+      sync->queue[sync->queued++] = *msg;
+    } else {
+      //a resync covers everything queued so far
+      sync->resync = true;
+      sync->queued = 0;
+    }
+  }
+  pthread_mutex_unlock(&sync->lock);
+}
+
+static void sync_mapping_msg(struct sr_nat_sync_msg *msg, const sr_nat_mapping_t *map,
+                             sr_nat_sync_kind kind)
+{
+  memset(msg, 0, sizeof(*msg));
+  msg->kind = kind;
+  msg->type = map->type;
+  msg->ip_int = map->ip_int;
+  msg->ip_ext = map->ip_ext;
+  msg->aux_int = map->aux_int;
+  msg->aux_ext = map->aux_ext;
+}
+
+static void sync_conn_msg(struct sr_nat_sync_msg *msg, const sr_nat_mapping_t *map,
+                          const sr_nat_connection_t *conn, sr_nat_sync_kind kind)
+{
+  sync_mapping_msg(msg, map, kind);
+  msg->state = conn->state;
+  msg->dest_ip = conn->dest_ip;
+  msg->dest_port = conn->dest_port;
+  msg->fin_sent_seqno = conn->fin_sent_seqno;
+  msg->fin_recv_seqno = conn->fin_recv_seqno;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_mapping
+ *
+ * Scope:  Global
+ *
+ * Queues the creation ('add') or removal of a mapping for the standby.
+ * Does nothing unless this instance replicates to one. The caller holds
+ * the NAT lock.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_sync_mapping(struct sr_nat *nat, const sr_nat_mapping_t *map, bool add)
+{
+  if (!sync_active(nat))
+    return;
+
+  struct sr_nat_sync_msg msg;
+  sync_mapping_msg(&msg, map, add ? sync_mapping_add : sync_mapping_del);
+  sync_queue(nat->sync, &msg);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_conn
+ *
+ * Scope:  Global
+ *
+ * Queues a new or changed TCP connection of 'map', or its removal
+ * ('del'), for the standby. The caller holds the NAT lock.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_sync_conn(struct sr_nat *nat, const sr_nat_mapping_t *map,
+                      const sr_nat_connection_t *conn, bool del)
+{
+  if (!sync_active(nat))
+    return;
+
+  struct sr_nat_sync_msg msg;
+  sync_conn_msg(&msg, map, conn, del ? sync_conn_del : sync_conn);
+  sync_queue(nat->sync, &msg);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_resync
+ *
+ * Scope:  Global
+ *
+ * Drops the queued events and has the next send carry the full table.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_sync_resync(struct sr_nat *nat)
+{
+  if (!sync_active(nat))
+    return;
+
+  pthread_mutex_lock(&nat->sync->lock);
+  nat->sync->resync = true;
+  nat->sync->queued = 0;
+  pthread_mutex_unlock(&nat->sync->lock);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_unlink
+ *
+ * Scope:  Global
+ *
+ * Moves a resync in progress past 'map', which is about to be freed.
+ * The caller holds the NAT lock.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_sync_unlink(struct sr_nat *nat, const sr_nat_mapping_t *map)
+{
+  if ((nat->sync != NULL) && (nat->sync->cursor == map))
+    nat->sync->cursor = map->next;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_following
+ *
+ * Scope:  Global
+ *
+ * returns true while this instance is a standby with an active instance
+ * connected, i.e. while its table is maintained by the other side.
+ *
+ *---------------------------------------------------------------------*/
+bool sr_nat_sync_following(struct sr_nat *nat)
+{
+  return (nat->sync != NULL) && nat->sync->standby &&
+         __atomic_load_n(&nat->sync->following, __ATOMIC_RELAXED);
+}
+
+
+/* -- active side ------------------------------------------------------ */
+
+static int sync_send(int fd, const struct sr_nat_sync_msg *msgs, uint32_t count)
+{
+  struct sr_nat_sync_batch batch = { SR_NAT_SYNC_MAGIC, count };
+  const uint8_t *parts[2] = { (const uint8_t *) &batch, (const uint8_t *) msgs };
+  size_t lens[2] = { sizeof(batch), (size_t) count * sizeof(*msgs) };
+
+  for (int i = 0; i < 2; i++) {
+    for (size_t off = 0; off < lens[i];) {
+      ssize_t n = send(fd, parts[i] + off, lens[i] - off, MSG_NOSIGNAL | (i == 0 ? MSG_MORE : 0));
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+      off += n;
+    }
+  }
+  return 0;
+}
+
+/* Count the events of the next chunk of mappings, from the cursor on. */
+static uint32_t sync_chunk_count(const struct sr_nat_sync *sync)
+{
+  uint32_t count = 0;
+  unsigned int n = 0;
+
+  for (sr_nat_mapping_t *map = sync->cursor; (map != NULL) && (n < SYNC_RESYNC_CHUNK); map = map->next, n++) {
+    count += !map->is_static;
+    for (sr_nat_connection_t *conn = map->conns; conn != NULL; conn = conn->next)
+      count++;
+  }
+  return count;
+}
+
+/* Copy the table SYNC_RESYNC_CHUNK mappings per hold of the NAT lock and
+   send every chunk as its own batch. Mappings linked while the lock is
+   dropped go in front of the cursor; they, and changes to mappings
+   already copied, reach the standby as queued events after the end. */
+static int sync_send_table(struct sr_instance *sr)
+{
+  struct sr_nat *nat = &sr->nat;
+  struct sr_nat_sync *sync = nat->sync;
+  struct sr_nat_sync_msg *msgs = NULL;
+  uint32_t cap = 0, total = 0;
+  bool first = true, last = false;
+  int ret = 0;
+
+  pthread_mutex_lock(&(nat->lock));
+
+  //from here on the queue only holds events newer than the copy
+  pthread_mutex_lock(&sync->lock);
+  sync->resync = false;
+  sync->queued = 0;
+  sync->resyncs++;
+  pthread_mutex_unlock(&sync->lock);
+  sync->cursor = nat->mappings;
+
+  while (!last) {
+    //room for the resync begin and end as well
+    uint32_t count = sync_chunk_count(sync) + 2;
+    if (count > cap) {
+      pthread_mutex_unlock(&(nat->lock));
+      free(msgs);
+      cap = count * 2;
+      msgs = malloc(cap * sizeof(*msgs));
+      pthread_mutex_lock(&(nat->lock));
+      if (msgs == NULL) {
+        sr_nat_sync_resync(nat);
+        ret = -1;
+        break;
+      }
+      //the chunk may have changed meanwhile
+      continue;
+    }
+
+    struct sr_nat_sync_msg *msg = msgs;
+    if (first) {
+      memset(msg, 0, sizeof(*msg));
+      (msg++)->kind = sync_resync_begin;
+    }
+    for (unsigned int n = 0; (sync->cursor != NULL) && (n < SYNC_RESYNC_CHUNK); n++) {
+      sr_nat_mapping_t *map = sync->cursor;
+      if (!map->is_static)
+        sync_mapping_msg(msg++, map, sync_mapping_add);
+      for (sr_nat_connection_t *conn = map->conns; conn != NULL; conn = conn->next)
+        sync_conn_msg(msg++, map, conn, sync_conn);
+      sync->cursor = map->next;
+    }
+    last = (sync->cursor == NULL);
+    if (last) {
+      memset(msg, 0, sizeof(*msg));
+      (msg++)->kind = sync_resync_end;
+    }
+    assert(msg <= msgs + count);
+
+    pthread_mutex_unlock(&(nat->lock));
+    count = msg - msgs;
+    total += count;
+    ret = sync_send(sync->fd, msgs, count);
+    pthread_mutex_lock(&(nat->lock));
+    if (ret != 0)
+      break;
+    first = false;
+  }
+
+  sync->cursor = NULL;
+  pthread_mutex_unlock(&(nat->lock));
+  free(msgs);
+  if (ret == 0)
+    sr_trace(trace_nat,"resynced standby with [%u] events",total);
+  return ret;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_flush
+ *
+ * Scope:  Global
+ *
+ * Sends the queued events to the standby over 'sync->fd', or the full
+ * table if a resync is due. Called by the sender thread; the packet path
+ * keeps queueing meanwhile.
+ *
+ * returns:
+ *    0 on success, -1 if the connection failed
+ *
+ *---------------------------------------------------------------------*/
+int sr_nat_sync_flush(struct sr_instance *sr)
+{
+  struct sr_nat_sync *sync = sr->nat.sync;
+
+  pthread_mutex_lock(&sync->lock);
+  bool resync = sync->resync;
+  unsigned int count = sync->queued;
+  if (!resync) {
+    struct sr_nat_sync_msg *sending = sync->queue;
+    sync->queue = sync->sending;
+    sync->sending = sending;
+    sync->queued = 0;
+  }
+  pthread_mutex_unlock(&sync->lock);
+
+  if (resync)
+    return sync_send_table(sr);
+  if (count == 0)
+    return 0;
+  return sync_send(sync->fd, sync->sending, count);
+}
+
+static int sync_connect(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct timeval tv = { 1, 0 };
+
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  //a standby that stops reading costs a reconnect and a resync, but
+  //never stalls the sender for long
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+static void *sync_sender_thread(void *sr_ptr)
+{
+  struct sr_instance *sr = (struct sr_instance *) sr_ptr;
+  struct sr_nat_sync *sync = sr->nat.sync;
+
+  while (1) {
+    if (sync->fd < 0) {
+      sync->fd = sync_connect(sync->path);
+      if (sync->fd < 0) {
+        sync_sleep_ms(1000);
+        continue;
+      }
+      fprintf(stderr,"NAT standby connected on %s\n",sync->path);
+      sr_nat_sync_resync(&sr->nat);
+    }
+    if (sr_nat_sync_flush(sr) != 0) {
+      fprintf(stderr,"NAT standby on %s lost\n",sync->path);
+      close(sync->fd);
+      sync->fd = -1;
+    }
+    sync_sleep_ms(SR_NAT_SYNC_BATCH_MS);
+  }
+  return NULL;
+}
+
+
+/* -- standby side ----------------------------------------------------- */
+
+static void sync_apply_conn(struct sr_nat *nat, const struct sr_nat_sync_msg *msg, time_t now)
+{
+  sr_nat_mapping_t *map = sr_nat_lookup_external(nat,msg->ip_ext,msg->aux_ext,nat_mapping_tcp);
+  //the backends of a virtual service share the external port
+  if ((map != NULL) && (map->vip != NULL))
+    map = sr_nat_lookup_internal(nat,msg->ip_int,msg->aux_int,nat_mapping_tcp);
+  if ((map == NULL) || (msg->state > tcp_state_time_wait))
+    return;
+
+  sr_nat_connection_t **pp;
+  for (pp = &map->conns; *pp != NULL; pp = &(*pp)->next)
+    if (((*pp)->dest_ip == msg->dest_ip) && ((*pp)->dest_port == msg->dest_port))
+      break;
+
+  if (msg->kind == sync_conn_del) {
+    if (*pp != NULL) {
+      sr_nat_connection_t *conn = *pp;
+      *pp = conn->next;
+      free(conn);
+      sr_stats_gauge(gauge_nat_tcp_conns, -1);
+    }
+    return;
+  }
+
+  sr_nat_connection_t *conn = *pp;
+  if (conn == NULL) {
+    conn = malloc(sizeof(sr_nat_connection_t));
+    conn->dest_ip = msg->dest_ip;
+    conn->dest_port = msg->dest_port;
+    conn->next = map->conns;
+    map->conns = conn;
+    sr_stats_gauge(gauge_nat_tcp_conns, 1);
+    sr_nat_lb_pin(nat,map,conn->dest_ip,conn->dest_port);
+  }
+  conn->state = msg->state;
+  conn->fin_sent_seqno = msg->fin_sent_seqno;
+  conn->fin_recv_seqno = msg->fin_recv_seqno;
+  conn->last_updated = now;
+  map->last_updated = now;
+}
+
+static void sync_apply_msg(struct sr_instance *sr, const struct sr_nat_sync_msg *msg, time_t now)
+{
+  struct sr_nat *nat = &sr->nat;
+  sr_nat_mapping_t *map;
+
+  switch (msg->kind) {
+    case sync_mapping_add:
+    case sync_mapping_del:
+      if (msg->type >= NAT_MAPPING_TYPES)
+        break;
+      map = sr_nat_lookup_external(nat,msg->ip_ext,msg->aux_ext,msg->type);
+      if ((map != NULL) && map->is_static)
+        break;  //port forwards are configured on each side
+      if (map != NULL)
+        sr_nat_remove_mapping(nat,map);
+      if (msg->kind == sync_mapping_add)
+        sr_nat_restore_mapping(sr,msg->type,msg->ip_int,msg->aux_int,msg->ip_ext,msg->aux_ext,now);
+      break;
+    case sync_conn:
+    case sync_conn_del:
+      sync_apply_conn(nat,msg,now);
+      break;
+    case sync_resync_begin:
+      sr_nat_clear(nat);
+      break;
+    case sync_resync_end:
+      sr_trace(trace_nat,"standby resynced");
+      break;
+    default:
+      //newer event kinds are skipped
+      break;
+  }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_apply
+ *
+ * Scope:  Global
+ *
+ * Applies the complete events at the start of 'buf', a piece of the
+ * stream from the active instance, to the NAT of a standby.
+ *
+ * returns:
+ *    the number of bytes consumed; the rest must be passed again with
+ *    the following data. -1 if the stream is not a sync stream
+ *
+ *---------------------------------------------------------------------*/
+long sr_nat_sync_apply(struct sr_instance *sr, const uint8_t *buf, size_t len)
+{
+  struct sr_nat *nat = &sr->nat;
+  struct sr_nat_sync *sync = nat->sync;
+  size_t off = 0;
+
+  pthread_mutex_lock(&(nat->lock));
+
+  time_t now = sr_clock_now();
+  while (1) {
+    if (sync->batch_left == 0) {
+      const struct sr_nat_sync_batch *batch = (const struct sr_nat_sync_batch *) (buf + off);
+      if (len - off < sizeof(*batch))
+        break;
+      if (batch->magic != SR_NAT_SYNC_MAGIC) {
+        pthread_mutex_unlock(&(nat->lock));
+        return -1;
+      }
+      sync->batch_left = batch->count;
+      off += sizeof(*batch);
+      continue;
+    }
+    if (len - off < sizeof(struct sr_nat_sync_msg))
+      break;
+    sync_apply_msg(sr, (const struct sr_nat_sync_msg *) (buf + off), now);
+    off += sizeof(struct sr_nat_sync_msg);
+    sync->batch_left--;
+  }
+
+  pthread_mutex_unlock(&(nat->lock));
+  return off;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_lost
+ *
+ * Scope:  Global
+ *
+ * Called on a standby when the active instance goes away. Restarts the
+ * idle timer of every mapping and connection, as the standby has not
+ * seen their traffic, and resumes expiring them locally.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_sync_lost(struct sr_instance *sr)
+{
+  struct sr_nat *nat = &sr->nat;
+  unsigned int count = 0;
+
+  pthread_mutex_lock(&(nat->lock));
+  time_t now = sr_clock_now();
+  for (sr_nat_mapping_t *map = nat->mappings; map != NULL; map = map->next, count++) {
+    map->last_updated = now;
+    for (sr_nat_connection_t *conn = map->conns; conn != NULL; conn = conn->next)
+      conn->last_updated = now;
+  }
+  nat->sync->batch_left = 0;
+  __atomic_store_n(&nat->sync->following, false, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&(nat->lock));
+
+  fprintf(stderr,"NAT active instance lost, taking over %u mappings\n",count);
+}
+
+static int sync_listen(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  unlink(path);
+  if ((bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) || (listen(fd, 1) != 0)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void *sync_standby_thread(void *sr_ptr)
+{
+  struct sr_instance *sr = (struct sr_instance *) sr_ptr;
+  struct sr_nat_sync *sync = sr->nat.sync;
+  uint8_t *buf = malloc(SYNC_RECV_BUF);
+  assert(buf);
+
+  while (1) {
+    int fd = accept(sync->fd, NULL, NULL);
+    if (fd < 0) {
+      sync_sleep_ms(100);
+      continue;
+    }
+    fprintf(stderr,"NAT active instance connected on %s\n",sync->path);
+    __atomic_store_n(&sync->following, true, __ATOMIC_RELAXED);
+
+    size_t have = 0;
+    while (1) {
+      ssize_t n = read(fd, buf + have, SYNC_RECV_BUF - have);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      have += n;
+      long used = sr_nat_sync_apply(sr, buf, have);
+      if (used < 0)
+        break;
+      memmove(buf, buf + used, have - used);
+      have -= used;
+    }
+    close(fd);
+    sr_nat_sync_lost(sr);
+  }
+  return NULL;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_init
+ *
+ * Scope:  Global
+ *
+ * Sets up replication for an initialized NAT. An active instance
+ * connects to the standby listening on 'path', and reconnects whenever
+ * the connection drops; a standby listens on 'path'. With a NULL 'path'
+ * no thread is started and the caller drives sr_nat_sync_flush or
+ * sr_nat_sync_apply itself over 'sync->fd' (used by the tests).
+ *
+ * returns:
+ *    0 on success, -1 if the standby cannot listen on 'path'
+ *
+ *---------------------------------------------------------------------*/
+int sr_nat_sync_init(struct sr_instance *sr, const char *path, bool standby)
+{
+  struct sr_nat_sync *sync = calloc(1, sizeof(struct sr_nat_sync));
+  assert(sync);
+
+  sync->standby = standby;
+  sync->path = path;
+  sync->fd = -1;
+  sync->resync = true;
+  pthread_mutex_init(&sync->lock, NULL);
+  if (!standby) {
+    sync->queue = malloc(SR_NAT_SYNC_QUEUE * sizeof(struct sr_nat_sync_msg));
+    sync->sending = malloc(SR_NAT_SYNC_QUEUE * sizeof(struct sr_nat_sync_msg));
+    assert(sync->queue && sync->sending);
+  } else if (path != NULL && (sync->fd = sync_listen(path)) < 0) {
+    free(sync);
+    return -1;
+  }
+
+  pthread_mutex_lock(&(sr->nat.lock));
+  sr->nat.sync = sync;
+  pthread_mutex_unlock(&(sr->nat.lock));
+
+  if (path != NULL) {
+    pthread_create(&sync->thread, NULL, standby ? sync_standby_thread : sync_sender_thread, sr);
+    pthread_detach(sync->thread);
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_sync_destroy
+ *
+ * Scope:  Global
+ *
+ * Turns replication off again. Only for a NAT set up without a thread.
+ *
+ *---------------------------------------------------------------------*/
+void sr_nat_sync_destroy(struct sr_nat *nat)
+{
+  struct sr_nat_sync *sync = nat->sync;
+  if (sync == NULL)
+    return;
+
+  pthread_mutex_lock(&(nat->lock));
+  nat->sync = NULL;
+  pthread_mutex_unlock(&(nat->lock));
+
+  if (sync->fd >= 0)
+    close(sync->fd);
+  pthread_mutex_destroy(&sync->lock);
+  free(sync->queue);
+  free(sync->sending);
+  free(sync);
+}
@@ -0,0 +1,99 @@
+
+#ifndef SR_NAT_SYNC_H
+#define SR_NAT_SYNC_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "sr_router.h"
+#include "sr_nat.h"
+
+#define SR_NAT_SYNC_MAGIC    0x534e5359    /* "SNSY" */
+#define SR_NAT_SYNC_QUEUE    8192          /* events held between two sends */
+#define SR_NAT_SYNC_BATCH_MS 10            /* how often the queue is sent */
+
+typedef enum {
+  sync_mapping_add = 1,
+  sync_mapping_del,
+  sync_conn,              /* a connection was opened or changed state */
+  sync_conn_del,
+  sync_resync_begin,      /* the standby drops its table... */
+  sync_resync_end         /* ...and has the full table again */
+} sr_nat_sync_kind;
+
+/*
+ * Wire format, host byte order (both ends run on the same machine): a
+ * batch header, then 'count' events. Addresses and ports are in network
+ * byte order as in the NAT itself. Mappings are identified by their
+ * external (type, ip, port).
+ */
+struct sr_nat_sync_batch {
+  uint32_t magic;
+  uint32_t count;
+} __attribute__ ((packed));
+
+struct sr_nat_sync_msg {
+  uint8_t  kind;
+  uint8_t  type;
+  uint8_t  state;
+  uint8_t  pad;
+  uint32_t ip_int;
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+  uint32_t dest_ip;
+  uint16_t dest_port;
+  uint16_t pad2;
+  uint32_t fin_sent_seqno;
+  uint32_t fin_recv_seqno;
+} __attribute__ ((packed));
+
+struct sr_nat_sync {
+  bool standby;                   /* receiving rather than sending */
+  const char *path;               /* UNIX socket of the standby */
+  int fd;                         /* connection to the peer, -1 if none */
+
+  /* active side: events queued by the packet path. 'lock' only guards
+     the queue and is never held across I/O */
+  pthread_mutex_t lock;
+  struct sr_nat_sync_msg *queue;
+  struct sr_nat_sync_msg *sending;
+  unsigned int queued;
+  bool resync;                    /* queue overflowed or peer is new */
+  uint64_t events;
+  uint64_t resyncs;
+  sr_nat_mapping_t *cursor;       /* next mapping a resync copies, guarded
+                                     by the NAT lock. NULL when idle */
+
+  /* standby side */
+  bool following;                 /* an active instance is connected */
+  uint32_t batch_left;            /* events left in the current batch */
+
+  pthread_t thread;
+};
+typedef struct sr_nat_sync sr_nat_sync_t;
+
+
+int  sr_nat_sync_init(struct sr_instance *sr, const char *path, bool standby);
+
+void sr_nat_sync_destroy(struct sr_nat *nat);
+
+void sr_nat_sync_mapping(struct sr_nat *nat, const sr_nat_mapping_t *map, bool add);
+
+void sr_nat_sync_conn(struct sr_nat *nat, const sr_nat_mapping_t *map,
+                      const sr_nat_connection_t *conn, bool del);
+
+void sr_nat_sync_resync(struct sr_nat *nat);
+
+void sr_nat_sync_unlink(struct sr_nat *nat, const sr_nat_mapping_t *map);
+
+bool sr_nat_sync_following(struct sr_nat *nat);
+
+int  sr_nat_sync_flush(struct sr_instance *sr);
+
+long sr_nat_sync_apply(struct sr_instance *sr, const uint8_t *buf, size_t len);
+
+void sr_nat_sync_lost(struct sr_instance *sr);
+
+
+
+#endif /* SR_NAT_SYNC_H */
@@ -7,6 +7,11 @@
 #include "sr_nat.h"
 #include "sr_nat_tcp.h"
 #include "sr_nat_tcp_state.h"
+#include "sr_nat_sync.h"
+#include "sr_nat_lb.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
 
 
 /*---------------------------------------------------------------------
@@ -77,13 +82,11 @@ bool nat_timeout_tcp(struct sr_nat *nat, sr_nat_mapping_t *map,time_t now)
         (is_tcp_conn_transitory(curconn)  && (difftime(now, curconn->last_updated) > nat->tcp_trans_timeout))) {
           
 
-          DebugNATTimeout("+++&& ");
-          DebugNATTimeoutCondition(is_tcp_conn_transitory(curconn),"Transitory ");
-          DebugNATTimeoutCondition(is_tcp_conn_established(curconn),"Established ");
-          DebugNATTimeout("connection to ip [");
-          DebugNATTimeoutAddrIP(ntohl(curconn->dest_ip));
-          DebugNATTimeout("] and port [%d] timedout &&+++\n",ntohs(curconn->dest_port));
+          sr_trace(trace_nat_timeout,"%s connection to ip [%I] and port [%u] timed out",
+                   (uintptr_t)(is_tcp_conn_transitory(curconn) ? "transitory" : "established"),
+                   curconn->dest_ip,ntohs(curconn->dest_port));
 
+          sr_nat_sync_conn(nat,map,curconn,true);
           if (prevconn != NULL)
             prevconn->next = curconn->next;
           else
@@ -92,6 +95,7 @@ bool nat_timeout_tcp(struct sr_nat *nat, sr_nat_mapping_t *map,time_t now)
           sr_nat_connection_t *oldcur = curconn;
           curconn = curconn->next;
           free(oldcur);
+          sr_stats_gauge(gauge_nat_tcp_conns, -1);
           continue;
 
     }
@@ -127,11 +131,7 @@ void translate_outgoing_tcp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map)
   assert(map->type == nat_mapping_tcp);
 
   //translate src ip address to NAT's external ip
-  DebugNAT("+++ Translating source IP address from [");
-  DebugNATAddrIP(ntohl(iphdr->ip_src));
-  DebugNAT("] to [");
-  DebugNATAddrIP(ntohl(map->ip_ext));
-  DebugNAT("]. +++\n");
+  sr_trace(trace_nat,"translating source IP address from [%I] to [%I]",iphdr->ip_src,map->ip_ext);
   iphdr->ip_src = map->ip_ext;
 
   unsigned int iplen = ntohs(iphdr->ip_len);
@@ -139,7 +139,7 @@ void translate_outgoing_tcp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map)
   sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) extract_ip_payload(iphdr, iplen, &tcplen);
 
   //translate port
-  DebugNAT("+++ Translating source port from [%d] to [%d]. +++\n",ntohs(tcphdr->th_sport),ntohs(map->aux_ext));
+  sr_trace(trace_nat,"translating source port from [%u] to [%u]",ntohs(tcphdr->th_sport),ntohs(map->aux_ext));
   tcphdr->th_sport = map->aux_ext;
 
   //compute tcp checksum
@@ -178,11 +178,7 @@ void translate_incoming_tcp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map)
   assert(map->type == nat_mapping_tcp);
 
   //translate src ip address to NAT's external ip
-  DebugNAT("+++ Translating destination IP address from [");
-  DebugNATAddrIP(ntohl(iphdr->ip_dst));
-  DebugNAT("] to [");
-  DebugNATAddrIP(ntohl(map->ip_int));
-  DebugNAT("]. +++\n");
+  sr_trace(trace_nat,"translating destination IP address from [%I] to [%I]",iphdr->ip_dst,map->ip_int);
   iphdr->ip_dst = map->ip_int;
 
   unsigned int iplen = ntohs(iphdr->ip_len);
@@ -190,7 +186,7 @@ void translate_incoming_tcp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map)
   sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) extract_ip_payload(iphdr, iplen, &tcplen);
 
   //translate port
-  DebugNAT("+++ Translating destination port from [%d] to [%d]. +++\n",ntohs(tcphdr->th_dport),ntohs(map->aux_int));
+  sr_trace(trace_nat,"translating destination port from [%u] to [%u]",ntohs(tcphdr->th_dport),ntohs(map->aux_int));
   tcphdr->th_dport = map->aux_int;
 
 
@@ -218,7 +214,11 @@ void translate_incoming_tcp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map)
  * 'sr_nat_tcp_state' module. Note that all values are stored internally
  * in network byte order.
  *
+ * A new connection or a change in its state is passed on to the standby,
+ * if any (see sr_nat_sync.c).
+ *
  * parameters:
+ *		nat 		- a reference to the nat structure
  *		map 		- a struct containing the NAT's translation policy
  *					  this struct will be updated.
  *		ip_dst		- the IP address of the destanation host
@@ -229,26 +229,29 @@ void translate_incoming_tcp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map)
  *					  interface or from an external one
  *		
  *---------------------------------------------------------------------*/
-void update_tcp_connection(sr_nat_mapping_t *map,uint32_t ip_dst, uint16_t dst_port,
-							sr_tcp_hdr_t *tcphdr, bool incoming)
+void update_tcp_connection(struct sr_nat *nat,sr_nat_mapping_t *map,uint32_t ip_dst,
+							uint16_t dst_port,sr_tcp_hdr_t *tcphdr, bool incoming)
 {
   	assert(map->type == nat_mapping_tcp);
 
   	//update timestamp for entire mapping.
   	//since we are maintaing separate timestamps for individual connections
   	//this value is unused
-  	time_t now = current_time();
+  	time_t now = sr_clock_now();
   	map->last_updated = now;
 
   	sr_nat_connection_t *conn;
   	for(conn = map->conns; conn != NULL; conn = conn->next) {
   		if ((ip_dst == conn->dest_ip) && (dst_port == conn->dest_port)) {
-  			conn->last_updated = current_time();
+  			conn->last_updated = sr_clock_now();
+  			sr_nat_tcp_state state = conn->state;
   			if (incoming) {
   				update_incoming_tcp_state(conn,tcphdr);
   			} else {
   				update_outgoing_tcp_state(conn,tcphdr);
   			}
+  			if (conn->state != state)
+  				sr_nat_sync_conn(nat,map,conn,false);
   			break;	
   		}
   	}
@@ -261,12 +264,14 @@ void update_tcp_connection(sr_nat_mapping_t *map,uint32_t ip_dst, uint16_t dst_p
     	conn->dest_port = dst_port;
     	conn->next = map->conns;
     	map->conns = conn;
+    	sr_stats_gauge(gauge_nat_tcp_conns, 1);
 
     	//initialize connection state
     	if (incoming)
     		init_incoming_tcp_state(conn,tcphdr);
     	else
     		init_outgoing_tcp_state(conn,tcphdr);
+    	sr_nat_sync_conn(nat,map,conn,false);
     }
 
     conn->last_updated = now;
@@ -295,7 +300,7 @@ void update_tcp_connection(sr_nat_mapping_t *map,uint32_t ip_dst, uint16_t dst_p
  *---------------------------------------------------------------------*/
 nat_action_type handle_outgoing_tcp(struct sr_instance *sr, sr_ip_hdr_t *iphdr) 
 {
-	DebugNAT("+++ NAT handling outbound TCP segment. +++\n");
+	sr_trace(trace_nat,"NAT handling outbound TCP segment");
 	struct sr_nat *nat = &sr->nat;
 	unsigned int iplen = ntohs(iphdr->ip_len);
   	unsigned int tcplen = 0;
@@ -312,12 +317,14 @@ nat_action_type handle_outgoing_tcp(struct sr_instance *sr, sr_ip_hdr_t *iphdr)
 	if (map == NULL) {
 		//insert new mapping into the translation table
 		map = sr_nat_insert_mapping(sr,ip_src,aux_src,ip_dst,aux_dst,nat_mapping_tcp);
-		DebugNAT("+++ Created NAT mapping from port [%d] to [%d]. +++\n",ntohs(map->aux_int),ntohs(map->aux_ext));
+		if (map == NULL)
+			return nat_action_drop; //counted by the NAT
+		sr_trace(trace_nat,"created NAT mapping from port [%u] to [%u]",ntohs(map->aux_int),ntohs(map->aux_ext));
 	}
 	//translate entry
 	translate_outgoing_tcp(iphdr,map);
 	//update connection state
-	update_tcp_connection(map,ip_dst,aux_dst,tcphdr,false);
+	update_tcp_connection(nat,map,ip_dst,aux_dst,tcphdr,false);
 
   	return nat_action_route;
 }
@@ -345,7 +352,7 @@ nat_action_type handle_outgoing_tcp(struct sr_instance *sr, sr_ip_hdr_t *iphdr)
  *---------------------------------------------------------------------*/
 nat_action_type handle_incoming_tcp(struct sr_nat *nat, sr_ip_hdr_t *iphdr) 
 {
-	DebugNAT("+++ NAT handling inbound TCP segment +++\n");
+	sr_trace(trace_nat,"NAT handling inbound TCP segment");
 	unsigned int iplen = ntohs(iphdr->ip_len);
   	unsigned int tcplen = 0;
   	sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) extract_ip_payload(iphdr, iplen, &tcplen);  
@@ -356,26 +363,37 @@ nat_action_type handle_incoming_tcp(struct sr_nat *nat, sr_ip_hdr_t *iphdr)
   	uint16_t aux_dst = tcphdr->th_dport;
 
 
-  	sr_nat_mapping_t *map = sr_nat_lookup_external(nat,aux_dst,nat_mapping_tcp);
+  	sr_nat_mapping_t *map = sr_nat_lookup_external(nat,iphdr->ip_dst,aux_dst,nat_mapping_tcp);
 
   	//packet addressed to unmapped port
 	if (map == NULL) {
-		DebugNAT("+++ Segment received on unmatched port +++\n");
+		sr_trace(trace_nat,"segment received on unmatched port");
 		if (is_tcp_syn(tcphdr)) {
     		//unsolicited syn segment
 			sr_nat_insert_pending_syn(nat,aux_dst,iphdr);
-			DebugNAT("+++ Unsolicited SYN segment. Dropping response.\n");
+			sr_trace(trace_nat,"unsolicited SYN segment. Dropping response");
+			sr_stats_drop(drop_nat_unsolicited_syn);
 			return nat_action_drop;
   		}
   		return nat_action_route; //destined to NAT device. 'handle_ip' should take 
   					 //care of processing the packet
 	} 
 
+	//a virtual service: the mapping of the backend the segment goes to
+	if (map->vip != NULL) {
+		map = sr_nat_lb_select(nat,map->vip,iphdr,tcphdr);
+		if (map == NULL) {
+			sr_trace(trace_nat,"no mapping for the selected backend. Dropping");
+			sr_stats_drop(drop_nat_unmapped);
+			return nat_action_drop;
+		}
+	}
+
 	//translate entry
 	translate_incoming_tcp(iphdr,map);
 
 	//update connection state
-	update_tcp_connection(map,ip_src,aux_src,tcphdr,true); 	
+	update_tcp_connection(nat,map,ip_src,aux_src,tcphdr,true); 	
 
   	return nat_action_route;
 }
@@ -6,14 +6,16 @@
 #include "sr_nat.h"
 
 
+uint16_t tcp_cksum(sr_ip_hdr_t *iphdr, sr_tcp_hdr_t *tcphdr, unsigned int tcplen);
+
 bool nat_timeout_tcp(struct sr_nat *nat, sr_nat_mapping_t *map,time_t now);
 
 void translate_outgoing_tcp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map);
 
 void translate_incoming_tcp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map);
 
-void update_tcp_connection(sr_nat_mapping_t *map,uint32_t ip_dst, uint16_t dst_port,
-							sr_tcp_hdr_t *tcphdr, bool incoming);
+void update_tcp_connection(struct sr_nat *nat,sr_nat_mapping_t *map,uint32_t ip_dst,
+							uint16_t dst_port,sr_tcp_hdr_t *tcphdr, bool incoming);
 
 nat_action_type handle_outgoing_tcp(struct sr_instance *sr, sr_ip_hdr_t *iphdr);
 
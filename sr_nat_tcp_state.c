@@ -3,6 +3,37 @@
 #include "sr_utils.h"
 #include "sr_nat.h"
 #include "sr_nat_tcp_state.h"
+#include "sr_trace.h"
+
+#define trace_tcp_conn_state(conn) \
+	sr_trace(trace_tcp_state,"[%I]:[%u] TCP state [%s]",(conn)->dest_ip, \
+			 ntohs((conn)->dest_port),(uintptr_t)tcp_state_name((conn)->state))
+
+/*---------------------------------------------------------------------
+ * Method: tcp_state_name
+ *
+ * Scope:  Global
+ *
+ * returns a static, printable name for a connection state
+ *
+ *---------------------------------------------------------------------*/
+const char *tcp_state_name(sr_nat_tcp_state state)
+{
+	switch(state) {
+		case tcp_state_closed: 					return "CLOSED";
+		case tcp_state_syn_recvd_processing: 	return "SYN RECEIVED (processing)";
+		case tcp_state_syn_recvd:				return "SYN RECEIVED";
+		case tcp_state_syn_sent:				return "SYN SENT";
+		case tcp_state_established:				return "ESTABLISHED";
+		case tcp_state_fin_wait1:				return "FIN WAIT 1";
+		case tcp_state_fin_wait2:				return "FIN WAIT 2";
+		case tcp_state_closing:					return "CLOSING";
+		case tcp_state_close_wait:				return "CLOSE WAIT";
+		case tcp_state_last_ack:				return "LAST ACK";
+		case tcp_state_time_wait:				return "TIME WAIT";
+	}
+	return "?";
+}
 
 /*---------------------------------------------------------------------
  * Method: is_tcp_syn
@@ -145,7 +176,7 @@ void init_incoming_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 		//connection reset or otherwise
 		conn->state = tcp_state_closed;
 	}
-	DebugTCPState(conn);
+	trace_tcp_conn_state(conn);
 }
 
 /*---------------------------------------------------------------------
@@ -174,7 +205,7 @@ void init_outgoing_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 		////be very strict in adhering to tcp state diagram
 		conn->state = tcp_state_closed;
 	}
-	DebugTCPState(conn);
+	trace_tcp_conn_state(conn);
 
 }
 
@@ -206,7 +237,7 @@ void update_outgoing_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 
 	if (is_tcp_rst(tcphdr)) {
 		conn->state = tcp_state_closed;
-		DebugTCPState(conn);
+		trace_tcp_conn_state(conn);
 	}
 
 	switch (conn->state) {
@@ -218,7 +249,7 @@ void update_outgoing_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 			//SYN+ACK in response to received SYN
 			if (is_tcp_ack(tcphdr) && is_tcp_syn(tcphdr)) {
 				conn->state = tcp_state_syn_recvd;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 			}
 			break;
 		
@@ -231,7 +262,7 @@ void update_outgoing_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 			if (is_tcp_fin(tcphdr)) {
 				conn->state = tcp_state_fin_wait1;
 				conn->fin_sent_seqno = seqno;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 			} else if (is_tcp_syn(tcphdr)) {
 				init_outgoing_tcp_state(conn,tcphdr); 
 			}
@@ -250,7 +281,7 @@ void update_outgoing_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 			if (is_tcp_fin(tcphdr)) {
 				conn->state = tcp_state_last_ack;
 				conn->fin_sent_seqno = seqno;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 			} else if (is_tcp_syn(tcphdr)) {
 				init_outgoing_tcp_state(conn,tcphdr); 
 			}
@@ -295,7 +326,7 @@ void update_incoming_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 
 	if (is_tcp_rst(tcphdr)) {
 		conn->state = tcp_state_closed;
-		DebugTCPState(conn);
+		trace_tcp_conn_state(conn);
 	}
 
 	switch (conn->state) {
@@ -311,22 +342,22 @@ void update_incoming_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 				if (is_tcp_ack(tcphdr)) {
 					//SYN+ACK: end host acknowledged SYN sent plus sent his own SYN
 					conn->state = tcp_state_established;
-					DebugTCPState(conn);
+					trace_tcp_conn_state(conn);
 				} else {
 					//simultaneous open: SYN from destination host was sent
 					//prior to reception of SYN from host behind NAT
 					conn->state = tcp_state_syn_recvd;
 					//re-sending SYN. no need to update connection structure.
 					//received an ack to either this or previously sent SYN would suffice
-					DebugTCPStatePrint("^^^^^ (simultaneous open) ^^^^^");
-					DebugTCPState(conn);
+					sr_trace(trace_tcp_state,"[%I]:[%u] simultaneous open",conn->dest_ip,ntohs(conn->dest_port));
+					trace_tcp_conn_state(conn);
 				}
 			}
 			break;
 		case tcp_state_syn_recvd:
 			if (is_tcp_ack(tcphdr)) {
 				conn->state = tcp_state_established;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 			}
 			break;
 
@@ -334,7 +365,7 @@ void update_incoming_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 			if (is_tcp_fin(tcphdr)) {
 				conn->state = tcp_state_close_wait;
 				conn->fin_recv_seqno = seqno;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 			} else if (is_tcp_syn(tcphdr)) {
 				init_incoming_tcp_state(conn,tcphdr); //reset connection
 			}
@@ -344,11 +375,11 @@ void update_incoming_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 			if (is_tcp_fin(tcphdr)) { //FIN+ACK or FIN
 				conn->state = tcp_state_time_wait;
 				conn->fin_recv_seqno = seqno;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 				//neglect intermediate transition to CLOSING if we get FIN+ACK
 			} else if (is_tcp_ack(tcphdr) && (ackno > conn->fin_sent_seqno)) {	//FIN
 				conn->state = tcp_state_fin_wait2;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 			} else if (is_tcp_syn(tcphdr)) {
 				init_incoming_tcp_state(conn,tcphdr); //reset connection
 			}
@@ -358,7 +389,7 @@ void update_incoming_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 			if (is_tcp_fin(tcphdr)) {
 				conn->state = tcp_state_time_wait;
 				conn->fin_recv_seqno = seqno;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 			} else if (is_tcp_syn(tcphdr)) {
 				init_incoming_tcp_state(conn,tcphdr); //reset connection
 			}
@@ -372,7 +403,7 @@ void update_incoming_tcp_state(sr_nat_connection_t *conn,sr_tcp_hdr_t *tcphdr)
 		case tcp_state_last_ack:
 			if (is_tcp_ack(tcphdr) && (ackno > conn->fin_sent_seqno)) {
 				conn->state = tcp_state_time_wait;
-				DebugTCPState(conn);
+				trace_tcp_conn_state(conn);
 			} else if (is_tcp_syn(tcphdr)) {
 				init_incoming_tcp_state(conn,tcphdr); //reset connection
 			}
@@ -0,0 +1,226 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_nat_udp.c
+ *
+ * Description:
+ *
+ * UDP translation for the NAT. UDP mappings are endpoint independent
+ * (RFC 4787): one mapping per internal (address, port), whatever remote
+ * endpoints it talks to, and any remote may send back through it. Only
+ * outbound traffic keeps a mapping alive, so unsolicited inbound
+ * datagrams cannot hold a port open indefinitely.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <assert.h>
+#include "sr_nat.h"
+#include "sr_nat_udp.h"
+#include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+
+
+/*---------------------------------------------------------------------
+ * Method: nat_timeout_udp
+ *
+ * Scope:  Global
+ *
+ * This function is a helper function for the connection garbage collector
+ * thread. A UDP mapping may be released once no datagram has left through
+ * it for more than the udp_timeout field in the NAT.
+ *
+ *  parameters:
+ *    nat       - a reference to the nat structure
+ *    map       - a mapping in the NAT to process
+ *    now       - the current time.
+ *
+ * returns: 
+ *    true if it is ok to release/destroy the mapping
+ *
+ *---------------------------------------------------------------------*/
+bool nat_timeout_udp(struct sr_nat *nat, sr_nat_mapping_t *map, time_t now)
+{
+  return (difftime(now,map->last_updated) > nat->udp_timeout);
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: udp_sum_adjust
+ *
+ * Scope:  Local
+ *
+ * Patches a UDP checksum for an address and port rewrite without
+ * touching the payload. A zero checksum means the sender did not compute
+ * one and is left alone; a computed checksum of zero is sent as 0xffff.
+ *
+ *---------------------------------------------------------------------*/
+static void udp_sum_adjust(sr_udp_hdr_t *udphdr, uint32_t old_ip, uint32_t new_ip,
+                           uint16_t old_port, uint16_t new_port)
+{
+  if (udphdr->uh_sum == 0)
+    return;
+
+  uint16_t sum = cksum_update32(udphdr->uh_sum, old_ip, new_ip);
+  sum = cksum_update16(sum, old_port, new_port);
+  udphdr->uh_sum = (sum == 0) ? 0xffff : sum;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: translate_outgoing_udp
+ *
+ * Scope:  Global
+ *
+ * Rewrites an outbound datagram's source address and port to the NAT's
+ * external address and the mapped port. Values are in network byte order.
+ *
+ * parameters:
+ *		iphdr 		- a pointer to the outbound IP packet.
+ *		map 		- a struct containing the NAT's translation policy
+ *
+ *---------------------------------------------------------------------*/
+void translate_outgoing_udp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map) 
+{
+  assert(iphdr->ip_p == ip_protocol_udp);
+  assert(map->type == nat_mapping_udp);
+
+  unsigned int iplen = ntohs(iphdr->ip_len);
+  sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) extract_ip_payload(iphdr, iplen, NULL);
+
+  sr_trace(trace_nat,"translating source IP address from [%I] to [%I]",iphdr->ip_src,map->ip_ext);
+  sr_trace(trace_nat,"translating port from [%u] to [%u]",ntohs(udphdr->uh_sport),ntohs(map->aux_ext));
+  udp_sum_adjust(udphdr,iphdr->ip_src,map->ip_ext,udphdr->uh_sport,map->aux_ext);
+  iphdr->ip_src = map->ip_ext;
+  udphdr->uh_sport = map->aux_ext;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: translate_incoming_udp
+ *
+ * Scope:  Global
+ *
+ * Rewrites an inbound datagram's destination address and port back to
+ * the internal host and port the mapping belongs to.
+ *
+ * parameters:
+ *		iphdr 		- a pointer to the inbound IP packet.
+ *		map 		- a struct containing the NAT's translation policy
+ *
+ *---------------------------------------------------------------------*/
+void translate_incoming_udp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map) 
+{
+  assert(iphdr->ip_p == ip_protocol_udp);
+  assert(map->type == nat_mapping_udp);
+
+  unsigned int iplen = ntohs(iphdr->ip_len);
+  sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) extract_ip_payload(iphdr, iplen, NULL);
+
+  sr_trace(trace_nat,"translating destination IP address from [%I] to [%I]",iphdr->ip_dst,map->ip_int);
+  sr_trace(trace_nat,"translating port from [%u] to [%u]",ntohs(udphdr->uh_dport),ntohs(map->aux_int));
+  udp_sum_adjust(udphdr,iphdr->ip_dst,map->ip_int,udphdr->uh_dport,map->aux_int);
+  iphdr->ip_dst = map->ip_int;
+  udphdr->uh_dport = map->aux_int;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: udp_header_ok
+ *
+ * Scope:  Local
+ *
+ * Checks that the packet carries a whole UDP header, and a UDP length
+ * that fits in the IP payload, before the NAT reads or rewrites it.
+ *
+ *---------------------------------------------------------------------*/
+static bool udp_header_ok(sr_ip_hdr_t *iphdr)
+{
+  unsigned int udplen = 0;
+  sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) extract_ip_payload(iphdr, ntohs(iphdr->ip_len), &udplen);
+  if ((ntohs(iphdr->ip_len) < sizeof(sr_ip_hdr_t) + sizeof(sr_udp_hdr_t)) ||
+      (ntohs(udphdr->uh_ulen) < sizeof(sr_udp_hdr_t)) || (ntohs(udphdr->uh_ulen) > udplen)) {
+    sr_trace(trace_nat,"truncated UDP header");
+    sr_stats_drop(drop_nat_udp_truncated);
+    return false;
+  }
+  return true;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: handle_outgoing_udp
+ *
+ * Scope:  Global
+ *
+ * This function contains the logic for handling outbound UDP datagrams.
+ * It looks up, or creates, the mapping for the datagram's internal
+ * address and port, translates the datagram and refreshes the mapping.
+ *
+ * parameters:
+ *		sr 	 		- a reference to the router structure
+ *		iphdr 		- a pointer to the outbound IP packet
+ *
+ *---------------------------------------------------------------------*/
+nat_action_type handle_outgoing_udp(struct sr_instance *sr, sr_ip_hdr_t *iphdr) 
+{
+  sr_trace(trace_nat,"NAT handling outbound UDP");
+  struct sr_nat *nat = &sr->nat;
+
+  if (!udp_header_ok(iphdr))
+    return nat_action_drop;
+
+  sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) extract_ip_payload(iphdr, ntohs(iphdr->ip_len), NULL);
+  uint32_t ip_src = iphdr->ip_src;
+  uint16_t aux_src = udphdr->uh_sport;
+
+  sr_nat_mapping_t *map = sr_nat_lookup_internal(nat,ip_src,aux_src,nat_mapping_udp);
+
+  if (map == NULL) {
+    //destination is not part of the key: endpoint-independent mapping
+    map = sr_nat_insert_mapping(sr,ip_src,aux_src,0,0,nat_mapping_udp);
+    if (map == NULL)
+      return nat_action_drop; //counted by the NAT
+    sr_trace(trace_nat,"created NAT mapping from port [%u] to [%u]",ntohs(map->aux_int),ntohs(map->aux_ext));
+  }
+
+  translate_outgoing_udp(iphdr,map);
+  map->last_updated = sr_clock_now();
+
+  return nat_action_route;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: handle_incoming_udp
+ *
+ * Scope:  Global
+ *
+ * This function contains the logic for handling inbound UDP datagrams.
+ * A datagram addressed to a mapped port is translated and forwarded no
+ * matter which remote endpoint sent it. Datagrams to unmapped ports are
+ * left for the router itself.
+ *
+ * parameters:
+ *		nat 		- a reference to the nat structure
+ *		iphdr 		- a pointer to the inbound IP packet
+ *
+ *---------------------------------------------------------------------*/
+nat_action_type handle_incoming_udp(struct sr_nat *nat, sr_ip_hdr_t *iphdr) 
+{
+  sr_trace(trace_nat,"NAT handling inbound UDP");
+
+  if (!udp_header_ok(iphdr))
+    return nat_action_drop;
+
+  sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) extract_ip_payload(iphdr, ntohs(iphdr->ip_len), NULL);
+  sr_nat_mapping_t *map = sr_nat_lookup_external(nat,iphdr->ip_dst,udphdr->uh_dport,nat_mapping_udp);
+
+  if (map == NULL) {
+    sr_trace(trace_nat,"datagram addressed to unmapped port");
+    return nat_action_route; //packet addressed to router itself
+  }
+
+  translate_incoming_udp(iphdr,map);
+
+  return nat_action_route;
+}
@@ -0,0 +1,22 @@
+
+#ifndef SR_NAT_UDP_H
+#define SR_NAT_UDP_H
+
+#include "sr_utils.h"
+#include "sr_router.h"
+#include "sr_nat.h"
+
+
+bool nat_timeout_udp(struct sr_nat *nat, sr_nat_mapping_t *map, time_t now);
+
+void translate_outgoing_udp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map);
+
+void translate_incoming_udp(sr_ip_hdr_t *iphdr,sr_nat_mapping_t *map);
+
+nat_action_type handle_outgoing_udp(struct sr_instance *sr, sr_ip_hdr_t *iphdr);
+
+nat_action_type handle_incoming_udp(struct sr_nat *nat, sr_ip_hdr_t *iphdr);
+
+
+
+#endif /* SR_NAT_UDP_H */
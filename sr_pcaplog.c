@@ -0,0 +1,489 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pcaplog.c
+ *
+ * Description:
+ *
+ * Asynchronous pcap packet log, see sr_pcaplog.h.
+ *
+ * The ring is a bounded multi-producer queue (frames are logged from the
+ * main thread and from the ARP and NAT sweeper threads) with a single
+ * consumer, the writer thread. Every slot carries a sequence number:
+ * a producer claims position 'pos' by advancing 'tail' with a CAS once the
+ * slot's sequence equals 'pos', fills it, then publishes it by storing
+ * pos + 1. The writer consumes a slot once its sequence reads head + 1 and
+ * hands it back by storing head + slots. A producer that finds the slot at
+ * its position still unconsumed gives up and counts a drop.
+ *
+ * The capture policy is checked before a slot is claimed, so frames that
+ * are filtered, sampled out or over the rate cap cost a few header
+ * compares and at most one atomic add.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "sr_dumper.h"
+#include "sr_pcaplog.h"
+#include "sr_utils.h"
+
+#define PCAPLOG_WBUF_SIZE   (1 << 20)   /* bytes per batched write */
+#define PCAPLOG_IDLE_NS     1000000     /* writer poll interval when idle */
+#define PCAPLOG_FLUSH_NS    50000000    /* max age of buffered records */
+#define PCAPLOG_CACHELINE   64
+
+struct pcaplog_slot {
+    uint64_t seq;
+    struct pcap_sf_pkthdr hdr;
+    uint8_t data[];
+};
+
+struct sr_pcaplog {
+    FILE *fp;
+    uint8_t *slots;
+    size_t slot_size;
+    uint64_t nslots;
+    unsigned int snaplen;
+    struct sr_pcaplog_policy policy;
+
+    /* producers and consumer indexes live on separate cache lines */
+    uint64_t tail __attribute__((aligned(PCAPLOG_CACHELINE)));
+    /* the counters and sampling state every logged frame updates get a
+       line of their own, off both indexes */
+    uint64_t drops __attribute__((aligned(PCAPLOG_CACHELINE)));
+    uint64_t seen;          /* frames matching the filter, for sampling */
+    uint64_t rate_window;   /* second << 32 | records logged in it */
+    uint64_t filtered;
+    uint64_t sampled_out;
+    uint64_t rate_limited;
+    uint64_t head __attribute__((aligned(PCAPLOG_CACHELINE)));
+    uint64_t written;
+
+    int stop;
+    pthread_t writer;
+
+    uint8_t *wbuf;
+    size_t wlen;
+};
+
+static inline struct pcaplog_slot *pcaplog_slot(struct sr_pcaplog *log,
+                                                uint64_t pos)
+{
+    return (struct pcaplog_slot *)
+        (log->slots + (pos & (log->nslots - 1)) * log->slot_size);
+}
+
+static uint64_t pcaplog_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pcaplog_flush(struct sr_pcaplog *log)
+{
+    if (log->wlen == 0)
+        return;
+    if (fwrite(log->wbuf, log->wlen, 1, log->fp) != 1)
+        fprintf(stderr, "sr_pcaplog: error writing packet log\n");
+    fflush(log->fp);
+    log->wlen = 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_pcaplog_policy_init
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_pcaplog_policy_init(struct sr_pcaplog_policy *policy)
+{
+    memset(policy, 0, sizeof(*policy));
+    policy->dir = sr_pcaplog_in | sr_pcaplog_out;
+    policy->proto = SR_PCAPLOG_PROTO_ANY;
+    policy->sample = 1;
+}
+
+/* A decimal number from 'lo' to 'hi', nothing else. */
+static int pcaplog_parse_num(const char *val, unsigned long lo, unsigned long hi,
+                             unsigned long *num)
+{
+    char *end;
+
+    errno = 0;
+    unsigned long v = strtoul(val, &end, 10);
+    if (end == val || *end != '\0' || errno != 0 || val[0] == '-' ||
+        v < lo || v > hi)
+        return -1;
+    *num = v;
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_pcaplog_policy_parse
+ * Scope:  Global
+ *
+ * Keys not given keep the capture everything default.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_pcaplog_policy_parse(const char *spec, struct sr_pcaplog_policy *policy)
+{
+    char *copy = strdup(spec);
+    char *save = NULL;
+    unsigned long num;
+    int ret = 0;
+
+    sr_pcaplog_policy_init(policy);
+
+    for (char *tok = strtok_r(copy, ",", &save); tok && ret == 0;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        if (!val) {
+            ret = -1;
+            break;
+        }
+        *val++ = '\0';
+
+        if (strcmp(tok, "dir") == 0) {
+            if (strcmp(val, "in") == 0)
+                policy->dir = sr_pcaplog_in;
+            else if (strcmp(val, "out") == 0)
+                policy->dir = sr_pcaplog_out;
+            else if (strcmp(val, "both") == 0)
+                policy->dir = sr_pcaplog_in | sr_pcaplog_out;
+            else
+                ret = -1;
+        } else if (strcmp(tok, "if") == 0) {
+            strncpy(policy->iface, val, sr_IFACE_NAMELEN - 1);
+        } else if (strcmp(tok, "proto") == 0) {
+            if (strcmp(val, "arp") == 0)
+                policy->proto = SR_PCAPLOG_PROTO_ARP;
+            else if (strcmp(val, "icmp") == 0)
+                policy->proto = ip_protocol_icmp;
+            else if (strcmp(val, "tcp") == 0)
+                policy->proto = ip_protocol_tcp;
+            else if (strcmp(val, "udp") == 0)
+                policy->proto = IPPROTO_UDP;
+            else if (strcmp(val, "any") == 0)
+                policy->proto = SR_PCAPLOG_PROTO_ANY;
+            else if ((ret = pcaplog_parse_num(val, 1, 255, &num)) == 0)
+                policy->proto = (int) num;
+        } else if (strcmp(tok, "src") == 0) {
+            ret = sr_parse_prefix(val, &policy->src, &policy->src_mask);
+        } else if (strcmp(tok, "dst") == 0) {
+            ret = sr_parse_prefix(val, &policy->dst, &policy->dst_mask);
+        } else if (strcmp(tok, "sample") == 0) {
+            if ((ret = pcaplog_parse_num(val, 1, UINT32_MAX, &num)) == 0)
+                policy->sample = (uint32_t) num;
+        } else if (strcmp(tok, "rate") == 0) {
+            if ((ret = pcaplog_parse_num(val, 0, UINT32_MAX, &num)) == 0)
+                policy->rate = (uint32_t) num;
+        } else {
+            ret = -1;
+        }
+    }
+
+    if (ret != 0)
+        fprintf(stderr, "sr_pcaplog: bad capture policy '%s'\n", spec);
+    free(copy);
+    return ret;
+}
+
+/*---------------------------------------------------------------------
+ * Method: pcaplog_match
+ * Scope:  Local
+ *
+ * Evaluate the filter part of the policy. Prefixes are compared against
+ * the IPv4 addresses, or the sender and target addresses of an ARP.
+ *
+ *---------------------------------------------------------------------*/
+
+static bool pcaplog_match(const struct sr_pcaplog_policy *p, const uint8_t *buf,
+                          unsigned int len, enum sr_pcaplog_dir dir,
+                          const char *iface)
+{
+    const sr_ethernet_hdr_t *ehdr = (const sr_ethernet_hdr_t *) buf;
+    uint32_t src, dst;
+
+    if (!(p->dir & dir))
+        return false;
+    if (p->iface[0] && (!iface || strncmp(p->iface, iface, sr_IFACE_NAMELEN) != 0))
+        return false;
+    if (p->proto == SR_PCAPLOG_PROTO_ANY && !p->src_mask && !p->dst_mask)
+        return true;
+
+    if (len < sizeof(sr_ethernet_hdr_t))
+        return false;
+
+    if (ehdr->ether_type == htons(ethertype_arp)) {
+        const sr_arp_hdr_t *arphdr = (const sr_arp_hdr_t *) (buf + sizeof(sr_ethernet_hdr_t));
+        if (p->proto != SR_PCAPLOG_PROTO_ANY && p->proto != SR_PCAPLOG_PROTO_ARP)
+            return false;
+        if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))
+            return false;
+        src = arphdr->ar_sip;
+        dst = arphdr->ar_tip;
+    } else if (ehdr->ether_type == htons(ethertype_ip)) {
+        const sr_ip_hdr_t *iphdr = (const sr_ip_hdr_t *) (buf + sizeof(sr_ethernet_hdr_t));
+        if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+            return false;
+        if (p->proto != SR_PCAPLOG_PROTO_ANY && p->proto != iphdr->ip_p)
+            return false;
+        src = iphdr->ip_src;
+        dst = iphdr->ip_dst;
+    } else {
+        return false;
+    }
+
+    return (src & p->src_mask) == p->src && (dst & p->dst_mask) == p->dst;
+}
+
+/*---------------------------------------------------------------------
+ * Method: pcaplog_admit
+ * Scope:  Local
+ *
+ * Apply sampling and the rate cap to a frame that matched the filter. The
+ * rate window packs the current second and the number of records logged
+ * in it into one word so it can be advanced with a single CAS.
+ *
+ *---------------------------------------------------------------------*/
+
+static bool pcaplog_admit(struct sr_pcaplog *log)
+{
+    const struct sr_pcaplog_policy *p = &log->policy;
+
+    if (p->sample > 1 &&
+        __atomic_fetch_add(&log->seen, 1, __ATOMIC_RELAXED) % p->sample != 0) {
+        __atomic_fetch_add(&log->sampled_out, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if (p->rate) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        uint64_t now = (uint64_t) ts.tv_sec;
+        uint64_t w = __atomic_load_n(&log->rate_window, __ATOMIC_RELAXED);
+        uint64_t next;
+
+        do {
+            if ((w >> 32) != now)
+                next = (now << 32) | 1;
+            else if ((w & 0xffffffffu) >= p->rate) {
+                __atomic_fetch_add(&log->rate_limited, 1, __ATOMIC_RELAXED);
+                return false;
+            } else
+                next = w + 1;
+        } while (!__atomic_compare_exchange_n(&log->rate_window, &w, next, true,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    return true;
+}
+
+/*---------------------------------------------------------------------
+ * Method: pcaplog_writer
+ * Scope:  Local
+ *
+ * Writer thread. Copies published records into a large buffer and writes
+ * it out when it fills up, or when the ring runs dry and the oldest
+ * buffered record is older than PCAPLOG_FLUSH_NS.
+ *
+ *---------------------------------------------------------------------*/
+
+static void *pcaplog_writer(void *arg)
+{
+    struct sr_pcaplog *log = arg;
+    uint64_t last_flush = pcaplog_now_ns();
+
+    for (;;) {
+        struct pcaplog_slot *slot = pcaplog_slot(log, log->head);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == log->head + 1) {
+            size_t rec = sizeof(struct pcap_sf_pkthdr) + slot->hdr.caplen;
+            if (log->wlen + rec > PCAPLOG_WBUF_SIZE) {
+                pcaplog_flush(log);
+                last_flush = pcaplog_now_ns();
+            }
+            memcpy(log->wbuf + log->wlen, &slot->hdr, rec);
+            log->wlen += rec;
+            log->written++;
+
+            __atomic_store_n(&slot->seq, log->head + log->nslots, __ATOMIC_RELEASE);
+            log->head++;
+            continue;
+        }
+
+        /* -- ring is empty -- */
+        if (__atomic_load_n(&log->stop, __ATOMIC_ACQUIRE)) {
+            /* a producer may have claimed a slot but not published it yet */
+            if (__atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) != log->head)
+                continue;
+            break;
+        }
+        if (log->wlen && pcaplog_now_ns() - last_flush >= PCAPLOG_FLUSH_NS) {
+            pcaplog_flush(log);
+            last_flush = pcaplog_now_ns();
+        }
+
+        struct timespec idle = { 0, PCAPLOG_IDLE_NS };
+        nanosleep(&idle, NULL);
+    }
+
+    pcaplog_flush(log);
+    return NULL;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_pcaplog_open
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_pcaplog *sr_pcaplog_open(const char *fname, unsigned int snaplen,
+                                   unsigned int slots,
+                                   const struct sr_pcaplog_policy *policy)
+{
+    struct sr_pcaplog *log;
+
+    assert(fname);
+    assert(slots && (slots & (slots - 1)) == 0);
+
+    if (posix_memalign((void **)&log, PCAPLOG_CACHELINE, sizeof(*log)) != 0)
+        return NULL;
+    memset(log, 0, sizeof(*log));
+
+    log->fp = sr_dump_open(fname, 0, snaplen);
+    if (!log->fp) {
+        free(log);
+        return NULL;
+    }
+
+    log->snaplen = snaplen;
+    if (policy)
+        log->policy = *policy;
+    else
+        sr_pcaplog_policy_init(&log->policy);
+    log->nslots = slots;
+    log->slot_size = (sizeof(struct pcaplog_slot) + snaplen + PCAPLOG_CACHELINE - 1)
+                     & ~(size_t)(PCAPLOG_CACHELINE - 1);
+    if (posix_memalign((void **)&log->slots, PCAPLOG_CACHELINE,
+                       log->slot_size * slots) != 0) {
+        sr_dump_close(log->fp);
+        free(log);
+        return NULL;
+    }
+    for (uint64_t i = 0; i < slots; i++)
+        pcaplog_slot(log, i)->seq = i;
+
+    log->wbuf = malloc(PCAPLOG_WBUF_SIZE);
+    assert(log->wbuf);
+    assert(sizeof(struct pcap_sf_pkthdr) + snaplen <= PCAPLOG_WBUF_SIZE);
+
+    if (pthread_create(&log->writer, NULL, pcaplog_writer, log) != 0) {
+        perror("pthread_create");
+        sr_dump_close(log->fp);
+        free(log->wbuf);
+        free(log->slots);
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_pcaplog_packet
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_pcaplog_packet(struct sr_pcaplog *log, const uint8_t *buf,
+                       unsigned int len, enum sr_pcaplog_dir dir,
+                       const char *iface)
+{
+    struct pcaplog_slot *slot;
+    uint64_t pos;
+
+    if (!pcaplog_match(&log->policy, buf, len, dir, iface)) {
+        __atomic_fetch_add(&log->filtered, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (!pcaplog_admit(log))
+        return;
+
+    pos = __atomic_load_n(&log->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        slot = pcaplog_slot(log, pos);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            /* pos was reloaded by the failed CAS */
+        } else if (diff < 0) {
+            __atomic_fetch_add(&log->drops, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    slot->hdr.ts.tv_sec = ts.tv_sec;
+    slot->hdr.ts.tv_usec = ts.tv_nsec / 1000;
+    slot->hdr.caplen = min(len, log->snaplen);
+    slot->hdr.len = len;
+    memcpy(slot->data, buf, slot->hdr.caplen);
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t sr_pcaplog_drops(struct sr_pcaplog *log)
+{
+    return __atomic_load_n(&log->drops, __ATOMIC_RELAXED);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_pcaplog_close
+ * Scope:  Global
+ *
+ * Must not race with sr_pcaplog_packet, i.e. the data path and sweeper
+ * threads must no longer be logging.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_pcaplog_close(struct sr_pcaplog *log)
+{
+    if (!log)
+        return;
+
+    __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(log->writer, NULL);
+
+    fprintf(stderr, "Packet log: %llu records written, %llu dropped, "
+            "%llu filtered, %llu sampled out, %llu over rate\n",
+            (unsigned long long) log->written,
+            (unsigned long long) sr_pcaplog_drops(log),
+            (unsigned long long) log->filtered,
+            (unsigned long long) log->sampled_out,
+            (unsigned long long) log->rate_limited);
+
+    sr_dump_close(log->fp);
+    free(log->wbuf);
+    free(log->slots);
+    free(log);
+}
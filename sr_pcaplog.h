@@ -0,0 +1,75 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pcaplog.h
+ *
+ * Description:
+ *
+ * Asynchronous pcap packet log. The data path copies up to snaplen bytes
+ * of each frame into a fixed size ring and returns; a background writer
+ * thread drains the ring and writes records to disk in large batches.
+ * When the ring is full the record is dropped and counted, forwarding is
+ * never stalled by the log.
+ *
+ * A capture policy limits what gets logged: a filter on direction,
+ * interface, protocol and source/destination prefix, 1-in-N sampling and
+ * a records per second cap. The policy is evaluated on the headers before
+ * anything is copied.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PCAPLOG_H
+#define SR_PCAPLOG_H
+
+#include <stdint.h>
+
+#include "sr_protocol.h"
+
+#define SR_PCAPLOG_SLOTS 4096   /* ring size in records, power of two */
+
+enum sr_pcaplog_dir {
+    sr_pcaplog_in  = 0x1,       /* frames received from an interface */
+    sr_pcaplog_out = 0x2,       /* frames sent out of an interface */
+};
+
+#define SR_PCAPLOG_PROTO_ANY -1
+#define SR_PCAPLOG_PROTO_ARP -2 /* otherwise an IPv4 protocol number */
+
+struct sr_pcaplog_policy
+{
+    uint8_t  dir;                       /* mask of sr_pcaplog_dir */
+    char     iface[sr_IFACE_NAMELEN];   /* empty matches any interface */
+    int      proto;
+    uint32_t src, src_mask;             /* network byte order */
+    uint32_t dst, dst_mask;
+    uint32_t sample;                    /* log 1 in 'sample' matches */
+    uint32_t rate;                      /* max records per second, 0 = no cap */
+};
+
+struct sr_pcaplog;
+
+/* Fill 'policy' with the capture everything policy. */
+void sr_pcaplog_policy_init(struct sr_pcaplog_policy *policy);
+
+/* Parse a comma separated policy such as
+       dir=in,if=eth1,proto=tcp,src=10.0.1.0/24,dst=0.0.0.0/0,sample=100,rate=500
+   Returns 0 on success, -1 on error. */
+int sr_pcaplog_policy_parse(const char *spec, struct sr_pcaplog_policy *policy);
+
+/* Create the dump file 'fname' and start the writer thread. 'policy' may be
+   NULL to log everything. Returns NULL on error. */
+struct sr_pcaplog *sr_pcaplog_open(const char *fname, unsigned int snaplen,
+                                   unsigned int slots,
+                                   const struct sr_pcaplog_policy *policy);
+
+/* Queue one frame if it passes the capture policy. Safe to call from any
+   thread, never blocks. */
+void sr_pcaplog_packet(struct sr_pcaplog *log, const uint8_t *buf,
+                       unsigned int len, enum sr_pcaplog_dir dir,
+                       const char *iface);
+
+/* Number of records dropped because the ring was full. */
+uint64_t sr_pcaplog_drops(struct sr_pcaplog *log);
+
+/* Drain outstanding records, stop the writer and close the file. */
+void sr_pcaplog_close(struct sr_pcaplog *log);
+
+#endif /* -- SR_PCAPLOG_H -- */
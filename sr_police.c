@@ -0,0 +1,238 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sr_router.h"
+#include "sr_police.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+
+/*
+ * Ingress policing.
+ *
+ * An interface can have a token bucket for all the traffic it receives
+ * and one for each source address seen on it. handle_ip_packet checks
+ * them right after validating the IP header, so traffic over its rate is
+ * dropped before it costs a NAT lookup, a route lookup or an ARP queue
+ * entry. A bucket holds its tokens and the clock second it was last
+ * refilled in one 64-bit word that is updated with a compare and swap;
+ * buckets refill once per second, so a burst is at least one second's
+ * worth of tokens. The per-source buckets live in a fixed open addressed
+ * table. A source claims a free slot, or one idle for SR_POLICE_HOST_IDLE
+ * seconds, with a compare and swap on the slot's key; a source that finds
+ * none of its SR_POLICE_PROBES slots available is only held to the
+ * interface's rate.
+ */
+
+
+static int police_parse_rate(const char *val, uint32_t *out)
+{
+  char *end;
+  unsigned long long v = strtoull(val, &end, 10);
+
+  switch (*end) {
+    case 'k': v *= 1000ull; end++; break;
+    case 'm': v *= 1000000ull; end++; break;
+    case 'g': v *= 1000000000ull; end++; break;
+  }
+  if ((end == val) || (*end != '\0') || (v == 0) || (v > UINT32_MAX))
+    return -1;
+  *out = (uint32_t) v;
+  return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_police_parse
+ *
+ * Scope:  Global
+ *
+ * Adds the policers of one interface, given as
+ * "if=name,rate=bytes/s,burst=bytes,host=bytes/s,hostburst=bytes". Rates
+ * take a k, m or g suffix. Bursts default to, and are at least, one
+ * second at the rate.
+ *
+ * returns:
+ *    0 on success, -1 if 'spec' is malformed or there are too many
+ *
+ *---------------------------------------------------------------------*/
+int sr_police_parse(struct sr_police *police, const char *spec)
+{
+  struct sr_policer p;
+  char *copy = strdup(spec);
+  char *save = NULL;
+  int ret = 0;
+
+  memset(&p, 0, sizeof(p));
+  for (char *tok = strtok_r(copy, ",", &save); tok && ret == 0;
+       tok = strtok_r(NULL, ",", &save)) {
+    char *val = strchr(tok, '=');
+    if (!val) {
+      ret = -1;
+      break;
+    }
+    *val++ = '\0';
+
+    if (strcmp(tok, "if") == 0)
+      strncpy(p.iface, val, sr_IFACE_NAMELEN - 1);
+    else if (strcmp(tok, "rate") == 0)
+      ret = police_parse_rate(val, &p.rate);
+    else if (strcmp(tok, "burst") == 0)
+      ret = police_parse_rate(val, &p.burst);
+    else if (strcmp(tok, "host") == 0)
+      ret = police_parse_rate(val, &p.host_rate);
+    else if (strcmp(tok, "hostburst") == 0)
+      ret = police_parse_rate(val, &p.host_burst);
+    else
+      ret = -1;
+  }
+  free(copy);
+
+  if ((ret != 0) || (p.iface[0] == '\0') || (p.rate == 0 && p.host_rate == 0) ||
+      (police->npolicers == SR_STATS_MAX_IFACES)) {
+    fprintf(stderr, "sr_police: bad policer '%s'\n", spec);
+    return -1;
+  }
+  if (p.burst < p.rate)
+    p.burst = p.rate;
+  if (p.host_burst < p.host_rate)
+    p.host_burst = p.host_rate;
+  police->policers[police->npolicers++] = p;
+  return 0;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_police_init
+ *
+ * Scope:  Global
+ *
+ * Moves the parsed policers to the index of their interface and
+ * allocates the per source table if any of them needs it. Called once
+ * the interface list is known, before packets are handled.
+ *
+ * returns:
+ *    0 on success, -1 if a policer names an unknown interface
+ *
+ *---------------------------------------------------------------------*/
+int sr_police_init(struct sr_instance *sr)
+{
+  struct sr_police *police = &sr->police;
+  struct sr_policer parsed[SR_STATS_MAX_IFACES];
+  unsigned int n = police->npolicers;
+  bool hosts = false;
+
+  memcpy(parsed, police->policers, sizeof(parsed));
+  memset(police->policers, 0, sizeof(police->policers));
+  for (unsigned int i = 0; i < n; i++) {
+    sr_if_t *iface = sr_get_interface(sr, parsed[i].iface);
+    if ((iface == NULL) || (iface->idx >= SR_STATS_MAX_IFACES)) {
+      fprintf(stderr, "sr_police: no interface %s\n", parsed[i].iface);
+      return -1;
+    }
+    police->policers[iface->idx] = parsed[i];
+    police->policers[iface->idx].bucket = 0;
+    hosts |= (parsed[i].host_rate != 0);
+  }
+  if (hosts && police->hosts == NULL)
+    police->hosts = calloc(SR_POLICE_HOSTS, sizeof(struct sr_police_host));
+  police->enabled = (n != 0);
+  return 0;
+}
+
+void sr_police_destroy(struct sr_police *police)
+{
+  police->enabled = false;
+  free(police->hosts);
+  police->hosts = NULL;
+}
+
+
+/* Takes 'len' tokens from a bucket refilled with 'rate' tokens a second
+   up to 'burst'. A bucket that was never used (all zero) is full. */
+static bool bucket_take(uint64_t *bucket, uint32_t now, uint32_t rate, uint32_t burst, uint32_t len)
+{
+  uint64_t old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+  uint64_t new;
+
+  do {
+    uint32_t stamp = (uint32_t) (old >> 32);
+    uint64_t tokens = (uint32_t) old;
+    if (now - stamp > burst / rate)
+      tokens = burst;
+    else
+      tokens += (uint64_t) (now - stamp) * rate;
+    if (tokens > burst)
+      tokens = burst;
+    if (tokens < len)
+      return false;
+    new = ((uint64_t) now << 32) | (tokens - len);
+  } while (!__atomic_compare_exchange_n(bucket, &old, new, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return true;
+}
+
+/* The bucket of source 'ip' on interface 'idx', or NULL if the table has
+   no room for it. */
+static uint64_t *police_host_bucket(struct sr_police *police, int idx, uint32_t ip, uint32_t now)
+{
+  uint64_t key = ((uint64_t) (idx + 1) << 32) | ip;
+  unsigned int slot = sr_nat_hash(key);
+
+  for (unsigned int i = 0; i < SR_POLICE_PROBES; i++) {
+    struct sr_police_host *h = &police->hosts[(slot + i) & (SR_POLICE_HOSTS - 1)];
+    uint64_t cur = __atomic_load_n(&h->key, __ATOMIC_ACQUIRE);
+    if (cur == key)
+      return &h->bucket;
+
+    uint64_t bucket = __atomic_load_n(&h->bucket, __ATOMIC_RELAXED);
+    bool idle = (cur != 0) && (now - (uint32_t) (bucket >> 32) > SR_POLICE_HOST_IDLE);
+    if (((cur == 0) || idle) &&
+        __atomic_compare_exchange_n(&h->key, &cur, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&h->bucket, 0, __ATOMIC_RELAXED);
+      return &h->bucket;
+    }
+    if (cur == key)  //claimed for the same source meanwhile
+      return &h->bucket;
+  }
+  return NULL;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_police_check
+ *
+ * Scope:  Global
+ *
+ * Charges a received packet to its source's bucket, then to its
+ * interface's. Use sr_police_admit, which skips this when no policer is
+ * configured.
+ *
+ * returns:
+ *    true if the packet may go on, false if it was dropped
+ *
+ *---------------------------------------------------------------------*/
+bool sr_police_check(struct sr_police *police, sr_if_t *iface, uint32_t ip_src, unsigned int len)
+{
+  if (iface->idx >= SR_STATS_MAX_IFACES)
+    return true;
+  struct sr_policer *p = &police->policers[iface->idx];
+  uint32_t now = (uint32_t) sr_clock_now();
+
+  if (p->host_rate != 0 && police->hosts != NULL) {
+    uint64_t *bucket = police_host_bucket(police, iface->idx, ip_src, now);
+    if (bucket != NULL && !bucket_take(bucket, now, p->host_rate, p->host_burst, len)) {
+      sr_trace(trace_router,"[%u] bytes from [%I] over the host rate on [%s]",len,ip_src,
+               (uintptr_t)iface->name);
+      sr_stats_drop(drop_police_host);
+      return false;
+    }
+  }
+  if (p->rate != 0 && !bucket_take(&p->bucket, now, p->rate, p->burst, len)) {
+    sr_trace(trace_router,"[%u] bytes from [%I] over the rate of [%s]",len,ip_src,
+             (uintptr_t)iface->name);
+    sr_stats_drop(drop_police_iface);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,57 @@
+
+#ifndef SR_POLICE_H
+#define SR_POLICE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "sr_if.h"
+#include "sr_stats.h"
+
+#define SR_POLICE_HOSTS      4096   /* per host buckets, power of two */
+#define SR_POLICE_PROBES     8      /* slots looked at for one host */
+#define SR_POLICE_HOST_IDLE  60     /* seconds before a host's slot can be reused */
+
+struct sr_instance;
+
+/* Policers of one ingress interface. Rates are in bytes per second and
+   a rate of 0 turns that policer off. A bucket is a single word, the
+   second it was last refilled above the tokens left, so it is updated
+   with one compare and swap. */
+struct sr_policer {
+  char iface[sr_IFACE_NAMELEN];
+  uint32_t rate;
+  uint32_t burst;
+  uint32_t host_rate;        /* each source address on the interface */
+  uint32_t host_burst;
+  uint64_t bucket;
+};
+
+struct sr_police_host {
+  uint64_t key;              /* interface index + 1 above the source address, 0 if free */
+  uint64_t bucket;
+};
+
+/* Ingress policers, see sr_police.c. All zero polices nothing. */
+struct sr_police {
+  bool enabled;
+  unsigned int npolicers;                       /* as parsed, before sr_police_init */
+  struct sr_policer policers[SR_STATS_MAX_IFACES]; /* by interface index after sr_police_init */
+  struct sr_police_host *hosts;                 /* SR_POLICE_HOSTS slots, or NULL */
+};
+
+int  sr_police_parse(struct sr_police *police, const char *spec);
+int  sr_police_init(struct sr_instance *sr);
+void sr_police_destroy(struct sr_police *police);
+bool sr_police_check(struct sr_police *police, sr_if_t *iface, uint32_t ip_src, unsigned int len);
+
+/* True if a packet of 'len' bytes from 'ip_src' received on 'iface' is
+   within its interface's and its source's rate. Drops are counted. */
+static inline bool sr_police_admit(struct sr_police *police, sr_if_t *iface,
+                                   uint32_t ip_src, unsigned int len)
+{
+  if (!__builtin_expect(police->enabled, 0))
+    return true;
+  return sr_police_check(police, iface, ip_src, len);
+}
+
+#endif
@@ -80,6 +80,16 @@ struct sr_tcp_hdr {
 } __attribute__ ((packed)) ;
 typedef struct sr_tcp_hdr sr_tcp_hdr_t;
 
+/* Structure of a UDP header
+ */
+struct sr_udp_hdr {
+  uint16_t uh_sport;  /* source port */
+  uint16_t uh_dport;  /* destination port */
+  uint16_t uh_ulen;   /* udp length */
+  uint16_t uh_sum;    /* checksum, 0 if not computed */
+} __attribute__ ((packed)) ;
+typedef struct sr_udp_hdr sr_udp_hdr_t;
+
 /* Structure of a ICMP header
  */
 struct sr_icmp_hdr {
@@ -180,6 +190,7 @@ enum sr_ip_version {
 enum sr_ip_protocol {
   ip_protocol_icmp = 0x01,
   ip_protocol_tcp  = 0x06, 
+  ip_protocol_udp  = 0x11,
 };
 
 enum sr_ethertype {
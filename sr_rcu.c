@@ -0,0 +1,71 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rcu.c
+ *
+ * Description:
+ *
+ * Reader slots and grace periods, see sr_rcu.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "sr_rcu.h"
+
+uint64_t sr_rcu_epoch = 1;
+__thread struct sr_rcu_reader *sr_rcu_self;
+
+static struct sr_rcu_reader rcu_readers[SR_RCU_READERS];
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+
+static void rcu_release(void *arg)
+{
+    struct sr_rcu_reader *r = arg;
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+    r->nest = 0;
+    __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static void rcu_init(void)
+{
+    pthread_key_create(&rcu_key, rcu_release);
+}
+
+struct sr_rcu_reader *sr_rcu_register(void)
+{
+    pthread_once(&rcu_once, rcu_init);
+    for (int i = 0; i < SR_RCU_READERS; i++) {
+        struct sr_rcu_reader *r = &rcu_readers[i];
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&r->used, &unused, 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            pthread_setspecific(rcu_key, r);
+            sr_rcu_self = r;
+            return r;
+        }
+    }
+    fprintf(stderr, "More than %d threads reading under RCU\n", SR_RCU_READERS);
+    abort();
+}
+
+void sr_rcu_synchronize(void)
+{
+    /* Orders the caller's unlinking store before the slot loads below.
+       A reader that entered after this sees the new epoch, and with it
+       the new pointer; one that entered before is waited for. */
+    uint64_t now = __atomic_add_fetch(&sr_rcu_epoch, 1, __ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < SR_RCU_READERS; i++) {
+        struct sr_rcu_reader *r = &rcu_readers[i];
+        for (;;) {
+            uint64_t e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+            if (e == 0 || e >= now)
+                break;
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,66 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rcu.h
+ *
+ * Description:
+ *
+ * Epoch based reclamation for structures the packet path reads while
+ * another thread replaces them (the FIB, see sr_fib.h).
+ *
+ * Readers bracket their accesses with sr_rcu_read_lock() and
+ * sr_rcu_read_unlock(). Entering a read section publishes the current
+ * epoch in a slot of the calling thread and leaving it clears the slot;
+ * neither ever waits. A writer unlinks the old structure (one atomic
+ * store of the new pointer), calls sr_rcu_synchronize() and then frees
+ * it: synchronize moves the epoch on and waits until no thread is still
+ * inside a read section that began before the move.
+ *
+ * Read sections nest. They must be short and must not call
+ * sr_rcu_synchronize().
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_RCU_H
+#define SR_RCU_H
+
+#include <stdint.h>
+
+#define SR_RCU_READERS 64   /* threads that may be inside read sections */
+
+struct sr_rcu_reader {
+    uint64_t epoch;         /* epoch at entry, 0 outside read sections */
+    unsigned int nest;
+    int used;
+} __attribute__((aligned(64)));
+
+extern uint64_t sr_rcu_epoch;
+extern __thread struct sr_rcu_reader *sr_rcu_self;
+
+/* Claim a reader slot for the calling thread; it is given back when the
+   thread exits. */
+struct sr_rcu_reader *sr_rcu_register(void);
+
+static inline void sr_rcu_read_lock(void)
+{
+    struct sr_rcu_reader *r = sr_rcu_self;
+    if (r == NULL)
+        r = sr_rcu_register();
+    if (r->nest++ == 0) {
+        __atomic_store_n(&r->epoch, __atomic_load_n(&sr_rcu_epoch, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELAXED);
+        /* the slot must be visible before anything the section reads */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void sr_rcu_read_unlock(void)
+{
+    struct sr_rcu_reader *r = sr_rcu_self;
+    if (--r->nest == 0)
+        __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Wait until every read section that was running when it was called has
+   ended. */
+void sr_rcu_synchronize(void);
+
+#endif /* -- SR_RCU_H -- */
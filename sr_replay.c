@@ -0,0 +1,262 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_replay.c
+ *
+ * Description:
+ *
+ * Replays a pcap capture through the router without a VNS connection so
+ * that captured production traffic can be used to reproduce and measure
+ * performance regressions. See sr_replay.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "sr_dumper.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_replay.h"
+#include "sr_clock.h"
+
+#define REPLAY_SNAPLEN 65535
+
+static uint64_t replay_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_replay_open
+ * Scope:  Global
+ *
+ * Prepare the router for offline replay. 'out_file' may be NULL, in
+ * which case frames sent by the router are discarded.
+ *
+ * returns 0 on success, -1 on error
+ *---------------------------------------------------------------------*/
+
+int sr_replay_open(struct sr_instance* sr, const char* in_file,
+                   const char* out_file, bool paced)
+{
+    assert(sr);
+    assert(in_file);
+
+    struct sr_replay *rp = calloc(1, sizeof(struct sr_replay));
+    assert(rp);
+
+    rp->in = sr_dump_open_read(in_file, NULL);
+    if (!rp->in) {
+        free(rp);
+        return -1;
+    }
+    if (out_file) {
+        rp->out = sr_dump_open(out_file, 0, REPLAY_SNAPLEN);
+        if (!rp->out) {
+            fclose(rp->in);
+            free(rp);
+            return -1;
+        }
+    }
+    rp->paced = paced;
+    rp->lat_cap = 1 << 16;
+    rp->lat = malloc(rp->lat_cap * sizeof(uint64_t));
+    assert(rp->lat);
+
+    sr->replay = rp;
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: replay_input_iface
+ * Scope:  Local
+ *
+ * A pcap record carries no interface name, so the receiving interface is
+ * inferred from the frame: the interface owning the destination MAC, or
+ * for broadcast ARP the interface owning the target address. Frames
+ * whose source is one of the router's own interfaces were sent by the
+ * router when the capture was taken, and are skipped.
+ *
+ * returns the interface, or NULL if the frame should be skipped
+ *---------------------------------------------------------------------*/
+
+static struct sr_if *replay_input_iface(struct sr_instance *sr, uint8_t *buf,
+                                        unsigned int len)
+{
+    sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *) buf;
+    bool broadcast = true;
+
+    if (len < sizeof(sr_ethernet_hdr_t))
+        return NULL;
+
+    for (struct sr_if *iface = sr->if_list; iface != NULL; iface = iface->next) {
+        if (memcmp(ehdr->ether_shost, iface->addr, ETHER_ADDR_LEN) == 0)
+            return NULL;
+    }
+    for (struct sr_if *iface = sr->if_list; iface != NULL; iface = iface->next) {
+        if (memcmp(ehdr->ether_dhost, iface->addr, ETHER_ADDR_LEN) == 0)
+            return iface;
+    }
+
+    for (int i = 0; i < ETHER_ADDR_LEN; i++) {
+        if (ehdr->ether_dhost[i] != 0xff)
+            broadcast = false;
+    }
+    if (broadcast && ntohs(ehdr->ether_type) == ethertype_arp &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+        sr_arp_hdr_t *arphdr = (sr_arp_hdr_t *) (buf + sizeof(sr_ethernet_hdr_t));
+        for (struct sr_if *iface = sr->if_list; iface != NULL; iface = iface->next) {
+            if (iface->ip == arphdr->ar_tip)
+                return iface;
+        }
+    }
+    return NULL;
+}
+
+static void replay_record_latency(struct sr_replay *rp, uint64_t ns)
+{
+    if (rp->lat_len == rp->lat_cap) {
+        rp->lat_cap *= 2;
+        rp->lat = realloc(rp->lat, rp->lat_cap * sizeof(uint64_t));
+        assert(rp->lat);
+    }
+    rp->lat[rp->lat_len++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double replay_percentile_us(struct sr_replay *rp, double p)
+{
+    if (rp->lat_len == 0)
+        return 0.0;
+    return rp->lat[(uint64_t) (p * (rp->lat_len - 1))] / 1000.0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_replay_run
+ * Scope:  Global
+ *
+ * Feed every frame of the capture to sr_handlepacket, or those before
+ * SIGTERM, and print the achieved packet rate and the per-packet
+ * handling latency at the end.
+ *
+ * returns 0 on success, -1 if the capture is corrupt
+ *---------------------------------------------------------------------*/
+
+int sr_replay_run(struct sr_instance* sr)
+{
+    struct sr_replay *rp = sr->replay;
+    struct pcap_pkthdr h;
+    uint8_t *buf = malloc(REPLAY_SNAPLEN);
+    uint64_t busy_ns = 0, first_ts = 0, wall_start = replay_now_ns();
+    int ret = 0;
+
+    assert(rp);
+    assert(buf);
+
+    while (!__atomic_load_n(&sr->stopping, __ATOMIC_ACQUIRE) &&
+           (ret = sr_dump_read(rp->in, &h, buf, REPLAY_SNAPLEN)) == 1) {
+        struct sr_if *iface = replay_input_iface(sr, buf, h.caplen);
+        if (!iface) {
+            rp->frames_skipped++;
+            continue;
+        }
+
+        if (rp->paced) {
+            uint64_t ts = (uint64_t)h.ts.tv_sec * 1000000000ull + h.ts.tv_usec * 1000ull;
+            if (rp->frames_in == 0)
+                first_ts = ts;
+            uint64_t due = wall_start + (ts > first_ts ? ts - first_ts : 0);
+            struct timespec sl;
+            sl.tv_sec = due / 1000000000ull;
+            sl.tv_nsec = due % 1000000000ull;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sl, NULL) == EINTR);
+        }
+
+        sr_clock_tick();
+        uint64_t start = replay_now_ns();
+        sr_handlepacket(sr, buf, h.caplen, iface->name);
+        uint64_t elapsed = replay_now_ns() - start;
+
+        busy_ns += elapsed;
+        replay_record_latency(rp, elapsed);
+        rp->frames_in++;
+        rp->bytes_in += h.caplen;
+    }
+
+    double wall = (replay_now_ns() - wall_start) / 1e9;
+    double busy = busy_ns / 1e9;
+    if (wall <= 0) wall = 1e-9;
+    if (busy <= 0) busy = 1e-9;
+
+    qsort(rp->lat, rp->lat_len, sizeof(uint64_t), cmp_u64);
+
+    printf("---------------------------------------------\n");
+    printf("Replayed %llu frames (%llu skipped), sent %llu frames\n",
+           (unsigned long long) rp->frames_in, (unsigned long long) rp->frames_skipped,
+           (unsigned long long) rp->frames_out);
+    printf("Wall time %.3f s: %.0f pkt/s, %.2f Mbit/s\n", wall,
+           rp->frames_in / wall, rp->bytes_in * 8 / wall / 1e6);
+    printf("Handling time %.3f s: %.0f pkt/s\n", busy, rp->frames_in / busy);
+    printf("Per-packet latency (us): mean %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+           rp->frames_in ? busy_ns / 1000.0 / rp->frames_in : 0.0,
+           replay_percentile_us(rp, 0.50), replay_percentile_us(rp, 0.90),
+           replay_percentile_us(rp, 0.99), replay_percentile_us(rp, 1.0));
+    printf("---------------------------------------------\n");
+
+    free(buf);
+    if (ret < 0) {
+        fprintf(stderr, "Error: truncated or corrupt record in replay file\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_replay_send
+ * Scope:  Global
+ *
+ * Replacement for the VNS write in sr_send_packet while replaying.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_replay_send(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                   const char* iface)
+{
+    struct sr_replay *rp = sr->replay;
+
+    rp->frames_out++;
+    if (rp->out) {
+        struct pcap_pkthdr h;
+        gettimeofday(&h.ts, 0);
+        h.caplen = min(len, REPLAY_SNAPLEN);
+        h.len = len;
+        sr_dump(rp->out, &h, buf);
+    }
+    return 0;
+}
+
+void sr_replay_close(struct sr_instance* sr)
+{
+    struct sr_replay *rp = sr->replay;
+    if (!rp)
+        return;
+
+    if (rp->in != stdin)
+        fclose(rp->in);
+    if (rp->out)
+        sr_dump_close(rp->out);
+    free(rp->lat);
+    free(rp);
+    sr->replay = NULL;
+}
@@ -0,0 +1,45 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_replay.h
+ *
+ * Description:
+ *
+ * Offline input backend. Frames are read from a pcap file and handed to
+ * sr_handlepacket, either as fast as possible or at the pacing recorded
+ * in the file. Frames the router sends are written to an optional pcap
+ * file or discarded.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_REPLAY_H
+#define SR_REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct sr_instance;
+
+struct sr_replay
+{
+    FILE* in;                   /* pcap file being replayed */
+    FILE* out;                  /* pcap file for sent frames, or NULL */
+    bool paced;                 /* honour recorded inter-packet gaps */
+
+    uint64_t frames_in;         /* frames handed to sr_handlepacket */
+    uint64_t frames_skipped;    /* frames originally sent by the router */
+    uint64_t frames_out;        /* frames sent by the router */
+    uint64_t bytes_in;
+
+    uint64_t *lat;              /* per-packet handling time in ns */
+    uint64_t lat_len;
+    uint64_t lat_cap;
+};
+
+int  sr_replay_open(struct sr_instance* sr, const char* in_file,
+                    const char* out_file, bool paced);
+int  sr_replay_run(struct sr_instance* sr);
+void sr_replay_close(struct sr_instance* sr);
+int  sr_replay_send(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                    const char* iface);
+
+#endif /* -- SR_REPLAY_H -- */
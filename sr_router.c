@@ -11,6 +11,12 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_utils.h"
+#include "sr_stats.h"
+#include "sr_latency.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+#include "sr_nat_pool.h"
+#include "sr_fib.h"
 
 #include <stdbool.h>
  
@@ -23,7 +29,7 @@ void handle_arpreq(struct sr_instance *sr, sr_arpreq_t *arpreq); //global
 void wrap_frame(struct sr_instance *sr,sr_if_t* interface, uint8_t *payload, unsigned int pyldlen,uint8_t * deth,uint16_t ethtype);
 void set_ether_addr_broadcast(uint8_t * ethr_addr);
 void send_arp_request(struct sr_instance *sr, sr_if_t *iface ,uint32_t tip);
-void send_arp_reply(struct sr_instance *sr, sr_if_t *iface,uint8_t *teth,uint32_t tip);
+void send_arp_reply(struct sr_instance *sr, sr_if_t *iface,uint32_t sip,uint8_t *teth,uint32_t tip);
 bool valid_arp_packet(unsigned int arplen);
 void handle_arp_packet(struct sr_instance* sr, sr_ethernet_hdr_t *frame, unsigned int len, sr_if_t *iface);
 void process_pending_packets(struct sr_instance *sr, sr_arpreq_t *arpreq); 
@@ -53,7 +59,7 @@ void handle_ip_packet(struct sr_instance* sr, sr_ethernet_hdr_t *frame, unsigned
  *---------------------------------------------------------------------*/
 
 void sr_init(struct sr_instance* sr,char * external_iface_name, bool nat_enabled, time_t icmp_query_timeout,
-			 time_t tcp_estab_timeout,time_t tcp_trans_timeout)
+			 time_t tcp_estab_timeout,time_t tcp_trans_timeout,time_t udp_timeout)
 {
 
     /* REQUIRES */
@@ -69,14 +75,22 @@ void sr_init(struct sr_instance* sr,char * external_iface_name, bool nat_enabled
     pthread_t thread;
 
     pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+
+    /* Egress queues and the thread writing them out. A replay writes
+       synchronously, so that its counts are complete when it reports */
+    if (sr->replay == NULL && sr_txq_start(sr) != 0)
+        fprintf(stderr,"Could not start the transmit thread, frames are written directly\n");
     
     /* Add initialization code here! */
 
     sr->nat_enabled = nat_enabled;
 
+    /* ICMP error limits. keep the rates set from the command line */
+    sr_icmp_limit_init(&sr->icmp,sr->icmp.rate,sr->icmp.dest_rate);
+
 	/* initialize nat */
     if (nat_enabled) {
-        sr_nat_init(sr,icmp_query_timeout,tcp_estab_timeout,tcp_trans_timeout,external_iface_name);
+        sr_nat_init(sr,icmp_query_timeout,tcp_estab_timeout,tcp_trans_timeout,udp_timeout,external_iface_name);
     }
 
 } /* -- sr_init -- */
@@ -104,7 +118,7 @@ void handle_arpreq(struct sr_instance *sr, sr_arpreq_t *arpreq)
 {
 
     
-    time_t now = current_time();
+    time_t now = sr_clock_now();
     if (difftime(now, arpreq->sent) < 1.0)
         return;
            
@@ -146,6 +160,8 @@ void handle_arpreq(struct sr_instance *sr, sr_arpreq_t *arpreq)
 void wrap_frame(struct sr_instance *sr,sr_if_t* interface, uint8_t *payload, 
 				unsigned int pyldlen,uint8_t * deth,uint16_t ethtype)
 {
+	uint64_t lat = sr_lat_begin();
+
 	//wrap in ethernet header
 	unsigned int frlen = sizeof(sr_ethernet_hdr_t) + pyldlen;
 	sr_ethernet_hdr_t *frame = malloc(frlen); 
@@ -158,11 +174,14 @@ void wrap_frame(struct sr_instance *sr,sr_if_t* interface, uint8_t *payload,
 	unsigned int offset = sizeof(sr_ethernet_hdr_t);
 	memcpy(buf+offset,payload,pyldlen);
 	
-	Debug("----- Sending frame ---------");
-	DebugFrame(frame,frlen);
-	sr_send_packet(sr,(uint8_t *) frame,frlen,interface->name);
-							   
-	free(frame);
+	sr_trace(trace_router,"tx [%u] bytes on [%s] to [%M] type [0x%04x]",frlen,
+			 (uintptr_t)interface->name,sr_trace_mac(deth),ethtype);
+	sr_lat_end(lat_tx_build,lat);
+
+	//queued, or written right away before the transmit thread runs
+	lat = sr_lat_begin();
+	sr_txq_send(sr,interface,(uint8_t *) frame,frlen,sr_txq_classify(ethtype,payload,pyldlen));
+	sr_lat_end(lat_tx_enqueue,lat);
 	
 }
 
@@ -240,6 +259,8 @@ void send_arp_request(struct sr_instance *sr, sr_if_t *iface ,uint32_t tip)
  *		sr 		- a reference to the router structure
  *		iface  	- a reference to the interface structure through which
  *				  the request is to be sent.
+ *		sip 	- the address being resolved: the interface's own, or a
+ *				  NAT pool address that lives on it
  *		teth 	- the destination ethernet address of the packet. (stands for 
  *				  "to ethernet")
  *		tip 	- the desintation ip address of the packet . (stands for 
@@ -247,11 +268,8 @@ void send_arp_request(struct sr_instance *sr, sr_if_t *iface ,uint32_t tip)
  *
  *---------------------------------------------------------------------*/
 
-void send_arp_reply(struct sr_instance *sr, sr_if_t *iface,uint8_t *teth,uint32_t tip) 
+void send_arp_reply(struct sr_instance *sr, sr_if_t *iface,uint32_t sip,uint8_t *teth,uint32_t tip) 
 {
-	//locate ip address and ethernet address for interface to populate the sender fields
-	uint32_t sip = iface->ip;
-	
 	sr_arp_hdr_t arphdr;
 
 	arphdr.ar_hrd = htons(arp_hrd_ethernet);	//hardware type
@@ -315,14 +333,18 @@ void handle_arp_packet(struct sr_instance* sr, sr_ethernet_hdr_t *frame, unsigne
 	sr_arp_hdr_t * arphdr = (sr_arp_hdr_t *) extract_frame_payload(frame,len,&arplen);	
 	
 	if (!valid_arp_packet(arplen)) {
-		Debug("Dropping frame. Invalid ARP header.\n");
+		sr_trace(trace_router,"dropping frame. invalid ARP header");
+		sr_stats_drop(drop_arp_truncated);
 		return;
 	}
 	
 	uint32_t tip = arphdr->ar_tip;
-	//check if ip target matches the interface through which frame was received
-	if ((iface != 0) && (iface->ip != tip)) {
-		Debug("Target ip in packet [%d] does not match interface [%s]",tip,iface->name);
+	//check if ip target matches the interface through which frame was received,
+	//or one of the NAT's pool addresses on it
+	if ((iface != 0) && (iface->ip != tip) &&
+	    !(sr->nat_enabled && sr_nat_pool_answers_arp(sr,tip,iface))) {
+		sr_trace(trace_router,"target ip in packet [%I] does not match interface [%s]",tip,(uintptr_t)iface->name);
+		sr_stats_drop(drop_arp_not_for_us);
 		return;
 	}
 	
@@ -339,7 +361,7 @@ void handle_arp_packet(struct sr_instance* sr, sr_ethernet_hdr_t *frame, unsigne
 		
 	//issue reply if this is a request
 	if (arphdr->ar_op == htons(arp_op_request)) {
-		send_arp_reply(sr, iface,seth,sip);
+		send_arp_reply(sr, iface,tip,seth,sip);
 	}
 	
 }
@@ -395,6 +417,7 @@ void reject_pending_packets(struct sr_instance *sr,sr_arpreq_t *arpreq)
 {
 	sr_if_t *iface = sr_get_interface(sr,arpreq->iface);
 	for (sr_packet_t *pkt = arpreq->packets; pkt != 0; pkt = pkt->next) {
+		sr_stats_drop(drop_arp_failure);
 		send_ICMP_host_unreachable(sr,(sr_ip_hdr_t *)pkt->buf,iface);
 	}
 	sr_arpreq_destroy(&sr->cache,arpreq);
@@ -407,7 +430,8 @@ void reject_pending_packets(struct sr_instance *sr,sr_arpreq_t *arpreq)
  *
  * checks to see if received ip packet is valid. The function checks the
  * length of the packet to see that entire packet has been read from the
- * input stream, and that the checksum is valid
+ * input stream, and that the checksum is valid. Counts the reason an
+ * invalid packet is dropped.
  * parameters:
  *		sr 		- a reference to the router structure
  *		ip_len  - the number of bytes read from the input stream
@@ -419,12 +443,16 @@ void reject_pending_packets(struct sr_instance *sr,sr_arpreq_t *arpreq)
 bool valid_ip_packet(sr_ip_hdr_t *iphdr,unsigned int ip_len) 
 {
 	//Debug("IP Length in packet: [%d], IP Length Read [%d]\n",ntohs(iphdr->ip_len),ip_len);
-	if(ntohs(iphdr->ip_len) > ip_len)
+	if((ip_len < sizeof(sr_ip_hdr_t)) || (ntohs(iphdr->ip_len) > ip_len)) {
+		sr_stats_drop(drop_ip_truncated);
 		return false;
+	}
 
 	//Debug("stored sum: [%d], computed sum: [%d]",stored_sum,computed_sum);
-	if (cksum(iphdr,sizeof(sr_ip_hdr_t)) != CHK_SUM_VALUE)
+	if (cksum(iphdr,sizeof(sr_ip_hdr_t)) != CHK_SUM_VALUE) {
+		sr_stats_drop(drop_ip_bad_cksum);
 		return false;
+	}
 		
 	return true;
 }
@@ -454,27 +482,36 @@ bool valid_ip_packet(sr_ip_hdr_t *iphdr,unsigned int ip_len)
 void route_ip_packet(struct sr_instance *sr,sr_ip_hdr_t *iphdr,sr_if_t *in_iface)
 {
 
-	struct sr_rt *rt_entry;
-	bool found = longest_prefix_match(sr->routing_table,iphdr->ip_dst,&rt_entry);
+	struct sr_rt route;
+	uint64_t lat = sr_lat_begin();
+	bool found = sr_fib_route(sr,iphdr->ip_dst,&route);
+	sr_lat_end(lat_route,lat);
 	if (!found) {
+		sr_stats_drop(drop_no_route);
 		send_ICMP_host_unreachable(sr,iphdr,in_iface);	
 		return;
 	}
 
+	sr_if_t* out_iface = sr_get_interface(sr,route.interface);
+	assert(out_iface != 0);	//Bad routing table otherwise
+
+	if (!sr_acl_permit(sr->acl,out_iface,sr_acl_out,iphdr,ntohs(iphdr->ip_len)))
+		return;	//counted by the ACL
+
 	sr_arpentry_t * arpentry = 0;
 
-	arpentry = sr_arpcache_lookup(&sr->cache, rt_entry->gw.s_addr);
+	lat = sr_lat_begin();
+	arpentry = sr_arpcache_lookup(&sr->cache, route.gw.s_addr);
 
 	if (arpentry == 0) {
 	
-		sr_arpreq_t * arpreq = sr_arpcache_queuereq(&sr->cache,rt_entry->gw.s_addr,(uint8_t *)iphdr,ntohs(iphdr->ip_len),
-														  rt_entry->interface);
+		sr_arpreq_t * arpreq = sr_arpcache_queuereq(&sr->cache,route.gw.s_addr,(uint8_t *)iphdr,ntohs(iphdr->ip_len),
+														  route.interface);
+		sr_lat_end(lat_arp,lat);
 		handle_arpreq(sr,arpreq);
 		return;
 	} 
-
-	sr_if_t* out_iface = sr_get_interface(sr,rt_entry->interface);
-	assert(out_iface != 0);	//Bad routing table otherwise
+	sr_lat_end(lat_arp,lat);
 
 	wrap_frame(sr,out_iface,(uint8_t *)iphdr,ntohs(iphdr->ip_len),arpentry->mac,ethertype_ip);
 
@@ -516,7 +553,8 @@ void wrap_ip_packet(struct sr_instance *sr,uint8_t *payload, unsigned int pyldle
 							   uint32_t sip,uint32_t dip,uint8_t protocol,sr_if_t *iface)
 {
 	if (my_ip_address(sr,dip,0)) {
-		Debug("--Pending packet addressed to self. cancelling transmission\n");
+		sr_trace(trace_router,"pending packet addressed to self. cancelling transmission");
+		sr_stats_drop(drop_to_self);
 		return;
 	}
 
@@ -550,45 +588,68 @@ void wrap_ip_packet(struct sr_instance *sr,uint8_t *payload, unsigned int pyldle
 }
 
 /*---------------------------------------------------------------------
- * Method: send_ICMP_ttl_exceeded
+ * Method: send_ICMP_error
 
- * Scope:  Private
+ * Scope:  Global
  *
- * issues an ICMP message to a host specifying the TTL of his message has
- * been exceeded. It constructs the ICMP message and header, and lends it
- * to 'wrap_ip' to append an ip header ontop of it and send it. 
- * The function cleans up after itself, freeing all the memory it has 
- * allocated.
+ * builds an ICMP error message of the given type and code around the
+ * first ICMP_DATA_SIZE bytes of the offending packet and lends it to 
+ * 'wrap_ip' to append an ip header ontop of it and send it to the 
+ * packet's source. Called by 'sr_icmp_flush' for the errors that were
+ * let through by the rate limits, never directly.
  * parameters:
  *		sr 			- a reference to the router structure.
- *		recv_iphdr 	- the ip packet that the ICMP message is to be a 
- *					 response to.
+ *		type, code	- the ICMP type and code.
+ *		data 		- ip header plus 8 bytes of the packet the ICMP message
+ *					  is to be a response to.
  *		iface 		- the interface through which the packet has been received
  *				  	  or origniated.
  *
  *---------------------------------------------------------------------*/
 
-
-void send_ICMP_ttl_exceeded(struct sr_instance *sr, sr_ip_hdr_t *recv_iphdr,sr_if_t *iface)
+void send_ICMP_error(struct sr_instance *sr,uint8_t type,uint8_t code,const uint8_t *data,sr_if_t *iface)
 {
-	Debug("--Sending TTL exceeded\n");
-  	sr_icmp_t3_hdr_t *icmp3hdr = (sr_icmp_t3_hdr_t *) malloc(ICMP_PACKET_SIZE);
-  	memset(icmp3hdr,0,ICMP_PACKET_SIZE);
+	uint8_t buf[ICMP_PACKET_SIZE];
+	sr_icmp_t3_hdr_t *icmp3hdr = (sr_icmp_t3_hdr_t *) buf;
+	memset(buf,0,ICMP_PACKET_SIZE);
 
-  	memcpy(&icmp3hdr->data,recv_iphdr,ICMP_DATA_SIZE);
+	memcpy(&icmp3hdr->data,data,ICMP_DATA_SIZE);
+
+	icmp3hdr->icmp_type = type;
+	icmp3hdr->icmp_code = code;
 
-	icmp3hdr->icmp_type = icmp_type_ttl_expired;
-	icmp3hdr->icmp_code = icmp_code_ttl_expired_in_transit;
-	
 	icmp3hdr->icmp_sum = 0;
 	icmp3hdr->icmp_sum = cksum(icmp3hdr,ICMP_PACKET_SIZE);
 
 	uint32_t sip = iface->ip;
-	uint32_t dip = recv_iphdr->ip_src;
+	uint32_t dip = ((const sr_ip_hdr_t *) data)->ip_src;
+
+	wrap_ip_packet(sr,buf,ICMP_PACKET_SIZE,sip,dip,ip_protocol_icmp,iface);
+}
+
+/*---------------------------------------------------------------------
+ * Method: send_ICMP_ttl_exceeded
+
+ * Scope:  Private
+ *
+ * issues an ICMP message to a host specifying the TTL of his message has
+ * been exceeded. The message is subject to the ICMP error rate limits and
+ * is only sent once the current packet has been dealt with, see 
+ * sr_icmp_limit.c.
+ * parameters:
+ *		sr 			- a reference to the router structure.
+ *		recv_iphdr 	- the ip packet that the ICMP message is to be a 
+ *					 response to.
+ *		iface 		- the interface through which the packet has been received
+ *				  	  or origniated.
+ *
+ *---------------------------------------------------------------------*/
 
-	wrap_ip_packet(sr,(uint8_t *)icmp3hdr,ICMP_PACKET_SIZE,sip,dip,ip_protocol_icmp,iface);
 
-	free(icmp3hdr);
+void send_ICMP_ttl_exceeded(struct sr_instance *sr, sr_ip_hdr_t *recv_iphdr,sr_if_t *iface)
+{
+	sr_trace(trace_router,"sending TTL exceeded");
+	sr_icmp_error(sr,icmp_type_ttl_expired,icmp_code_ttl_expired_in_transit,recv_iphdr,iface);
 }
 
 /*---------------------------------------------------------------------
@@ -598,9 +659,7 @@ void send_ICMP_ttl_exceeded(struct sr_instance *sr, sr_ip_hdr_t *recv_iphdr,sr_i
  *
  * issues an ICMP message to a host specifying the network is unreachable,
  * meaning no appropriate entry was found in the routing table.
- * It constructs the ICMP message and header, and lends it to 'wrap_ip' 
- * to append an ip header ontop of it and send it. The function cleans up 
- * after itself, freeing all the memory it has allocated.
+ * Rate limited and deferred like 'send_ICMP_ttl_exceeded'.
  * parameters:
  *		sr 			- a reference to the router structure.
  *		recv_iphdr 	- the ip packet that the ICMP message is to be a 
@@ -612,24 +671,8 @@ void send_ICMP_ttl_exceeded(struct sr_instance *sr, sr_ip_hdr_t *recv_iphdr,sr_i
 
 void send_ICMP_net_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr, sr_if_t *iface)
 {
-	Debug("--Sending ICMP host unreachable\n");
-	sr_icmp_t3_hdr_t *icmp3hdr = (sr_icmp_t3_hdr_t *) malloc(ICMP_PACKET_SIZE);
-	memset(icmp3hdr,0,ICMP_PACKET_SIZE);
-
-	memcpy(&icmp3hdr->data,recv_iphdr,ICMP_DATA_SIZE);
-
-	icmp3hdr->icmp_type = icmp_type_dst_unrch;
-	icmp3hdr->icmp_code = icmp_code_dst_unrch_net;
-
-	icmp3hdr->icmp_sum = 0;
-	icmp3hdr->icmp_sum = cksum(icmp3hdr,ICMP_PACKET_SIZE);
-
-	uint32_t sip = iface->ip;
-	uint32_t dip = recv_iphdr->ip_src;
-	
-	wrap_ip_packet(sr,(uint8_t *)icmp3hdr,ICMP_PACKET_SIZE,sip,dip,ip_protocol_icmp,iface);
-
-	free(icmp3hdr);
+	sr_trace(trace_router,"sending ICMP net unreachable");
+	sr_icmp_error(sr,icmp_type_dst_unrch,icmp_code_dst_unrch_net,recv_iphdr,iface);
 }
 
 /*---------------------------------------------------------------------
@@ -638,9 +681,7 @@ void send_ICMP_net_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr, s
  * Scope:  Private
  *
  * issues an ICMP message to a host specifying the host is unreachable.
- * It constructs the ICMP message and header, and lends it to 'wrap_ip' 
- * to append an ip header ontop of it and send it. The function cleans up 
- * after itself, freeing all the memory it has allocated.
+ * Rate limited and deferred like 'send_ICMP_ttl_exceeded'.
  * parameters:
  *		sr 			- a reference to the router structure.
  *		recv_iphdr 	- the ip packet that the ICMP message is to be a 
@@ -652,24 +693,8 @@ void send_ICMP_net_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr, s
 
 void send_ICMP_host_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr, sr_if_t *iface)
 {
-	Debug("--Sending ICMP host unreachable\n");
-	sr_icmp_t3_hdr_t *icmp3hdr = (sr_icmp_t3_hdr_t *) malloc(ICMP_PACKET_SIZE);
-	memset(icmp3hdr,0,ICMP_PACKET_SIZE);
-
-	memcpy(&icmp3hdr->data,recv_iphdr,ICMP_DATA_SIZE);
-
-	icmp3hdr->icmp_type = icmp_type_dst_unrch;
-	icmp3hdr->icmp_code = icmp_code_dst_unrch_host;
-
-	icmp3hdr->icmp_sum = 0;
-	icmp3hdr->icmp_sum = cksum(icmp3hdr,ICMP_PACKET_SIZE);
-
-	uint32_t sip = iface->ip;
-	uint32_t dip = recv_iphdr->ip_src;
-	
-	wrap_ip_packet(sr,(uint8_t *)icmp3hdr,ICMP_PACKET_SIZE,sip,dip,ip_protocol_icmp,iface);
-
-	free(icmp3hdr);
+	sr_trace(trace_router,"sending ICMP host unreachable");
+	sr_icmp_error(sr,icmp_type_dst_unrch,icmp_code_dst_unrch_host,recv_iphdr,iface);
 }
 
 /*---------------------------------------------------------------------
@@ -678,9 +703,8 @@ void send_ICMP_host_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr,
  * Scope:  Private
  *
  * issues an ICMP message to a host specifying the requested port on the
- * router is unreachable. It constructs the ICMP message and header, and 
- * lends it to 'wrap_ip' to append an ip header ontop of it and send it. 
- * The function cleans up after itself, freeing all the memory it has allocated.
+ * router is unreachable. Rate limited and deferred like 
+ * 'send_ICMP_ttl_exceeded'.
  * parameters:
  *		sr 			- a reference to the router structure.
  *		recv_iphdr 	- the ip packet that the ICMP message is to be a 
@@ -692,24 +716,8 @@ void send_ICMP_host_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr,
 
 void send_ICMP_port_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr,sr_if_t *iface)
 {
-	Debug("--Sending ICMP port unreachable message\n");
-	sr_icmp_t3_hdr_t *icmp3hdr = (sr_icmp_t3_hdr_t *) malloc(ICMP_PACKET_SIZE);
-	memset(icmp3hdr,0,ICMP_PACKET_SIZE);
-
-	memcpy(&icmp3hdr->data,recv_iphdr,ICMP_DATA_SIZE);
-
-	icmp3hdr->icmp_type = icmp_type_dst_unrch;
-	icmp3hdr->icmp_code = icmp_code_dst_unrch_port;
-
-	icmp3hdr->icmp_sum = 0;
-	icmp3hdr->icmp_sum = cksum(icmp3hdr,ICMP_PACKET_SIZE);
-
-	uint32_t sip = iface->ip;
-	uint32_t dip = recv_iphdr->ip_src;
-	
-	wrap_ip_packet(sr,(uint8_t *)icmp3hdr,ICMP_PACKET_SIZE,sip,dip,ip_protocol_icmp,iface);
-
-	free(icmp3hdr);
+	sr_trace(trace_router,"sending ICMP port unreachable message");
+	sr_icmp_error(sr,icmp_type_dst_unrch,icmp_code_dst_unrch_port,recv_iphdr,iface);
 }
 
 /*---------------------------------------------------------------------
@@ -732,7 +740,7 @@ void send_ICMP_port_unreachable(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr,s
 
 void send_ICMP_echoreply(struct sr_instance *sr,sr_ip_hdr_t *recv_iphdr,sr_if_t *iface)
 {
-	Debug("--Sending ICMP echo reply\n");
+	sr_trace(trace_router,"sending ICMP echo reply");
 	unsigned int icmp_len = 0;
 
 	sr_icmp_hdr_t *recv_icmphdr = (sr_icmp_hdr_t *) extract_ip_payload(recv_iphdr,ntohs(recv_iphdr->ip_len),&icmp_len);
@@ -772,7 +780,8 @@ void process_ip_payload(struct sr_instance *sr,sr_ip_hdr_t *iphdr,unsigned int i
 {
 	if (iphdr->ip_p != ip_protocol_icmp) {
 		
-		Debug("--Non-ICMP packet addressed to router. invalid IP header. dropping packet.\n");
+		sr_trace(trace_router,"non-ICMP packet addressed to router. invalid IP header. dropping packet");
+		sr_stats_drop(drop_port_unreachable);
 		send_ICMP_port_unreachable(sr,iphdr,iface);
 		return;
 	} 
@@ -781,7 +790,8 @@ void process_ip_payload(struct sr_instance *sr,sr_ip_hdr_t *iphdr,unsigned int i
 	sr_icmp_hdr_t *icmphdr = (sr_icmp_hdr_t *) extract_ip_payload(iphdr,iplen,&icmplen);
 	
 	if (!valid_icmp_echoreq(icmphdr,icmplen)) {
-		Debug("--Invalid ICMP echo request. dropping packet.\n");
+		sr_trace(trace_router,"invalid ICMP echo request. dropping packet");
+		sr_stats_drop(drop_not_echo);
 		return;
 	}
 	
@@ -810,21 +820,37 @@ void process_ip_payload(struct sr_instance *sr,sr_ip_hdr_t *iphdr,unsigned int i
 void handle_ip_packet(struct sr_instance* sr, sr_ethernet_hdr_t *frame, unsigned int len, sr_if_t *iface)
 {
 	unsigned int iplen = 0;
+	uint64_t lat = sr_lat_begin();
 	sr_ip_hdr_t * iphdr = (sr_ip_hdr_t *) extract_frame_payload(frame,len,&iplen);
+	bool valid = valid_ip_packet(iphdr,iplen);
+	sr_lat_end(lat_validate,lat);
 	
-	if (!valid_ip_packet(iphdr,iplen)) {
-		Debug("--Dropping frame. invalid IP header.\n");
+	if (!valid) {
+		sr_trace(trace_router,"dropping frame. invalid IP header");
 		return;
 	} 
 
+	//ingress policers, before the packet costs a NAT or ARP entry
+	if (!sr_police_admit(&sr->police,iface,iphdr->ip_src,iplen))
+		return;	//counted by the policer
+
+	//access lists of the receiving interface, on the addresses as received
+	if (!sr_acl_permit(sr->acl,iface,sr_acl_in,iphdr,iplen))
+		return;	//counted by the ACL
+
 	//perform NAT operations if necessary
 	if (sr->nat_enabled) {
-		switch(do_nat(sr,iphdr,iface)) {
+		lat = sr_lat_begin();
+		nat_action_type action = do_nat(sr,iphdr,iface);
+		sr_lat_end(lat_nat,lat);
+
+		switch(action) {
 			case nat_action_drop:
-				Debug("--Dropping frame as instructed to by NAT.\n");
-				return;
+				sr_trace(trace_router,"dropping frame as instructed to by NAT");
+				return;	//reason counted by the NAT
 			case nat_action_unrch:
-				Debug("--Generating ICMP host unreachable as instructed to by NAT.\n");
+				sr_trace(trace_router,"generating ICMP host unreachable as instructed to by NAT");
+				sr_stats_drop(drop_nat_unreachable);
 				send_ICMP_host_unreachable(sr,iphdr,iface);
 				return;
 			case nat_action_route:
@@ -835,7 +861,7 @@ void handle_ip_packet(struct sr_instance* sr, sr_ethernet_hdr_t *frame, unsigned
 	if (my_ip_address(sr,iphdr->ip_dst,&iface))
 	{
 		//IP packet destined to me directly
-		Debug("--Packet addressed to router\n");
+		sr_trace(trace_router,"packet addressed to router");
 		process_ip_payload(sr,iphdr,len,iface);
 		return;
 	}
@@ -845,7 +871,8 @@ void handle_ip_packet(struct sr_instance* sr, sr_ethernet_hdr_t *frame, unsigned
 	iphdr->ip_sum = 0;
 	iphdr->ip_sum = cksum(iphdr,sizeof(sr_ip_hdr_t));
 	if (iphdr->ip_ttl <= 0) {
-		Debug("--TTL exceeded on my watch.\n");
+		sr_trace(trace_router,"TTL exceeded on my watch");
+		sr_stats_drop(drop_ttl_expired);
 		send_ICMP_ttl_exceeded(sr,iphdr,iface);
 		return;
 	}
@@ -883,41 +910,49 @@ void sr_handlepacket(struct sr_instance* sr,
   	assert(packet);
   	assert(interface);
 
-  	Debug("*** -> Received packet of length [%d] in interface [%s] \n",len,interface);
-  	
-  	//log incoming frame
-	DebugFrame(packet,len);
-
   	/* fill in code here */
+  	uint64_t lat = sr_lat_begin();
   	sr_if_t *iface = sr_get_interface(sr,interface);
+  	if (iface != 0)
+  		sr_stats_iface(iface->idx,sr_stats_rx,len);
   	
   	sr_ethernet_hdr_t *frame = (sr_ethernet_hdr_t *) packet;
   	
   	uint16_t ethtype = ethertype(packet);
+
+  	sr_trace(trace_router,"rx [%u] bytes on [%s] from [%M] type [0x%04x]",len,
+  			 (uintptr_t)(iface ? iface->name : "?"),sr_trace_mac(frame->ether_shost),ethtype);
   	
 	if (ethtype == ethertype_ip) {
-		Debug("--- IP packet detected\n");
-		if (addressed_to_instance(sr,frame,interface,false)) {
+		sr_trace(trace_router,"IP packet detected");
+		bool ours = addressed_to_instance(sr,frame,interface,false);
+		sr_lat_end(lat_rx_parse,lat);
+		if (ours) {
 			handle_ip_packet(sr,frame,len,iface);
 		} else {
-			Debug("Frame dropped. addressed to MAC address:[");
-			DebugMAC(frame->ether_dhost);
-			Debug("]\n");
+			sr_trace(trace_router,"frame dropped. addressed to MAC address [%M]",sr_trace_mac(frame->ether_dhost));
+			sr_stats_drop(drop_not_for_us);
 		}
 		
 	} else if (ethtype == ethertype_arp) {
-		Debug("--- ARP packet detected\n");
-		if (addressed_to_instance(sr,frame,interface,true)) {
+		sr_trace(trace_router,"ARP packet detected");
+		bool ours = addressed_to_instance(sr,frame,interface,true);
+		sr_lat_end(lat_rx_parse,lat);
+		if (ours) {
 			handle_arp_packet(sr,frame,len,iface);
 		} else {
-			Debug("Frame dropped. addressed to MAC address:[");
-			DebugMAC(frame->ether_dhost);
-			Debug("]\n");
+			sr_trace(trace_router,"frame dropped. addressed to MAC address [%M]",sr_trace_mac(frame->ether_dhost));
+			sr_stats_drop(drop_not_for_us);
 		}
 		
 	} else {
-		Debug("-- Frame dropped. Unknown frame type: [%d]\n",ethtype);
+		sr_lat_end(lat_rx_parse,lat);
+		sr_trace(trace_router,"frame dropped. unknown frame type [0x%04x]",ethtype);
+		sr_stats_drop(drop_unknown_ethertype);
 	}
+
+	//ICMP errors raised by this frame go out once it has been forwarded
+	sr_icmp_flush(sr,SR_ICMP_FLUSH_BATCH);
 	  	  
 }
 
@@ -9,19 +9,10 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_nat.h"
-
-/* we dont like this debug , but what to do for varargs ? */
-#ifdef _DEBUG_
-#define DebugFrame(frame,len) print_hdrs(frame,len)
-#define Debug(x, args...) fprintf(stderr, x, ## args)
-#define DebugMAC(x) \
-  do { int ivyl; for(ivyl=0; ivyl<5; ivyl++) fprintf(stderr,"%02x:", \
-  (unsigned char)(x[ivyl])); fprintf(stderr,"%02x",(unsigned char)(x[5])); } while (0)
-#else
-#define Debug(x, args...) do{}while(0)
-#define DebugMAC(x) do{}while(0)
-#define DebugFrame(frame,len)
-#endif
+#include "sr_icmp_limit.h"
+#include "sr_police.h"
+#include "sr_txq.h"
+#include "sr_acl.h"
 
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
@@ -29,6 +20,10 @@
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_fib;
+struct sr_replay;
+struct sr_shmstats;
+struct sr_pcaplog;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -47,11 +42,20 @@ struct sr_instance
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
     struct sr_rt* routing_table; /* routing table */
+    struct sr_fib* fib;         /* compiled routing table, NULL until published */
+    const char* rtable_path;    /* file the routing table was read from */
     struct sr_arpcache cache;   /* ARP cache */
     pthread_attr_t attr;
-    FILE* logfile;
+    struct sr_pcaplog* logfile; /* asynchronous packet log */
     bool nat_enabled;
     struct sr_nat nat;          /* NAT */
+    struct sr_replay* replay;   /* pcap replay backend, NULL when using VNS */
+    struct sr_shmstats* shmstats; /* shared memory stats export, or NULL */
+    struct sr_icmp_limit icmp;  /* ICMP error limits and send queue */
+    struct sr_police police;    /* ingress policers */
+    struct sr_txq txq;          /* egress queues */
+    struct sr_acl* acl;         /* access lists, NULL if none */
+    bool stopping;              /* SIGTERM received, see sr_main.c */
 };
 
 /* -- sr_main.c -- */
@@ -64,15 +68,19 @@ int sr_read_from_server(struct sr_instance* );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* sr, char * external_iface_name, bool nat_enabled, 
-            time_t icmp_query_timeout,time_t tcp_estab_timeout, time_t tcp_trans_timeout);
+            time_t icmp_query_timeout,time_t tcp_estab_timeout, time_t tcp_trans_timeout,
+            time_t udp_timeout);
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
 void handle_arpreq(struct sr_instance *sr, sr_arpreq_t *arpreq);
+void route_ip_packet(struct sr_instance *sr,sr_ip_hdr_t *iphdr,sr_if_t *in_iface);
 bool longest_prefix_match(struct sr_rt* routing_table, uint32_t lookup, struct sr_rt **best_match); 
+void send_ICMP_error(struct sr_instance *sr, uint8_t type, uint8_t code, const uint8_t *data, sr_if_t *iface);
 
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
 void sr_set_ether_ip(struct sr_instance* , uint32_t );
+void sr_set_ether_speed(struct sr_instance* , uint32_t );
 void sr_set_ether_addr(struct sr_instance* , const unsigned char* );
 void sr_print_if_list(struct sr_instance* );
 
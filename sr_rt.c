@@ -23,11 +23,18 @@
 #include "sr_router.h"
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_read_rt
+ *
+ * Reads the routing table in 'filename' into a new list, in file order,
+ * without touching the router. Lines that do not have four fields are
+ * skipped.
+ *
+ * returns: the number of routes, or -1 if the file cannot be read or
+ * an address is malformed (and then '*routes' is left alone)
  *
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+int sr_read_rt(const char* filename, struct sr_rt** routes)
 {
     FILE* fp;
     char  line[BUFSIZ];
@@ -35,10 +42,9 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
     char  gw[32];
     char  mask[32];
     char  iface[32];
-    struct in_addr dest_addr;
-    struct in_addr gw_addr;
-    struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    struct sr_rt* head = 0;
+    struct sr_rt** tail = &head;
+    int n = 0;
 
     /* -- REQUIRES -- */
     assert(filename);
@@ -49,42 +55,122 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
     }
 
     fp = fopen(filename,"r");
+    if(fp == 0)
+    {
+        perror("fopen");
+        return -1;
+    }
 
     while( fgets(line,BUFSIZ,fp) != 0)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
-        }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
-        }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
+        struct sr_rt* rt;
+
+        if(sscanf(line,"%31s %31s %31s %31s",dest,gw,mask,iface) != 4)
+        { continue; }
+
+        rt = (struct sr_rt*)calloc(1,sizeof(struct sr_rt));
+        assert(rt);
+        if(inet_aton(dest,&rt->dest) == 0 || inet_aton(gw,&rt->gw) == 0 ||
+           inet_aton(mask,&rt->mask) == 0)
+        {
             fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
-        }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+                    "Error loading routing table, cannot convert %s %s %s to valid IPs\n",
+                    dest, gw, mask);
+            free(rt);
+            sr_free_rt(head);
+            fclose(fp);
+            return -1;
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
+        strncpy(rt->interface,iface,sr_IFACE_NAMELEN - 1);
+
+        *tail = rt;
+        tail = &rt->next;
+        n++;
     } /* -- while -- */
 
+    fclose(fp);
+    *routes = head;
+    return n;
+} /* -- sr_read_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method:
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr,const char* filename)
+{
+    struct sr_rt* routes;
+    int n = sr_read_rt(filename,&routes);
+
+    if(n < 0)
+    { return -1; }
+    if(n > 0)
+    {
+        printf("Loading routing table from server, clear local routing table.\n");
+        sr->routing_table = routes;
+    }
+
     return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_check_rt_ifaces
+ *
+ * Counts the routes whose interface the router does not have, and
+ * points 'bad' at the first of them. Tables use a handful of interfaces,
+ * so the names already found are remembered and most routes cost one
+ * comparison rather than a walk of the interface list.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_check_rt_ifaces(struct sr_instance* sr, struct sr_rt* routes, struct sr_rt** bad)
+{
+    const char* known[16];
+    int nknown = 0;
+    int ret = 0;
+
+    for(struct sr_rt* rt = routes; rt != 0; rt = rt->next)
+    {
+        int i;
+        for(i = 0; i < nknown; i++)
+        {
+            if(strncmp(known[i],rt->interface,sr_IFACE_NAMELEN) == 0)
+            { break; }
+        }
+        if(i < nknown)
+        { continue; }
+
+        struct sr_if* iface = sr_get_interface(sr,rt->interface);
+        if(iface == 0)
+        {
+            if(ret++ == 0 && bad)
+            { *bad = rt; }
+        }
+        else if(nknown < 16)
+        { known[nknown++] = iface->name; }
+    }
+
+    return ret;
+} /* -- sr_check_rt_ifaces -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_free_rt
+ *
+ * Frees a list of routes.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_free_rt(struct sr_rt* routes)
+{
+    while(routes)
+    {
+        struct sr_rt* next = routes->next;
+        free(routes);
+        routes = next;
+    }
+} /* -- sr_free_rt -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -132,15 +218,18 @@ struct in_addr gw, struct in_addr mask,char* if_name)
 } /* -- sr_add_entry -- */
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_print_routing_table
+ *
+ * Once the router runs, the caller holds an RCU read section, as the
+ * table may be swapped while it is printed.
  *
  *---------------------------------------------------------------------*/
 
 void sr_print_routing_table(struct sr_instance* sr)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_rt* rt_walker = __atomic_load_n(&sr->routing_table, __ATOMIC_ACQUIRE);
 
-    if(sr->routing_table == 0)
+    if(rt_walker == 0)
     {
         printf(" *warning* Routing table empty \n");
         return;
@@ -148,12 +237,9 @@ void sr_print_routing_table(struct sr_instance* sr)
 
     printf("Destination\tGateway\t\tMask\tIface\n");
 
-    rt_walker = sr->routing_table;
-    
     sr_print_routing_entry(rt_walker);
-    while(rt_walker->next)
+    while((rt_walker = __atomic_load_n(&rt_walker->next, __ATOMIC_ACQUIRE)))
     {
-        rt_walker = rt_walker->next; 
         sr_print_routing_entry(rt_walker);
     }
 
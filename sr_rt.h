@@ -34,11 +34,15 @@ struct sr_rt
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
     struct sr_rt* next;
+    struct sr_rt** pprev;   /* in a compiled table, the pointer to this entry */
 };
 typedef struct sr_rt sr_rt_t;
 
 
+int sr_read_rt(const char*, struct sr_rt**);
 int sr_load_rt(struct sr_instance*,const char*);
+void sr_free_rt(struct sr_rt*);
+int sr_check_rt_ifaces(struct sr_instance*, struct sr_rt*, struct sr_rt**);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
 void sr_print_routing_table(struct sr_instance* sr);
@@ -0,0 +1,214 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_shmstats.c
+ *
+ * Description:
+ *
+ * Shared memory stats export, see sr_shmstats.h.
+ *
+ * The data path keeps counting into its per-thread blocks (sr_stats.c);
+ * only the publisher thread writes the segment, so the sequence counter
+ * has a single writer and needs no atomic read-modify-write.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_shmstats.h"
+
+#define SHMSTATS_READ_TRIES 1000
+
+struct sr_shmstats {
+    struct sr_instance *sr;
+    struct sr_shmstats_seg *seg;
+    char name[SR_SHMSTATS_NAMELEN + 1];
+    pthread_t publisher;
+    int stop;
+};
+
+static uint64_t shmstats_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*---------------------------------------------------------------------
+ * Method: shmstats_publish
+ * Scope:  Local
+ *
+ * Take a snapshot of the counters and write it to the segment. The
+ * snapshot is taken before the sequence goes odd to keep the window a
+ * reader can collide with down to a memcpy.
+ *
+ *---------------------------------------------------------------------*/
+
+static void shmstats_publish(struct sr_shmstats *shm)
+{
+    struct sr_shmstats_seg *seg = shm->seg;
+    struct sr_stats_snapshot snap;
+    uint64_t seq = seg->seq;
+
+    sr_stats_snapshot(&snap);
+
+    __atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    seg->updated_ns = shmstats_now_ns();
+    for (struct sr_if *iface = __atomic_load_n(&shm->sr->if_list, __ATOMIC_ACQUIRE);
+         iface != NULL; iface = __atomic_load_n(&iface->next, __ATOMIC_ACQUIRE)) {
+        if (iface->idx >= SR_STATS_MAX_IFACES)
+            continue;
+        struct sr_shmstats_iface *si = &seg->ifaces[iface->idx];
+        strncpy(si->name, iface->name, sr_IFACE_NAMELEN - 1);
+        if (iface->idx + 1 > (int) seg->n_ifaces)
+            seg->n_ifaces = iface->idx + 1;
+        memcpy(si->pkts, snap.if_pkts[iface->idx], sizeof(si->pkts));
+        memcpy(si->bytes, snap.if_bytes[iface->idx], sizeof(si->bytes));
+    }
+    memcpy(seg->drops, snap.drops, sizeof(seg->drops));
+    memcpy(seg->gauges, snap.gauges, sizeof(seg->gauges));
+
+    __atomic_store_n(&seg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *shmstats_publisher(void *arg)
+{
+    struct sr_shmstats *shm = arg;
+    struct timespec period = { 0, SR_SHMSTATS_INTERVAL * 1000000L };
+
+    while (!__atomic_load_n(&shm->stop, __ATOMIC_ACQUIRE)) {
+        shmstats_publish(shm);
+        nanosleep(&period, NULL);
+    }
+    shmstats_publish(shm);
+    return NULL;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_shmstats_open
+ * Scope:  Global
+ *
+ * Interfaces may still be unknown (VNS sends the hardware description
+ * once the main loop is running), so they are picked up on every update.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_shmstats *sr_shmstats_open(struct sr_instance *sr, const char *name)
+{
+    struct sr_shmstats *shm;
+    struct sr_shmstats_seg *seg;
+    int fd;
+
+    assert(sr);
+    assert(name);
+
+    shm = calloc(1, sizeof(*shm));
+    assert(shm);
+    shm->sr = sr;
+    if (name[0] != '/')
+        snprintf(shm->name, sizeof(shm->name), "/%s", name);
+    else
+        snprintf(shm->name, sizeof(shm->name), "%s", name);
+
+    fd = shm_open(shm->name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("shm_open");
+        free(shm);
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(*seg)) != 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(shm->name);
+        free(shm);
+        return NULL;
+    }
+    seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(shm->name);
+        free(shm);
+        return NULL;
+    }
+    shm->seg = seg;
+
+    seg->version = SR_SHMSTATS_VERSION;
+    seg->size = sizeof(*seg);
+    seg->interval_ms = SR_SHMSTATS_INTERVAL;
+    seg->n_drops = drop_reason_max;
+    seg->n_gauges = gauge_max;
+    seg->pid = getpid();
+    for (int r = 0; r < drop_reason_max; r++)
+        strncpy(seg->drop_names[r], sr_stats_drop_name(r), SR_SHMSTATS_NAMELEN - 1);
+    for (int g = 0; g < gauge_max; g++)
+        strncpy(seg->gauge_names[g], sr_stats_gauge_name(g), SR_SHMSTATS_NAMELEN - 1);
+    shmstats_publish(shm);
+
+    /* -- readers check the magic last, it marks the header as complete -- */
+    __atomic_store_n(&seg->magic, SR_SHMSTATS_MAGIC, __ATOMIC_RELEASE);
+
+    if (pthread_create(&shm->publisher, NULL, shmstats_publisher, shm) != 0) {
+        perror("pthread_create");
+        munmap(seg, sizeof(*seg));
+        shm_unlink(shm->name);
+        free(shm);
+        return NULL;
+    }
+
+    return shm;
+}
+
+void sr_shmstats_close(struct sr_shmstats *shm)
+{
+    if (!shm)
+        return;
+
+    __atomic_store_n(&shm->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(shm->publisher, NULL);
+
+    munmap(shm->seg, sizeof(*shm->seg));
+    shm_unlink(shm->name);
+    free(shm);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_shmstats_read
+ * Scope:  Global
+ *
+ * Reader side of the sequence counter. Safe on a read only mapping.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_shmstats_read(const struct sr_shmstats_seg *seg,
+                     struct sr_shmstats_seg *out)
+{
+    for (int tries = 0; tries < SHMSTATS_READ_TRIES; tries++) {
+        uint64_t begin = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+        if (begin & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(out, seg, sizeof(*out));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&seg->seq, __ATOMIC_RELAXED) == begin) {
+            out->seq = begin;
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,77 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_shmstats.h
+ *
+ * Description:
+ *
+ * Shared memory stats export. A publisher thread copies the interface and
+ * drop counters and the NAT and ARP gauges into a POSIX shared memory
+ * segment (/dev/shm/<name> on Linux) a few times a second. External tools
+ * such as sr_stat map the segment read only, so monitoring never takes a
+ * router lock or sends the router a signal.
+ *
+ * The segment is guarded by a sequence counter: the publisher makes it odd
+ * before it writes and even again afterwards, and a reader retries until
+ * it copies the segment with the same even value at both ends.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SHMSTATS_H
+#define SR_SHMSTATS_H
+
+#include <stdint.h>
+
+#include "sr_protocol.h"
+#include "sr_stats.h"
+
+#define SR_SHMSTATS_MAGIC    0x53525354    /* "SRST" */
+#define SR_SHMSTATS_VERSION  8
+#define SR_SHMSTATS_NAMELEN  32
+#define SR_SHMSTATS_INTERVAL 100           /* publish period in ms */
+
+struct sr_shmstats_iface
+{
+    char     name[sr_IFACE_NAMELEN];
+    uint64_t pkts[sr_stats_dir_max];
+    uint64_t bytes[sr_stats_dir_max];
+};
+
+/* Layout of the segment. Any change to it bumps SR_SHMSTATS_VERSION. */
+struct sr_shmstats_seg
+{
+    /* -- written once when the segment is created -- */
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                      /* sizeof(struct sr_shmstats_seg) */
+    uint32_t interval_ms;
+    uint32_t n_drops;
+    uint32_t n_gauges;
+    uint32_t pid;
+    char     drop_names[drop_reason_max][SR_SHMSTATS_NAMELEN];
+    char     gauge_names[gauge_max][SR_SHMSTATS_NAMELEN];
+
+    /* -- guarded by seq -- */
+    uint64_t seq;                       /* odd while an update is in progress */
+    uint64_t updated_ns;                /* CLOCK_MONOTONIC of the last update */
+    uint32_t n_ifaces;
+    uint32_t pad;
+    struct sr_shmstats_iface ifaces[SR_STATS_MAX_IFACES];
+    uint64_t drops[drop_reason_max];
+    int64_t  gauges[gauge_max];
+};
+
+struct sr_instance;
+struct sr_shmstats;
+
+/* Create the segment 'name' and start the publisher thread. Returns NULL
+   on error. */
+struct sr_shmstats *sr_shmstats_open(struct sr_instance *sr, const char *name);
+
+/* Stop the publisher and remove the segment. */
+void sr_shmstats_close(struct sr_shmstats *shm);
+
+/* Copy a consistent view of 'seg' into 'out'. Returns 0 on success, -1 if
+   the writer kept the segment busy for too long. */
+int sr_shmstats_read(const struct sr_shmstats_seg *seg,
+                     struct sr_shmstats_seg *out);
+
+#endif /* -- SR_SHMSTATS_H -- */
@@ -0,0 +1,176 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_stat.c
+ *
+ * Reader for the shared memory stats segment a router publishes with -M
+ * (see sr_shmstats.h). It maps the segment read only and prints, every
+ * interval, per interface packet and bit rates, the drop counters that
+ * moved since the previous sample and the current NAT and ARP gauges.
+ * It never talks to the router, so it can be run as often as needed.
+ *
+ *   sr_stat [-f segment] [-i seconds] [-c count]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sr_shmstats.h"
+
+#define DEFAULT_SEGMENT "sr_stats"
+
+static void usage(char* argv0)
+{
+    printf("Format: %s [-f segment] [-i interval seconds] [-c count]\n", argv0);
+    printf("   defaults segment=%s interval=1 count=0 (run forever)\n",
+           DEFAULT_SEGMENT);
+}
+
+static const struct sr_shmstats_seg* stat_map(const char* name)
+{
+    char path[SR_SHMSTATS_NAMELEN + 2];
+    const struct sr_shmstats_seg* seg;
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if(fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*seg))
+    {
+        fprintf(stderr, "%s: segment too small, version mismatch?\n", path);
+        close(fd);
+        return NULL;
+    }
+    seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(seg == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    if(__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != SR_SHMSTATS_MAGIC ||
+       seg->version != SR_SHMSTATS_VERSION || seg->size != sizeof(*seg))
+    {
+        fprintf(stderr, "%s: not a version %d stats segment\n", path,
+                SR_SHMSTATS_VERSION);
+        munmap((void*) seg, sizeof(*seg));
+        return NULL;
+    }
+    return seg;
+}
+
+static void stat_print(const struct sr_shmstats_seg* prev,
+                       const struct sr_shmstats_seg* cur)
+{
+    double dt = (cur->updated_ns - prev->updated_ns) / 1e9;
+    time_t now = time(NULL);
+    char stamp[32];
+
+    if(dt <= 0)
+        dt = 1e-9;
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+
+    printf("%s  (%.2f s)\n", stamp, dt);
+    printf("%-8s %12s %12s %12s %12s\n", "iface", "rx pkt/s", "rx Mbit/s",
+           "tx pkt/s", "tx Mbit/s");
+    for(unsigned int i = 0; i < cur->n_ifaces && i < SR_STATS_MAX_IFACES; i++)
+    {
+        const struct sr_shmstats_iface* a = &prev->ifaces[i];
+        const struct sr_shmstats_iface* b = &cur->ifaces[i];
+        if(b->name[0] == '\0')
+            continue;
+        printf("%-8s %12.0f %12.2f %12.0f %12.2f\n", b->name,
+               (b->pkts[sr_stats_rx] - a->pkts[sr_stats_rx]) / dt,
+               (b->bytes[sr_stats_rx] - a->bytes[sr_stats_rx]) * 8 / dt / 1e6,
+               (b->pkts[sr_stats_tx] - a->pkts[sr_stats_tx]) / dt,
+               (b->bytes[sr_stats_tx] - a->bytes[sr_stats_tx]) * 8 / dt / 1e6);
+    }
+
+    for(unsigned int r = 0; r < cur->n_drops && r < drop_reason_max; r++)
+    {
+        uint64_t delta = cur->drops[r] - prev->drops[r];
+        if(delta == 0)
+            continue;
+        printf("  drop %-28s +%-10llu %12llu total\n", cur->drop_names[r],
+               (unsigned long long) delta, (unsigned long long) cur->drops[r]);
+    }
+    for(unsigned int g = 0; g < cur->n_gauges && g < gauge_max; g++)
+        printf("  %-33s %12lld\n", cur->gauge_names[g], (long long) cur->gauges[g]);
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    const char* name = DEFAULT_SEGMENT;
+    double interval = 1.0;
+    long count = 0;
+    const struct sr_shmstats_seg* seg;
+    struct sr_shmstats_seg prev, cur;
+    int c;
+
+    while((c = getopt(argc, argv, "hf:i:c:")) != EOF)
+    {
+        switch(c)
+        {
+            case 'f':
+                name = optarg;
+                break;
+            case 'i':
+                interval = atof(optarg);
+                break;
+            case 'c':
+                count = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if(interval <= 0)
+        interval = 1.0;
+
+    if(!(seg = stat_map(name)))
+        return 1;
+    if(sr_shmstats_read(seg, &prev) != 0)
+    {
+        fprintf(stderr, "segment stayed busy, is the router stuck?\n");
+        return 1;
+    }
+
+    for(long n = 0; count == 0 || n < count; n++)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t) interval;
+        ts.tv_nsec = (long) ((interval - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+
+        if(sr_shmstats_read(seg, &cur) != 0)
+        {
+            fprintf(stderr, "segment stayed busy, is the router stuck?\n");
+            return 1;
+        }
+        /* -- a new router instance recreated the segment: start over -- */
+        if(cur.pid != prev.pid || cur.updated_ns < prev.updated_ns)
+        {
+            prev = cur;
+            continue;
+        }
+        stat_print(&prev, &cur);
+        prev = cur;
+    }
+
+    munmap((void*) seg, sizeof(*seg));
+    return 0;
+}
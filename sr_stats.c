@@ -0,0 +1,210 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stats.c
+ *
+ * Description:
+ *
+ * Per-thread statistics counters, see sr_stats.h.
+ *
+ * A thread allocates its block the first time it counts something and
+ * links it into a global list; that is the only time the list lock is
+ * taken. Blocks are never freed, so counts of threads that have exited
+ * still show up in the totals. Each counter has exactly one writer, which
+ * updates it with a relaxed load and store: no locked instruction, and a
+ * concurrent reader never sees a torn value. Gauges are shared and use
+ * atomic adds.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_stats.h"
+
+#define STATS_CACHELINE 64
+
+struct sr_stats_block {
+    struct sr_stats_counters c;
+    struct sr_stats_block *next;
+} __attribute__((aligned(STATS_CACHELINE)));
+
+static const char *sr_drop_names[drop_reason_max] = {
+    [drop_not_for_us]             = "not addressed to us",
+    [drop_unknown_ethertype]      = "unknown ethertype",
+    [drop_arp_truncated]          = "truncated ARP",
+    [drop_arp_not_for_us]         = "ARP for another host",
+    [drop_arp_failure]            = "ARP resolution failed",
+    [drop_ip_truncated]           = "truncated IP",
+    [drop_ip_bad_cksum]           = "bad IP checksum",
+    [drop_ttl_expired]            = "TTL expired",
+    [drop_no_route]               = "no route",
+    [drop_to_self]                = "addressed to self",
+    [drop_not_echo]               = "ICMP to router not echo",
+    [drop_port_unreachable]       = "port unreachable",
+    [drop_nat_unsupported_proto]  = "NAT unsupported protocol",
+    [drop_nat_unsupported_icmp]   = "NAT unsupported ICMP type",
+    [drop_nat_unsolicited_syn]    = "NAT unsolicited SYN",
+    [drop_nat_syn_evicted]        = "NAT pending SYN evicted",
+    [drop_nat_udp_truncated]      = "NAT truncated UDP",
+    [drop_nat_ports_exhausted]    = "NAT ports exhausted",
+    [drop_nat_unmapped]           = "NAT unmapped pool address",
+    [drop_nat_unreachable]        = "NAT host unreachable",
+    [drop_icmp_suppressed]        = "ICMP error suppressed",
+    [drop_police_iface]           = "interface policer",
+    [drop_police_host]            = "host policer",
+    [drop_txq_full]               = "egress queue full",
+    [drop_acl_deny]               = "ACL deny",
+    [drop_send_error]             = "send error",
+};
+
+static const char *sr_gauge_names[gauge_max] = {
+    [gauge_nat_icmp_mappings]     = "NAT ICMP mappings",
+    [gauge_nat_tcp_mappings]      = "NAT TCP mappings",
+    [gauge_nat_tcp_conns]         = "NAT TCP connections",
+    [gauge_nat_udp_mappings]      = "NAT UDP mappings",
+    [gauge_nat_port_blocks]       = "NAT port blocks",
+    [gauge_nat_pending_syns]      = "NAT pending SYNs",
+    [gauge_arp_entries]           = "ARP cache entries",
+    [gauge_arp_requests]          = "ARP requests pending",
+    [gauge_arp_queued_pkts]       = "packets waiting on ARP",
+};
+
+static int64_t stats_gauges[gauge_max];
+
+static __thread struct sr_stats_block *stats_self;
+static struct sr_stats_block *stats_blocks;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sr_stats_block *stats_register(void)
+{
+    struct sr_stats_block *blk;
+
+    if (posix_memalign((void **)&blk, STATS_CACHELINE, sizeof(*blk)) != 0)
+        abort();
+    memset(blk, 0, sizeof(*blk));
+
+    pthread_mutex_lock(&stats_lock);
+    blk->next = stats_blocks;
+    __atomic_store_n(&stats_blocks, blk, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_self = blk;
+    return blk;
+}
+
+static inline struct sr_stats_block *stats_block(void)
+{
+    struct sr_stats_block *blk = stats_self;
+    return blk ? blk : stats_register();
+}
+
+static inline void stats_add(uint64_t *ctr, uint64_t n)
+{
+    __atomic_store_n(ctr, __atomic_load_n(ctr, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void sr_stats_iface(int idx, enum sr_stats_dir dir, unsigned int len)
+{
+    if (idx < 0 || idx >= SR_STATS_MAX_IFACES)
+        return;
+
+    struct sr_stats_block *blk = stats_block();
+    stats_add(&blk->c.if_pkts[idx][dir], 1);
+    stats_add(&blk->c.if_bytes[idx][dir], len);
+}
+
+void sr_stats_drop(enum sr_drop_reason reason)
+{
+    assert(reason < drop_reason_max);
+    stats_add(&stats_block()->c.drops[reason], 1);
+}
+
+void sr_stats_gauge(enum sr_gauge gauge, int64_t delta)
+{
+    assert(gauge < gauge_max);
+    __atomic_fetch_add(&stats_gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+const char *sr_stats_drop_name(enum sr_drop_reason reason)
+{
+    return reason < drop_reason_max ? sr_drop_names[reason] : "?";
+}
+
+const char *sr_stats_gauge_name(enum sr_gauge gauge)
+{
+    return gauge < gauge_max ? sr_gauge_names[gauge] : "?";
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_snapshot
+ * Scope:  Global
+ *
+ * The list is only ever pushed to at the head, so it can be walked
+ * without the lock.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_stats_snapshot(struct sr_stats_snapshot *snap)
+{
+    uint64_t *dst = (uint64_t *) snap;
+    const size_t n = sizeof(struct sr_stats_counters) / sizeof(uint64_t);
+
+    memset(snap, 0, sizeof(*snap));
+
+    for (struct sr_stats_block *blk = __atomic_load_n(&stats_blocks, __ATOMIC_ACQUIRE);
+         blk != NULL; blk = blk->next) {
+        uint64_t *src = (uint64_t *) &blk->c;
+        for (size_t i = 0; i < n; i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+
+    for (int g = 0; g < gauge_max; g++)
+        snap->gauges[g] = __atomic_load_n(&stats_gauges[g], __ATOMIC_RELAXED);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_stats_print
+ * Scope:  Global
+ *
+ * Print per interface traffic and the non-zero drop counters.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_stats_print(struct sr_instance *sr, FILE *fp)
+{
+    struct sr_stats_snapshot snap;
+    uint64_t total = 0;
+
+    sr_stats_snapshot(&snap);
+
+    fprintf(fp, "---------------------------------------------\n");
+    fprintf(fp, "%-8s %12s %14s %12s %14s\n", "iface", "rx pkts", "rx bytes",
+            "tx pkts", "tx bytes");
+    for (struct sr_if *iface = sr->if_list; iface != NULL; iface = iface->next) {
+        if (iface->idx >= SR_STATS_MAX_IFACES)
+            continue;
+        fprintf(fp, "%-8s %12llu %14llu %12llu %14llu\n", iface->name,
+                (unsigned long long) snap.if_pkts[iface->idx][sr_stats_rx],
+                (unsigned long long) snap.if_bytes[iface->idx][sr_stats_rx],
+                (unsigned long long) snap.if_pkts[iface->idx][sr_stats_tx],
+                (unsigned long long) snap.if_bytes[iface->idx][sr_stats_tx]);
+    }
+
+    fprintf(fp, "drops:\n");
+    for (int r = 0; r < drop_reason_max; r++) {
+        if (snap.drops[r] == 0)
+            continue;
+        fprintf(fp, "  %-28s %12llu\n", sr_drop_names[r],
+                (unsigned long long) snap.drops[r]);
+        total += snap.drops[r];
+    }
+    fprintf(fp, "  %-28s %12llu\n", "total", (unsigned long long) total);
+
+    for (int g = 0; g < gauge_max; g++)
+        fprintf(fp, "%-30s %12lld\n", sr_gauge_names[g], (long long) snap.gauges[g]);
+    fprintf(fp, "---------------------------------------------\n");
+}
@@ -0,0 +1,104 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_stats.h
+ *
+ * Description:
+ *
+ * Packet, byte and drop counters. Every thread that touches a counter gets
+ * its own cache line aligned block, so the data path only ever does
+ * uncontended increments; readers add the blocks up on demand.
+ *
+ * Gauges (table sizes and queue lengths) are global and only change on
+ * control paths, which already hold the owning table's lock.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_STATS_H
+#define SR_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SR_STATS_MAX_IFACES 16
+
+struct sr_instance;
+
+enum sr_stats_dir {
+    sr_stats_rx,
+    sr_stats_tx,
+    sr_stats_dir_max
+};
+
+/* Why a packet died. Keep sr_drop_names in sr_stats.c in sync. */
+enum sr_drop_reason {
+    drop_not_for_us,            /* destination MAC is not ours */
+    drop_unknown_ethertype,
+    drop_arp_truncated,
+    drop_arp_not_for_us,        /* ARP target is not the receiving interface */
+    drop_arp_failure,           /* next hop never answered ARP */
+    drop_ip_truncated,          /* ip_len larger than the frame */
+    drop_ip_bad_cksum,
+    drop_ttl_expired,
+    drop_no_route,
+    drop_to_self,               /* router generated packet addressed to itself */
+    drop_not_echo,              /* ICMP to the router that is not an echo request */
+    drop_port_unreachable,      /* non-ICMP packet addressed to the router */
+    drop_nat_unsupported_proto,
+    drop_nat_unsupported_icmp,
+    drop_nat_unsolicited_syn,
+    drop_nat_syn_evicted,       /* pending SYN pushed out by newer ones, never answered */
+    drop_nat_udp_truncated,     /* UDP header or length past the IP payload */
+    drop_nat_ports_exhausted,   /* host's port blocks or the address pool full */
+    drop_nat_unmapped,          /* inbound to a pool address without a mapping */
+    drop_nat_unreachable,       /* inbound packet to a host behind the NAT */
+    drop_icmp_suppressed,       /* ICMP error over its rate limit, or its queue full */
+    drop_police_iface,          /* over the ingress interface's rate */
+    drop_police_host,           /* over the source address' rate */
+    drop_txq_full,              /* egress queue of the class full */
+    drop_acl_deny,              /* denied by an access list rule */
+    drop_send_error,
+    drop_reason_max
+};
+
+/* Current sizes. Keep sr_gauge_names in sr_stats.c in sync. */
+enum sr_gauge {
+    gauge_nat_icmp_mappings,
+    gauge_nat_tcp_mappings,
+    gauge_nat_tcp_conns,
+    gauge_nat_udp_mappings,
+    gauge_nat_port_blocks,
+    gauge_nat_pending_syns,
+    gauge_arp_entries,
+    gauge_arp_requests,
+    gauge_arp_queued_pkts,
+    gauge_max
+};
+
+struct sr_stats_counters {
+    uint64_t if_pkts[SR_STATS_MAX_IFACES][sr_stats_dir_max];
+    uint64_t if_bytes[SR_STATS_MAX_IFACES][sr_stats_dir_max];
+    uint64_t drops[drop_reason_max];
+};
+
+struct sr_stats_snapshot {
+    uint64_t if_pkts[SR_STATS_MAX_IFACES][sr_stats_dir_max];
+    uint64_t if_bytes[SR_STATS_MAX_IFACES][sr_stats_dir_max];
+    uint64_t drops[drop_reason_max];
+    int64_t  gauges[gauge_max];
+};
+
+/* Count one packet of 'len' bytes on interface 'idx' (sr_if->idx). */
+void sr_stats_iface(int idx, enum sr_stats_dir dir, unsigned int len);
+/* Count one dropped packet. */
+void sr_stats_drop(enum sr_drop_reason reason);
+
+/* Adjust a gauge by 'delta'. */
+void sr_stats_gauge(enum sr_gauge gauge, int64_t delta);
+
+const char *sr_stats_drop_name(enum sr_drop_reason reason);
+const char *sr_stats_gauge_name(enum sr_gauge gauge);
+
+/* Sum the blocks of all threads. */
+void sr_stats_snapshot(struct sr_stats_snapshot *snap);
+void sr_stats_print(struct sr_instance *sr, FILE *fp);
+
+#endif /* -- SR_STATS_H -- */
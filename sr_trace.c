@@ -0,0 +1,376 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_trace.c
+ *
+ * Description:
+ *
+ * Runtime switchable tracing, see sr_trace.h.
+ *
+ * Every thread that emits a trace record gets its own single producer,
+ * single consumer ring the first time it does so. The ring is registered
+ * in a global list the same way sr_stats.c registers counter blocks. The
+ * owner fills the slot at 'head' and publishes it with a release store;
+ * the reader thread copies records between 'tail' and 'head' out and
+ * hands the slots back by advancing 'tail'. A full ring drops the new
+ * record and counts it, the traced thread never waits.
+ *
+ * The reader drains all rings every few milliseconds, sorts the batch by
+ * timestamp so records of different threads interleave correctly, and
+ * only then runs the formatter.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+
+#include "sr_trace.h"
+
+#define TRACE_CACHELINE 64
+#define TRACE_DRAIN_NS  5000000     /* reader poll period */
+#define TRACE_LINE      512
+
+struct trace_rec {
+    uint64_t ts;                    /* CLOCK_REALTIME in ns */
+    const char *fmt;
+    uint32_t cat;
+    uint32_t nargs;
+    uint64_t args[SR_TRACE_MAX_ARGS];
+};
+
+struct trace_ring {
+    uint64_t head;                  /* written by the owner only */
+    uint64_t drops;
+    uint64_t tail __attribute__((aligned(TRACE_CACHELINE)));  /* reader only */
+    uint64_t drops_seen;
+    int tid;
+    struct trace_ring *next;
+    struct trace_rec recs[SR_TRACE_SLOTS] __attribute__((aligned(TRACE_CACHELINE)));
+};
+
+struct trace_item {
+    struct trace_rec rec;
+    int tid;
+};
+
+static const struct {
+    const char *name;
+    uint32_t cat;
+} sr_trace_cat_names[] = {
+    { "router",  trace_router },
+    { "nat",     trace_nat },
+    { "timeout", trace_nat_timeout },
+    { "tcp",     trace_tcp_state },
+    { "block",   trace_nat_block },
+    { "all",     trace_all },
+    { "none",    0 },
+};
+
+uint32_t sr_trace_mask;
+
+static __thread struct trace_ring *trace_self;
+static struct trace_ring *trace_rings;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *trace_out;
+static pthread_t trace_reader;
+static int trace_running;
+static int trace_stop;
+
+static struct trace_ring *trace_register(void)
+{
+    struct trace_ring *ring;
+
+    if (posix_memalign((void **)&ring, TRACE_CACHELINE, sizeof(*ring)) != 0)
+        abort();
+    memset(ring, 0, offsetof(struct trace_ring, recs));
+    ring->tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&trace_lock);
+    ring->next = trace_rings;
+    __atomic_store_n(&trace_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_self = ring;
+    return ring;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_trace_emit
+ * Scope:  Global
+ *
+ * Called through the sr_trace macro once the category check passed.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_trace_emit(enum sr_trace_cat cat, const char *fmt,
+                   const uint64_t *args, unsigned int nargs)
+{
+    struct trace_ring *ring = trace_self ? trace_self : trace_register();
+    uint64_t head = ring->head;
+    struct trace_rec *rec;
+    struct timespec ts;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= SR_TRACE_SLOTS) {
+        __atomic_store_n(&ring->drops, ring->drops + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (nargs > SR_TRACE_MAX_ARGS)
+        nargs = SR_TRACE_MAX_ARGS;
+
+    rec = &ring->recs[head & (SR_TRACE_SLOTS - 1)];
+    rec->ts = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec->fmt = fmt;
+    rec->cat = cat;
+    rec->nargs = nargs;
+    memcpy(rec->args, args, nargs * sizeof(uint64_t));
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_trace_format
+ * Scope:  Global
+ *
+ * printf for captured arguments. Flags, width and precision are passed
+ * through to snprintf; missing arguments print as zero.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_trace_format(char *out, size_t size, const char *fmt,
+                    const uint64_t *args, unsigned int nargs)
+{
+    size_t len = 0;
+    unsigned int argi = 0;
+
+#define TRACE_PUT(...) do { \
+        int n_ = snprintf(out + len, size - len, __VA_ARGS__); \
+        if (n_ > 0) len += ((size_t) n_ < size - len) ? (size_t) n_ : size - len - 1; \
+    } while (0)
+
+    assert(size > 0);
+    out[0] = '\0';
+
+    for (const char *p = fmt; *p && len + 1 < size; p++) {
+        if (*p != '%') {
+            out[len++] = *p;
+            out[len] = '\0';
+            continue;
+        }
+        if (p[1] == '%') {
+            TRACE_PUT("%%");
+            p++;
+            continue;
+        }
+
+        /* -- copy flags, width and precision, drop length modifiers -- */
+        char spec[16] = "%";
+        size_t sl = 1;
+        for (p++; *p && strchr("-+ #0123456789.", *p); p++)
+            if (sl < sizeof(spec) - 4)
+                spec[sl++] = *p;
+        while (*p && strchr("hlLqjzt", *p))
+            p++;
+        if (!*p)
+            break;
+
+        uint64_t v = argi < nargs ? args[argi] : 0;
+        argi++;
+
+        switch (*p) {
+            case 'd': case 'i':
+                strcpy(spec + sl, "lld");
+                TRACE_PUT(spec, (long long) (int64_t) v);
+                break;
+            case 'u': case 'x': case 'X':
+                spec[sl++] = 'l';
+                spec[sl++] = 'l';
+                spec[sl++] = *p;
+                spec[sl] = '\0';
+                TRACE_PUT(spec, (unsigned long long) v);
+                break;
+            case 'c':
+                strcpy(spec + sl, "c");
+                TRACE_PUT(spec, (int) v);
+                break;
+            case 's':
+                strcpy(spec + sl, "s");
+                TRACE_PUT(spec, v ? (const char *) (uintptr_t) v : "(null)");
+                break;
+            case 'I': {
+                uint32_t a = ntohl((uint32_t) v);
+                TRACE_PUT("%u.%u.%u.%u", a >> 24, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff);
+                break;
+            }
+            case 'M': {
+                uint8_t m[8];
+                memcpy(m, &v, sizeof(m));
+                TRACE_PUT("%02x:%02x:%02x:%02x:%02x:%02x", m[0], m[1], m[2], m[3], m[4], m[5]);
+                break;
+            }
+            default:
+                TRACE_PUT("%%%c", *p);
+                argi--;
+                break;
+        }
+    }
+#undef TRACE_PUT
+
+    return len;
+}
+
+static const char *trace_cat_name(uint32_t cat)
+{
+    for (size_t i = 0; i < sizeof(sr_trace_cat_names) / sizeof(sr_trace_cat_names[0]); i++)
+        if (sr_trace_cat_names[i].cat == cat)
+            return sr_trace_cat_names[i].name;
+    return "?";
+}
+
+static int trace_item_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const struct trace_item *) a)->rec.ts;
+    uint64_t y = ((const struct trace_item *) b)->rec.ts;
+    return (x > y) - (x < y);
+}
+
+/*---------------------------------------------------------------------
+ * Method: trace_drain
+ * Scope:  Local
+ *
+ * Copy out, sort and write everything that is in the rings right now.
+ * Only ever called by one thread at a time.
+ *
+ *---------------------------------------------------------------------*/
+
+static void trace_drain(struct trace_item **items, size_t *cap)
+{
+    size_t n = 0;
+    char line[TRACE_LINE];
+
+    for (struct trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+         ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t drops = __atomic_load_n(&ring->drops, __ATOMIC_RELAXED);
+
+        if (drops != ring->drops_seen) {
+            fprintf(trace_out, "trace: thread %d lost %llu records\n", ring->tid,
+                    (unsigned long long) (drops - ring->drops_seen));
+            ring->drops_seen = drops;
+        }
+        if (n + (head - ring->tail) > *cap) {
+            *cap = n + (head - ring->tail) + SR_TRACE_SLOTS;
+            *items = realloc(*items, *cap * sizeof(struct trace_item));
+            assert(*items);
+        }
+        for (uint64_t pos = ring->tail; pos != head; pos++, n++) {
+            (*items)[n].rec = ring->recs[pos & (SR_TRACE_SLOTS - 1)];
+            (*items)[n].tid = ring->tid;
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    }
+    if (n == 0)
+        return;
+
+    qsort(*items, n, sizeof(struct trace_item), trace_item_cmp);
+
+    for (size_t i = 0; i < n; i++) {
+        struct trace_rec *rec = &(*items)[i].rec;
+        time_t sec = rec->ts / 1000000000ull;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        sr_trace_format(line, sizeof(line), rec->fmt, rec->args, rec->nargs);
+        fprintf(trace_out, "%02d:%02d:%02d.%06llu [%d] %s: %s\n", tm.tm_hour,
+                tm.tm_min, tm.tm_sec,
+                (unsigned long long) (rec->ts % 1000000000ull) / 1000,
+                (*items)[i].tid, trace_cat_name(rec->cat), line);
+    }
+    fflush(trace_out);
+}
+
+static void *trace_reader_main(void *arg)
+{
+    struct trace_item *items = NULL;
+    size_t cap = 0;
+    struct timespec period = { 0, TRACE_DRAIN_NS };
+
+    while (!__atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE)) {
+        trace_drain(&items, &cap);
+        nanosleep(&period, NULL);
+    }
+    trace_drain(&items, &cap);
+    free(items);
+    return NULL;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_trace_parse
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_trace_parse(const char *spec, uint32_t *mask)
+{
+    char buf[128];
+    char *save = NULL;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    *mask = 0;
+
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        size_t i;
+        for (i = 0; i < sizeof(sr_trace_cat_names) / sizeof(sr_trace_cat_names[0]); i++) {
+            if (strcmp(tok, sr_trace_cat_names[i].name) == 0) {
+                *mask |= sr_trace_cat_names[i].cat;
+                break;
+            }
+        }
+        if (i == sizeof(sr_trace_cat_names) / sizeof(sr_trace_cat_names[0])) {
+            fprintf(stderr, "Unknown trace category '%s' "
+                    "(router, nat, timeout, tcp, block, all, none)\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void sr_trace_set(uint32_t mask, FILE *out)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (out)
+        trace_out = out;
+    if (!trace_out)
+        trace_out = stderr;
+    if (mask && !trace_running) {
+        if (pthread_create(&trace_reader, NULL, trace_reader_main, NULL) != 0) {
+            perror("pthread_create");
+            pthread_mutex_unlock(&trace_lock);
+            return;
+        }
+        trace_running = 1;
+    }
+    __atomic_store_n(&sr_trace_mask, mask, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void sr_trace_close(void)
+{
+    __atomic_store_n(&sr_trace_mask, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_running) {
+        __atomic_store_n(&trace_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(trace_reader, NULL);
+        trace_running = 0;
+        trace_stop = 0;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,88 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_trace.h
+ *
+ * Description:
+ *
+ * Runtime switchable tracing. A trace point stores a timestamp, its
+ * format string and up to SR_TRACE_MAX_ARGS integer arguments into a
+ * ring owned by the calling thread; a reader thread formats the records
+ * and writes them out. Nothing is formatted and no lock is taken on the
+ * traced thread. While a trace point's category is disabled it costs a
+ * load and a predictable branch.
+ *
+ * Because formatting is deferred, arguments are captured by value as
+ * 64-bit integers. Conversions understood by the reader:
+ *
+ *   %d %i %u %x %X %c  integers (length modifiers are accepted and ignored)
+ *   %s                 a string that outlives the process' tracing, such
+ *                      as a literal or an interface name, passed as
+ *                      (uintptr_t) ptr
+ *   %I                 IPv4 address in network byte order
+ *   %M                 MAC address packed with sr_trace_mac()
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TRACE_H
+#define SR_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SR_TRACE_MAX_ARGS 6
+#define SR_TRACE_SLOTS    4096  /* records per thread, power of two */
+
+/* Keep sr_trace_cat_names in sr_trace.c in sync. */
+enum sr_trace_cat {
+    trace_router      = 0x01,   /* forwarding, ARP and ICMP generation */
+    trace_nat         = 0x02,   /* NAT translation */
+    trace_nat_timeout = 0x04,   /* NAT mapping and connection expiry */
+    trace_tcp_state   = 0x08,   /* NAT TCP connection state changes */
+    trace_nat_block   = 0x10,   /* NAT port block allocation and release */
+    trace_all         = 0x1f
+};
+
+extern uint32_t sr_trace_mask;
+
+static inline int sr_trace_enabled(enum sr_trace_cat cat)
+{
+    return __builtin_expect((__atomic_load_n(&sr_trace_mask, __ATOMIC_RELAXED) & cat) != 0, 0);
+}
+
+void sr_trace_emit(enum sr_trace_cat cat, const char *fmt,
+                   const uint64_t *args, unsigned int nargs);
+
+/* sr_trace(cat, fmt, ...): record a trace point. Arguments are only
+   evaluated when 'cat' is enabled. */
+#define sr_trace(cat, fmt, ...) do { \
+    if (sr_trace_enabled(cat)) { \
+        const uint64_t sr_trace_args_[] = { 0, ##__VA_ARGS__ }; \
+        sr_trace_emit((cat), (fmt), sr_trace_args_ + 1, \
+                      sizeof(sr_trace_args_) / sizeof(uint64_t) - 1); \
+    } \
+} while (0)
+
+static inline uint64_t sr_trace_mac(const uint8_t *mac)
+{
+    uint64_t v = 0;
+    memcpy(&v, mac, 6);
+    return v;
+}
+
+/* Parse a comma separated category list ("nat,tcp", "all", "none").
+   Returns -1 on an unknown category. */
+int sr_trace_parse(const char *spec, uint32_t *mask);
+
+/* Enable the categories in 'mask', disable the others. Starts the reader
+   thread the first time a category is enabled. 'out' is where records
+   are written; NULL keeps the current stream (stderr by default). */
+void sr_trace_set(uint32_t mask, FILE *out);
+
+/* Write out everything recorded so far and stop the reader. */
+void sr_trace_close(void);
+
+/* Format one record, exposed for tests. Returns the length written. */
+int sr_trace_format(char *out, size_t size, const char *fmt,
+                    const uint64_t *args, unsigned int nargs);
+
+#endif /* -- SR_TRACE_H -- */
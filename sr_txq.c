@@ -0,0 +1,341 @@
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_txq.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+
+/*
+ * Egress queues.
+ *
+ * Every frame the router builds goes through sr_txq_send. Once the
+ * transmit thread runs, the frame is only queued there and the thread
+ * does the writes, so a slow server socket no longer holds up the
+ * receive loop. Each interface has one queue per class. Classes are
+ * served in strict priority order: ARP first, then interactive traffic
+ * (ICMP, DSCP CS4 and up, small TCP segments), then bulk. Within a class
+ * the interfaces take turns by deficit round robin, SR_TXQ_QUANTUM bytes
+ * a round, as they share one socket to the server. An interface with a
+ * speed (Mbit/s, from the hardware info) is shaped to it by a token
+ * bucket of SR_TXQ_BURST_MS worth of bytes; its frames wait while the
+ * bucket is empty. The thread takes up to SR_TXQ_BATCH frames at a time
+ * and hands them to sr_send_packets, which writes them with one call. A
+ * full queue drops the new frame, counted as drop_txq_full.
+ *
+ * Before sr_txq_start, and in the tests, frames are written right away.
+ */
+
+#define TXQ_SMALL_TCP 128   /* IP length up to which a TCP segment is interactive */
+
+
+static uint64_t txq_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int64_t txq_burst(const struct sr_txq_if *qi)
+{
+  uint64_t burst = qi->rate * SR_TXQ_BURST_MS / 1000;
+  return (burst < 2 * SR_TXQ_QUANTUM) ? 2 * SR_TXQ_QUANTUM : (int64_t) burst;
+}
+
+static struct sr_txq_if *txq_if_create(sr_if_t *iface)
+{
+  struct sr_txq_if *qi = calloc(1, sizeof(struct sr_txq_if));
+  qi->iface = iface;
+  qi->rate = (uint64_t) iface->speed * 125000;
+  qi->tokens = txq_burst(qi);
+  qi->stamp = txq_now_ns();
+  return qi;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_txq_init
+ *
+ * Scope:  Global
+ *
+ * Switches to queued transmission. Frames pile up until sr_txq_run is
+ * called; sr_txq_start does that from its own thread.
+ *
+ *---------------------------------------------------------------------*/
+void sr_txq_init(struct sr_instance *sr)
+{
+  struct sr_txq *q = &sr->txq;
+
+  memset(q, 0, sizeof(*q));
+  pthread_mutex_init(&(q->lock), NULL);
+  pthread_cond_init(&(q->cond), NULL);
+  for (sr_if_t *iface = sr->if_list; iface != NULL; iface = iface->next)
+    if (iface->idx < SR_STATS_MAX_IFACES)
+      q->ifs[iface->idx] = txq_if_create(iface);
+  q->enabled = true;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_txq_classify
+ *
+ * Scope:  Global
+ *
+ * Picks the transmit class of a frame from its ethertype and payload.
+ *
+ *---------------------------------------------------------------------*/
+enum sr_txq_class sr_txq_classify(uint16_t ethtype, const uint8_t *payload, unsigned int len)
+{
+  if (ethtype == ethertype_arp)
+    return txq_control;
+  if (ethtype != ethertype_ip || len < sizeof(sr_ip_hdr_t))
+    return txq_bulk;
+
+  const sr_ip_hdr_t *iphdr = (const sr_ip_hdr_t *) payload;
+  if ((iphdr->ip_p == ip_protocol_icmp) || ((iphdr->ip_tos >> 2) >= 32))
+    return txq_interactive;
+  if ((iphdr->ip_p == ip_protocol_tcp) && (ntohs(iphdr->ip_len) <= TXQ_SMALL_TCP))
+    return txq_interactive;
+  return txq_bulk;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_txq_send
+ *
+ * Scope:  Global
+ *
+ * Transmits a complete ethernet frame on 'iface'. Takes ownership of
+ * 'frame', which must come from malloc.
+ *
+ *---------------------------------------------------------------------*/
+void sr_txq_send(struct sr_instance *sr, sr_if_t *iface, uint8_t *frame, unsigned int len,
+                 enum sr_txq_class cls)
+{
+  struct sr_txq *q = &sr->txq;
+
+  if (!q->enabled || iface->idx >= SR_STATS_MAX_IFACES) {
+    sr_send_packet(sr, frame, len, iface->name);
+    free(frame);
+    return;
+  }
+
+  pthread_mutex_lock(&(q->lock));
+  struct sr_txq_if *qi = q->ifs[iface->idx];
+  if (qi == NULL)
+    qi = q->ifs[iface->idx] = txq_if_create(iface);
+  if (qi->count[cls] == SR_TXQ_DEPTH) {
+    pthread_mutex_unlock(&(q->lock));
+    sr_trace(trace_router,"egress queue [%u] of [%s] full",cls,(uintptr_t)iface->name);
+    sr_stats_drop(drop_txq_full);
+    free(frame);
+    return;
+  }
+  struct sr_txq_frame *f = &qi->ring[cls][(qi->head[cls] + qi->count[cls]) % SR_TXQ_DEPTH];
+  f->buf = frame;
+  f->len = len;
+  f->iface = iface;
+  qi->count[cls]++;
+  if (q->queued++ == 0)
+    pthread_cond_signal(&(q->cond));
+  pthread_mutex_unlock(&(q->lock));
+}
+
+
+/* Refills the shaper of an interface and tells whether it may send. */
+static bool txq_shaper_open(struct sr_txq_if *qi, uint64_t now)
+{
+  if (qi->rate == 0)
+    return true;
+  if (now > qi->stamp) {
+    uint64_t elapsed = now - qi->stamp;
+    if (elapsed > 1000000000ull)
+      elapsed = 1000000000ull;
+    qi->tokens += (int64_t) (elapsed * qi->rate / 1000000000ull);
+    if (qi->tokens > txq_burst(qi))
+      qi->tokens = txq_burst(qi);
+    qi->stamp = now;
+  }
+  return qi->tokens > 0;
+}
+
+/* Takes the next frame of class 'c' by deficit round robin over the
+   interfaces that have one and are not held back by their shaper. Called
+   with the queue locked. */
+static bool txq_pick_class(struct sr_txq *q, enum sr_txq_class c, uint64_t now,
+                           struct sr_txq_frame *out)
+{
+  unsigned int idle = 0;
+
+  while (idle < SR_STATS_MAX_IFACES) {
+    struct sr_txq_if *qi = q->ifs[q->cursor[c]];
+    if ((qi != NULL) && (qi->count[c] != 0) && txq_shaper_open(qi, now)) {
+      struct sr_txq_frame *f = &qi->ring[c][qi->head[c]];
+      if (!q->credited[c]) {
+        qi->deficit[c] += SR_TXQ_QUANTUM;
+        q->credited[c] = true;
+      }
+      if (qi->deficit[c] >= f->len) {
+        *out = *f;
+        qi->head[c] = (qi->head[c] + 1) % SR_TXQ_DEPTH;
+        qi->deficit[c] -= f->len;
+        if (--qi->count[c] == 0)
+          qi->deficit[c] = 0;
+        qi->tokens -= out->len;
+        q->queued--;
+        return true;
+      }
+      idle = 0;
+    } else {
+      if ((qi != NULL) && (qi->count[c] == 0))
+        qi->deficit[c] = 0;
+      idle++;
+    }
+    q->cursor[c] = (q->cursor[c] + 1) % SR_STATS_MAX_IFACES;
+    q->credited[c] = false;
+  }
+  return false;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_txq_run
+ *
+ * Scope:  Global
+ *
+ * Writes up to 'max' queued frames, in batches, in scheduling order.
+ *
+ * returns:
+ *    the number of frames written. Less than 'max' when the queues are
+ *    empty or their shapers hold the rest back.
+ *
+ *---------------------------------------------------------------------*/
+unsigned int sr_txq_run(struct sr_instance *sr, unsigned int max)
+{
+  struct sr_txq *q = &sr->txq;
+  struct sr_txq_frame batch[SR_TXQ_BATCH];
+  unsigned int sent = 0;
+
+  while (sent < max) {
+    unsigned int n = 0;
+    uint64_t now = txq_now_ns();
+
+    pthread_mutex_lock(&(q->lock));
+    while ((n < SR_TXQ_BATCH) && (sent + n < max) && (q->queued != 0)) {
+      enum sr_txq_class c;
+      for (c = txq_control; c < txq_classes; c++)
+        if (txq_pick_class(q, c, now, &batch[n]))
+          break;
+      if (c == txq_classes)
+        break;
+      n++;
+    }
+    pthread_mutex_unlock(&(q->lock));
+
+    if (n == 0)
+      break;
+    sr_send_packets(sr, batch, n);
+    for (unsigned int i = 0; i < n; i++)
+      free(batch[i].buf);
+    sent += n;
+  }
+  return sent;
+}
+
+static void *txq_thread(void *arg)
+{
+  struct sr_instance *sr = arg;
+  struct sr_txq *q = &sr->txq;
+
+  while (1) {
+    pthread_mutex_lock(&(q->lock));
+    while ((q->queued == 0) && !q->stop)
+      pthread_cond_wait(&(q->cond), &(q->lock));
+    bool stop = q->stop;
+    pthread_mutex_unlock(&(q->lock));
+
+    //on stop, what the shapers let through now is the last write; the
+    //rest is discarded by sr_txq_stop instead of waited for
+    unsigned int sent = sr_txq_run(sr, UINT_MAX);
+    if (stop)
+      break;
+
+    //nothing sent: the shapers hold every queued frame back
+    if (sent == 0) {
+      struct timespec ts = { 0, 1000000 };
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_txq_start
+ *
+ * Scope:  Global
+ *
+ * Switches to queued transmission and starts the thread that writes the
+ * queues out.
+ *
+ * returns:
+ *    0 on success, -1 if the thread cannot be started
+ *
+ *---------------------------------------------------------------------*/
+int sr_txq_start(struct sr_instance *sr)
+{
+  sr_txq_init(sr);
+  if (pthread_create(&(sr->txq.thread), NULL, txq_thread, sr) != 0) {
+    sr->txq.enabled = false;
+    return -1;
+  }
+  sr->txq.threaded = true;
+  return 0;
+}
+
+
+/*---------------------------------------------------------------------
+ * Method: sr_txq_stop
+ *
+ * Scope:  Global
+ *
+ * Writes out what is still queued and the shapers let through, discards
+ * the rest, stops the transmit thread and goes back to writing frames
+ * right away. It does not wait for a shaped backlog to drain.
+ *
+ *---------------------------------------------------------------------*/
+void sr_txq_stop(struct sr_instance *sr)
+{
+  struct sr_txq *q = &sr->txq;
+  if (!q->enabled)
+    return;
+
+  if (q->threaded) {
+    pthread_mutex_lock(&(q->lock));
+    q->stop = true;
+    pthread_cond_signal(&(q->cond));
+    pthread_mutex_unlock(&(q->lock));
+    pthread_join(q->thread, NULL);
+    q->threaded = false;
+  } else {
+    sr_txq_run(sr, UINT_MAX);
+  }
+
+  //frames a shaper still holds back: nobody waits for them
+  q->enabled = false;
+  for (int i = 0; i < SR_STATS_MAX_IFACES; i++) {
+    struct sr_txq_if *qi = q->ifs[i];
+    for (int c = 0; qi != NULL && c < txq_classes; c++)
+      for (unsigned int k = 0; k < qi->count[c]; k++)
+        free(qi->ring[c][(qi->head[c] + k) % SR_TXQ_DEPTH].buf);
+    free(qi);
+    q->ifs[i] = NULL;
+  }
+  q->queued = 0;
+}
@@ -0,0 +1,72 @@
+
+#ifndef SR_TXQ_H
+#define SR_TXQ_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "sr_if.h"
+#include "sr_stats.h"
+
+#define SR_TXQ_DEPTH    512    /* frames per class and interface */
+#define SR_TXQ_QUANTUM  1514   /* bytes an interface may send per DRR round */
+#define SR_TXQ_BATCH    64     /* frames per write */
+#define SR_TXQ_BURST_MS 10     /* shaper burst, in time at the interface speed */
+
+struct sr_instance;
+
+/* Transmit classes, served in strict priority order */
+enum sr_txq_class {
+  txq_control,         /* ARP */
+  txq_interactive,     /* ICMP, low latency DSCPs, small TCP segments */
+  txq_bulk,
+  txq_classes
+};
+
+/* A frame handed to the transmit queue. 'buf' is malloc'd and owned by
+   the queue until it is written. */
+struct sr_txq_frame {
+  uint8_t *buf;
+  unsigned int len;
+  sr_if_t *iface;
+};
+
+/* The queues of one egress interface */
+struct sr_txq_if {
+  sr_if_t *iface;
+  struct sr_txq_frame ring[txq_classes][SR_TXQ_DEPTH];
+  unsigned int head[txq_classes];
+  unsigned int count[txq_classes];
+  unsigned int deficit[txq_classes];   /* DRR byte credit */
+  uint64_t rate;                       /* bytes/s from iface->speed, 0: not shaped */
+  int64_t tokens;                      /* shaper bytes, may go below zero */
+  uint64_t stamp;                      /* ns of the last refill */
+};
+
+/* Egress queues of the router, see sr_txq.c. All zero is off: frames are
+   written as they are built. */
+struct sr_txq {
+  bool enabled;
+  bool threaded;                       /* 'thread' runs the queues */
+  bool stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  struct sr_txq_if *ifs[SR_STATS_MAX_IFACES];
+  unsigned int cursor[txq_classes];    /* DRR position per class */
+  bool credited[txq_classes];          /* cursor's interface got its quantum */
+  unsigned int queued;
+};
+
+void sr_txq_init(struct sr_instance *sr);
+int  sr_txq_start(struct sr_instance *sr);
+void sr_txq_stop(struct sr_instance *sr);
+enum sr_txq_class sr_txq_classify(uint16_t ethtype, const uint8_t *payload, unsigned int len);
+void sr_txq_send(struct sr_instance *sr, sr_if_t *iface, uint8_t *frame, unsigned int len,
+                 enum sr_txq_class cls);
+unsigned int sr_txq_run(struct sr_instance *sr, unsigned int max);
+
+/* -- sr_vns_comm.c -- */
+int sr_send_packets(struct sr_instance *sr, struct sr_txq_frame *frames, unsigned int n);
+
+#endif
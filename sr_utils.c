@@ -5,6 +5,7 @@
 #include "sr_utils.h"
 #include <stdlib.h>
 #include <time.h>
+#include <arpa/inet.h>
 
 
 uint16_t cksum (const void *_data, int len) {
@@ -21,6 +22,69 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/*---------------------------------------------------------------------
+ * Method: cksum_update16
+ * Scope:  Global
+ *
+ * Incremental checksum update (RFC 1624, eqn. 3): returns checksum 'sum'
+ * adjusted for one 16 bit word of the covered data changing from 'old'
+ * to 'new'. All three are taken as stored in the packet, so byte order
+ * does not matter as long as it is the same for all of them.
+ *
+ *---------------------------------------------------------------------*/
+uint16_t cksum_update16(uint16_t sum, uint16_t old, uint16_t new)
+{
+  uint32_t s = (uint16_t) ~sum + (uint16_t) ~old + new;
+  s = (s >> 16) + (s & 0xffff);
+  s += s >> 16;
+  return (uint16_t) ~s;
+}
+
+/* Same for a 32 bit field such as an IP address. */
+uint16_t cksum_update32(uint16_t sum, uint32_t old, uint32_t new)
+{
+  sum = cksum_update16(sum, (uint16_t) old, (uint16_t) new);
+  return cksum_update16(sum, (uint16_t) (old >> 16), (uint16_t) (new >> 16));
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_parse_prefix
+ *
+ * Scope:  Global
+ *
+ * Parses 'a.b.c.d' or 'a.b.c.d/len' into an address and mask, both in
+ * network byte order, with the host bits of the address cleared. Used
+ * by the access lists and the capture policy.
+ *
+ * returns:
+ *    0 on success, -1 if the address or the length is malformed
+ *
+ *---------------------------------------------------------------------*/
+int sr_parse_prefix(const char *val, uint32_t *addr, uint32_t *mask)
+{
+  char buf[32];
+  char *slash;
+  struct in_addr in;
+  int bits = 32;
+
+  strncpy(buf, val, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  if ((slash = strchr(buf, '/')) != NULL) {
+    char *end;
+    *slash = '\0';
+    long l = strtol(slash + 1, &end, 10);
+    if ((end == slash + 1) || (*end != '\0') || (l < 0) || (l > 32))
+      return -1;
+    bits = (int) l;
+  }
+  if (inet_aton(buf, &in) == 0)
+    return -1;
+
+  *mask = bits ? htonl(0xffffffffu << (32 - bits)) : 0;
+  *addr = in.s_addr & *mask;
+  return 0;
+}
+
 /*---------------------------------------------------------------------
  * Method: extract_ip_payload
 
@@ -45,20 +109,6 @@ uint8_t * extract_ip_payload(sr_ip_hdr_t *iphdr,unsigned int len,unsigned int *l
   return ((uint8_t *)iphdr+ sizeof(sr_ip_hdr_t));
 }
 
-/*---------------------------------------------------------------------
- * Method: current_time
- * Scope:  Private
- *
- * returns the current time of day in a 'time_t' struct.    
- *
- *---------------------------------------------------------------------*/
-time_t current_time() 
-{
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC,&ts);
-  return ts.tv_sec;
-}
-
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
   return ntohs(ehdr->ether_type);
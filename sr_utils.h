@@ -35,8 +35,12 @@
  #define MAX_IP_LENGTH 20
 
 uint16_t cksum(const void *_data, int len);
+uint16_t cksum_update16(uint16_t sum, uint16_t old, uint16_t new);
+uint16_t cksum_update32(uint16_t sum, uint32_t old, uint32_t new);
+
+/* parses 'a.b.c.d[/len]' into a network address and mask, -1 if malformed */
+int sr_parse_prefix(const char *val, uint32_t *addr, uint32_t *mask);
 
-time_t current_time();
 uint8_t * extract_ip_payload(sr_ip_hdr_t *iphdr,unsigned int len,unsigned int *len_payload);
 
 uint16_t ethertype(uint8_t *buf);
@@ -35,16 +35,25 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_replay.h"
+#include "sr_nat_pool.h"
+#include "sr_pcaplog.h"
+#include "sr_stats.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+#include "sr_latency.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
 
-static void sr_log_packet(struct sr_instance* , uint8_t* , int );
+static void sr_log_packet(struct sr_instance* , uint8_t* , int ,
+                          enum sr_pcaplog_dir , const char* );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
                                   unsigned int len,
@@ -201,6 +210,8 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
             case HWSPEED:
                 /* Debug("Speed: %d\n",
                         ntohl(*((unsigned int*)hwinfo->mHWInfo[i].value))); */
+                sr_set_ether_speed(sr,
+                        ntohl(*((uint32_t*)hwinfo->mHWInfo[i].value)));
                 break;
             case HWSUBNET:
                 /* Debug("Subnet: %s\n",inet_ntoa(
@@ -336,6 +347,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
     int command, len;
     unsigned char *buf = 0;
     c_packet_ethernet_header* sr_pkt = 0;
+    char ifname[sizeof(sr_pkt->mInterfaceName) + 1];
     int ret = 0, bytes_read = 0;
 
     /* REQUIRES */
@@ -362,6 +374,10 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 perror("recv(..):sr_client.c::sr_read_from_server");
                 return -1;
             }
+            if (ret == 0)
+            { /* -- server gone, or shut down for SIGTERM -- */
+                return -1;
+            }
             bytes_read += ret;
         } while ( errno == EINTR); /* be mindful of signals */
 
@@ -402,6 +418,11 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 close(sr->sockfd);
                 return -1;
             }
+            if (ret == 0)
+            {
+                free(buf);
+                return -1;
+            }
             bytes_read += ret;
         } while (errno == EINTR); /* be mindful of signals */
     }
@@ -426,24 +447,39 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         case VNSPACKET:
             sr_pkt = (c_packet_ethernet_header *)buf;
 
+            /* -- the name in the header is not NUL-terminated -- */
+            memcpy(ifname, sr_pkt->mInterfaceName, sizeof(sr_pkt->mInterfaceName));
+            ifname[sizeof(sr_pkt->mInterfaceName)] = '\0';
+
             /* -- check if it is an ARP to another router if so drop   -- */
             if ( sr_arp_req_not_for_us(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
+                    ifname) )
+            {
+                struct sr_if* iface = sr_get_interface(sr, ifname);
+                if ( iface )
+                {
+                    sr_stats_iface(iface->idx, sr_stats_rx,
+                            len - sizeof(c_packet_ethernet_header) + sizeof(struct sr_ethernet_hdr));
+                }
+                sr_stats_drop(drop_arp_not_for_us);
+                break;
+            }
 
             /* -- log packet -- */
             sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
+                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header),
+                    sr_pcaplog_in, ifname);
 
             /* -- pass to router, student's code should take over here -- */
+            sr_clock_tick();
             sr_handlepacket(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+                    ifname);
 
             break;
 
@@ -474,6 +510,11 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 fprintf(stderr,"Routing table not consistent with hardware\n");
                 return -1;
             }
+            if(sr->nat_enabled && sr_nat_pool_default(sr) != 0)
+            {
+                fprintf(stderr,"No external interface for the NAT address pool\n");
+                return -1;
+            }
             printf(" <-- Ready to process packets --> \n");
             break;
 
@@ -496,7 +537,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             break;
 
         default:
-            Debug("unknown command: %d\n", command);
+            sr_trace(trace_router, "unknown command: %d", command);
             break;
 
     }/* -- switch -- */
@@ -578,6 +619,18 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
+    /* -- offline replay, nothing to send to -- */
+    if ( sr->replay ){
+        sr_log_packet(sr,buf,len,sr_pcaplog_out,iface);
+        if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
+            fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+            sr_stats_drop(drop_send_error);
+            return -1;
+        }
+        sr_stats_iface(sr_get_interface(sr, iface)->idx, sr_stats_tx, len);
+        return sr_replay_send(sr, buf, len, iface);
+    }
+
     /* Create packet */
     sr_pkt = (c_packet_header *)malloc(len +
             sizeof(c_packet_header));
@@ -589,50 +642,144 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
             buf,len);
 
     /* -- log packet -- */
-    sr_log_packet(sr,buf,len);
+    sr_log_packet(sr,buf,len,sr_pcaplog_out,iface);
 
     if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
         fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        sr_stats_drop(drop_send_error);
         free ( sr_pkt );
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
+    uint64_t lat = sr_lat_begin();
+    ssize_t written = write(sr->sockfd, sr_pkt, total_len);
+    sr_lat_end(lat_tx_write,lat);
+    if( written < total_len ){
         fprintf(stderr, "Error writing packet\n");
+        sr_stats_drop(drop_send_error);
         free(sr_pkt);
         return -1;
     }
 
+    sr_stats_iface(sr_get_interface(sr, iface)->idx, sr_stats_tx, len);
     free(sr_pkt);
 
     return 0;
 } /* -- sr_send_packet -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packets(..)
+ * Scope:  Global
+ *
+ * Sends a batch of frames from the egress queues to the server with a
+ * single writev. Frames are checked, logged and counted as by
+ * sr_send_packet; the caller keeps ownership of the buffers.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packets(struct sr_instance* sr /* borrowed */,
+                    struct sr_txq_frame* frames /* borrowed */,
+                    unsigned int n)
+{
+    c_packet_header hdrs[SR_TXQ_BATCH];
+    struct iovec iov[2 * SR_TXQ_BATCH];
+    size_t ends[SR_TXQ_BATCH];           /* stream offset after each frame */
+    unsigned int idx[SR_TXQ_BATCH];
+    unsigned int niov = 0, nframes = 0;
+    size_t total = 0;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(n <= SR_TXQ_BATCH);
+
+    /* -- offline replay writes frame by frame anyway -- */
+    if ( sr->replay ){
+        int ret = 0;
+        for ( unsigned int i = 0; i < n; i++ )
+        { ret |= sr_send_packet(sr, frames[i].buf, frames[i].len, frames[i].iface->name); }
+        return ret;
+    }
+
+    for ( unsigned int i = 0; i < n; i++ ){
+        struct sr_txq_frame *f = &frames[i];
+
+        if ( f->len < sizeof(struct sr_ethernet_hdr) ){
+            fprintf(stderr , "** Error: packet is wayy to short \n");
+            continue;
+        }
+        sr_log_packet(sr,f->buf,f->len,sr_pcaplog_out,f->iface->name);
+        if ( ! sr_ether_addrs_match_interface( sr, f->buf, f->iface->name) ){
+            fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+            sr_stats_drop(drop_send_error);
+            continue;
+        }
+
+        c_packet_header *hdr = &hdrs[nframes];
+        hdr->mLen  = htonl(f->len + sizeof(c_packet_header));
+        hdr->mType = htonl(VNSPACKET);
+        strncpy(hdr->mInterfaceName,f->iface->name,16);
+        iov[niov].iov_base = hdr;
+        iov[niov++].iov_len = sizeof(c_packet_header);
+        iov[niov].iov_base = f->buf;
+        iov[niov++].iov_len = f->len;
+        total += sizeof(c_packet_header) + f->len;
+        ends[nframes] = total;
+        idx[nframes++] = i;
+    }
+
+    /* -- write it all, picking up after short writes -- */
+    size_t written = 0;
+    struct iovec *v = iov;
+    uint64_t lat = sr_lat_begin();
+    while ( niov > 0 ){
+        ssize_t ret = writev(sr->sockfd, v, niov);
+        if ( ret < 0 ){
+            if ( errno == EINTR )
+            { continue; }
+            fprintf(stderr, "Error writing packet\n");
+            break;
+        }
+        written += ret;
+        while ( niov > 0 && (size_t) ret >= v->iov_len ){
+            ret -= v->iov_len;
+            v++;
+            niov--;
+        }
+        if ( niov > 0 ){
+            v->iov_base = (uint8_t *) v->iov_base + ret;
+            v->iov_len -= ret;
+        }
+    }
+    if ( nframes > 0 )
+    { sr_lat_end(lat_tx_write,lat); }
+
+    for ( unsigned int i = 0; i < nframes; i++ ){
+        struct sr_txq_frame *f = &frames[idx[i]];
+        if ( ends[i] <= written )
+        { sr_stats_iface(f->iface->idx, sr_stats_tx, f->len); }
+        else
+        { sr_stats_drop(drop_send_error); }
+    }
+
+    return (written == total && nframes == n) ? 0 : -1;
+} /* -- sr_send_packets -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
  * Scope: Local
  *
  *---------------------------------------------------------------------------*/
 
-void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
+void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len,
+                   enum sr_pcaplog_dir dir, const char* iface )
 {
-    struct pcap_pkthdr h;
-    int size;
-
     /* REQUIRES */
     assert(sr);
 
     if(!sr->logfile)
     {return; }
 
-    size = min(PACKET_DUMP_SIZE, len);
-
-    gettimeofday(&h.ts, 0);
-    h.caplen = size;
-    h.len = (size < PACKET_DUMP_SIZE) ? size : PACKET_DUMP_SIZE;
-
-    sr_dump(sr->logfile, &h, buf);
-    fflush(sr->logfile);
+    sr_pcaplog_packet(sr->logfile, buf, len, dir, iface);
 } /* -- sr_log_packet -- */
 
 /*-----------------------------------------------------------------------------
@@ -650,11 +797,11 @@ int  sr_arp_req_not_for_us(struct sr_instance* sr,
     struct sr_ethernet_hdr* e_hdr = 0;
     struct sr_arp_hdr*       a_hdr = 0;
 
-    if (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr) )
+    /* -- not ours to judge, sr_handlepacket drops it -- */
+    if ( (iface == 0) ||
+            (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr)) )
     { return 0; }
 
-    assert(iface);
-
     e_hdr = (struct sr_ethernet_hdr*)packet;
     a_hdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
 
@@ -0,0 +1,886 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_vns_server.c
+ *
+ * A local stand-in for the VNS server. It speaks the same protocol as
+ * sr_vns_comm.c (see vnscommand.h), so the real 'sr' binary can be run
+ * against it without the external VNS service:
+ *
+ *   - performs the VNS_AUTH_REQUEST / VNS_AUTH_REPLY / VNS_AUTH_STATUS
+ *     handshake (any credentials are accepted)
+ *   - answers VNSOPEN and VNS_OPEN_TEMPLATE, serving the routing table
+ *     given with -r and the hardware description given with -c
+ *   - plays the part of the hosts attached to every router interface:
+ *     ARP requests for any address that does not belong to the router are
+ *     answered with a MAC derived from the requested address
+ *   - injects ICMP echo requests from a synthetic source host at a target
+ *     rate, and timestamps them so that the copies forwarded back by the
+ *     router can be used to measure throughput and latency
+ *
+ * hwinfo file format, one interface per line ('#' starts a comment):
+ *
+ *     <name> <ip> <mask> <mac> [speed]
+ *     eth1   10.0.1.1 255.255.255.0 00:00:00:00:01:01 1000
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "vnscommand.h"
+
+#define DEFAULT_PORT 8888
+#define DEFAULT_HWINFO "hwinfo"
+#define DEFAULT_RATE 1000
+#define DEFAULT_DURATION 10
+#define DEFAULT_PKT_SIZE 98
+#define DEFAULT_SRC_IP "10.0.1.100"
+#define DEFAULT_DST_IP "172.64.3.10"
+
+#define MAX_IFACES 16
+#define MAX_FRAME 1514
+#define MAX_SAMPLES (1 << 20)
+#define BENCH_MAGIC 0x5352424eu /* "SRBN" */
+#define BENCH_ICMP_ID 0x5342
+#define VS_MAX_CMD 10000    /* longest command sr_read_from_server takes */
+
+struct vs_iface {
+    char name[sr_IFACE_NAMELEN];
+    uint32_t ip;   /* network byte order */
+    uint32_t mask; /* network byte order */
+    uint8_t mac[ETHER_ADDR_LEN];
+    uint32_t speed;
+};
+
+/* payload appended after the ICMP echo header of every injected packet */
+struct vs_stamp {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t tx_ns;
+} __attribute__ ((packed));
+
+struct vs_server {
+    int fd;
+    pthread_mutex_t wlock;          /* serializes writes to the router */
+
+    struct vs_iface ifaces[MAX_IFACES];
+    int num_ifaces;
+    char *rtable_file;
+
+    /* traffic parameters */
+    struct vs_iface *in_iface;      /* where synthetic traffic enters */
+    uint32_t src_ip, dst_ip;        /* network byte order */
+    unsigned int rate;              /* packets per second. 0 = unpaced */
+    unsigned int duration;          /* seconds */
+    unsigned int pkt_size;          /* size of the ip packet */
+
+    /* results */
+    volatile bool sending;
+    volatile bool done;
+    uint64_t tx_pkts, tx_bytes;
+    uint64_t rx_pkts, rx_bytes, rx_other, arp_replies;
+    uint64_t tx_start_ns, tx_end_ns, rx_last_ns;
+    uint64_t *samples;              /* latency samples in nanoseconds */
+    unsigned int num_samples;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(char *argv0)
+{
+    printf("VNS stand-in server\n");
+    printf("Format: %s [-h] [-p port] [-c hwinfo file] [-r rtable file]\n", argv0);
+    printf("           [-i ingress iface] [-S src ip] [-D dst ip]\n");
+    printf("           [-R packets/s (0 = unpaced)] [-d seconds] [-s ip packet size]\n");
+    printf("   defaults port=%d hwinfo=%s rate=%d duration=%d size=%d\n",
+            DEFAULT_PORT, DEFAULT_HWINFO, DEFAULT_RATE, DEFAULT_DURATION,
+            DEFAULT_PKT_SIZE);
+    printf("   the router still needs a 64 character 'auth_key' file in its\n");
+    printf("   working directory; its contents are not checked.\n");
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_load_hwinfo(..)
+ * Scope: Local
+ *
+ * Parse the hwinfo file describing the router's interfaces.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vs_load_hwinfo(struct vs_server *vs, const char *filename)
+{
+    char line[BUFSIZ];
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        perror("unable to open hwinfo file");
+        return -1;
+    }
+
+    while (fgets(line, BUFSIZ, fp) != 0) {
+        char name[sr_IFACE_NAMELEN], ip[32], mask[32], mac[32];
+        unsigned int m[ETHER_ADDR_LEN], speed = 0;
+        struct in_addr addr;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%31s %31s %31s %31s %u", name, ip, mask, mac, &speed) < 4) {
+            fprintf(stderr, "Malformed hwinfo line: %s", line);
+            fclose(fp);
+            return -1;
+        }
+        if (vs->num_ifaces == MAX_IFACES) {
+            fprintf(stderr, "Too many interfaces in hwinfo file\n");
+            fclose(fp);
+            return -1;
+        }
+
+        struct vs_iface *iface = &vs->ifaces[vs->num_ifaces];
+        strncpy(iface->name, name, sr_IFACE_NAMELEN);
+        if (inet_aton(ip, &addr) == 0) {
+            fprintf(stderr, "Cannot convert %s to valid IP\n", ip);
+            fclose(fp);
+            return -1;
+        }
+        iface->ip = addr.s_addr;
+        if (inet_aton(mask, &addr) == 0) {
+            fprintf(stderr, "Cannot convert %s to valid mask\n", mask);
+            fclose(fp);
+            return -1;
+        }
+        iface->mask = addr.s_addr;
+        if (sscanf(mac, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) {
+            fprintf(stderr, "Cannot convert %s to valid MAC\n", mac);
+            fclose(fp);
+            return -1;
+        }
+        for (int i = 0; i < ETHER_ADDR_LEN; i++)
+            iface->mac[i] = (uint8_t) m[i];
+        iface->speed = speed;
+        vs->num_ifaces++;
+    }
+
+    fclose(fp);
+    return (vs->num_ifaces > 0) ? 0 : -1;
+}
+
+static struct vs_iface *vs_get_iface(struct vs_server *vs, const char *name)
+{
+    for (int i = 0; i < vs->num_ifaces; i++) {
+        if (strncmp(vs->ifaces[i].name, name, sr_IFACE_NAMELEN) == 0)
+            return &vs->ifaces[i];
+    }
+    return NULL;
+}
+
+static bool vs_router_ip(struct vs_server *vs, uint32_t ip)
+{
+    for (int i = 0; i < vs->num_ifaces; i++) {
+        if (vs->ifaces[i].ip == ip)
+            return true;
+    }
+    return false;
+}
+
+/* simulated hosts get a locally administered MAC derived from their ip */
+static void vs_host_mac(uint32_t ip, uint8_t *mac)
+{
+    uint8_t *b = (uint8_t *) &ip;
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    memcpy(mac + 2, b, 4);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_write / vs_read_msg
+ * Scope: Local
+ *
+ * Framed I/O on the router connection. Every VNS message begins with its
+ * total length in network byte order.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vs_write(struct vs_server *vs, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    pthread_mutex_lock(&vs->wlock);
+    while (len > 0) {
+        ssize_t ret = write(vs->fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            pthread_mutex_unlock(&vs->wlock);
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    pthread_mutex_unlock(&vs->wlock);
+    return 0;
+}
+
+static int vs_read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t ret = read(fd, p, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* returns a malloc'd message with mLen and mType in host byte order */
+static c_base *vs_read_msg(struct vs_server *vs)
+{
+    uint32_t len;
+    if (vs_read_full(vs->fd, &len, sizeof(len)) != 0)
+        return NULL;
+    len = ntohl(len);
+    if (len < sizeof(c_base) || len > 65536) {
+        fprintf(stderr, "Error: bad command length %u\n", len);
+        return NULL;
+    }
+
+    c_base *msg = malloc(len);
+    assert(msg);
+    if (vs_read_full(vs->fd, ((uint8_t *) msg) + sizeof(len), len - sizeof(len)) != 0) {
+        free(msg);
+        return NULL;
+    }
+    msg->mLen = len;
+    msg->mType = ntohl(msg->mType);
+    return msg;
+}
+
+static c_base *vs_expect(struct vs_server *vs, uint32_t type)
+{
+    c_base *msg = vs_read_msg(vs);
+    if (msg && msg->mType != type) {
+        fprintf(stderr, "Error: expected command %u but got %u\n", type, msg->mType);
+        free(msg);
+        return NULL;
+    }
+    return msg;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_send_hwinfo(..)
+ * Scope: Local
+ *
+ * Describe the router's interfaces. sr_handle_hwinfo applies every entry
+ * to the most recently added interface, so each HWINTERFACE is followed
+ * by that interface's attributes.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vs_send_hwinfo(struct vs_server *vs)
+{
+    c_hwinfo hw;
+    int n = 0;
+
+    memset(&hw, 0, sizeof(hw));
+    for (int i = 0; i < vs->num_ifaces; i++) {
+        struct vs_iface *iface = &vs->ifaces[i];
+        uint32_t subnet = iface->ip & iface->mask;
+        uint32_t speed = htonl(iface->speed);
+
+        hw.mHWInfo[n].mKey = htonl(HWINTERFACE);
+        strncpy(hw.mHWInfo[n++].value, iface->name, 32);
+        hw.mHWInfo[n].mKey = htonl(HWSPEED);
+        memcpy(hw.mHWInfo[n++].value, &speed, sizeof(speed));
+        hw.mHWInfo[n].mKey = htonl(HWSUBNET);
+        memcpy(hw.mHWInfo[n++].value, &subnet, sizeof(subnet));
+        hw.mHWInfo[n].mKey = htonl(HWMASK);
+        memcpy(hw.mHWInfo[n++].value, &iface->mask, sizeof(iface->mask));
+        hw.mHWInfo[n].mKey = htonl(HWETHER);
+        memcpy(hw.mHWInfo[n++].value, iface->mac, ETHER_ADDR_LEN);
+        hw.mHWInfo[n].mKey = htonl(HWETHIP);
+        memcpy(hw.mHWInfo[n++].value, &iface->ip, sizeof(iface->ip));
+    }
+
+    uint32_t len = 2 * sizeof(uint32_t) + n * sizeof(c_hw_entry);
+    hw.mLen = htonl(len);
+    hw.mType = htonl(VNSHWINFO);
+    return vs_write(vs, &hw, len);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_send_rtable(..)
+ * Scope: Local
+ *
+ * Send the -r routing table for a template. The router takes it as one
+ * message of at most VS_MAX_CMD bytes and overwrites its copy with it,
+ * so a longer table cannot be split up; it is refused rather than cut.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vs_send_rtable(struct vs_server *vs, const char *host_id)
+{
+    char body[VS_MAX_CMD - sizeof(c_rtable) + 1];
+    size_t body_len = 0;
+
+    FILE *fp = fopen(vs->rtable_file, "r");
+    if (!fp) {
+        perror("unable to open rtable file");
+        return -1;
+    }
+    body_len = fread(body, 1, sizeof(body), fp);
+    bool failed = ferror(fp);
+    fclose(fp);
+    if (failed) {
+        fprintf(stderr, "Error reading rtable file %s\n", vs->rtable_file);
+        return -1;
+    }
+    if (body_len == sizeof(body)) {
+        fprintf(stderr, "Routing table %s is too long for the router (at most %zu bytes)\n",
+                vs->rtable_file, sizeof(body) - 1);
+        return -1;
+    }
+
+    uint32_t len = sizeof(c_rtable) + body_len;
+    c_rtable *rt = malloc(len);
+    assert(rt);
+    rt->mLen = htonl(len);
+    rt->mType = htonl(VNS_RTABLE);
+    memset(rt->mVirtualHostID, 0, IDSIZE);
+    strncpy(rt->mVirtualHostID, host_id, IDSIZE - 1);
+    memcpy(rt->rtable, body, body_len);
+
+    int ret = vs_write(vs, rt, len);
+    free(rt);
+    return ret;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_handshake(..)
+ * Scope: Local
+ *
+ * Mirror of sr_connect_to_server: authenticate, accept the open request
+ * and hand out the topology.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vs_handshake(struct vs_server *vs)
+{
+    struct {
+        c_auth_request hdr;
+        uint8_t salt[20];
+    } __attribute__ ((packed)) req;
+
+    req.hdr.mLen = htonl(sizeof(req));
+    req.hdr.mType = htonl(VNS_AUTH_REQUEST);
+    for (int i = 0; i < (int) sizeof(req.salt); i++)
+        req.salt[i] = (uint8_t) rand();
+    if (vs_write(vs, &req, sizeof(req)) != 0)
+        return -1;
+
+    c_base *msg = vs_expect(vs, VNS_AUTH_REPLY);
+    if (!msg)
+        return -1;
+    free(msg);
+
+    struct {
+        c_auth_status hdr;
+        char msg[16];
+    } __attribute__ ((packed)) status;
+    status.hdr.mLen = htonl(sizeof(status));
+    status.hdr.mType = htonl(VNS_AUTH_STATUS);
+    status.hdr.auth_ok = 1;
+    strncpy(status.msg, "stand-in", sizeof(status.msg));
+    if (vs_write(vs, &status, sizeof(status)) != 0)
+        return -1;
+
+    msg = vs_read_msg(vs);
+    if (!msg)
+        return -1;
+
+    int ret = 0;
+    if (msg->mType == VNS_OPEN_TEMPLATE) {
+        c_open_template *ot = (c_open_template *) msg;
+        char host_id[IDSIZE + 1];
+        memcpy(host_id, ot->mVirtualHostID, IDSIZE);
+        host_id[IDSIZE] = '\0';
+        if (!vs->rtable_file) {
+            fprintf(stderr, "Template requested but no rtable file given (-r)\n");
+            ret = -1;
+        } else {
+            ret = vs_send_rtable(vs, host_id);
+        }
+    } else if (msg->mType != VNSOPEN) {
+        fprintf(stderr, "Error: expected open request but got %u\n", msg->mType);
+        ret = -1;
+    }
+    free(msg);
+
+    if (ret == 0)
+        ret = vs_send_hwinfo(vs);
+    return ret;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_send_frame(..)
+ * Scope: Local
+ *
+ * Inject an ethernet frame into the router on the given interface.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vs_send_frame(struct vs_server *vs, struct vs_iface *iface,
+                         uint8_t *frame, unsigned int len)
+{
+    uint8_t buf[sizeof(c_packet_header) + MAX_FRAME];
+    c_packet_header *hdr = (c_packet_header *) buf;
+
+    assert(len <= MAX_FRAME);
+    hdr->mLen = htonl(sizeof(c_packet_header) + len);
+    hdr->mType = htonl(VNSPACKET);
+    memset(hdr->mInterfaceName, 0, sizeof(hdr->mInterfaceName));
+    strncpy(hdr->mInterfaceName, iface->name, sizeof(hdr->mInterfaceName));
+    memcpy(buf + sizeof(c_packet_header), frame, len);
+    return vs_write(vs, buf, sizeof(c_packet_header) + len);
+}
+
+static void vs_answer_arp(struct vs_server *vs, struct vs_iface *iface,
+                          uint8_t *frame, unsigned int len)
+{
+    if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))
+        return;
+
+    sr_arp_hdr_t *req = (sr_arp_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+    if (ntohs(req->ar_op) != arp_op_request || vs_router_ip(vs, req->ar_tip))
+        return;
+
+    uint8_t reply[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+    sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *) reply;
+    sr_arp_hdr_t *arp = (sr_arp_hdr_t *) (reply + sizeof(sr_ethernet_hdr_t));
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    vs_host_mac(req->ar_tip, mac);
+    memcpy(ehdr->ether_dhost, req->ar_sha, ETHER_ADDR_LEN);
+    memcpy(ehdr->ether_shost, mac, ETHER_ADDR_LEN);
+    ehdr->ether_type = htons(ethertype_arp);
+
+    arp->ar_hrd = htons(arp_hrd_ethernet);
+    arp->ar_pro = htons(arp_protocol_ipv4);
+    arp->ar_hln = ETHER_ADDR_LEN;
+    arp->ar_pln = arp_protlen_ipv4;
+    arp->ar_op = htons(arp_op_reply);
+    memcpy(arp->ar_sha, mac, ETHER_ADDR_LEN);
+    arp->ar_sip = req->ar_tip;
+    memcpy(arp->ar_tha, req->ar_sha, ETHER_ADDR_LEN);
+    arp->ar_tip = req->ar_sip;
+
+    vs_send_frame(vs, iface, reply, sizeof(reply));
+    vs->arp_replies++;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_handle_packet(..)
+ * Scope: Local
+ *
+ * A frame sent by the router. Injected packets that come back out of the
+ * router are matched by their stamp and their latency is recorded.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vs_handle_packet(struct vs_server *vs, c_packet_header *pkt)
+{
+    uint64_t now = now_ns();
+    uint8_t *frame = ((uint8_t *) pkt) + sizeof(c_packet_header);
+    unsigned int len = pkt->mLen - sizeof(c_packet_header);
+    char name[sizeof(pkt->mInterfaceName) + 1];
+
+    memcpy(name, pkt->mInterfaceName, sizeof(pkt->mInterfaceName));
+    name[sizeof(pkt->mInterfaceName)] = '\0';
+    struct vs_iface *iface = vs_get_iface(vs, name);
+
+    if (!iface || len < sizeof(sr_ethernet_hdr_t))
+        return;
+
+    uint16_t type = ethertype(frame);
+    if (type == ethertype_arp) {
+        vs_answer_arp(vs, iface, frame, len);
+        return;
+    }
+
+    unsigned int off = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_echo_hdr_t);
+    if (type == ethertype_ip && len >= off + sizeof(struct vs_stamp)) {
+        sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+        struct vs_stamp stamp;
+        memcpy(&stamp, frame + off, sizeof(stamp));
+        if (iphdr->ip_p == ip_protocol_icmp && stamp.magic == htonl(BENCH_MAGIC)) {
+            vs->rx_pkts++;
+            vs->rx_bytes += len;
+            vs->rx_last_ns = now;
+            if (vs->num_samples < MAX_SAMPLES)
+                vs->samples[vs->num_samples++] = now - stamp.tx_ns;
+            return;
+        }
+    }
+    vs->rx_other++;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_build_probe(..)
+ * Scope: Local
+ *
+ * Build the template frame for injected traffic: an ICMP echo request from
+ * the synthetic source host to the destination host, addressed at ethernet
+ * level to the router's ingress interface.
+ *
+ *---------------------------------------------------------------------------*/
+
+static unsigned int vs_build_probe(struct vs_server *vs, uint8_t *frame)
+{
+    unsigned int iplen = vs->pkt_size;
+    unsigned int len = sizeof(sr_ethernet_hdr_t) + iplen;
+    sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *) frame;
+    sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+    sr_icmp_echo_hdr_t *echo = (sr_icmp_echo_hdr_t *) (((uint8_t *) iphdr) + sizeof(sr_ip_hdr_t));
+
+    memset(frame, 0, len);
+    memcpy(ehdr->ether_dhost, vs->in_iface->mac, ETHER_ADDR_LEN);
+    vs_host_mac(vs->src_ip, ehdr->ether_shost);
+    ehdr->ether_type = htons(ethertype_ip);
+
+    iphdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+    iphdr->ip_v = ip_version_4;
+    iphdr->ip_len = htons(iplen);
+    iphdr->ip_ttl = 64;
+    iphdr->ip_p = ip_protocol_icmp;
+    iphdr->ip_src = vs->src_ip;
+    iphdr->ip_dst = vs->dst_ip;
+    iphdr->ip_sum = cksum(iphdr, sizeof(sr_ip_hdr_t));
+
+    echo->icmp_type = icmp_type_echoreq;
+    echo->icmp_id = htons(BENCH_ICMP_ID);
+    return len;
+}
+
+static void vs_stamp_probe(uint8_t *frame, unsigned int len, uint32_t seq)
+{
+    sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+    sr_icmp_echo_hdr_t *echo = (sr_icmp_echo_hdr_t *) (((uint8_t *) iphdr) + sizeof(sr_ip_hdr_t));
+    struct vs_stamp stamp;
+
+    stamp.magic = htonl(BENCH_MAGIC);
+    stamp.seq = htonl(seq);
+    stamp.tx_ns = now_ns();
+    memcpy(((uint8_t *) echo) + sizeof(sr_icmp_echo_hdr_t), &stamp, sizeof(stamp));
+
+    echo->icmp_seqno = htons((uint16_t) seq);
+    echo->icmp_sum = 0;
+    echo->icmp_sum = cksum(echo, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_sender(..)
+ * Scope: Local
+ *
+ * Traffic generator thread. Packets are scheduled on an absolute timeline
+ * so that a late wakeup is made up for with a burst rather than lowering
+ * the offered rate.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void *vs_sender(void *arg)
+{
+    struct vs_server *vs = arg;
+    uint8_t frame[MAX_FRAME];
+    unsigned int len = vs_build_probe(vs, frame);
+    uint64_t interval = vs->rate ? 1000000000ull / vs->rate : 0;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t) vs->duration * 1000000000ull;
+    uint32_t seq = 0;
+
+    vs->tx_start_ns = start;
+    while (vs->sending) {
+        uint64_t now = now_ns();
+        if (now >= end)
+            break;
+
+        if (interval) {
+            uint64_t due = start + seq * interval;
+            if (due > now) {
+                struct timespec ts;
+                ts.tv_sec = due / 1000000000ull;
+                ts.tv_nsec = due % 1000000000ull;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                continue;
+            }
+        }
+
+        vs_stamp_probe(frame, len, seq);
+        if (vs_send_frame(vs, vs->in_iface, frame, len) != 0)
+            break;
+        vs->tx_pkts++;
+        vs->tx_bytes += len;
+        seq++;
+    }
+    vs->tx_end_ns = now_ns();
+    vs->sending = false;
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *sorted, unsigned int n, double p)
+{
+    if (n == 0)
+        return 0.0;
+    unsigned int idx = (unsigned int) (p * (n - 1));
+    return sorted[idx] / 1000.0;
+}
+
+static void vs_report(struct vs_server *vs)
+{
+    double tx_secs = (vs->tx_end_ns - vs->tx_start_ns) / 1e9;
+    double rx_secs = ((vs->rx_last_ns > vs->tx_start_ns ? vs->rx_last_ns : vs->tx_end_ns) -
+                      vs->tx_start_ns) / 1e9;
+    if (tx_secs <= 0) tx_secs = 1e-9;
+    if (rx_secs <= 0) rx_secs = 1e-9;
+
+    qsort(vs->samples, vs->num_samples, sizeof(uint64_t), cmp_u64);
+
+    printf("---------------------------------------------\n");
+    printf("sent          %llu packets (%.0f pkt/s offered)\n",
+           (unsigned long long) vs->tx_pkts, vs->tx_pkts / tx_secs);
+    printf("forwarded     %llu packets (%.0f pkt/s, %.2f Mbit/s)\n",
+           (unsigned long long) vs->rx_pkts, vs->rx_pkts / rx_secs,
+           vs->rx_bytes * 8 / rx_secs / 1e6);
+    printf("lost          %llu packets\n",
+           (unsigned long long) (vs->tx_pkts > vs->rx_pkts ? vs->tx_pkts - vs->rx_pkts : 0));
+    printf("other frames  %llu, arp replies %llu\n",
+           (unsigned long long) vs->rx_other, (unsigned long long) vs->arp_replies);
+    printf("latency (us)  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           percentile_us(vs->samples, vs->num_samples, 0.50),
+           percentile_us(vs->samples, vs->num_samples, 0.90),
+           percentile_us(vs->samples, vs->num_samples, 0.99),
+           percentile_us(vs->samples, vs->num_samples, 0.999),
+           percentile_us(vs->samples, vs->num_samples, 1.0));
+    printf("---------------------------------------------\n");
+
+    /* one machine readable line for scripts */
+    printf("RESULT tx=%llu rx=%llu tx_pps=%.0f rx_pps=%.0f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+           (unsigned long long) vs->tx_pkts, (unsigned long long) vs->rx_pkts,
+           vs->tx_pkts / tx_secs, vs->rx_pkts / rx_secs,
+           percentile_us(vs->samples, vs->num_samples, 0.50),
+           percentile_us(vs->samples, vs->num_samples, 0.99),
+           percentile_us(vs->samples, vs->num_samples, 1.0));
+}
+
+static void vs_close(struct vs_server *vs, const char *reason)
+{
+    c_close cl;
+    memset(&cl, 0, sizeof(cl));
+    cl.mLen = htonl(sizeof(cl));
+    cl.mType = htonl(VNSCLOSE);
+    strncpy(cl.mErrorMessage, reason, sizeof(cl.mErrorMessage) - 1);
+    vs_write(vs, &cl, sizeof(cl));
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vs_serve(..)
+ * Scope: Local
+ *
+ * Serve a single router session: handshake, wait for the router to settle,
+ * run the traffic generator and collect everything that comes back.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vs_serve(struct vs_server *vs)
+{
+    pthread_t sender;
+    bool started = false;
+    uint64_t start_at = 0, stop_at = 0;
+
+    if (vs_handshake(vs) != 0) {
+        fprintf(stderr, "Handshake with router failed\n");
+        return -1;
+    }
+    printf("Router connected. starting traffic shortly\n");
+
+    /* give the router a moment to finish initialization after hwinfo */
+    start_at = now_ns() + 500000000ull;
+
+    while (!vs->done) {
+        uint64_t now = now_ns();
+        if (!started && now >= start_at) {
+            vs->sending = true;
+            pthread_create(&sender, NULL, vs_sender, vs);
+            started = true;
+        }
+        if (started && !vs->sending && stop_at == 0)
+            stop_at = now + 1000000000ull; /* drain for one more second */
+        if (stop_at && now >= stop_at)
+            break;
+
+        /* wait for input with a short timeout so the timers above run */
+        fd_set rfds;
+        struct timeval tv = { 0, 50000 };
+        FD_ZERO(&rfds);
+        FD_SET(vs->fd, &rfds);
+        int ret = select(vs->fd + 1, &rfds, NULL, NULL, &tv);
+        if (ret < 0 && errno != EINTR)
+            break;
+        if (ret <= 0)
+            continue;
+
+        c_base *msg = vs_read_msg(vs);
+        if (!msg) {
+            fprintf(stderr, "Router closed the connection\n");
+            break;
+        }
+        if (msg->mType == VNSPACKET)
+            vs_handle_packet(vs, (c_packet_header *) msg);
+        free(msg);
+    }
+
+    if (started) {
+        vs->sending = false;
+        pthread_join(sender, NULL);
+    }
+    vs_close(vs, "benchmark complete");
+    vs_report(vs);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    unsigned int port = DEFAULT_PORT;
+    char *hwinfo = DEFAULT_HWINFO;
+    char *in_iface = NULL;
+    char *src = DEFAULT_SRC_IP;
+    char *dst = DEFAULT_DST_IP;
+    struct in_addr addr;
+    struct vs_server vs;
+
+    memset(&vs, 0, sizeof(vs));
+    vs.rate = DEFAULT_RATE;
+    vs.duration = DEFAULT_DURATION;
+    vs.pkt_size = DEFAULT_PKT_SIZE;
+    pthread_mutex_init(&vs.wlock, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((c = getopt(argc, argv, "hp:c:r:i:S:D:R:d:s:")) != EOF) {
+        switch (c) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                hwinfo = optarg;
+                break;
+            case 'r':
+                vs.rtable_file = optarg;
+                break;
+            case 'i':
+                in_iface = optarg;
+                break;
+            case 'S':
+                src = optarg;
+                break;
+            case 'D':
+                dst = optarg;
+                break;
+            case 'R':
+                vs.rate = atoi(optarg);
+                break;
+            case 'd':
+                vs.duration = atoi(optarg);
+                break;
+            case 's':
+                vs.pkt_size = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    unsigned int min_size = sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_echo_hdr_t) + sizeof(struct vs_stamp);
+    if (vs.pkt_size < min_size || vs.pkt_size > MAX_FRAME - sizeof(sr_ethernet_hdr_t)) {
+        fprintf(stderr, "Packet size must be between %u and %u\n", min_size,
+                (unsigned int) (MAX_FRAME - sizeof(sr_ethernet_hdr_t)));
+        exit(1);
+    }
+    if (vs_load_hwinfo(&vs, hwinfo) != 0) {
+        fprintf(stderr, "Error loading hwinfo from %s\n", hwinfo);
+        exit(1);
+    }
+    vs.in_iface = in_iface ? vs_get_iface(&vs, in_iface) : &vs.ifaces[0];
+    if (!vs.in_iface) {
+        fprintf(stderr, "Unknown ingress interface %s\n", in_iface);
+        exit(1);
+    }
+    if (inet_aton(src, &addr) == 0) {
+        fprintf(stderr, "Cannot convert %s to valid IP\n", src);
+        exit(1);
+    }
+    vs.src_ip = addr.s_addr;
+    if (inet_aton(dst, &addr) == 0) {
+        fprintf(stderr, "Cannot convert %s to valid IP\n", dst);
+        exit(1);
+    }
+    vs.dst_ip = addr.s_addr;
+    vs.samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    assert(vs.samples);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    struct sockaddr_in sin;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 || listen(lfd, 1) < 0) {
+        perror("bind/listen");
+        exit(1);
+    }
+
+    printf("VNS stand-in listening on port %u (%d interfaces, %u pkt/s for %us)\n",
+           port, vs.num_ifaces, vs.rate, vs.duration);
+    vs.fd = accept(lfd, NULL, NULL);
+    if (vs.fd < 0) {
+        perror("accept");
+        exit(1);
+    }
+    setsockopt(vs.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    close(lfd);
+
+    int ret = vs_serve(&vs);
+    close(vs.fd);
+    free(vs.samples);
+    return ret == 0 ? 0 : 1;
+}
@@ -7,6 +7,10 @@
 #include <pwd.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 
 #ifdef _LINUX_
@@ -19,6 +23,20 @@
 //#include "sr_utils.h"
 #include "sr_arpcache.h"
 #include "sr_if.h"
+#include "sr_stats.h"
+#include "sr_latency.h"
+#include "sr_trace.h"
+#include "sr_clock.h"
+#include "sr_nat_tcp.h"
+#include "sr_nat_pool.h"
+#include "sr_nat_ckpt.h"
+#include "sr_nat_sync.h"
+#include "sr_nat_forward.h"
+#include "sr_nat_lb.h"
+#include "sr_fib.h"
+#include "sr_fib_image.h"
+#include "sr_rcu.h"
+#include "sr_ctl.h"
 /* Necessary for Compilation */
 
 /* */
@@ -70,7 +88,7 @@ void insert_routing_table(struct sr_rt **rtable,uint32_t dest,uint32_t mask, uin
 	new_entry->gw = gw_addr;
 	new_entry->mask = mask_addr;
 	new_entry->next = 0;
-	strncpy(new_entry->interface,iface,4);
+	strncpy(new_entry->interface,iface,sr_IFACE_NAMELEN);
 	if ((*rtable) == 0) {
 		(*rtable) = new_entry;
 	}
@@ -168,20 +186,32 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
-	Debug("*** --> Packet sent\n");
-	DebugFrame(buf,len);
 	
 	memcpy(sentframe,buf,len);
 	sentlen = len;
 	return 1;
 }
 
+//egress queue writes. keeps the length of each frame, in order
+unsigned int txlens[4096];
+unsigned int ntx, ntxbatches;
+
+int sr_send_packets(struct sr_instance* sr, struct sr_txq_frame *frames, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++) {
+		sr_send_packet(sr,frames[i].buf,frames[i].len,frames[i].iface->name);
+		txlens[ntx++ % 4096] = frames[i].len;
+	}
+	ntxbatches++;
+	return 0;
+}
+
 
 void init_sr(struct sr_instance **sr)
 {
 /* initialize interface */
 	
-	*sr = malloc(sizeof(struct sr_instance));
+	*sr = calloc(1,sizeof(struct sr_instance));
 
 	unsigned char eth_addr[6];
 	eth_addr[0] = 0x11;
@@ -1372,10 +1402,1621 @@ printf("%-70s","Testing sending to unroutable hosts...");
 }
 
 
+void test_drop_counters(struct sr_instance *sr)
+{
+	printf("%-70s","Testing drop reason and interface counters...");
+
+	struct sr_stats_snapshot before, after;
+	uint8_t *frame;
+	unsigned int len;
+	sr_ethernet_hdr_t *ehdr;
+	sr_ip_hdr_t *iphdr;
+
+	len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + ICMP_PACKET_SIZE;
+	frame = calloc(1,len);
+
+	ehdr = (sr_ethernet_hdr_t *)frame;
+	iphdr = (sr_ip_hdr_t *) ((char *)ehdr + sizeof(sr_ethernet_hdr_t));
+
+	//ip header addressed through the router, with a corrupted checksum
+	iphdr->ip_src = 0x22221233;
+	iphdr->ip_dst = 0x33331234;
+	iphdr->ip_v = 	4;
+	iphdr->ip_hl = sizeof(sr_ip_hdr_t)/4;
+	iphdr->ip_len = htons(sizeof(sr_ip_hdr_t) + ICMP_PACKET_SIZE);
+	iphdr->ip_ttl = 10;
+	iphdr->ip_p =	ip_protocol_icmp;
+	iphdr->ip_sum = 0;
+	iphdr->ip_sum = ~cksum(iphdr,sizeof(sr_ip_hdr_t));
+
+	memcpy(ehdr->ether_dhost,sr_get_interface(sr,"eth1")->addr,ETHER_ADDR_LEN);
+	ehdr->ether_type = htons(ethertype_ip);
+
+	sr_stats_snapshot(&before);
+	sr_handlepacket(sr,frame,len,"eth1");
+	sr_stats_snapshot(&after);
+
+	assert(after.drops[drop_ip_bad_cksum] == before.drops[drop_ip_bad_cksum] + 1);
+	assert(after.if_pkts[0][sr_stats_rx] == before.if_pkts[0][sr_stats_rx] + 1);
+	assert(after.if_bytes[0][sr_stats_rx] == before.if_bytes[0][sr_stats_rx] + len);
+
+	//same packet with a valid checksum and a TTL that runs out here
+	iphdr->ip_ttl = 1;
+	iphdr->ip_sum = 0;
+	iphdr->ip_sum = cksum(iphdr,sizeof(sr_ip_hdr_t));
+
+	sr_stats_snapshot(&before);
+	sr_handlepacket(sr,frame,len,"eth1");
+	sr_stats_snapshot(&after);
+
+	assert(after.drops[drop_ttl_expired] == before.drops[drop_ttl_expired] + 1);
+	assert(after.drops[drop_ip_bad_cksum] == before.drops[drop_ip_bad_cksum]);
+
+	//unknown ethertype
+	ehdr->ether_type = htons(0x86dd);
+
+	sr_stats_snapshot(&before);
+	sr_handlepacket(sr,frame,len,"eth1");
+	sr_stats_snapshot(&after);
+
+	assert(after.drops[drop_unknown_ethertype] == before.drops[drop_unknown_ethertype] + 1);
+
+	free(frame);
+
+	printf("PASSED\n");
+}
+
+void test_latency_histogram(struct sr_instance *sr)
+{
+	printf("%-70s","Testing latency histogram buckets and stage timing...");
+
+	struct sr_lat_hist hist;
+
+	//values 1..1000 in a stage the data path never records
+	for (uint64_t v = 1; v <= 1000; v++)
+		sr_lat_record(lat_tx_write,v);
+	sr_lat_snapshot(lat_tx_write,&hist);
+
+	assert(hist.count == 1000);
+	assert(hist.sum == 500500);
+	assert(hist.max == 1000);
+	//a percentile is the top of its bucket: at most 12.5% above the exact value
+	assert(sr_lat_percentile(&hist,0.50) >= 500 && sr_lat_percentile(&hist,0.50) <= 500 * 9 / 8);
+	assert(sr_lat_percentile(&hist,0.99) >= 990 && sr_lat_percentile(&hist,0.99) <= 1000);
+	assert(sr_lat_percentile(&hist,1.0) == 1000);
+
+	//the rx stage is timed only while recording is on
+	uint8_t frame[sizeof(sr_ethernet_hdr_t)] = {0};
+	((sr_ethernet_hdr_t *)frame)->ether_type = htons(ethertype_arp);
+	uint64_t before;
+
+	sr_lat_snapshot(lat_rx_parse,&hist);
+	before = hist.count;
+	sr_handlepacket(sr,frame,sizeof(frame),"eth1");
+	sr_lat_snapshot(lat_rx_parse,&hist);
+	assert(hist.count == before);
+
+	sr_lat_enable(true);
+	sr_handlepacket(sr,frame,sizeof(frame),"eth1");
+	sr_lat_enable(false);
+	sr_lat_snapshot(lat_rx_parse,&hist);
+	assert(hist.count == before + 1);
+
+	//frames of an unknown type end their sample too
+	((sr_ethernet_hdr_t *)frame)->ether_type = htons(0x86dd);
+	sr_lat_enable(true);
+	sr_handlepacket(sr,frame,sizeof(frame),"eth1");
+	sr_lat_enable(false);
+	sr_lat_snapshot(lat_rx_parse,&hist);
+	assert(hist.count == before + 2);
+
+	printf("PASSED\n");
+}
+
+void test_trace_format()
+{
+	printf("%-70s","Testing deferred trace formatting...");
+
+	char out[128];
+	uint8_t mac[ETHER_ADDR_LEN] = {0x00,0x1b,0x21,0xaa,0xbb,0x0c};
+	uint64_t args[] = { htonl(0x0a000164), 443, (uint64_t) -3, sr_trace_mac(mac),
+						(uintptr_t) "eth1", 0xbeef };
+
+	sr_trace_format(out,sizeof(out),"[%I]:[%u] %d %M on %s 0x%04x %%",args,6);
+	assert(strcmp(out,"[10.0.1.100]:[443] -3 00:1b:21:aa:bb:0c on eth1 0xbeef %") == 0);
+
+	//missing arguments print as zero, output is truncated to the buffer
+	sr_trace_format(out,sizeof(out),"%u %lu",args + 1,1);
+	assert(strcmp(out,"443 0") == 0);
+	sr_trace_format(out,8,"%s and more",args + 4,1);
+	assert(strcmp(out,"eth1 an") == 0);
+
+	printf("PASSED\n");
+}
+
+void test_virtual_clock_timeouts(struct sr_instance *sr)
+{
+	printf("%-70s","Testing ARP and NAT expiry on a virtual clock...");
+
+	unsigned char mac[ETHER_ADDR_LEN] = {0x22,0x22,0x22,0x44,0x55,0x66};
+	uint32_t ip = 0x22225555;
+	struct sr_arpentry *entry;
+
+	sr_clock_set_virtual(sr_clock_now());
+
+	//ARP entries live for SR_ARPCACHE_TO seconds
+	sr_arpcache_insert(&sr->cache,mac,ip);
+	sr_clock_advance(SR_ARPCACHE_TO);
+	sr_arpcache_sweep(sr,sr_clock_now());
+	entry = sr_arpcache_lookup(&sr->cache,ip);
+	assert(entry != NULL);
+	free(entry);
+
+	sr_clock_advance(1);
+	sr_arpcache_sweep(sr,sr_clock_now());
+	assert(sr_arpcache_lookup(&sr->cache,ip) == NULL);
+
+	//ICMP mappings expire after icmp_query_timeout seconds without traffic
+	sr->nat.int_iface_name = "eth1";
+	sr->nat.icmp_query_timeout = DEFAULT_ICMP_TIMEOUT;
+	assert(sr_nat_pool_default(sr) == 0);
+	sr_nat_mapping_t *map = sr_nat_insert_mapping(sr,0x22221233,htons(7),0x33331234,0,nat_mapping_icmp);
+	uint16_t aux_ext = map->aux_ext;
+
+	sr_clock_advance(DEFAULT_ICMP_TIMEOUT);
+	sr_nat_sweep(sr,sr_clock_now());
+	assert(sr_nat_lookup_external(&sr->nat,map->ip_ext,aux_ext,nat_mapping_icmp) == map);
+
+	//a million simulated seconds pass without waiting for them
+	sr_clock_advance(1000000);
+	sr_nat_sweep(sr,sr_clock_now());
+	assert(sr_nat_lookup_external(&sr->nat,sr_get_interface(sr,"eth2")->ip,aux_ext,nat_mapping_icmp) == NULL);
+	assert(sr->nat.mappings == NULL);
+
+	printf("PASSED\n");
+}
+
+static sr_ip_hdr_t *build_udp(uint8_t *buf,uint32_t src,uint16_t sport,uint32_t dst,uint16_t dport)
+{
+	unsigned int udplen = sizeof(sr_udp_hdr_t) + 4;
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) buf;
+	sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) (buf + sizeof(sr_ip_hdr_t));
+
+	memset(buf,0,sizeof(sr_ip_hdr_t) + udplen);
+	iphdr->ip_v = 4;
+	iphdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+	iphdr->ip_len = htons(sizeof(sr_ip_hdr_t) + udplen);
+	iphdr->ip_ttl = 64;
+	iphdr->ip_p = ip_protocol_udp;
+	iphdr->ip_src = src;
+	iphdr->ip_dst = dst;
+	udphdr->uh_sport = htons(sport);
+	udphdr->uh_dport = htons(dport);
+	udphdr->uh_ulen = htons(udplen);
+	memcpy(udphdr + 1,"\x12\x34\xff\xfe",4);
+	//the pseudo header checksum is the same for UDP and TCP
+	udphdr->uh_sum = tcp_cksum(iphdr,(sr_tcp_hdr_t *) udphdr,udplen);
+	return iphdr;
+}
+
+static bool udp_sum_valid(sr_ip_hdr_t *iphdr)
+{
+	sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) (iphdr + 1);
+	//cksum() reports a zero result, i.e. a correct checksum, as 0xffff
+	return tcp_cksum(iphdr,(sr_tcp_hdr_t *) udphdr,ntohs(udphdr->uh_ulen)) == 0xffff;
+}
+
+void test_nat_udp(struct sr_instance *sr)
+{
+	printf("%-70s","Testing UDP NAT translation...");
+
+	uint8_t buf[64];
+	sr_if_t *int_iface = sr_get_interface(sr,"eth1");
+	sr_if_t *ext_iface = sr_get_interface(sr,"eth2");
+	uint32_t host = 0x11110005;
+	sr_ip_hdr_t *iphdr;
+	sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) (buf + sizeof(sr_ip_hdr_t));
+
+	sr->nat_enabled = true;
+	sr->nat.int_iface_name = "eth1";
+	sr->nat.udp_timeout = DEFAULT_UDP_TIMEOUT;
+
+	//outbound: source rewritten to the NAT's external address and port
+	iphdr = build_udp(buf,host,5353,0x22220009,53);
+	assert(do_nat(sr,iphdr,int_iface) == nat_action_route);
+	assert(iphdr->ip_src == ext_iface->ip);
+	uint16_t port_ext = udphdr->uh_sport;
+	assert(udp_sum_valid(iphdr));
+
+	//a second destination reuses the same mapping
+	iphdr = build_udp(buf,host,5353,0x33330009,443);
+	assert(do_nat(sr,iphdr,int_iface) == nat_action_route);
+	assert(udphdr->uh_sport == port_ext);
+
+	//inbound from a remote the host never talked to is let through
+	iphdr = build_udp(buf,0x22220077,9999,ext_iface->ip,ntohs(port_ext));
+	assert(do_nat(sr,iphdr,ext_iface) == nat_action_route);
+	assert(iphdr->ip_dst == host);
+	assert(ntohs(udphdr->uh_dport) == 5353);
+	assert(udp_sum_valid(iphdr));
+
+	//a zero checksum means none was computed, and stays zero
+	iphdr = build_udp(buf,host,5353,0x22220009,53);
+	udphdr->uh_sum = 0;
+	assert(do_nat(sr,iphdr,int_iface) == nat_action_route);
+	assert(udphdr->uh_sport == port_ext);
+	assert(udphdr->uh_sum == 0);
+
+	//truncated headers are dropped
+	iphdr = build_udp(buf,host,5353,0x22220009,53);
+	iphdr->ip_len = htons(sizeof(sr_ip_hdr_t) + 4);
+	assert(do_nat(sr,iphdr,int_iface) == nat_action_drop);
+
+	//only outbound traffic keeps the mapping alive
+	sr_clock_advance(DEFAULT_UDP_TIMEOUT + 1);
+	sr_nat_sweep(sr,sr_clock_now());
+	assert(sr_nat_lookup_external(&sr->nat,ext_iface->ip,port_ext,nat_mapping_udp) == NULL);
+	assert(sr->nat.mappings == NULL);
+
+	sr->nat_enabled = false;
+	printf("PASSED\n");
+}
+
+void test_nat_pool(struct sr_instance *sr)
+{
+	printf("%-70s","Testing NAT address pool and port blocks...");
+
+	struct sr_stats_snapshot before, after;
+	sr_nat_mapping_t *map;
+	uint32_t host_a = 0x11110005, host_b = 0x11110006;
+
+	sr->nat.int_iface_name = "eth1";
+	sr_nat_clear(&sr->nat);
+	sr_nat_pool_destroy(&sr->nat.pool);
+	assert(sr_nat_pool_parse(&sr->nat.pool,"100.64.0.0/31@eth2") == 0);
+	assert(sr_nat_pool_parse(&sr->nat.pool,"100.64.0.1") != 0);   //overlap
+	assert(sr_nat_pool_parse(&sr->nat.pool,"100.64.1.0/8") != 0); //too large
+	assert(sr->nat.pool.naddrs == 2);
+
+	//hosts are paired with one address each, and stay on it
+	sr_nat_mapping_t *a0 = sr_nat_insert_mapping(sr,host_a,htons(1000),0,0,nat_mapping_udp);
+	sr_nat_mapping_t *b0 = sr_nat_insert_mapping(sr,host_b,htons(1000),0,0,nat_mapping_udp);
+	sr_nat_mapping_t *a1 = sr_nat_insert_mapping(sr,host_a,htons(7),0,0,nat_mapping_icmp);
+	assert(a0->ip_ext != b0->ip_ext);
+	assert(a1->ip_ext == a0->ip_ext);
+	assert(sr_nat_pool_find(&sr->nat.pool,a0->ip_ext) != NULL);
+	assert(a0->block == a1->block);
+
+	//external lookups are keyed on address and port: both hosts got the
+	//first port of their first block
+	assert(a0->aux_ext == b0->aux_ext);
+	assert(sr_nat_lookup_external(&sr->nat,a0->ip_ext,a0->aux_ext,nat_mapping_udp) == a0);
+	assert(sr_nat_lookup_external(&sr->nat,b0->ip_ext,b0->aux_ext,nat_mapping_udp) == b0);
+
+	//a host gets at most NAT_MAX_BLOCKS_PER_HOST blocks
+	for (unsigned int i = 1; i < NAT_MAX_BLOCKS_PER_HOST * NAT_PORT_BLOCK_SIZE; i++) {
+		map = sr_nat_insert_mapping(sr,host_a,htons(1000 + i),0,0,nat_mapping_udp);
+		assert(map != NULL && map->ip_ext == a0->ip_ext);
+	}
+	sr_stats_snapshot(&before);
+	assert(sr_nat_insert_mapping(sr,host_a,htons(999),0,0,nat_mapping_udp) == NULL);
+	sr_stats_snapshot(&after);
+	assert(after.drops[drop_nat_ports_exhausted] == before.drops[drop_nat_ports_exhausted] + 1);
+	assert(after.gauges[gauge_nat_port_blocks] == NAT_MAX_BLOCKS_PER_HOST + 1);
+
+	//blocks go back to the pool with their last mapping
+	sr_nat_clear(&sr->nat);
+	sr_stats_snapshot(&after);
+	assert(after.gauges[gauge_nat_port_blocks] == 0);
+	assert(sr->nat.pool.nhosts == 0);
+
+	sr_nat_pool_destroy(&sr->nat.pool);
+	printf("PASSED\n");
+}
+
+void test_nat_checkpoint(struct sr_instance *sr)
+{
+	printf("%-70s","Testing NAT checkpoint and warm restart...");
+
+	char path[] = "/tmp/sr_nat_ckpt_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	struct sr_stats_snapshot before, after;
+	sr_tcp_hdr_t tcphdr = { 0 };
+	uint32_t host = 0x11110005;
+
+	sr->nat.int_iface_name = "eth1";
+	sr->nat.icmp_query_timeout = DEFAULT_ICMP_TIMEOUT;
+	sr->nat.tcp_estab_timeout = DEFAULT_TCP_ESTABLISHED_TIMEOUT;
+	sr->nat.tcp_trans_timeout = DEFAULT_TCP_TRANSITORY_TIMEOUT;
+	sr->nat.udp_timeout = DEFAULT_UDP_TIMEOUT;
+	sr_nat_clear(&sr->nat);
+	assert(sr_nat_pool_parse(&sr->nat.pool,"100.64.0.0/31@eth2") == 0);
+
+	sr_nat_mapping_t *icmp = sr_nat_insert_mapping(sr,host,htons(7),0,0,nat_mapping_icmp);
+	sr_nat_mapping_t *udp = sr_nat_insert_mapping(sr,host,htons(5353),0,0,nat_mapping_udp);
+	sr_nat_mapping_t *tcp = sr_nat_insert_mapping(sr,host,htons(4000),0,0,nat_mapping_tcp);
+	tcphdr.th_flags = TH_SYN;
+	update_tcp_connection(&sr->nat,tcp,0x22220009,htons(80),&tcphdr,false);
+	tcp->conns->state = tcp_state_established;
+	tcp->conns->fin_sent_seqno = 1234;
+	struct sr_nat_mapping saved[3] = { *icmp, *udp, *tcp };
+	sr_clock_advance(10);
+	tcphdr.th_flags = TH_ACK;
+	update_tcp_connection(&sr->nat,tcp,0x22220009,htons(80),&tcphdr,false);
+
+	sr_stats_snapshot(&before);
+	assert(sr_nat_ckpt_write(sr,path) == 0);
+	sr_nat_clear(&sr->nat);
+	assert(sr_nat_ckpt_load(sr,path) == 3);
+	sr_stats_snapshot(&after);
+	assert(memcmp(before.gauges,after.gauges,sizeof(before.gauges)) == 0);
+
+	//same external ports, blocks taken back from the pool, idle times kept
+	for (int i = 0; i < 3; i++) {
+		sr_nat_mapping_t *map = sr_nat_lookup_external(&sr->nat,saved[i].ip_ext,
+		                                               saved[i].aux_ext,saved[i].type);
+		assert(map != NULL);
+		assert(map->ip_int == host && map->aux_int == saved[i].aux_int);
+		assert(map->block != NULL);
+		assert(sr_nat_lookup_internal(&sr->nat,host,saved[i].aux_int,saved[i].type) == map);
+		if (map->type == nat_mapping_tcp) {
+			assert(map->conns != NULL && map->conns->next == NULL);
+			assert(map->conns->state == tcp_state_established);
+			assert(map->conns->fin_sent_seqno == 1234);
+			assert(sr_clock_now() - map->conns->last_updated <= 1);
+		} else {
+			assert(sr_clock_now() - map->last_updated >= 10);
+		}
+	}
+	assert(sr->nat.pool.nhosts == 1);
+
+	//new mappings do not collide with restored ones
+	sr_nat_mapping_t *udp2 = sr_nat_insert_mapping(sr,host,htons(5354),0,0,nat_mapping_udp);
+	assert(udp2->aux_ext != saved[1].aux_ext);
+
+	//a corrupt file is refused and nothing is restored from it
+	sr_nat_clear(&sr->nat);
+	assert(truncate(path,sizeof(struct sr_nat_ckpt_hdr) + 3) == 0);
+	assert(sr_nat_ckpt_load(sr,path) == -1);
+	assert(sr->nat.mappings == NULL);
+
+	unlink(path);
+	assert(sr_nat_ckpt_load(sr,path) == 0);
+	sr_nat_pool_destroy(&sr->nat.pool);
+	printf("PASSED\n");
+}
+
+static size_t drain_socket(int fd, uint8_t *buf, size_t size)
+{
+	size_t have = 0;
+	ssize_t n;
+	while (have < size && (n = recv(fd,buf + have,size - have,MSG_DONTWAIT)) > 0)
+		have += n;
+	return have;
+}
+
+void test_nat_sync(struct sr_instance *sr)
+{
+	printf("%-70s","Testing NAT replication to a standby...");
+
+	static uint8_t buf[64 * 1024];
+	sr_tcp_hdr_t tcphdr = { 0 };
+	uint32_t host = 0x11110005;
+	int sv[2];
+
+	//applying a resync clears the table with the NAT lock held
+	pthread_mutexattr_init(&sr->nat.attr);
+	pthread_mutexattr_settype(&sr->nat.attr,PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&sr->nat.lock,&sr->nat.attr);
+
+	sr->nat.int_iface_name = "eth1";
+	sr_nat_clear(&sr->nat);
+	assert(sr_nat_pool_parse(&sr->nat.pool,"100.64.0.0/31@eth2") == 0);
+
+	sr_nat_mapping_t *udp = sr_nat_insert_mapping(sr,host,htons(5353),0,0,nat_mapping_udp);
+	sr_nat_mapping_t *tcp = sr_nat_insert_mapping(sr,host,htons(4000),0,0,nat_mapping_tcp);
+	tcphdr.th_flags = TH_SYN;
+	update_tcp_connection(&sr->nat,tcp,0x22220009,htons(80),&tcphdr,false);
+
+	//a new standby first gets the whole table, then only the changes
+	assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv) == 0);
+	assert(sr_nat_sync_init(sr,NULL,false) == 0);
+	sr->nat.sync->fd = sv[0];
+	assert(sr_nat_sync_flush(sr) == 0);
+	sr_nat_mapping_t *icmp = sr_nat_insert_mapping(sr,host,htons(7),0,0,nat_mapping_icmp);
+	update_tcp_connection(&sr->nat,tcp,0x33330009,htons(443),&tcphdr,false);
+	uint16_t udp_port = udp->aux_ext;
+	sr_nat_remove_mapping(&sr->nat,udp);
+	assert(sr_nat_sync_flush(sr) == 0);
+	assert(sr->nat.sync->resyncs == 1);
+	size_t have = drain_socket(sv[1],buf,sizeof(buf));
+	assert(have == 2 * sizeof(struct sr_nat_sync_batch) + 8 * sizeof(struct sr_nat_sync_msg));
+
+	struct sr_nat_mapping saved[2] = { *tcp, *icmp };
+	sr_nat_sync_destroy(&sr->nat);
+	sr_nat_clear(&sr->nat);
+
+	//the standby rebuilds the same table, also from a stream cut mid-event
+	assert(sr_nat_sync_init(sr,NULL,true) == 0);
+	long used = sr_nat_sync_apply(sr,buf,have - 5);
+	assert(used > 0 && used < have - 5);
+	assert(sr_nat_sync_apply(sr,buf + used,have - used) == have - used);
+	for (int i = 0; i < 2; i++) {
+		sr_nat_mapping_t *map = sr_nat_lookup_external(&sr->nat,saved[i].ip_ext,
+		                                               saved[i].aux_ext,saved[i].type);
+		assert(map != NULL && map->aux_int == saved[i].aux_int);
+	}
+	tcp = sr_nat_lookup_external(&sr->nat,saved[0].ip_ext,saved[0].aux_ext,nat_mapping_tcp);
+	assert(tcp->conns != NULL && tcp->conns->next != NULL && tcp->conns->next->next == NULL);
+	assert(tcp->conns->state == tcp_state_syn_sent);
+	assert(sr_nat_lookup_external(&sr->nat,saved[0].ip_ext,udp_port,nat_mapping_udp) == NULL);
+	assert(sr_nat_sync_apply(sr,(const uint8_t *) "garbage!",8) == -1);
+	sr_nat_sync_destroy(&sr->nat);
+	close(sv[1]);
+
+	//when the queue overflows the backlog is replaced by a resync
+	assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv) == 0);
+	assert(sr_nat_sync_init(sr,NULL,false) == 0);
+	sr->nat.sync->fd = sv[0];
+	assert(sr_nat_sync_flush(sr) == 0);
+	drain_socket(sv[1],buf,sizeof(buf));
+	for (unsigned int i = 0; i < SR_NAT_SYNC_QUEUE; i++)
+		sr_nat_remove_mapping(&sr->nat,sr_nat_insert_mapping(sr,host,htons(9),0,0,nat_mapping_udp));
+	assert(sr->nat.sync->resync);
+	assert(sr_nat_sync_flush(sr) == 0);
+	assert(sr->nat.sync->resyncs == 2);
+	have = drain_socket(sv[1],buf,sizeof(buf));
+	assert(have == sizeof(struct sr_nat_sync_batch) + 6 * sizeof(struct sr_nat_sync_msg));
+	assert(((struct sr_nat_sync_msg *) (buf + sizeof(struct sr_nat_sync_batch)))->kind == sync_resync_begin);
+
+	//a large table goes out a chunk at a time
+	sr_nat_clear(&sr->nat);
+	for (unsigned int i = 0; i < 300; i++)
+		sr_nat_insert_mapping(sr,host,htons(1000 + i),0,0,nat_mapping_udp);
+	sr_nat_sync_resync(&sr->nat);
+	assert(sr_nat_sync_flush(sr) == 0);
+	have = drain_socket(sv[1],buf,sizeof(buf));
+	assert(have == 2 * sizeof(struct sr_nat_sync_batch) + 302 * sizeof(struct sr_nat_sync_msg));
+	assert(sr->nat.sync->cursor == NULL);
+
+	//removing the mapping under the cursor moves the copy along
+	sr_nat_mapping_t *head = sr->nat.mappings;
+	sr->nat.sync->cursor = head;
+	sr_nat_remove_mapping(&sr->nat,head);
+	assert(sr->nat.sync->cursor == sr->nat.mappings && sr->nat.mappings != NULL);
+	sr->nat.sync->cursor = NULL;
+
+	sr_nat_sync_destroy(&sr->nat);
+	close(sv[1]);
+	sr_nat_clear(&sr->nat);
+	sr_nat_pool_destroy(&sr->nat.pool);
+	printf("PASSED\n");
+}
+
+static sr_ip_hdr_t *build_syn(uint8_t *buf,uint32_t src,uint16_t sport,uint32_t dst,uint16_t dport)
+{
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) buf;
+	sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (buf + sizeof(sr_ip_hdr_t));
+
+	memset(buf,0,sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t));
+	iphdr->ip_v = 4;
+	iphdr->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+	iphdr->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t));
+	iphdr->ip_ttl = 64;
+	iphdr->ip_p = ip_protocol_tcp;
+	iphdr->ip_src = src;
+	iphdr->ip_dst = dst;
+	tcphdr->th_sport = htons(sport);
+	tcphdr->th_dport = htons(dport);
+	tcphdr->th_off = sizeof(sr_tcp_hdr_t) / 4;
+	tcphdr->th_flags = TH_SYN;
+	return iphdr;
+}
+
+void test_nat_pending_syns(struct sr_instance *sr)
+{
+	printf("%-70s","Testing bounded unsolicited SYN store...");
+
+	uint8_t buf[64];
+	uint32_t remote = 0x22221233;
+	uint32_t ip_ext = sr_get_interface(sr,"eth2")->ip;
+	struct sr_stats_snapshot before, after;
+	sr_ip_hdr_t *iphdr;
+
+	sr->nat.int_iface_name = "eth1";
+	sr_nat_clear(&sr->nat);
+	sr->nat.max_pending_syns = 4;
+
+	//a retransmitted SYN does not take a second entry
+	sr_stats_snapshot(&before);
+	iphdr = build_syn(buf,remote,5555,ip_ext,2000);
+	assert(handle_incoming_tcp(&sr->nat,iphdr) == nat_action_drop);
+	assert(handle_incoming_tcp(&sr->nat,iphdr) == nat_action_drop);
+	assert(sr->nat.npending_syns == 1);
+	sr_nat_pending_syn_t *syn = sr_nat_lookup_pending_syn(&sr->nat,ip_ext,htons(2000));
+	assert(syn != NULL && memcmp(syn->data,buf,ICMP_DATA_SIZE) == 0);
+
+	//past the cap the oldest entries make room
+	sr_clock_advance(1);
+	for (int port = 2001; port <= 2004; port++)
+		handle_incoming_tcp(&sr->nat,build_syn(buf,remote,5555,ip_ext,port));
+	sr_stats_snapshot(&after);
+	assert(sr->nat.npending_syns == 4);
+	assert(after.drops[drop_nat_syn_evicted] == before.drops[drop_nat_syn_evicted] + 1);
+	assert(after.gauges[gauge_nat_pending_syns] == before.gauges[gauge_nat_pending_syns] + 4);
+	assert(sr_nat_lookup_pending_syn(&sr->nat,ip_ext,htons(2000)) == NULL);
+	assert(sr_nat_lookup_pending_syn(&sr->nat,ip_ext,htons(2004)) != NULL);
+
+	//on expiry the sender of the SYN learns the port is closed
+	unsigned char mac[ETHER_ADDR_LEN] = {0x22,0x22,0x22,0x11,0x22,0x33};
+	sr_rt_t *rt = NULL;
+	assert(longest_prefix_match(sr->routing_table,remote,&rt));
+	sr_arpcache_insert(&sr->cache,mac,rt->gw.s_addr ? rt->gw.s_addr : remote);
+	memset(sentframe,0,MAX_FRAME_SIZE);
+	sr_clock_advance(UNSOLICITED_SYN_TIMEOUT + 1);
+	sr_nat_sweep(sr,sr_clock_now());
+	assert(sr->nat.npending_syns == 0);
+	sr_ip_hdr_t *recv_iphdr = (sr_ip_hdr_t *) (sentframe + sizeof(sr_ethernet_hdr_t));
+	sr_icmp_t3_hdr_t *recv_icmphdr = (sr_icmp_t3_hdr_t *) (recv_iphdr + 1);
+	assert(recv_iphdr->ip_dst == remote && recv_iphdr->ip_p == ip_protocol_icmp);
+	assert(recv_icmphdr->icmp_type == icmp_type_dst_unrch);
+	assert(recv_icmphdr->icmp_code == icmp_code_dst_unrch_port);
+	assert(memcmp(recv_icmphdr->data,buf,ICMP_DATA_SIZE) == 0);
+
+	sr->nat.max_pending_syns = 0;
+	sr_nat_clear(&sr->nat);
+	printf("PASSED\n");
+}
+
+void test_icmp_rate_limit(struct sr_instance *sr)
+{
+	printf("%-70s","Testing ICMP error rate limits and deferred queue...");
+
+	struct sr_stats_snapshot before, after;
+	//the offending packets: an IP header and the 8 bytes quoted after it
+	uint8_t pkt_a[ICMP_DATA_SIZE], pkt_b[ICMP_DATA_SIZE];
+	sr_ip_hdr_t *a = (sr_ip_hdr_t *) pkt_a, *b = (sr_ip_hdr_t *) pkt_b;
+	sr_if_t *iface = sr_get_interface(sr,"eth2");
+	unsigned char mac[ETHER_ADDR_LEN] = {0x22,0x22,0x22,0x11,0x22,0x33};
+
+	for (int i = 0; i < ICMP_DATA_SIZE; i++)
+		pkt_a[i] = i;
+	memset(a,0,sizeof(sr_ip_hdr_t));
+	a->ip_v = 4;
+	a->ip_hl = sizeof(sr_ip_hdr_t)/4;
+	a->ip_src = 0x22221233;
+	a->ip_dst = 0x33331234;
+	memcpy(pkt_b,pkt_a,ICMP_DATA_SIZE);
+	b->ip_src = 0x22221234;
+	sr_arpcache_insert(&sr->cache,mac,0x88882222);
+
+	//30 errors/s in total, 10/s and a burst of 20 per destination
+	sr_icmp_limit_init(&sr->icmp,30,10);
+	sr_stats_snapshot(&before);
+	for (int i = 0; i < 25; i++)
+		sr_icmp_error(sr,icmp_type_dst_unrch,icmp_code_dst_unrch_host,a,iface);
+	for (int i = 0; i < 15; i++)
+		sr_icmp_error(sr,icmp_type_dst_unrch,icmp_code_dst_unrch_host,b,iface);
+	sr_stats_snapshot(&after);
+	assert(sr->icmp.count == 30);
+	assert(after.drops[drop_icmp_suppressed] == before.drops[drop_icmp_suppressed] + 10);
+
+	//nothing is sent until the queue is flushed, then oldest first
+	memset(sentframe,0,MAX_FRAME_SIZE);
+	assert(sr_icmp_flush(sr,SR_ICMP_FLUSH_BATCH) == SR_ICMP_FLUSH_BATCH);
+	sr_ip_hdr_t *recv_iphdr = (sr_ip_hdr_t *) (sentframe + sizeof(sr_ethernet_hdr_t));
+	sr_icmp_t3_hdr_t *recv_icmphdr = (sr_icmp_t3_hdr_t *) (recv_iphdr + 1);
+	assert(recv_iphdr->ip_dst == a->ip_src && recv_iphdr->ip_src == iface->ip);
+	assert(recv_icmphdr->icmp_type == icmp_type_dst_unrch);
+	assert(recv_icmphdr->icmp_code == icmp_code_dst_unrch_host);
+	assert(memcmp(recv_icmphdr->data,pkt_a,ICMP_DATA_SIZE) == 0);
+	assert(sr_icmp_flush(sr,SR_ICMP_QUEUE) == 22);
+	assert(recv_iphdr->ip_dst == b->ip_src);
+
+	//a second later each destination has another 10
+	sr_clock_advance(1);
+	sr_stats_snapshot(&before);
+	for (int i = 0; i < 12; i++)
+		sr_icmp_error(sr,icmp_type_ttl_expired,icmp_code_ttl_expired_in_transit,a,iface);
+	sr_stats_snapshot(&after);
+	assert(after.drops[drop_icmp_suppressed] == before.drops[drop_icmp_suppressed] + 2);
+	assert(sr_icmp_flush(sr,SR_ICMP_QUEUE) == 10);
+
+	//the queue is bounded too
+	sr_icmp_limit_init(&sr->icmp,1000,1000);
+	sr_stats_snapshot(&before);
+	for (int i = 0; i < SR_ICMP_QUEUE + 10; i++)
+		sr_icmp_error(sr,icmp_type_dst_unrch,icmp_code_dst_unrch_port,a,iface);
+	sr_stats_snapshot(&after);
+	assert(after.drops[drop_icmp_suppressed] == before.drops[drop_icmp_suppressed] + 10);
+	assert(sr_icmp_flush(sr,SR_ICMP_QUEUE) == SR_ICMP_QUEUE);
+
+	sr_icmp_limit_init(&sr->icmp,0,0);
+	printf("PASSED\n");
+}
+
+void test_ingress_policing(struct sr_instance *sr)
+{
+	printf("%-70s","Testing ingress interface and per host policers...");
+
+	struct sr_stats_snapshot before, after;
+	sr_if_t *eth1 = sr_get_interface(sr,"eth1");
+	sr_if_t *eth2 = sr_get_interface(sr,"eth2");
+	uint32_t a = 0x1111110a, b = 0x1111110b, c = 0x1111110c, d = 0x1111110d;
+
+	assert(sr_police_parse(&sr->police,"if=eth1,rate=10k,host=3000") == 0);
+	assert(sr_police_parse(&sr->police,"if=eth1,rate=0") != 0);
+	assert(sr_police_parse(&sr->police,"if=eth9,rate=1k") == 0);
+	assert(sr_police_init(sr) != 0);
+	sr->police.npolicers = 1;
+	assert(sr_police_init(sr) == 0);
+
+	//each host gets 3000 bytes a second, the interface 10000
+	sr_stats_snapshot(&before);
+	for (int i = 0; i < 3; i++)
+		assert(sr_police_admit(&sr->police,eth1,a,1000));
+	assert(!sr_police_admit(&sr->police,eth1,a,1000));
+	for (int i = 0; i < 3; i++) {
+		assert(sr_police_admit(&sr->police,eth1,b,1000));
+		assert(sr_police_admit(&sr->police,eth1,c,1000));
+	}
+	assert(sr_police_admit(&sr->police,eth1,d,1000));
+	assert(!sr_police_admit(&sr->police,eth1,d,1000));
+	assert(sr_police_admit(&sr->police,eth2,d,1000));
+	sr_stats_snapshot(&after);
+	assert(after.drops[drop_police_host] == before.drops[drop_police_host] + 1);
+	assert(after.drops[drop_police_iface] == before.drops[drop_police_iface] + 1);
+
+	//refilled a second later
+	sr_clock_advance(1);
+	assert(sr_police_admit(&sr->police,eth1,a,1000));
+
+	sr_police_destroy(&sr->police);
+	memset(&sr->police,0,sizeof(sr->police));
+	printf("PASSED\n");
+}
+
+static void txq_ip(struct sr_instance *sr,const char *name,uint8_t proto,unsigned int len)
+{
+	uint8_t buf[2048];
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) buf;
+	sr_if_t *iface = sr_get_interface(sr,name);
+
+	memset(buf,0,len);
+	iphdr->ip_v = 4;
+	iphdr->ip_hl = sizeof(sr_ip_hdr_t)/4;
+	iphdr->ip_len = htons(len);
+	iphdr->ip_p = proto;
+	wrap_frame(sr,iface,buf,len,iface->addr,ethertype_ip);
+}
+
+void test_egress_queues(struct sr_instance *sr)
+{
+	printf("%-70s","Testing egress queue priorities, DRR and shaping...");
+
+	struct sr_stats_snapshot before, after;
+	sr_if_t *eth1 = sr_get_interface(sr,"eth1");
+	sr_arp_hdr_t arphdr;
+	unsigned int first;
+
+	sr_get_interface(sr,"eth2")->speed = 1;
+	sr_txq_init(sr);
+
+	//ARP ahead of ICMP ahead of bulk, all in one write
+	memset(&arphdr,0,sizeof(arphdr));
+	ntx = ntxbatches = 0;
+	txq_ip(sr,"eth1",IPPROTO_UDP,1000);
+	txq_ip(sr,"eth1",ip_protocol_icmp,100);
+	txq_ip(sr,"eth1",IPPROTO_UDP,1000);
+	wrap_frame(sr,eth1,(uint8_t *)&arphdr,sizeof(arphdr),eth1->addr,ethertype_arp);
+	txq_ip(sr,"eth1",ip_protocol_icmp,100);
+	assert(ntx == 0 && sr->txq.queued == 5);
+	assert(sr_txq_run(sr,SR_TXQ_DEPTH) == 5);
+	assert(ntxbatches == 1);
+	assert(txlens[0] == 14 + sizeof(arphdr));
+	assert(txlens[1] == 114 && txlens[2] == 114);
+	assert(txlens[3] == 1014 && txlens[4] == 1014);
+
+	//bulk on two interfaces shares by bytes, not frames
+	ntx = 0;
+	for (int i = 0; i < 4; i++) {
+		txq_ip(sr,"eth1",IPPROTO_UDP,1400);
+		txq_ip(sr,"eth3",IPPROTO_UDP,700);
+	}
+	assert(sr_txq_run(sr,SR_TXQ_DEPTH) == 8);
+	unsigned int big = 0;
+	for (int i = 0; i < 6; i++)
+		big += (txlens[i] == 1414);
+	assert(big == 2);
+
+	//eth2 runs at 1 Mbit/s, the burst lets only a few frames through
+	ntx = 0;
+	for (int i = 0; i < 10; i++)
+		txq_ip(sr,"eth2",IPPROTO_UDP,1000);
+	first = sr_txq_run(sr,SR_TXQ_DEPTH);
+	assert(first >= 1 && first < 10);
+	assert(sr->txq.queued == 10 - first);
+
+	//a full queue drops new frames
+	sr_stats_snapshot(&before);
+	for (int i = 0; i <= SR_TXQ_DEPTH; i++)
+		txq_ip(sr,"eth1",IPPROTO_UDP,200);
+	sr_stats_snapshot(&after);
+	assert(after.drops[drop_txq_full] == before.drops[drop_txq_full] + 1);
+
+	sr_txq_stop(sr);
+	assert(!sr->txq.enabled && sr->txq.queued == 0);
+
+	//stopping the thread discards a shaped backlog rather than wait
+	//seconds for it to drain
+	assert(sr_txq_start(sr) == 0);
+	for (int i = 0; i < SR_TXQ_DEPTH; i++)
+		txq_ip(sr,"eth2",IPPROTO_UDP,1400);
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	sr_txq_stop(sr);
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	assert((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000 < 500);
+	assert(!sr->txq.enabled && sr->txq.queued == 0);
+	sr_get_interface(sr,"eth2")->speed = 0;
+	printf("PASSED\n");
+}
+
+void test_acl(struct sr_instance *sr)
+{
+	printf("%-70s","Testing compiled access lists...");
+
+	struct sr_stats_snapshot before, after;
+	struct sr_acl *acl = sr_acl_create();
+	sr_if_t *eth1 = sr_get_interface(sr,"eth1");
+	sr_if_t *eth2 = sr_get_interface(sr,"eth2");
+	uint32_t host = htonl(0x0a000105), other = htonl(0x0a000205), server = htonl(0xc0000201);
+	const struct sr_acl_rule *r;
+	uint8_t buf[64];
+	sr_ip_hdr_t *iphdr;
+
+	assert(sr_acl_add(acl,sr,"   # only a comment") == 0);
+	assert(sr_acl_add(acl,sr,"eth9 in deny") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 up deny") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in drop") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny dport=80") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny proto=udp flags=S") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny proto=tcp dport=90-80") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny proto=tcp flags=SA/S") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny src=10.0.0.0/abc") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny src=10.0.0.0/") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny src=10.0.0.0/8x") != 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny dst=10.0.0.0/33") != 0);
+	assert(acl->nrules == 0);
+
+	assert(sr_acl_add(acl,sr,"eth1 in permit proto=udp src=10.0.1.5 dport=53") == 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny proto=udp src=10.0.0.0/16 dport=1-1023") == 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny proto=tcp dst=192.0.2.0/24 flags=S/SA # new connections") == 0);
+	assert(sr_acl_add(acl,sr,"eth1 in permit proto=udp dport=53") == 0);
+	assert(sr_acl_add(acl,sr,"eth1 in deny src=10.0.2.0/24") == 0);
+	assert(sr_acl_add(acl,sr,"eth2 out deny proto=udp dport=53") == 0);
+	sr_acl_compile(acl);
+	assert(acl->tables[eth1->idx][sr_acl_in]->nrules == 5);
+	assert(acl->tables[eth1->idx][sr_acl_out] == NULL);
+
+	//first match in file order, whatever tuple it is in
+	iphdr = build_udp(buf,host,1000,server,53);
+	r = sr_acl_lookup(acl,eth1,sr_acl_in,iphdr,ntohs(iphdr->ip_len));
+	assert(r && r->permit && r->prio == 0);
+	iphdr = build_udp(buf,host,1000,server,123);
+	r = sr_acl_lookup(acl,eth1,sr_acl_in,iphdr,ntohs(iphdr->ip_len));
+	assert(r && !r->permit && r->prio == 1);
+	iphdr = build_udp(buf,host,1000,server,5000);
+	assert(sr_acl_lookup(acl,eth1,sr_acl_in,iphdr,ntohs(iphdr->ip_len)) == NULL);
+	iphdr = build_udp(buf,other,1000,server,53);
+	r = sr_acl_lookup(acl,eth1,sr_acl_in,iphdr,ntohs(iphdr->ip_len));
+	assert(r && !r->permit && r->prio == 1);
+	iphdr = build_udp(buf,other,1000,server,5000);
+	r = sr_acl_lookup(acl,eth1,sr_acl_in,iphdr,ntohs(iphdr->ip_len));
+	assert(r && r->prio == 4);
+	assert(sr_acl_lookup(acl,eth2,sr_acl_in,iphdr,ntohs(iphdr->ip_len)) == NULL);
+
+	//TCP flags: SYN alone is denied, SYN+ACK is not
+	iphdr = build_syn(buf,host,1000,server,80);
+	r = sr_acl_lookup(acl,eth1,sr_acl_in,iphdr,ntohs(iphdr->ip_len));
+	assert(r && r->prio == 2);
+	((sr_tcp_hdr_t *) (iphdr + 1))->th_flags = TH_SYN | TH_ACK;
+	assert(sr_acl_lookup(acl,eth1,sr_acl_in,iphdr,ntohs(iphdr->ip_len)) == NULL);
+
+	//later fragments have no ports, so port rules do not match them
+	iphdr = build_udp(buf,other,1000,server,53);
+	iphdr->ip_off = htons(100);
+	r = sr_acl_lookup(acl,eth1,sr_acl_in,iphdr,ntohs(iphdr->ip_len));
+	assert(r && r->prio == 4);
+
+	//denied on the way out of eth2, counted once
+	sr->acl = acl;
+	sr_stats_snapshot(&before);
+	iphdr = build_udp(buf,host,1000,htonl(0x22220001),53);
+	assert(!sr_acl_permit(sr->acl,eth2,sr_acl_out,iphdr,ntohs(iphdr->ip_len)));
+	assert(sr_acl_permit(sr->acl,eth1,sr_acl_out,iphdr,ntohs(iphdr->ip_len)));
+	sr_stats_snapshot(&after);
+	assert(after.drops[drop_acl_deny] == before.drops[drop_acl_deny] + 1);
+
+	//many rules of one shape stay in one tuple
+	for (int i = 0; i < 1000; i++) {
+		char line[128];
+		snprintf(line,sizeof(line),"eth2 in deny proto=tcp src=10.1.%d.0/24 dport=%d",i % 256,1000 + i);
+		assert(sr_acl_add(acl,sr,line) == 0);
+	}
+	sr_acl_compile(acl);
+	assert(acl->tables[eth2->idx][sr_acl_in]->ntuples == 1);
+	iphdr = build_syn(buf,htonl(0x0a010709),1,server,1263);
+	r = sr_acl_lookup(acl,eth2,sr_acl_in,iphdr,ntohs(iphdr->ip_len));
+	assert(r && r->dport_lo == 1263);
+	iphdr = build_syn(buf,htonl(0x0a010809),1,server,1263);
+	assert(sr_acl_lookup(acl,eth2,sr_acl_in,iphdr,ntohs(iphdr->ip_len)) == NULL);
+
+	sr->acl = NULL;
+	sr_acl_destroy(acl);
+	printf("PASSED\n");
+}
+
+static void write_forwards(const char *path,const char *text)
+{
+	FILE *fp = fopen(path,"w");
+	assert(fp != NULL);
+	fputs(text,fp);
+	fclose(fp);
+}
+
+void test_nat_port_forwards(struct sr_instance *sr)
+{
+	printf("%-70s","Testing NAT static port forwards and reload...");
+
+	char path[] = "/tmp/sr_nat_fwd_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	uint8_t buf[64];
+	char text[512];
+	sr_if_t *int_iface = sr_get_interface(sr,"eth1");
+	sr_if_t *ext_iface = sr_get_interface(sr,"eth2");
+	uint32_t host_a = htonl(0x11110005), host_b = htonl(0x11110006), remote = 0x22220009;
+	sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (buf + sizeof(sr_ip_hdr_t));
+	sr_udp_hdr_t *udphdr = (sr_udp_hdr_t *) (buf + sizeof(sr_ip_hdr_t));
+	sr_nat_mapping_t *map;
+	sr_ip_hdr_t *iphdr;
+
+	sr->nat_enabled = true;
+	sr->nat.int_iface_name = "eth1";
+	sr->nat.icmp_query_timeout = DEFAULT_ICMP_TIMEOUT;
+	sr->nat.tcp_estab_timeout = DEFAULT_TCP_ESTABLISHED_TIMEOUT;
+	sr->nat.tcp_trans_timeout = DEFAULT_TCP_TRANSITORY_TIMEOUT;
+	sr->nat.udp_timeout = DEFAULT_UDP_TIMEOUT;
+	sr_nat_clear(&sr->nat);
+	assert(sr_nat_pool_default(sr) == 0);
+
+	//a dynamic mapping on the port a forward is about to take
+	map = sr_nat_insert_mapping(sr,host_b,htons(6000),0,0,nat_mapping_udp);
+	assert(map && ntohs(map->aux_ext) == MIN_AUX_VALUE);
+
+	write_forwards(path,"tcp 8080 17.17.0.5:80\n"
+	                    "# the name server\n"
+	                    "\n"
+	                    "udp 1024 17.17.0.5:53   # evicts host_b's mapping\n"
+	                    "icmp 77 17.17.0.5:7\n");
+	assert(sr_nat_forward_load(sr,path) == 3);
+	assert(sr_nat_lookup_internal(&sr->nat,host_b,htons(6000),nat_mapping_udp) == NULL);
+
+	//inbound connections reach the server without any outbound traffic first
+	iphdr = build_syn(buf,remote,5555,ext_iface->ip,8080);
+	assert(do_nat(sr,iphdr,ext_iface) == nat_action_route);
+	assert(iphdr->ip_dst == host_a && ntohs(tcphdr->th_dport) == 80);
+	iphdr = build_udp(buf,remote,9999,ext_iface->ip,1024);
+	assert(do_nat(sr,iphdr,ext_iface) == nat_action_route);
+	assert(iphdr->ip_dst == host_a && ntohs(udphdr->uh_dport) == 53);
+	assert(udp_sum_valid(iphdr));
+
+	//replies leave from the forwarded port
+	iphdr = build_syn(buf,host_a,80,remote,5555);
+	tcphdr->th_flags = TH_SYN | TH_ACK;
+	assert(do_nat(sr,iphdr,int_iface) == nat_action_route);
+	assert(iphdr->ip_src == ext_iface->ip && ntohs(tcphdr->th_sport) == 8080);
+	iphdr = build_udp(buf,host_a,53,remote,9999);
+	assert(do_nat(sr,iphdr,int_iface) == nat_action_route);
+	assert(iphdr->ip_src == ext_iface->ip && ntohs(udphdr->uh_sport) == 1024);
+
+	//the allocator steps over a forwarded port
+	map = sr_nat_insert_mapping(sr,host_b,htons(6000),0,0,nat_mapping_udp);
+	assert(map && ntohs(map->aux_ext) == MIN_AUX_VALUE + 1);
+	map = sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(8080),nat_mapping_tcp);
+	assert(map && map->is_static && map->conns != NULL);
+
+	//a checkpoint brings back the forward's connection, not the forward
+	char ckpt[] = "/tmp/sr_nat_ckpt_XXXXXX";
+	fd = mkstemp(ckpt);
+	assert(fd >= 0);
+	close(fd);
+	assert(sr_nat_ckpt_write(sr,ckpt) == 0);
+	sr_nat_clear(&sr->nat);
+	map = sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(8080),nat_mapping_tcp);
+	assert(map && map->conns == NULL);
+	assert(sr_nat_ckpt_load(sr,ckpt) == 1);  //host_b's mapping
+	assert(sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(8080),nat_mapping_tcp) == map);
+	assert(map->conns != NULL && map->conns->next == NULL);
+	unlink(ckpt);
+
+	//forwards never expire, their connections do
+	sr_clock_advance(DEFAULT_TCP_ESTABLISHED_TIMEOUT + DEFAULT_UDP_TIMEOUT + 1);
+	sr_nat_sweep(sr,sr_clock_now());
+	assert(sr_nat_lookup_internal(&sr->nat,host_b,htons(6000),nat_mapping_udp) == NULL);
+	map = sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(8080),nat_mapping_tcp);
+	assert(map && map->conns == NULL);
+	assert(sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(1024),nat_mapping_udp) != NULL);
+	assert(sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(77),nat_mapping_icmp) != NULL);
+
+	//a bad file keeps the current forwards
+	write_forwards(path,"tcp 8080 17.17.0.5:80\ntcp 8080 17.17.0.6:80\n");
+	assert(sr_nat_forward_load(sr,path) == -1);
+	write_forwards(path,"tcp 8080 17.17.0.5:80\ntcp 8081 17.17.0.5:80\n");
+	assert(sr_nat_forward_load(sr,path) == -1);
+	write_forwards(path,"tcp 8080@9.9.9.9 17.17.0.5:80\n");
+	assert(sr_nat_forward_load(sr,path) == -1);
+	write_forwards(path,"sctp 8080 17.17.0.5:80\n");
+	assert(sr_nat_forward_load(sr,path) == -1);
+	assert(sr->nat.nforwards == 3);
+
+	//a reload moves one forward, keeps one as it is and drops the last
+	map = sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(77),nat_mapping_icmp);
+	snprintf(text,sizeof(text),"tcp 8080@%s 17.17.0.6:8000\nicmp 77 17.17.0.5:7\n",
+	         inet_ntoa(*(struct in_addr *) &ext_iface->ip));
+	write_forwards(path,text);
+	assert(sr_nat_forward_load(sr,path) == 2);
+	assert(sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(77),nat_mapping_icmp) == map);
+	assert(sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(1024),nat_mapping_udp) == NULL);
+	iphdr = build_syn(buf,remote,5555,ext_iface->ip,8080);
+	assert(do_nat(sr,iphdr,ext_iface) == nat_action_route);
+	assert(iphdr->ip_dst == host_b && ntohs(tcphdr->th_dport) == 8000);
+
+	//the released port goes back to the allocator
+	map = sr_nat_insert_mapping(sr,host_b,htons(6000),0,0,nat_mapping_udp);
+	assert(map && ntohs(map->aux_ext) == MIN_AUX_VALUE);
+
+	//clearing the NAT drops learned mappings only
+	sr_nat_clear(&sr->nat);
+	map = sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(8080),nat_mapping_tcp);
+	assert(map && map->is_static && map->ip_int == host_b);
+	assert(sr_nat_lookup_internal(&sr->nat,host_b,htons(6000),nat_mapping_udp) == NULL);
+
+	unlink(path);
+	sr_nat_forward_clear(&sr->nat);
+	sr_nat_clear(&sr->nat);
+	sr_nat_pool_destroy(&sr->nat.pool);
+	assert(sr->nat.mappings == NULL);
+	sr->nat_enabled = false;
+	printf("PASSED\n");
+}
+
+/* The backend, 1 to 5 for 10.0.0.1 to 10.0.0.5, that an inbound segment
+   from 'remote':'port' to the virtual service is sent to. */
+static int vip_send(struct sr_instance *sr,uint8_t *buf,uint32_t remote,uint16_t port,uint8_t flags)
+{
+	sr_if_t *ext_iface = sr_get_interface(sr,"eth2");
+	sr_ip_hdr_t *iphdr = build_syn(buf,remote,port,ext_iface->ip,80);
+	sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (buf + sizeof(sr_ip_hdr_t));
+
+	tcphdr->th_flags = flags;
+	assert(do_nat(sr,iphdr,ext_iface) == nat_action_route);
+	assert(ntohs(tcphdr->th_dport) == 80);
+	assert((ntohl(iphdr->ip_dst) & 0xffffff00) == 0x0a000000);
+	return ntohl(iphdr->ip_dst) & 0xff;
+}
+
+void test_nat_virtual_services(struct sr_instance *sr)
+{
+	printf("%-70s","Testing NAT virtual services with Maglev hashing...");
+
+	char path[] = "/tmp/sr_nat_vip_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	enum { CLIENTS = 1000 };
+	static uint16_t before[SR_NAT_LB_TABLE];
+	static uint8_t pinned[CLIENTS];
+	uint8_t buf[64];
+	sr_if_t *int_iface = sr_get_interface(sr,"eth1");
+	sr_if_t *ext_iface = sr_get_interface(sr,"eth2");
+	sr_tcp_hdr_t *tcphdr = (sr_tcp_hdr_t *) (buf + sizeof(sr_ip_hdr_t));
+	uint32_t remote = 0x22220009;
+	struct sr_nat_vip *vip;
+	unsigned int count[5];
+
+	sr->nat_enabled = true;
+	sr->nat.int_iface_name = "eth1";
+	sr->nat.tcp_estab_timeout = DEFAULT_TCP_ESTABLISHED_TIMEOUT;
+	sr->nat.tcp_trans_timeout = DEFAULT_TCP_TRANSITORY_TIMEOUT;
+	sr_nat_clear(&sr->nat);
+
+	write_forwards(path,"udp 53 10.0.0.1:53 10.0.0.2:53\n");
+	assert(sr_nat_forward_load(sr,path) == -1);  //only TCP is balanced
+	write_forwards(path,"tcp 80 10.0.0.1:80 10.0.0.2:80 10.0.0.3:80 10.0.0.4:80\n"
+	                    "tcp 8080 10.0.0.9:80\n");
+	assert(sr_nat_forward_load(sr,path) == 5);
+	vip = sr->nat.vips;
+	assert(vip && vip->next == NULL && vip->nbackends == 4 && ntohs(vip->port) == 80);
+
+	//every backend owns an equal share of the lookup table
+	memset(count,0,sizeof(count));
+	for (unsigned int c = 0; c < SR_NAT_LB_TABLE; c++)
+		count[vip->table[c]]++;
+	for (int b = 0; b < 4; b++)
+		assert(count[b] >= SR_NAT_LB_TABLE / 4 && count[b] <= SR_NAT_LB_TABLE / 4 + 1);
+
+	//new connections spread over all backends and are pinned
+	memset(count,0,sizeof(count));
+	for (int i = 0; i < CLIENTS; i++) {
+		pinned[i] = vip_send(sr,buf,remote,10000 + i,TH_SYN);
+		count[pinned[i] - 1]++;
+	}
+	for (int b = 0; b < 4; b++)
+		assert(count[b] > CLIENTS / 8 && vip->backends[b].conns == count[b]);
+	assert(vip->nflows == CLIENTS);
+	assert(vip_send(sr,buf,remote,10000,TH_SYN) == pinned[0]);  //retransmission
+	assert(vip->backends[pinned[0] - 1].conns == count[pinned[0] - 1]);
+
+	//a checkpoint puts the connections back on the backends and pins them
+	char ckpt[] = "/tmp/sr_nat_ckpt_XXXXXX";
+	fd = mkstemp(ckpt);
+	assert(fd >= 0);
+	close(fd);
+	assert(sr_nat_ckpt_write(sr,ckpt) == 0);
+	sr_nat_forward_clear(&sr->nat);
+	sr_nat_clear(&sr->nat);
+	assert(sr_nat_forward_load(sr,path) == 5);
+	vip = sr->nat.vips;
+	assert(vip && vip->nflows == 0);
+	assert(sr_nat_ckpt_load(sr,ckpt) == 0);
+	assert(vip->nflows == CLIENTS);
+	sr_nat_mapping_t *backend = sr_nat_lookup_internal(&sr->nat,htonl(0x0a000000 | pinned[0]),
+	                                                   htons(80),nat_mapping_tcp);
+	assert(backend && backend->is_static && backend->conns != NULL);
+	unlink(ckpt);
+
+	//replies leave from the service's port
+	build_syn(buf,htonl(0x0a000000 | pinned[0]),80,remote,10000);
+	tcphdr->th_flags = TH_SYN | TH_ACK;
+	assert(do_nat(sr,(sr_ip_hdr_t *) buf,int_iface) == nat_action_route);
+	assert(((sr_ip_hdr_t *) buf)->ip_src == ext_iface->ip && ntohs(tcphdr->th_sport) == 80);
+
+	//a fifth backend takes about a fifth of the table from the others,
+	//and open connections stay where they are
+	memcpy(before,vip->table,sizeof(before));
+	write_forwards(path,"tcp 80 10.0.0.1:80 10.0.0.2:80 10.0.0.3:80 10.0.0.4:80 10.0.0.5:80\n"
+	                    "tcp 8080 10.0.0.9:80\n");
+	assert(sr_nat_forward_load(sr,path) == 6);
+	assert(sr->nat.vips == vip && vip->nbackends == 5 && vip->nflows == CLIENTS);
+	unsigned int moved = 0, to_new = 0;
+	for (unsigned int c = 0; c < SR_NAT_LB_TABLE; c++) {
+		moved += (vip->table[c] != before[c]);
+		to_new += (vip->table[c] == 4);
+	}
+	assert(to_new >= SR_NAT_LB_TABLE / 5 && to_new <= SR_NAT_LB_TABLE / 5 + 1);
+	assert(moved < SR_NAT_LB_TABLE / 4);
+	for (int i = 0; i < CLIENTS; i++)
+		assert(vip_send(sr,buf,remote,10000 + i,TH_ACK) == pinned[i]);
+
+	//removing a backend drops only its pins
+	write_forwards(path,"tcp 80 10.0.0.2:80 10.0.0.3:80 10.0.0.4:80 10.0.0.5:80\n"
+	                    "tcp 8080 10.0.0.9:80\n");
+	assert(sr_nat_forward_load(sr,path) == 5);
+	assert(sr_nat_lookup_internal(&sr->nat,htonl(0x0a000001),htons(80),nat_mapping_tcp) == NULL);
+	assert(vip->nflows == CLIENTS - count[0]);
+	for (int i = 0; i < CLIENTS; i++) {
+		int b = vip_send(sr,buf,remote,10000 + i,TH_ACK);
+		assert(b != 1 && (pinned[i] == 1 || b == pinned[i]));
+	}
+
+	//pins expire with the connections, the service stays
+	//a SYN alone pins for the transitory timeout, the handshake ACK
+	//makes the pin last
+	unsigned int nflows = vip->nflows;
+	vip_send(sr,buf,remote,20000,TH_SYN);
+	vip_send(sr,buf,remote,20001,TH_SYN);
+	vip_send(sr,buf,remote,20001,TH_ACK);
+	assert(vip->nflows == nflows + 2);
+	sr_clock_advance(DEFAULT_TCP_TRANSITORY_TIMEOUT + 1);
+	sr_nat_sweep(sr,sr_clock_now());
+	assert(vip->nflows == nflows + 1);
+
+	uint64_t packets = vip->backends[0].packets;
+	vip_send(sr,buf,remote,10000,TH_FIN | TH_ACK);
+	assert(vip->backends[0].packets + vip->backends[1].packets + vip->backends[2].packets +
+	       vip->backends[3].packets > packets);
+	sr_clock_advance(DEFAULT_TCP_ESTABLISHED_TIMEOUT + 1);
+	sr_nat_sweep(sr,sr_clock_now());
+	assert(vip->nflows == 0 && sr->nat.vips == vip);
+	assert(sr_nat_lookup_external(&sr->nat,ext_iface->ip,htons(80),nat_mapping_tcp) != NULL);
+
+	//a backend without its mapping drops the segment instead of crashing
+	uint16_t client = 30000;
+	int gone;
+	while ((gone = vip_send(sr,buf,remote,client,TH_SYN)) == 3)
+		client++;
+	sr_nat_remove_mapping(&sr->nat,sr_nat_lookup_internal(&sr->nat,htonl(0x0a000000 | gone),
+	                      htons(80),nat_mapping_tcp));
+	struct sr_stats_snapshot drops_before, drops_after;
+	sr_stats_snapshot(&drops_before);
+	build_syn(buf,remote,client,ext_iface->ip,80);
+	tcphdr->th_flags = TH_ACK;
+	assert(do_nat(sr,(sr_ip_hdr_t *) buf,ext_iface) == nat_action_drop);
+	sr_stats_snapshot(&drops_after);
+	assert(drops_after.drops[drop_nat_unmapped] == drops_before.drops[drop_nat_unmapped] + 1);
+
+	//a service cut down to one backend is a plain forward
+	write_forwards(path,"tcp 80 10.0.0.3:80\n");
+	assert(sr_nat_forward_load(sr,path) == 1);
+	assert(sr->nat.vips == NULL);
+	assert(vip_send(sr,buf,remote,10000,TH_SYN) == 3);
+
+	unlink(path);
+	sr_nat_forward_clear(&sr->nat);
+	sr_nat_clear(&sr->nat);
+	sr_nat_pool_destroy(&sr->nat.pool);
+	sr->nat_enabled = false;
+	printf("PASSED\n");
+}
+
+static void fib_check_list(struct sr_fib *fib)
+{
+	unsigned int n = 0;
+	struct sr_rt **pp = &fib->routes;
+	for (struct sr_rt *rt = fib->routes; rt != NULL; rt = rt->next, n++) {
+		assert(rt->pprev == pp);
+		pp = &rt->next;
+	}
+	assert(fib->tail == pp && n == fib->nroutes);
+}
+
+static volatile int rcu_stage;
+
+static void *rcu_reader(void *arg)
+{
+	sr_rcu_read_lock();
+	rcu_stage = 1;
+	while (rcu_stage != 2)
+		usleep(1000);
+	sr_rcu_read_unlock();
+	return NULL;
+}
+
+static void *rcu_writer(void *arg)
+{
+	sr_rcu_synchronize();
+	*(volatile int *)arg = 1;
+	return NULL;
+}
+
+void test_fib_reload(struct sr_instance *sr)
+{
+	printf("%-70s","Testing compiled FIB and routing table reload...");
+
+	//the trie picks the same route as the list for random tables
+	srand(48);
+	struct sr_rt *routes = NULL, **tail = &routes;
+	for (int i = 0; i <= 2000; i++) {
+		struct sr_rt *rt = calloc(1,sizeof(struct sr_rt));
+		int plen = (i == 0) ? 0 : 16 + rand() % 17;
+		rt->mask.s_addr = htonl(plen ? 0xffffffffu << (32 - plen) : 0);
+		rt->dest.s_addr = htonl(0x0a000000 | (rand() & 0x0003ffff)) & (i % 3 ? rt->mask.s_addr : 0xffffffff);
+		rt->gw.s_addr = i;
+		strcpy(rt->interface,"eth1");
+		bool dup = false;
+		for (struct sr_rt *o = routes; o != NULL; o = o->next)
+			dup |= (o->mask.s_addr == rt->mask.s_addr) &&
+			       ((o->dest.s_addr ^ rt->dest.s_addr) & rt->mask.s_addr) == 0;
+		if (i == 2000) {
+			*rt = *routes->next;   //one duplicate prefix, dropped
+			rt->next = NULL;
+		} else if (dup) {
+			free(rt);
+			i--;
+			continue;
+		}
+		*tail = rt;
+		tail = &rt->next;
+	}
+	struct sr_fib *fib = sr_fib_build(routes);
+	assert(fib != NULL && fib->nroutes == 2000);
+	fib_check_list(fib);
+	for (int i = 0; i < 100000; i++) {
+		uint32_t ip = htonl((i & 1) ? 0x0a000000 | (rand() & 0x00ffffff) : (uint32_t) rand());
+		struct sr_rt *a = NULL, *b = NULL;
+		assert(sr_fib_lookup(fib,ip,&a) == longest_prefix_match(routes,ip,&b));
+		assert(a == b);
+	}
+	sr_fib_free(fib);
+
+	struct sr_rt odd = { .mask.s_addr = htonl(0xff00ff00) };
+	assert(sr_fib_build(&odd) == NULL);
+
+	//publish, reject a bad file, replace
+	char path[] = "/tmp/sr_rtable_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	struct sr_rt *saved = sr->routing_table;
+	struct sr_rt route;
+	sr->routing_table = NULL;
+
+	write_forwards(path,"0.0.0.0 10.0.0.1 0.0.0.0 eth2\n"
+	                    "\n"
+	                    "172.16.0.0 0.0.0.0 255.255.0.0 eth1\n"
+	                    "172.16.5.0 172.16.0.9 255.255.255.0 eth3\n");
+	assert(sr_fib_reload(sr,path) == 3);
+	fib = sr->fib;
+	assert(fib != NULL && sr->routing_table == fib->routes);
+	assert(sr_fib_route(sr,inet_addr("172.16.5.7"),&route));
+	assert(strcmp(route.interface,"eth3") == 0 && route.gw.s_addr == inet_addr("172.16.0.9"));
+	assert(route.next == NULL);
+	assert(sr_fib_route(sr,inet_addr("172.16.6.7"),&route) && strcmp(route.interface,"eth1") == 0);
+	assert(sr_fib_route(sr,inet_addr("8.8.8.8"),&route) && strcmp(route.interface,"eth2") == 0);
+
+	write_forwards(path,"0.0.0.0 10.0.0.1 0.0.0.0 eth9\n");
+	assert(sr_fib_reload(sr,path) == -1 && sr->fib == fib);
+	write_forwards(path,"0.0.0.0 10.0.0.1 255.0.255.0 eth2\n");
+	assert(sr_fib_reload(sr,path) == -1 && sr->fib == fib);
+	write_forwards(path,"0.0.0.0 zero 0.0.0.0 eth2\n");
+	assert(sr_fib_reload(sr,path) == -1 && sr->fib == fib);
+	write_forwards(path,"\n");
+	assert(sr_fib_reload(sr,path) == -1 && sr->fib == fib);
+
+	write_forwards(path,"172.16.0.0 0.0.0.0 255.255.0.0 eth2\n");
+	assert(sr_fib_reload(sr,path) == 1 && sr->fib != fib);
+	assert(sr_fib_route(sr,inet_addr("172.16.5.7"),&route) && strcmp(route.interface,"eth2") == 0);
+	assert(!sr_fib_route(sr,inet_addr("8.8.8.8"),&route));
+
+	//a grace period waits for a reader that was already inside
+	pthread_t reader, writer;
+	volatile int synced = 0;
+	rcu_stage = 0;
+	pthread_create(&reader,NULL,rcu_reader,NULL);
+	while (rcu_stage != 1)
+		usleep(1000);
+	pthread_create(&writer,NULL,rcu_writer,(void *)&synced);
+	usleep(50000);
+	assert(!synced);
+	sr_rcu_read_lock();      //later readers do not hold it up
+	rcu_stage = 2;
+	pthread_join(writer,NULL);
+	pthread_join(reader,NULL);
+	sr_rcu_read_unlock();
+	assert(synced);
+
+	unlink(path);
+	fib = sr->fib;
+	sr->fib = NULL;
+	sr->routing_table = saved;
+	sr_fib_free(fib);
+	printf("PASSED\n");
+}
+
+static sr_arpreq_t *find_arpreq(struct sr_instance *sr, uint32_t ip)
+{
+	for (sr_arpreq_t *req = sr->cache.requests; req != NULL; req = req->next)
+		if (req->ip == ip)
+			return req;
+	return NULL;
+}
+
+static int count_packets(sr_arpreq_t *req)
+{
+	int n = 0;
+	for (struct sr_packet *pkt = req ? req->packets : NULL; pkt != NULL; pkt = pkt->next)
+		n++;
+	return n;
+}
+
+static char *ctl_run(struct sr_instance *sr, const char *cmd, int *ret)
+{
+	static char text[1024];
+	char line[SR_CTL_LINE];
+	FILE *out = fmemopen(text, sizeof(text), "w");
+	text[0] = '\0';
+	strcpy(line, cmd);
+	*ret = sr_ctl_command(sr, line, out);
+	fclose(out);
+	return text;
+}
+
+void test_fib_updates(struct sr_instance *sr)
+{
+	printf("%-70s","Testing incremental FIB updates and the control socket...");
+
+	struct sr_rt *saved = sr->routing_table;
+	struct sr_rt rt = { .interface = "eth1" };
+	struct sr_rt route, *a, *b;
+	sr->routing_table = NULL;
+
+	//random adds, changes and deletes match a list lookup of the result
+	srand(49);
+	uint32_t prefixes[512];
+	int plens[512];
+	for (int i = 0; i < 512; i++) {
+		plens[i] = (i == 0) ? 0 : 1 + rand() % 32;
+		prefixes[i] = plens[i] ? 0x0a000000 | (rand() & 0x00ffffff) : 0;
+	}
+	for (int op = 0; op < 20000; op++) {
+		int i = rand() % 512;
+		rt.dest.s_addr = htonl(prefixes[i]);
+		rt.mask.s_addr = htonl(plens[i] ? 0xffffffffu << (32 - plens[i]) : 0);
+		rt.gw.s_addr = op;
+		int r = rand() % 3;
+		if (r == 0) {
+			int ret = sr_fib_add(sr,&rt);
+			assert(ret == 0 || ret == -EEXIST);
+		} else if (r == 1) {
+			int ret = sr_fib_change(sr,&rt);
+			assert(ret == 0 || ret == -ESRCH);
+		} else {
+			int ret = sr_fib_delete(sr,rt.dest,rt.mask);
+			assert(ret == 0 || ret == -ESRCH);
+		}
+		if (op % 1000 == 0)
+			sr_fib_reclaim();
+	}
+	struct sr_fib *fib = sr->fib;
+	assert(fib != NULL && sr->routing_table == fib->routes);
+	fib_check_list(fib);
+	for (int i = 0; i < 100000; i++) {
+		uint32_t ip = htonl((i & 1) ? 0x0a000000 | (rand() & 0x00ffffff) : (uint32_t) rand());
+		assert(sr_fib_lookup(fib,ip,&a) == longest_prefix_match(fib->routes,ip,&b));
+		assert(a == b);
+	}
+	while (fib->routes != NULL)
+		assert(sr_fib_delete(sr,fib->routes->dest,fib->routes->mask) == 0);
+	sr_fib_reclaim();
+	assert(fib->nnodes == 1 && fib->nroutes == 0 && fib->tail == &fib->routes);
+
+	rt.dest.s_addr = inet_addr("10.9.0.0");
+	rt.mask.s_addr = inet_addr("255.0.255.0");
+	assert(sr_fib_add(sr,&rt) == -EINVAL);
+	rt.mask.s_addr = inet_addr("255.255.0.0");
+	strcpy(rt.interface,"eth9");
+	assert(sr_fib_add(sr,&rt) == -ENODEV);
+
+	//packets waiting for ARP follow a changed next hop and only those
+	uint8_t pkt[sizeof(sr_ip_hdr_t) + 8] = { 0 };
+	sr_ip_hdr_t *iphdr = (sr_ip_hdr_t *) pkt;
+	uint32_t gw_old = inet_addr("10.9.255.1"), gw_new = inet_addr("10.9.255.2");
+	struct sr_stats_snapshot before, after;
+	iphdr->ip_v = 4;
+	iphdr->ip_hl = 5;
+	iphdr->ip_ttl = 64;
+	iphdr->ip_len = htons(sizeof(pkt));
+	strcpy(rt.interface,"eth1");
+	rt.gw.s_addr = gw_old;
+	assert(sr_fib_add(sr,&rt) == 0);
+	rt.dest.s_addr = inet_addr("10.8.0.0");
+	assert(sr_fib_add(sr,&rt) == 0);
+	iphdr->ip_dst = inet_addr("10.9.1.1");
+	sr_arpcache_queuereq(&sr->cache,gw_old,pkt,sizeof(pkt),"eth1");
+	iphdr->ip_dst = inet_addr("10.8.1.1");
+	sr_arpcache_queuereq(&sr->cache,gw_old,pkt,sizeof(pkt),"eth1");
+	rt.dest.s_addr = inet_addr("10.9.0.0");
+	rt.gw.s_addr = gw_new;
+	strcpy(rt.interface,"eth2");
+	assert(sr_fib_change(sr,&rt) == 0);
+	assert(count_packets(find_arpreq(sr,gw_old)) == 1);
+	assert(count_packets(find_arpreq(sr,gw_new)) == 1);
+	assert(strcmp(find_arpreq(sr,gw_new)->iface,"eth2") == 0);
+	assert(sr_fib_route(sr,inet_addr("10.9.1.1"),&route) && route.gw.s_addr == gw_new);
+	sr_stats_snapshot(&before);
+	assert(sr_fib_delete(sr,rt.dest,rt.mask) == 0);
+	sr_stats_snapshot(&after);
+	assert(count_packets(find_arpreq(sr,gw_new)) == 0);
+	assert(count_packets(find_arpreq(sr,gw_old)) == 1);
+	assert(after.drops[drop_no_route] == before.drops[drop_no_route] + 1);
+	sr_arpreq_destroy(&sr->cache,find_arpreq(sr,gw_new));
+	sr_arpreq_destroy(&sr->cache,find_arpreq(sr,gw_old));
+
+	//control commands
+	int ret;
+	assert(strcmp(ctl_run(sr,"route add 10.7.0.0 10.0.0.2 255.255.0.0 eth3",&ret),"ok\n") == 0 && ret == 0);
+	assert(strcmp(ctl_run(sr,"route add 10.7.0.0 10.0.0.2 255.255.0.0 eth3",&ret),"error: File exists\n") == 0 && ret == -1);
+	assert(strcmp(ctl_run(sr,"route change 10.7.0.0 10.0.0.3 255.255.0.0 eth1  # failover",&ret),"ok\n") == 0);
+	assert(sr_fib_route(sr,inet_addr("10.7.3.3"),&route) && route.gw.s_addr == inet_addr("10.0.0.3"));
+	assert(strcmp(ctl_run(sr,"route show",&ret),
+	              "10.8.0.0 10.9.255.1 255.255.0.0 eth1\n"
+	              "10.7.0.0 10.0.0.3 255.255.0.0 eth1\n"
+	              "ok\n") == 0);
+	assert(strcmp(ctl_run(sr,"route del 10.7.0.0 255.255.0.0",&ret),"ok\n") == 0);
+	assert(strcmp(ctl_run(sr,"route del 10.7.0.0 255.255.0.0",&ret),"error: No such process\n") == 0);
+	assert(strcmp(ctl_run(sr,"route add 10.7.0.0 10.0.0.2 255.255.0.0",&ret),"error: Invalid argument\n") == 0);
+	assert(strcmp(ctl_run(sr,"  # nothing",&ret),"") == 0 && ret == 0);
+
+	//the same over the socket, several commands per write
+	char path[] = "/tmp/sr_ctl_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	assert(sr_ctl_start(sr,path) == 0);
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strcpy(addr.sun_path,path);
+	fd = socket(AF_UNIX,SOCK_STREAM,0);
+	assert(connect(fd,(struct sockaddr *) &addr,sizeof(addr)) == 0);
+	const char *cmds = "route add 10.6.0.0 10.0.0.2 255.255.0.0 eth3\nroute del 10.8.0.0 255.255.0.0\nroute bogus\n";
+	const char *expect = "ok\nok\nerror: Invalid argument\n";
+	assert(write(fd,cmds,strlen(cmds)) == strlen(cmds));
+	char reply[128];
+	size_t have = 0;
+	while (have < strlen(expect)) {
+		ssize_t n = read(fd,reply + have,sizeof(reply) - 1 - have);
+		assert(n > 0);
+		have += n;
+	}
+	reply[have] = '\0';
+	assert(strcmp(reply,expect) == 0);
+	close(fd);
+	unlink(path);
+	assert(sr_fib_route(sr,inet_addr("10.6.1.1"),&route) && strcmp(route.interface,"eth3") == 0);
+	assert(!sr_fib_route(sr,inet_addr("10.8.1.1"),&route));
+
+	sr_fib_reclaim();
+	fib = sr->fib;
+	sr->fib = NULL;
+	sr->routing_table = saved;
+	sr_fib_free(fib);
+	printf("PASSED\n");
+}
+
+static void fib_same_lookups(struct sr_fib *a, struct sr_fib *b)
+{
+	for (int i = 0; i < 100000; i++) {
+		uint32_t ip = htonl((i & 1) ? 0x0a000000 | (rand() & 0x00ffffff) : (uint32_t) rand());
+		struct sr_rt *ra = NULL, *rb = NULL;
+		assert(sr_fib_lookup(a,ip,&ra) == sr_fib_lookup(b,ip,&rb));
+		if (ra != NULL)
+			assert(ra->dest.s_addr == rb->dest.s_addr && ra->mask.s_addr == rb->mask.s_addr &&
+			       ra->gw.s_addr == rb->gw.s_addr && strcmp(ra->interface,rb->interface) == 0);
+	}
+}
+
+static void image_patch(const char *path, uint64_t off, const void *data, size_t len)
+{
+	FILE *fp = fopen(path,"r+");
+	assert(fp != NULL && fseek(fp,off,SEEK_SET) == 0);
+	assert(fwrite(data,len,1,fp) == 1);
+	fclose(fp);
+}
+
+void test_fib_image(struct sr_instance *sr)
+{
+	printf("%-70s","Testing binary routing table images...");
+
+	//an image maps back to a table that routes like the one written
+	srand(50);
+	const char *ifaces[] = { "eth1", "eth2", "eth3" };
+	struct sr_rt *routes = NULL, **tail = &routes;
+	for (int i = 0; i < 5000; i++) {
+		struct sr_rt *rt = calloc(1,sizeof(struct sr_rt));
+		int plen = (i == 0) ? 0 : 8 + rand() % 25;
+		rt->mask.s_addr = htonl(plen ? 0xffffffffu << (32 - plen) : 0);
+		rt->dest.s_addr = htonl(0x0a000000 | (rand() & 0x00ffffff)) & rt->mask.s_addr;
+		rt->gw.s_addr = i;
+		strcpy(rt->interface,ifaces[i % 3]);
+		*tail = rt;
+		tail = &rt->next;
+	}
+	struct sr_fib *fib = sr_fib_build(routes);
+	assert(fib != NULL);
+
+	char path[] = "/tmp/sr_fib_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	assert(!sr_fib_image_is(path));
+	assert(sr_fib_image_write(fib,path) == 0 && sr_fib_image_is(path));
+	struct sr_fib *img = sr_fib_image_load(path);
+	assert(img != NULL && img->image != NULL);
+	assert(img->nroutes == fib->nroutes && img->nnodes == fib->nnodes);
+	fib_check_list(img);
+	fib_same_lookups(fib,img);
+	sr_fib_free(img);
+
+	//reload takes an image, and updates work on the mapped table
+	struct sr_rt *saved = sr->routing_table;
+	struct sr_rt route;
+	sr->routing_table = NULL;
+	assert(sr_fib_reload(sr,path) == (int) fib->nroutes);
+	img = sr->fib;
+	assert(img->image != NULL && sr->routing_table == img->routes);
+
+	struct sr_rt upd = { .dest.s_addr = inet_addr("192.168.7.0"), .mask.s_addr = inet_addr("255.255.255.0"),
+	                     .gw.s_addr = inet_addr("10.0.0.9"), .interface = "eth2" };
+	assert(sr_fib_add(sr,&upd) == 0);
+	upd = *img->routes;
+	strcpy(upd.interface,"eth3");
+	upd.gw.s_addr = inet_addr("10.0.0.7");
+	assert(sr_fib_change(sr,&upd) == 0);
+	struct sr_rt *victim = img->routes->next->next;
+	struct in_addr dest = victim->dest, mask = victim->mask;
+	assert(sr_fib_delete(sr,dest,mask) == 0);
+	sr_fib_reclaim();
+	fib_check_list(img);
+	assert(sr_fib_route(sr,inet_addr("192.168.7.1"),&route) && strcmp(route.interface,"eth2") == 0);
+	assert(sr_fib_route(sr,upd.dest.s_addr,&route) && route.gw.s_addr == inet_addr("10.0.0.7"));
+	assert(sr_fib_delete(sr,dest,mask) == -ESRCH);
+
+	//a changed mapped table writes out and loads again
+	char path2[] = "/tmp/sr_fib_XXXXXX";
+	fd = mkstemp(path2);
+	assert(fd >= 0);
+	close(fd);
+	assert(sr_fib_image_write(img,path2) == 0);
+	struct sr_fib *again = sr_fib_image_load(path2);
+	assert(again != NULL && again->nroutes == img->nroutes && again->nnodes == img->nnodes);
+	fib_same_lookups(img,again);
+	sr_fib_free(again);
+	unlink(path2);
+
+	//routes through missing interfaces are refused as for text tables
+	struct sr_rt *odd = calloc(1,sizeof(struct sr_rt));
+	strcpy(odd->interface,"eth9");
+	struct sr_fib *bad = sr_fib_build(odd);
+	assert(bad != NULL && sr_fib_image_write(bad,path) == 0);
+	sr_fib_free(bad);
+	assert(sr_fib_reload(sr,path) == -1 && sr->fib == img);
+
+	//truncated, foreign and damaged images are refused
+	assert(sr_fib_image_write(fib,path) == 0);
+	struct sr_fib_image_hdr hdr;
+	FILE *fp = fopen(path,"r");
+	assert(fp != NULL && fread(&hdr,sizeof(hdr),1,fp) == 1);
+	fclose(fp);
+	uint64_t size = hdr.nodes_off + (uint64_t) hdr.nnodes * sizeof(struct sr_fib_node);
+	assert(truncate(path,size - 1) == 0);
+	assert(sr_fib_image_load(path) == NULL);
+
+	assert(sr_fib_image_write(fib,path) == 0);
+	uint16_t wrong = hdr.route_size + 8;
+	image_patch(path,offsetof(struct sr_fib_image_hdr,route_size),&wrong,sizeof(wrong));
+	assert(sr_fib_image_load(path) == NULL);
+	assert(sr_fib_reload(sr,path) == -1 && sr->fib == img);
+
+	assert(sr_fib_image_write(fib,path) == 0);
+	uint64_t loop = hdr.nodes_off;          //a child pointing back at the root
+	image_patch(path,hdr.nodes_off + sizeof(struct sr_fib_node),&loop,sizeof(loop));
+	assert(sr_fib_image_load(path) == NULL);
+
+	assert(sr_fib_image_write(fib,path) == 0);
+	uint64_t stray = hdr.routes_off + 1;    //a route pointer between routes
+	for (uint32_t i = 0; i < hdr.nnodes; i++) {
+		struct sr_fib_node node;
+		fp = fopen(path,"r");
+		assert(fseek(fp,hdr.nodes_off + i * sizeof(node),SEEK_SET) == 0 && fread(&node,sizeof(node),1,fp) == 1);
+		fclose(fp);
+		if (node.route != NULL) {
+			image_patch(path,hdr.nodes_off + i * sizeof(node) + offsetof(struct sr_fib_node,route),
+			            &stray,sizeof(stray));
+			break;
+		}
+	}
+	assert(sr_fib_image_load(path) == NULL);
+
+	unlink(path);
+	sr_fib_free(fib);
+	fib = sr->fib;
+	sr->fib = NULL;
+	sr->routing_table = saved;
+	sr_fib_free(fib);
+	printf("PASSED\n");
+}
+
 int main(int argc, char **argv) 
 {
 	sentframe = malloc(MAX_FRAME_SIZE);
-	struct sr_instance *sr = malloc(sizeof(struct sr_instance));
+	struct sr_instance *sr = calloc(1,sizeof(struct sr_instance));
 	init_sr(&sr);
 
 	longest_prefix_match_test();
@@ -1396,6 +3037,24 @@ int main(int argc, char **argv)
 	test_icmp_port_unrch(sr);
 	test_send_to_self(sr);
 	test_host_unrch(sr);
+	test_drop_counters(sr);
+	test_latency_histogram(sr);
+	test_trace_format();
+	test_virtual_clock_timeouts(sr);
+	test_nat_udp(sr);
+	test_nat_pool(sr);
+	test_nat_checkpoint(sr);
+	test_nat_sync(sr);
+	test_nat_pending_syns(sr);
+	test_icmp_rate_limit(sr);
+	test_ingress_policing(sr);
+	test_egress_queues(sr);
+	test_acl(sr);
+	test_nat_port_forwards(sr);
+	test_nat_virtual_services(sr);
+	test_fib_reload(sr);
+	test_fib_updates(sr);
+	test_fib_image(sr);
 	
 	free(sr);
 	free(sentframe);
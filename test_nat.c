@@ -64,8 +64,6 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
-	Debug("*** --> Packet sent\n");
-	DebugFrame(buf,len);
 	
 	memcpy(sentframe,buf,len);
 	sentlen = len;